@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
 #endif
+#include <zlib.h>
 #include "config.h"
 #include "monitor.h"
 #include "sysemu.h"
@@ -44,6 +45,20 @@
 #include "exec-memory.h"
 #include "hw/pcspk.h"
 #include "qemu/page_cache.h"
+#include "qemu/xbzrle.h"
+#include "qemu/worker-pool.h"
+#include "bitmap.h"
+#include "qemu_socket.h"
+#include "qemu-coroutine.h"
+#include "event_notifier.h"
+#include "trace.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -104,6 +119,18 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+/* the extra RAM streams have all been ended, wait for them */
+#define RAM_SAVE_FLAG_SYNC     0x80
+/* followed by the pages that will only arrive after the device state */
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+/* a page compressed with zlib, see compress_save_page() */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x200
+/* followed by the pages that are zero, see ram_save_zero_map(); there is no
+   bit left with 1K pages, and MEM_SIZE never comes with SYNC otherwise */
+#define RAM_SAVE_FLAG_ZERO_MAP (RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_SYNC)
+/* followed by where the blocks are in a mapped-ram file, see
+   ram_save_mapped(); MEM_SIZE never comes with POSTCOPY otherwise */
+#define RAM_SAVE_FLAG_MAPPED   (RAM_SAVE_FLAG_MEM_SIZE | RAM_SAVE_FLAG_POSTCOPY)
 
 #ifdef __ALTIVEC__
 #include <altivec.h>
@@ -171,32 +198,107 @@ static int is_dup_page(uint8_t *page)
     return 1;
 }
 
-/* struct contains XBZRLE cache and a static page
-   used by the compression */
-static struct {
-    /* buffer used for XBZRLE encoding */
+/* Number of dirty pages handed to the XBZRLE encoders at a time */
+#define XBZRLE_BATCH_PAGES 64
+
+/* Outcome of encoding one page */
+enum {
+    XBZRLE_JOB_DUP,
+    XBZRLE_JOB_ENCODED,
+    XBZRLE_JOB_UNMODIFIED,
+    XBZRLE_JOB_CACHE_MISS,
+    XBZRLE_JOB_OVERFLOW,
+};
+
+typedef struct XBZRLEJob {
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* guest page */
+    uint8_t *host;
+    /* encoder (and cache shard) in charge of this page */
+    int worker;
+    /* results, filled in by the encoder */
+    int status;
+    int encoded_len;
+    uint8_t dup_byte;
+    /* page to send in full on cache miss or overflow */
+    uint8_t *data;
     uint8_t *encoded_buf;
+    /* set if data is compressed before it is sent */
+    struct CompressJob *compress;
+} XBZRLEJob;
+
+typedef struct XBZRLEWorker {
+    int id;
+    /* this encoder's shard of the XBZRLE cache */
+    PageCache *cache;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* buffer used for XBZRLE decoding */
-    uint8_t *decoded_buf;
-    /* Cache for XBZRLE */
-    PageCache *cache;
-} XBZRLE = {
-    .encoded_buf = NULL,
-    .current_buf = NULL,
-    .decoded_buf = NULL,
-    .cache = NULL,
-};
+} XBZRLEWorker;
+
+/* struct contains the XBZRLE encoders, their caches and the batch of
+   pages they are working on */
+static struct {
+    /* encoders, one cache shard each; NULL when XBZRLE is not running */
+    XBZRLEWorker *workers;
+    int nr_workers;
+    /* current batch, in stream order */
+    XBZRLEJob jobs[XBZRLE_BATCH_PAGES];
+    int nr_jobs;
+    bool last_stage;
+    /* threads for the encoders, NULL with a single encoder */
+    WorkerPool *pool;
+} XBZRLE;
 
 
+/*
+ * Pages in each of the @nr_workers shards of a cache of @cache_size bytes.
+ * cache_init() rounds the shards down to a power of 2, and so does this.
+ */
+static int64_t xbzrle_shard_pages(int64_t cache_size, int nr_workers)
+{
+    return pow2floor(MAX(cache_size / TARGET_PAGE_SIZE / nr_workers, 1));
+}
+
+/*
+ * Resizes the XBZRLE cache, or sizes the one of the next migration.
+ * Returns the size that the cache really has, which is smaller than
+ * @new_size when it is split in shards, or -1 on error; the size is then
+ * unchanged.
+ */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    if (XBZRLE.cache != NULL) {
-        return cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) *
-            TARGET_PAGE_SIZE;
+    int64_t shard_pages, old_shard_pages;
+    int nr_workers;
+    int64_t ret;
+    int i;
+
+    if (new_size < TARGET_PAGE_SIZE) {
+        return -1;
+    }
+
+    /* the migration thread uses the cache while holding the ramlist lock */
+    qemu_mutex_lock_ramlist();
+    nr_workers = XBZRLE.workers ? XBZRLE.nr_workers : migrate_xbzrle_threads();
+    shard_pages = xbzrle_shard_pages(new_size, nr_workers);
+    ret = shard_pages * nr_workers * TARGET_PAGE_SIZE;
+
+    if (XBZRLE.workers != NULL) {
+        old_shard_pages = xbzrle_shard_pages(migrate_xbzrle_cache_size(),
+                                             nr_workers);
+        for (i = 0; i < nr_workers; i++) {
+            if (cache_resize(XBZRLE.workers[i].cache, shard_pages) < 0) {
+                /* give the shards that were resized their old size back */
+                while (--i >= 0) {
+                    cache_resize(XBZRLE.workers[i].cache, old_shard_pages);
+                }
+                ret = -1;
+                break;
+            }
+        }
     }
-    return pow2floor(new_size);
+    qemu_mutex_unlock_ramlist();
+    return ret;
 }
 
 /* accounting for migration statistics */
@@ -208,10 +310,16 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
 
+/* per encoder statistics, kept after the migration ends */
+static XBZRLEThreadAcct *xbzrle_thread_acct;
+static int xbzrle_nr_thread_acct;
+
 static void acct_clear(void)
 {
     memset(&acct_info, 0, sizeof(acct_info));
@@ -257,6 +365,12 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+const XBZRLEThreadAcct *xbzrle_mig_thread_acct(int *nr_threads)
+{
+    *nr_threads = xbzrle_nr_thread_acct;
+    return xbzrle_thread_acct;
+}
+
 static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
         int cont, int flag)
 {
@@ -271,424 +385,2658 @@ static void save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 
 #define ENCODING_FLAG_XBZRLE 0x1
 
-static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
-                            ram_addr_t current_addr, RAMBlock *block,
-                            ram_addr_t offset, int cont, bool last_stage)
+/*
+ * Guest pages are spread round-robin over the encoders.  Inside a shard
+ * the pages are renumbered densely, otherwise each shard would only ever
+ * use 1/nr_workers of its cache slots.
+ */
+static inline int xbzrle_shard(ram_addr_t addr)
+{
+    return (addr >> TARGET_PAGE_BITS) % XBZRLE.nr_workers;
+}
+
+static inline uint64_t xbzrle_shard_addr(ram_addr_t addr)
+{
+    return ((addr >> TARGET_PAGE_BITS) / XBZRLE.nr_workers) <<
+        TARGET_PAGE_BITS;
+}
+
+static void xbzrle_encode_page(XBZRLEWorker *w, XBZRLEJob *job)
 {
-    int encoded_len = 0, bytes_sent = -1;
+    uint64_t addr = xbzrle_shard_addr(job->block->offset + job->offset);
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
-        if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr,
-                         g_memdup(current_data, TARGET_PAGE_SIZE));
-        }
-        acct_info.xbzrle_cache_miss++;
-        return -1;
+    job->data = job->host;
+
+    if (is_dup_page(job->host)) {
+        job->dup_byte = *job->host;
+        job->status = XBZRLE_JOB_DUP;
+        return;
     }
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    prev_cached_page = get_cached_data(w->cache, addr);
+    if (!prev_cached_page) {
+        /* the cache may decline the page, then send it from guest memory */
+        if (!XBZRLE.last_stage &&
+            cache_insert(w->cache, addr, job->host) == 0) {
+            job->data = get_cached_data(w->cache, addr);
+        }
+        job->status = XBZRLE_JOB_CACHE_MISS;
+        return;
+    }
 
     /* save current buffer into memory */
-    memcpy(XBZRLE.current_buf, current_data, TARGET_PAGE_SIZE);
+    memcpy(w->current_buf, job->host, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
-                                       TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
-                                       TARGET_PAGE_SIZE);
-    if (encoded_len == 0) {
-        DPRINTF("Skipping unmodified page\n");
-        return 0;
-    } else if (encoded_len == -1) {
-        DPRINTF("Overflow\n");
-        acct_info.xbzrle_overflows++;
-        /* update data in the cache */
-        memcpy(prev_cached_page, current_data, TARGET_PAGE_SIZE);
-        return -1;
+    job->encoded_len = xbzrle_encode_buffer(prev_cached_page, w->current_buf,
+                                            TARGET_PAGE_SIZE, job->encoded_buf,
+                                            TARGET_PAGE_SIZE);
+    if (job->encoded_len == 0) {
+        job->status = XBZRLE_JOB_UNMODIFIED;
+        return;
+    } else if (job->encoded_len == -1) {
+        /* update data in the cache, and send what we stored there */
+        memcpy(prev_cached_page, w->current_buf, TARGET_PAGE_SIZE);
+        if (!XBZRLE.last_stage) {
+            job->data = prev_cached_page;
+        }
+        job->status = XBZRLE_JOB_OVERFLOW;
+        return;
     }
 
     /* we need to update the data in the cache, in order to get the same data */
-    if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+    if (!XBZRLE.last_stage) {
+        memcpy(prev_cached_page, w->current_buf, TARGET_PAGE_SIZE);
     }
-
-    /* Send XBZRLE based compressed page */
-    save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_XBZRLE);
-    qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
-    qemu_put_be16(f, encoded_len);
-    qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
-    bytes_sent = encoded_len + 1 + 2;
-    acct_info.xbzrle_pages++;
-    acct_info.xbzrle_bytes += bytes_sent;
-
-    return bytes_sent;
+    job->status = XBZRLE_JOB_ENCODED;
 }
 
-static RAMBlock *last_block;
-static ram_addr_t last_offset;
-
-/*
- * ram_save_block: Writes a page of memory to the stream f
- *
- * Returns:  0: if the page hasn't changed
- *          -1: if there are no more dirty pages
- *           n: the amount of bytes written in other case
- */
-
-static int ram_save_block(QEMUFile *f, bool last_stage)
+static void xbzrle_encode_shard(void *opaque)
 {
-    RAMBlock *block = last_block;
-    ram_addr_t offset = last_offset;
-    int bytes_sent = -1;
-    MemoryRegion *mr;
-    ram_addr_t current_addr;
+    XBZRLEWorker *w = opaque;
+    int i;
 
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
+    for (i = 0; i < XBZRLE.nr_jobs; i++) {
+        if (XBZRLE.jobs[i].worker == w->id) {
+            xbzrle_encode_page(w, &XBZRLE.jobs[i]);
+        }
+    }
+}
 
-    do {
-        mr = block->mr;
-        if (memory_region_get_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                    DIRTY_MEMORY_MIGRATION)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
-
-            memory_region_reset_dirty(mr, offset, TARGET_PAGE_SIZE,
-                                      DIRTY_MEMORY_MIGRATION);
-
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            if (is_dup_page(p)) {
-                acct_info.dup_pages++;
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else if (migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
-            }
+/* Encode XBZRLE.jobs, returns once every page has been handled */
+static void xbzrle_encode_batch(void)
+{
+    if (!XBZRLE.pool) {
+        xbzrle_encode_shard(&XBZRLE.workers[0]);
+        return;
+    }
 
-            /* either we didn't send yet (we may have had XBZRLE overflow) */
-            if (bytes_sent == -1) {
-                save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+    worker_pool_kick_all(XBZRLE.pool);
+    worker_pool_wait(XBZRLE.pool);
+}
 
-            /* if page is unmodified, continue to the next */
-            if (bytes_sent != 0) {
-                break;
-            }
-        }
+static void xbzrle_free_workers(void)
+{
+    int i;
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+    for (i = 0; i < XBZRLE.nr_workers; i++) {
+        if (XBZRLE.workers[i].cache) {
+            cache_fini(XBZRLE.workers[i].cache);
+            g_free(XBZRLE.workers[i].cache);
         }
-    } while (block != last_block || offset != last_offset);
-
-    last_block = block;
-    last_offset = offset;
+        g_free(XBZRLE.workers[i].current_buf);
+    }
+    for (i = 0; i < XBZRLE_BATCH_PAGES; i++) {
+        g_free(XBZRLE.jobs[i].encoded_buf);
+        XBZRLE.jobs[i].encoded_buf = NULL;
+    }
 
-    return bytes_sent;
+    g_free(XBZRLE.workers);
+    XBZRLE.workers = NULL;
+    XBZRLE.nr_workers = 0;
 }
 
-static uint64_t bytes_transferred;
-
-static ram_addr_t ram_save_remaining(void)
+static void xbzrle_stop(void)
 {
-    return ram_list.dirty_pages;
+    worker_pool_free(XBZRLE.pool);
+    XBZRLE.pool = NULL;
+    xbzrle_free_workers();
 }
 
-uint64_t ram_bytes_remaining(void)
+static int xbzrle_start(void)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
-}
+    int nr_workers = migrate_xbzrle_threads();
+    int64_t shard_pages;
+    int i;
 
-uint64_t ram_bytes_transferred(void)
-{
-    return bytes_transferred;
-}
+    shard_pages = xbzrle_shard_pages(migrate_xbzrle_cache_size(), nr_workers);
 
-uint64_t ram_bytes_total(void)
-{
-    RAMBlock *block;
-    uint64_t total = 0;
+    XBZRLE.workers = g_malloc0(nr_workers * sizeof(*XBZRLE.workers));
+    XBZRLE.nr_workers = nr_workers;
+    for (i = 0; i < nr_workers; i++) {
+        XBZRLEWorker *w = &XBZRLE.workers[i];
 
-    QLIST_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+        w->id = i;
+        w->cache = cache_init(shard_pages, TARGET_PAGE_SIZE,
+                              migrate_xbzrle_cache_associativity(),
+                              migrate_xbzrle_cache_admit_on_second_dirty());
+        if (!w->cache) {
+            DPRINTF("Error creating cache\n");
+            /* no thread has been started yet */
+            xbzrle_free_workers();
+            return -1;
+        }
+        w->current_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+    for (i = 0; i < XBZRLE_BATCH_PAGES; i++) {
+        XBZRLE.jobs[i].encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
+    }
 
-    return total;
+    g_free(xbzrle_thread_acct);
+    xbzrle_thread_acct = g_malloc0(nr_workers * sizeof(*xbzrle_thread_acct));
+    xbzrle_nr_thread_acct = nr_workers;
+
+    if (nr_workers > 1) {
+        XBZRLE.pool = worker_pool_new(nr_workers, xbzrle_encode_shard,
+                                      XBZRLE.workers, sizeof(XBZRLEWorker));
+    }
+    return 0;
 }
 
-static int block_compar(const void *a, const void *b)
-{
-    RAMBlock * const *ablock = a;
-    RAMBlock * const *bblock = b;
+/*
+ * Page compression.  Pages that go out in full are handed to a pool of
+ * threads in batches; each page is compressed on its own, so that the
+ * destination can decompress them in parallel too.  A page that does not
+ * shrink is sent as it is.
+ */
 
-    return strcmp((*ablock)->idstr, (*bblock)->idstr);
-}
+/* the XBZRLE misses of a batch must fit in one compression batch */
+#define COMPRESS_BATCH_PAGES XBZRLE_BATCH_PAGES
 
-static void sort_ram_list(void)
+typedef struct CompressJob {
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* page to send */
+    uint8_t *data;
+    /* results, filled in by the compression thread */
+    bool dup;
+    int compressed_len;
+    /* copy of data, so that the guest can not change it under zlib */
+    uint8_t *page_buf;
+    uint8_t *compressed_buf;
+} CompressJob;
+
+typedef struct CompressWorker {
+    int id;
+    z_stream stream;
+} CompressWorker;
+
+/* struct contains the compression threads and the batch of pages they are
+   working on */
+static struct {
+    /* NULL when compression is not running */
+    CompressWorker *workers;
+    int nr_workers;
+    /* current batch, in stream order */
+    CompressJob jobs[COMPRESS_BATCH_PAGES];
+    int nr_jobs;
+    /* NULL with a single compression thread */
+    WorkerPool *pool;
+} Compress;
+
+static void compress_page(CompressWorker *w, CompressJob *job)
 {
-    RAMBlock *block, *nblock, **blocks;
-    int n;
-    n = 0;
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ++n;
-    }
-    blocks = g_malloc(n * sizeof *blocks);
-    n = 0;
-    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
-        blocks[n++] = block;
-        QLIST_REMOVE(block, next);
+    z_stream *stream = &w->stream;
+
+    memcpy(job->page_buf, job->data, TARGET_PAGE_SIZE);
+    job->compressed_len = 0;
+    job->dup = is_dup_page(job->page_buf);
+    if (job->dup) {
+        return;
     }
-    qsort(blocks, n, sizeof *blocks, block_compar);
-    while (--n >= 0) {
-        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+
+    deflateReset(stream);
+    stream->next_in = job->page_buf;
+    stream->avail_in = TARGET_PAGE_SIZE;
+    stream->next_out = job->compressed_buf;
+    /* the record, with its length, must not be bigger than the page */
+    stream->avail_out = TARGET_PAGE_SIZE - 2;
+    if (deflate(stream, Z_FINISH) == Z_STREAM_END) {
+        job->compressed_len = stream->total_out;
     }
-    g_free(blocks);
 }
 
-static void migration_end(void)
+static void compress_jobs(void *opaque)
 {
-    memory_global_dirty_log_stop();
+    CompressWorker *w = opaque;
+    int i;
 
-    if (migrate_use_xbzrle()) {
-        cache_fini(XBZRLE.cache);
-        g_free(XBZRLE.cache);
-        g_free(XBZRLE.encoded_buf);
-        g_free(XBZRLE.current_buf);
-        g_free(XBZRLE.decoded_buf);
-        XBZRLE.cache = NULL;
+    for (i = w->id; i < Compress.nr_jobs; i += Compress.nr_workers) {
+        compress_page(w, &Compress.jobs[i]);
     }
 }
 
-static void ram_migration_cancel(void *opaque)
+/* Compress Compress.jobs, returns once every page has been handled */
+static void compress_batch(void)
 {
-    migration_end();
-}
+    if (Compress.nr_jobs == 0) {
+        return;
+    }
+    if (!Compress.pool) {
+        compress_jobs(&Compress.workers[0]);
+        return;
+    }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+    worker_pool_kick_all(Compress.pool);
+    worker_pool_wait(Compress.pool);
+}
 
-static int ram_save_setup(QEMUFile *f, void *opaque)
+/*
+ * Writes the page of @job: a duplicate page, a RAM_SAVE_FLAG_COMPRESS_PAGE
+ * record (the be16 length of the zlib data, then the data) or the page
+ * itself.  Returns the bytes sent.
+ */
+static int compress_save_page(QEMUFile *f, CompressJob *job, int cont)
 {
-    ram_addr_t addr;
-    RAMBlock *block;
-
-    bytes_transferred = 0;
-    last_block = NULL;
-    last_offset = 0;
-    sort_ram_list();
-
-    if (migrate_use_xbzrle()) {
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            DPRINTF("Error creating cache\n");
-            return -1;
-        }
-        XBZRLE.encoded_buf = g_malloc0(TARGET_PAGE_SIZE);
-        XBZRLE.current_buf = g_malloc(TARGET_PAGE_SIZE);
-        acct_clear();
+    int bytes_sent;
+
+    if (job->dup) {
+        acct_info.dup_pages++;
+        save_block_hdr(f, job->block, job->offset, cont,
+                       RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *job->page_buf);
+        bytes_sent = 1;
+    } else if (job->compressed_len) {
+        save_block_hdr(f, job->block, job->offset, cont,
+                       RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be16(f, job->compressed_len);
+        qemu_put_buffer(f, job->compressed_buf, job->compressed_len);
+        bytes_sent = job->compressed_len + 2;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+    } else {
+        save_block_hdr(f, job->block, job->offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, job->page_buf, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
     }
 
-    /* Make sure all dirty bits are set */
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (!memory_region_get_dirty(block->mr, addr, TARGET_PAGE_SIZE,
-                                         DIRTY_MEMORY_MIGRATION)) {
-                memory_region_set_dirty(block->mr, addr, TARGET_PAGE_SIZE);
-            }
-        }
-    }
+    return bytes_sent;
+}
 
-    memory_global_dirty_log_start();
+static void compress_stop(void)
+{
+    int i;
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    worker_pool_free(Compress.pool);
+    Compress.pool = NULL;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        qemu_put_byte(f, strlen(block->idstr));
-        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-        qemu_put_be64(f, block->length);
+    for (i = 0; i < Compress.nr_workers; i++) {
+        deflateEnd(&Compress.workers[i].stream);
+    }
+    for (i = 0; i < COMPRESS_BATCH_PAGES; i++) {
+        g_free(Compress.jobs[i].page_buf);
+        g_free(Compress.jobs[i].compressed_buf);
+        Compress.jobs[i].page_buf = NULL;
+        Compress.jobs[i].compressed_buf = NULL;
     }
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
-    return 0;
+    g_free(Compress.workers);
+    Compress.workers = NULL;
+    Compress.nr_workers = 0;
 }
 
-static int ram_save_iterate(QEMUFile *f, void *opaque)
+static int compress_start(void)
 {
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    int ret;
+    int nr_workers = migrate_compress_threads();
     int i;
-    uint64_t expected_time;
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
-
-    i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+    Compress.workers = g_malloc0(nr_workers * sizeof(*Compress.workers));
+    for (i = 0; i < nr_workers; i++) {
+        CompressWorker *w = &Compress.workers[i];
 
-        bytes_sent = ram_save_block(f, false);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
-            break;
-        }
-        bytes_transferred += bytes_sent;
-        acct_info.iterations++;
-        /* we want to check in the 1st loop, just in case it was the 1st time
-           and we had to sync the dirty bitmap.
-           qemu_get_clock_ns() is a bit expensive, so we only check each some
-           iterations
-        */
-        if ((i & 63) == 0) {
-            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - bwidth) / 1000000;
-            if (t1 > MAX_WAIT) {
-                DPRINTF("big wait: " PRIu64 " milliseconds, %d iterations\n",
-                        t1, i);
-                break;
+        w->id = i;
+        if (deflateInit(&w->stream, migrate_compress_level()) != Z_OK) {
+            DPRINTF("Error initializing zlib\n");
+            /* no thread has been started yet */
+            while (--i >= 0) {
+                deflateEnd(&Compress.workers[i].stream);
             }
+            g_free(Compress.workers);
+            Compress.workers = NULL;
+            return -1;
         }
-        i++;
     }
-
-    if (ret < 0) {
-        return ret;
+    Compress.nr_workers = nr_workers;
+    for (i = 0; i < COMPRESS_BATCH_PAGES; i++) {
+        Compress.jobs[i].page_buf = g_malloc(TARGET_PAGE_SIZE);
+        Compress.jobs[i].compressed_buf = g_malloc(TARGET_PAGE_SIZE);
     }
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
-
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
+    if (nr_workers > 1) {
+        Compress.pool = worker_pool_new(nr_workers, compress_jobs,
+                                        Compress.workers,
+                                        sizeof(CompressWorker));
     }
+    return 0;
+}
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+static RAMBlock *last_block;
+static ram_addr_t last_offset;
+static RAMBlock *last_sent_block;
+static uint32_t last_version;
+static unsigned long *migration_bitmap;
+/* pages covered by migration_bitmap, and by mapped_ram_bitmap if set */
+static int64_t migration_bitmap_pages;
+static uint64_t migration_dirty_pages;
+/* with mapped-ram, the pages that have been written to the file */
+static unsigned long *mapped_ram_bitmap;
+/* new dirty pages since the dirty rate was last sampled, and when */
+static uint64_t migration_bitmap_sync_pages;
+static int64_t migration_bitmap_sync_time;
+
+/* Returns a copy of @map, which has @old_bits bits, with @new_bits bits */
+static unsigned long *bitmap_grow(unsigned long *map, int64_t old_bits,
+                                  int64_t new_bits)
+{
+    unsigned long *new_map = bitmap_new(new_bits);
 
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    bitmap_copy(new_map, map, old_bits);
+    g_free(map);
+    return new_map;
+}
 
-    DPRINTF("ram_save_live: expected(" PRIu64 ") <= max(" PRIu64 ")?\n",
-            expected_time, migrate_max_downtime());
+/*
+ * migration_bitmap_extend: Make the migration bitmaps cover RAM that was
+ * hot-plugged since they were allocated.  The new pages are dirty.
+ *
+ * Must be called with the ramlist lock held.
+ */
+static void migration_bitmap_extend(void)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
 
-    if (expected_time <= migrate_max_downtime()) {
-        memory_global_sync_dirty_bitmap(get_system_memory());
-        expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    if (!migration_bitmap || ram_pages <= migration_bitmap_pages) {
+        return;
+    }
 
-        return expected_time <= migrate_max_downtime();
+    migration_bitmap = bitmap_grow(migration_bitmap, migration_bitmap_pages,
+                                   ram_pages);
+    bitmap_set(migration_bitmap, migration_bitmap_pages,
+               ram_pages - migration_bitmap_pages);
+    migration_dirty_pages += ram_pages - migration_bitmap_pages;
+    if (mapped_ram_bitmap) {
+        mapped_ram_bitmap = bitmap_grow(mapped_ram_bitmap,
+                                        migration_bitmap_pages, ram_pages);
     }
-    return 0;
+    migration_bitmap_pages = ram_pages;
 }
 
-static int ram_save_complete(QEMUFile *f, void *opaque)
+static inline bool migration_bitmap_test_and_reset_dirty(MemoryRegion *mr,
+                                                         ram_addr_t offset)
 {
-    memory_global_sync_dirty_bitmap(get_system_memory());
-
-    /* try transferring iterative blocks of memory */
+    bool ret;
+    unsigned long nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
 
-    /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
+    ret = test_and_clear_bit(nr, migration_bitmap);
 
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent < 0) {
-            break;
-        }
-        bytes_transferred += bytes_sent;
+    if (ret) {
+        migration_dirty_pages--;
     }
-    memory_global_dirty_log_stop();
-
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
-    return 0;
+    return ret;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+/*
+ * migration_bitmap_sync: Move the dirty bits gathered by the memory core
+ * into the migration bitmap.
+ *
+ * Must be called with the iothread lock held.  This is the only place that
+ * touches ram_list.phys_dirty on behalf of migration; everything else works
+ * on migration_bitmap and can run from the migration thread.
+ */
+static void migration_bitmap_sync(void)
 {
-    int ret, rc = 0;
-    unsigned int xh_len;
-    int xh_flags;
+    RAMBlock *block;
+    uint64_t num_dirty_pages_init = migration_dirty_pages;
+    int64_t now;
+
+    trace_migration_bitmap_sync_start();
+    memory_global_sync_dirty_bitmap(get_system_memory());
 
-    if (!XBZRLE.decoded_buf) {
-        XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_extend();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        migration_dirty_pages +=
+            memory_region_sync_migration_dirty(block->mr, 0, block->length,
+                                               migration_bitmap);
+    }
+    qemu_mutex_unlock_ramlist();
+    trace_migration_bitmap_sync_end(migration_dirty_pages
+                                    - num_dirty_pages_init);
+
+    /* pages that were still waiting in migration_bitmap do not count,
+     * they cost nothing more to send
+     */
+    migration_bitmap_sync_pages += migration_dirty_pages - num_dirty_pages_init;
+    now = qemu_get_clock_ms(rt_clock);
+    if (now > migration_bitmap_sync_time) {
+        migrate_estimate_dirty_rate(migration_bitmap_sync_pages *
+                                    TARGET_PAGE_SIZE,
+                                    now - migration_bitmap_sync_time);
+        migration_bitmap_sync_pages = 0;
+        migration_bitmap_sync_time = now;
     }
+}
 
-    /* extract RLE header */
+/*
+ * ram_find_dirty_page: Find the next dirty page, starting at the page
+ * after the last one found, and clear it in the migration bitmap
+ *
+ * Returns false if there are no more dirty pages
+ */
+static bool ram_find_dirty_page(RAMBlock **blockp, ram_addr_t *offsetp)
+{
+    RAMBlock *block;
+    ram_addr_t offset = last_offset;
+    unsigned long first, end, nr;
+    bool wrapped = false;
+    bool found = false;
+
+    if (!last_block) {
+        last_block = QLIST_FIRST(&ram_list.blocks);
+    }
+    block = last_block;
+
+    /* Each block owns the bits from its ram_addr_t page number onwards;
+     * after wrapping around, look at the part of last_block before
+     * last_offset too.
+     */
+    for (;;) {
+        first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        end = first + (block->length >> TARGET_PAGE_BITS);
+        if (wrapped && block == last_block) {
+            end = first + (last_offset >> TARGET_PAGE_BITS);
+        }
+        nr = find_next_bit(migration_bitmap, end,
+                           first + (offset >> TARGET_PAGE_BITS));
+        if (nr < end) {
+            offset = (ram_addr_t)(nr - first) << TARGET_PAGE_BITS;
+            found = migration_bitmap_test_and_reset_dirty(block->mr, offset);
+            break;
+        }
+        if (wrapped && block == last_block) {
+            offset = last_offset;
+            break;
+        }
+
+        offset = 0;
+        block = QLIST_NEXT(block, next);
+        if (!block) {
+            block = QLIST_FIRST(&ram_list.blocks);
+        }
+        if (block == last_block) {
+            wrapped = true;
+        }
+    }
+
+    last_block = block;
+    last_offset = offset;
+
+    *blockp = block;
+    *offsetp = offset;
+    return found;
+}
+
+/*
+ * With several migration connections, normal pages are spread over them:
+ * stream 0 is the main channel, written by the migration thread, and each
+ * of the others has a sender thread.  A page always goes to the same
+ * stream, so the copies of a page arrive in the order they were sent.
+ */
+#define RAM_STREAM_CHUNK_BITS 4
+#define RAM_STREAM_BATCH_PAGES 256
+
+typedef struct RAMStreamPage {
+    RAMBlock *block;
+    ram_addr_t offset;
+} RAMStreamPage;
+
+typedef struct RAMStream {
+    int id;
+    QEMUFile *file;
+    RAMBlock *last_sent_block;
+    /* statistics of the current batch */
+    int bytes_sent;
+    uint64_t dup_pages;
+    uint64_t norm_pages;
+} RAMStream;
+
+static struct {
+    RAMStream *streams;
+    int nr_streams;
+    RAMStreamPage pages[RAM_STREAM_BATCH_PAGES];
+    int nr_pages;
+    /* sender threads of the extra streams, NULL if they are not used */
+    WorkerPool *pool;
+} RAMStreams;
+
+static inline int ram_stream_of(RAMBlock *block, ram_addr_t offset)
+{
+    return ((block->offset + offset) >> (TARGET_PAGE_BITS +
+                                         RAM_STREAM_CHUNK_BITS)) %
+        RAMStreams.nr_streams;
+}
+
+static int ram_save_page(RAMStream *st, RAMBlock *block, ram_addr_t offset)
+{
+    QEMUFile *f = st->file;
+    int cont = (block == st->last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (is_dup_page(p)) {
+        st->dup_pages++;
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_sent = 1;
+    } else {
+        save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        /* Sent straight from guest RAM.  If the guest writes the page
+         * before it leaves, the dirty log has it and it is sent again.
+         */
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        st->norm_pages++;
+    }
+
+    st->last_sent_block = block;
+    st->bytes_sent += bytes_sent;
+    return bytes_sent;
+}
+
+/*
+ * Writes the page to its place in a mapped-ram file, MAPPED_RAM_ALIGN plus
+ * its ram_addr_t; a page sent again simply overwrites the old copy.  Zero
+ * pages that were never written are left out, the file reads as zeroes
+ * there.
+ */
+static int ram_save_mapped_page(RAMStream *st, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    ram_addr_t addr = block->mr->ram_addr + offset;
+    unsigned long nr = addr >> TARGET_PAGE_BITS;
+
+    if (!test_bit(nr, mapped_ram_bitmap) && is_dup_page(p) && *p == 0) {
+        st->dup_pages++;
+        return 0;
+    }
+
+    qemu_put_buffer_at(st->file, p, TARGET_PAGE_SIZE,
+                       MAPPED_RAM_ALIGN + addr);
+    set_bit(nr, mapped_ram_bitmap);
+    st->norm_pages++;
+    st->bytes_sent += TARGET_PAGE_SIZE;
+    return TARGET_PAGE_SIZE;
+}
+
+/* Moves the statistics of @st into acct_info, returns the bytes sent */
+static int ram_stream_acct(RAMStream *st)
+{
+    int bytes_sent = st->bytes_sent;
+
+    acct_info.dup_pages += st->dup_pages;
+    acct_info.norm_pages += st->norm_pages;
+    st->bytes_sent = 0;
+    st->dup_pages = 0;
+    st->norm_pages = 0;
+    return bytes_sent;
+}
+
+static void ram_stream_send(void *opaque)
+{
+    RAMStream *st = opaque;
+    RAMStreamPage *page;
+    int i;
+
+    for (i = 0; i < RAMStreams.nr_pages; i++) {
+        page = &RAMStreams.pages[i];
+        if (ram_stream_of(page->block, page->offset) == st->id) {
+            ram_save_page(st, page->block, page->offset);
+        }
+    }
+
+    /* the pages must be gone before the ramlist lock is dropped */
+    if (st->id != 0) {
+        qemu_fflush(st->file);
+    }
+}
+
+/*
+ * Collect up to RAM_STREAM_BATCH_PAGES dirty pages and send them over all
+ * the streams at once.  Returns once every stream is done with them.
+ */
+static int ram_save_batch(QEMUFile *f)
+{
+    int bytes_sent = 0;
+    int error;
+    int i;
+
+    RAMStreams.nr_pages = 0;
+    while (RAMStreams.nr_pages < RAM_STREAM_BATCH_PAGES) {
+        RAMStreamPage *page = &RAMStreams.pages[RAMStreams.nr_pages];
+
+        if (!ram_find_dirty_page(&page->block, &page->offset)) {
+            break;
+        }
+        RAMStreams.nr_pages++;
+    }
+
+    if (RAMStreams.nr_pages == 0) {
+        return -1;
+    }
+
+    worker_pool_kick_all(RAMStreams.pool);
+
+    RAMStreams.streams[0].file = f;
+    ram_stream_send(&RAMStreams.streams[0]);
+
+    worker_pool_wait(RAMStreams.pool);
+
+    for (i = 0; i < RAMStreams.nr_streams; i++) {
+        RAMStream *st = &RAMStreams.streams[i];
+
+        bytes_sent += ram_stream_acct(st);
+        error = qemu_file_get_error(st->file);
+        if (error) {
+            qemu_file_set_error(f, error);
+        }
+    }
+
+    return bytes_sent;
+}
+
+/* Tells the destination that nothing more comes over the extra streams */
+static void ram_streams_finish(QEMUFile *f)
+{
+    int error;
+    int i;
+
+    if (RAMStreams.nr_streams == 1) {
+        return;
+    }
+
+    for (i = 1; i < RAMStreams.nr_streams; i++) {
+        QEMUFile *file = RAMStreams.streams[i].file;
+
+        qemu_put_be64(file, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(file);
+        error = qemu_file_get_error(file);
+        if (error) {
+            qemu_file_set_error(f, error);
+        }
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_SYNC);
+}
+
+static void ram_streams_stop(void)
+{
+    worker_pool_free(RAMStreams.pool);
+    RAMStreams.pool = NULL;
+
+    g_free(RAMStreams.streams);
+    RAMStreams.streams = NULL;
+    RAMStreams.nr_streams = 0;
+}
+
+/*
+ * Picks up the extra connections of the migration, if any.  With XBZRLE
+ * or compression everything stays on the main channel and the extra
+ * streams are only ended at completion.
+ */
+static void ram_streams_start(void)
+{
+    int nr_streams = 1;
+    int i;
+
+    while (nr_streams < MIGRATION_STREAMS_MAX &&
+           migrate_get_stream(nr_streams)) {
+        nr_streams++;
+    }
+
+    RAMStreams.streams = g_malloc0(nr_streams * sizeof(*RAMStreams.streams));
+    RAMStreams.nr_streams = nr_streams;
+    for (i = 0; i < nr_streams; i++) {
+        RAMStreams.streams[i].id = i;
+        RAMStreams.streams[i].file = i ? migrate_get_stream(i) : NULL;
+    }
+
+    if (nr_streams > 1 && !migrate_use_xbzrle() &&
+        !migrate_use_compression()) {
+        /* the migration thread itself sends the share of stream 0 */
+        RAMStreams.pool = worker_pool_new(nr_streams - 1, ram_stream_send,
+                                          &RAMStreams.streams[1],
+                                          sizeof(RAMStream));
+    }
+}
+
+static int xbzrle_save_page(QEMUFile *f, XBZRLEJob *job)
+{
+    XBZRLEThreadAcct *thread_acct = &xbzrle_thread_acct[job->worker];
+    int cont = (job->block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    int bytes_sent;
+
+    switch (job->status) {
+    case XBZRLE_JOB_UNMODIFIED:
+        DPRINTF("Skipping unmodified page\n");
+        return 0;
+    case XBZRLE_JOB_DUP:
+        acct_info.dup_pages++;
+        save_block_hdr(f, job->block, job->offset, cont,
+                       RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, job->dup_byte);
+        bytes_sent = 1;
+        break;
+    case XBZRLE_JOB_ENCODED:
+        /* Send XBZRLE based compressed page */
+        save_block_hdr(f, job->block, job->offset, cont,
+                       RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_byte(f, ENCODING_FLAG_XBZRLE);
+        qemu_put_be16(f, job->encoded_len);
+        qemu_put_buffer(f, job->encoded_buf, job->encoded_len);
+        bytes_sent = job->encoded_len + 1 + 2;
+        acct_info.xbzrle_pages++;
+        acct_info.xbzrle_bytes += bytes_sent;
+        thread_acct->pages++;
+        thread_acct->bytes += bytes_sent;
+        break;
+    default:
+        if (job->status == XBZRLE_JOB_CACHE_MISS) {
+            acct_info.xbzrle_cache_miss++;
+            thread_acct->cache_miss++;
+        } else {
+            DPRINTF("Overflow\n");
+            acct_info.xbzrle_overflows++;
+            thread_acct->overflows++;
+        }
+        if (job->compress) {
+            bytes_sent = compress_save_page(f, job->compress, cont);
+            break;
+        }
+        save_block_hdr(f, job->block, job->offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, job->data, TARGET_PAGE_SIZE);
+        bytes_sent = TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+        break;
+    }
+
+    last_sent_block = job->block;
+    return bytes_sent;
+}
+
+/*
+ * Collect up to XBZRLE_BATCH_PAGES dirty pages, have the encoders work on
+ * them and write the results in the order the pages were found, so the
+ * stream does not depend on how the encoders were scheduled.
+ */
+static int xbzrle_save_batch(QEMUFile *f, bool last_stage)
+{
+    int bytes_sent = 0;
+    int i;
+
+    XBZRLE.nr_jobs = 0;
+    while (XBZRLE.nr_jobs < XBZRLE_BATCH_PAGES) {
+        XBZRLEJob *job = &XBZRLE.jobs[XBZRLE.nr_jobs];
+
+        if (!ram_find_dirty_page(&job->block, &job->offset)) {
+            break;
+        }
+        job->host = memory_region_get_ram_ptr(job->block->mr) + job->offset;
+        job->worker = xbzrle_shard(job->block->offset + job->offset);
+        XBZRLE.nr_jobs++;
+    }
+
+    if (XBZRLE.nr_jobs == 0) {
+        return -1;
+    }
+
+    XBZRLE.last_stage = last_stage;
+    xbzrle_encode_batch();
+
+    /* what the cache could not help with is compressed instead */
+    Compress.nr_jobs = 0;
+    for (i = 0; i < XBZRLE.nr_jobs; i++) {
+        XBZRLEJob *job = &XBZRLE.jobs[i];
+
+        job->compress = NULL;
+        if (Compress.workers && (job->status == XBZRLE_JOB_CACHE_MISS ||
+                                 job->status == XBZRLE_JOB_OVERFLOW)) {
+            job->compress = &Compress.jobs[Compress.nr_jobs++];
+            job->compress->block = job->block;
+            job->compress->offset = job->offset;
+            job->compress->data = job->data;
+        }
+    }
+    compress_batch();
+
+    for (i = 0; i < XBZRLE.nr_jobs; i++) {
+        bytes_sent += xbzrle_save_page(f, &XBZRLE.jobs[i]);
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * Collect up to COMPRESS_BATCH_PAGES dirty pages, compress them and write
+ * them in the order they were found.
+ */
+static int compress_save_batch(QEMUFile *f)
+{
+    RAMStream *st = &RAMStreams.streams[0];
+    int bytes_sent = 0;
+    int i;
+
+    Compress.nr_jobs = 0;
+    while (Compress.nr_jobs < COMPRESS_BATCH_PAGES) {
+        CompressJob *job = &Compress.jobs[Compress.nr_jobs];
+
+        if (!ram_find_dirty_page(&job->block, &job->offset)) {
+            break;
+        }
+        job->data = memory_region_get_ram_ptr(job->block->mr) + job->offset;
+        Compress.nr_jobs++;
+    }
+
+    if (Compress.nr_jobs == 0) {
+        return -1;
+    }
+
+    compress_batch();
+
+    for (i = 0; i < Compress.nr_jobs; i++) {
+        CompressJob *job = &Compress.jobs[i];
+        int cont = (job->block == st->last_sent_block) ?
+            RAM_SAVE_FLAG_CONTINUE : 0;
+
+        bytes_sent += compress_save_page(f, job, cont);
+        st->last_sent_block = job->block;
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f, or a batch of
+ * pages when XBZRLE, compression or several streams are in use
+ *
+ * Returns:  0: if the pages haven't changed
+ *          -1: if there are no more dirty pages
+ *           n: the amount of bytes written in other case
+ *
+ * Called with the ramlist lock held.
+ */
+
+static int ram_save_block(QEMUFile *f, bool last_stage)
+{
+    RAMStream *st = &RAMStreams.streams[0];
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    if (migrate_use_xbzrle()) {
+        return xbzrle_save_batch(f, last_stage);
+    }
+
+    if (Compress.workers) {
+        return compress_save_batch(f);
+    }
+
+    if (RAMStreams.pool) {
+        return ram_save_batch(f);
+    }
+
+    if (!ram_find_dirty_page(&block, &offset)) {
+        return -1;
+    }
+
+    st->file = f;
+    if (mapped_ram_bitmap) {
+        ram_save_mapped_page(st, block, offset);
+    } else {
+        ram_save_page(st, block, offset);
+    }
+    return ram_stream_acct(st);
+}
+
+static uint64_t bytes_transferred;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+/* Guest RAM covered by the pages sent so far, before any compression */
+uint64_t ram_raw_bytes_transferred(void)
+{
+    return (acct_info.dup_pages + acct_info.norm_pages +
+            acct_info.xbzrle_pages + acct_info.compress_pages) *
+        TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+/* Room that the RAM of a mapped-ram file takes, see ram_save_mapped_page() */
+uint64_t ram_mapped_size(void)
+{
+    return last_ram_offset();
+}
+
+static int block_compar(const void *a, const void *b)
+{
+    RAMBlock * const *ablock = a;
+    RAMBlock * const *bblock = b;
+
+    return strcmp((*ablock)->idstr, (*bblock)->idstr);
+}
+
+static void sort_ram_list(void)
+{
+    RAMBlock *block, *nblock, **blocks;
+    int n;
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ++n;
+    }
+    blocks = g_malloc(n * sizeof *blocks);
+    n = 0;
+    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
+        blocks[n++] = block;
+        QLIST_REMOVE(block, next);
+    }
+    qsort(blocks, n, sizeof *blocks, block_compar);
+    while (--n >= 0) {
+        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    }
+    g_free(blocks);
+}
+
+static void migration_end(void)
+{
+    memory_global_dirty_log_stop();
+
+    if (migration_bitmap) {
+        g_free(migration_bitmap);
+        migration_bitmap = NULL;
+    }
+    migration_bitmap_pages = 0;
+
+    g_free(mapped_ram_bitmap);
+    mapped_ram_bitmap = NULL;
+
+    if (XBZRLE.workers) {
+        xbzrle_stop();
+    }
+
+    if (Compress.workers) {
+        compress_stop();
+    }
+
+    if (RAMStreams.streams) {
+        ram_streams_stop();
+    }
+}
+
+static void ram_migration_cancel(void *opaque)
+{
+    migration_end();
+}
+
+static void reset_ram_globals(void)
+{
+    int i;
+
+    last_block = NULL;
+    last_offset = 0;
+    last_sent_block = NULL;
+    for (i = 0; i < RAMStreams.nr_streams; i++) {
+        RAMStreams.streams[i].last_sent_block = NULL;
+    }
+    last_version = ram_list.version;
+    sort_ram_list();
+    migration_bitmap_extend();
+}
+
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+#ifdef __linux__
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAPPED (1ULL << 62)
+#define PAGEMAP_CHUNK   4096
+
+/* Returns a descriptor for ram_find_unpopulated(), or -errno */
+static int ram_open_pagemap(void)
+{
+    int fd = open("/proc/self/pagemap", O_RDONLY);
+
+    return fd < 0 ? -errno : fd;
+}
+
+/*
+ * Sets in @map, from bit @nr on, the ones of the @npages target pages at
+ * @host that the host kernel never populated: they are neither in memory
+ * nor swapped out, and read as zeroes.  @host must be private anonymous
+ * memory, @fd comes from ram_open_pagemap().  Returns the number of such
+ * pages, or -errno.
+ */
+static int64_t ram_find_unpopulated(int fd, uint8_t *host, uint64_t npages,
+                                    unsigned long *map, unsigned long nr)
+{
+    uint64_t entries[PAGEMAP_CHUNK];
+    uintptr_t host_page_size = getpagesize();
+    uintptr_t addr = (uintptr_t)host;
+    uintptr_t end = addr + (npages << TARGET_PAGE_BITS);
+    uintptr_t first = 0, last = 0, page;
+    int64_t count = 0;
+    bool populated;
+    ssize_t len;
+
+    for (; addr < end; addr += TARGET_PAGE_SIZE, nr++) {
+        populated = false;
+        /* a target page may span several host pages */
+        for (page = addr / host_page_size;
+             page * host_page_size < addr + TARGET_PAGE_SIZE; page++) {
+            if (page >= last) {
+                len = pread(fd, entries, sizeof(entries),
+                            (off_t)page * sizeof(entries[0]));
+                if (len < (ssize_t)sizeof(entries[0])) {
+                    return len < 0 ? -errno : -EIO;
+                }
+                first = page;
+                last = page + len / sizeof(entries[0]);
+            }
+            if (entries[page - first] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) {
+                populated = true;
+                break;
+            }
+        }
+        if (!populated) {
+            set_bit(nr, map);
+            count++;
+        }
+    }
+
+    return count;
+}
+#else
+static int ram_open_pagemap(void)
+{
+    return -ENOTSUP;
+}
+
+static int64_t ram_find_unpopulated(int fd, uint8_t *host, uint64_t npages,
+                                    unsigned long *map, unsigned long nr)
+{
+    return -ENOTSUP;
+}
+#endif
+
+/*
+ * Writes the ranges of pages set in @map, block by block: the length and
+ * name of the block, then (number of pages, first page) pairs up to a
+ * zero number of pages.  A zero length block name ends the list.
+ */
+static void ram_put_ranges(QEMUFile *f, unsigned long *map)
+{
+    RAMBlock *block;
+    unsigned long first, end, start, stop;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        end = first + (block->length >> TARGET_PAGE_BITS);
+        start = find_next_bit(map, end, first);
+        if (start >= end) {
+            continue;
+        }
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        while (start < end) {
+            stop = find_next_zero_bit(map, end, start);
+            qemu_put_be64(f, stop - start);
+            qemu_put_be64(f, start - first);
+            start = find_next_bit(map, end, stop);
+        }
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+}
+
+/*
+ * Leaves the pages that the host never populated out of the migration,
+ * and tells the destination that they are zero.  This must come after
+ * dirty logging has started, so that the ones that the guest writes to
+ * from now on are still sent.
+ */
+static void ram_save_zero_map(QEMUFile *f)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    unsigned long *zero_map;
+    RAMBlock *block;
+    int64_t count;
+    int fd;
+
+    /* file backed memory is not zero when it is not mapped in yet */
+    if (mem_path) {
+        return;
+    }
+
+    /* without it the map stays empty, and every page is sent */
+    fd = ram_open_pagemap();
+    if (fd < 0) {
+        DPRINTF("Could not open the page map: %s\n", strerror(-fd));
+    }
+
+    zero_map = bitmap_new(ram_pages);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (fd < 0 || !block->host || (block->flags & RAM_PREALLOC_MASK)) {
+            continue;
+        }
+        count = ram_find_unpopulated(fd, block->host,
+                                     block->length >> TARGET_PAGE_BITS,
+                                     zero_map,
+                                     block->mr->ram_addr >> TARGET_PAGE_BITS);
+        if (count < 0) {
+            DPRINTF("Could not find the unpopulated pages of %s: %s\n",
+                    block->idstr, strerror(-count));
+            bitmap_clear(zero_map, block->mr->ram_addr >> TARGET_PAGE_BITS,
+                         block->length >> TARGET_PAGE_BITS);
+            continue;
+        }
+        DPRINTF("%s: %" PRId64 " unpopulated pages\n", block->idstr, count);
+        migration_dirty_pages -= count;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_ZERO_MAP);
+    ram_put_ranges(f, zero_map);
+    bitmap_andnot(migration_bitmap, migration_bitmap, zero_map, ram_pages);
+    g_free(zero_map);
+}
+
+static int ram_save_setup(QEMUFile *f, void *opaque)
+{
+    RAMBlock *block;
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+
+    migration_bitmap = bitmap_new(ram_pages);
+    bitmap_set(migration_bitmap, 0, ram_pages);
+    migration_bitmap_pages = ram_pages;
+    migration_dirty_pages = ram_pages;
+
+    bytes_transferred = 0;
+    /* the wire ratio estimate is computed from these, so never let a
+     * previous migration's page counts leak into this one */
+    acct_clear();
+
+    /* the transport only allows this for a mapped-ram file */
+    if (qemu_file_can_put_at(f)) {
+        mapped_ram_bitmap = bitmap_new(ram_pages);
+    }
+
+    if (migrate_use_xbzrle() && xbzrle_start() < 0) {
+        return -1;
+    }
+    if (migrate_use_compression() && compress_start() < 0) {
+        return -1;
+    }
+    ram_streams_start();
+
+    qemu_mutex_lock_ramlist();
+    reset_ram_globals();
+
+    memory_global_dirty_log_start();
+    migration_bitmap_sync_pages = 0;
+    migration_bitmap_sync_time = qemu_get_clock_ms(rt_clock);
+    /* start from a clean slate: everything is already in migration_bitmap */
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        memory_region_sync_migration_dirty(block->mr, 0, block->length,
+                                           migration_bitmap);
+    }
+
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+    }
+
+    if (migrate_use_zero_map()) {
+        ram_save_zero_map(f);
+    }
+
+    qemu_mutex_unlock_ramlist();
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+/*
+ * ram_save_iterate: send dirty pages until the rate limit is hit
+ *
+ * Called from the migration thread without the iothread lock; only the
+ * ramlist lock is taken.  The dirty bitmap is refilled from
+ * ram_save_pending(), so this just drains migration_bitmap.
+ *
+ * Returns 1 once there are no dirty pages left, 0 otherwise.
+ */
+static int ram_save_iterate(QEMUFile *f, void *opaque)
+{
+    int ret;
+    int i;
+    int64_t t0;
+    bool done = false;
+
+    qemu_mutex_lock_ramlist();
+
+    if (ram_list.version != last_version) {
+        reset_ram_globals();
+    }
+
+    t0 = qemu_get_clock_ns(rt_clock);
+    i = 0;
+    while ((ret = qemu_file_rate_limit(f)) == 0) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, false);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            done = true;
+            break;
+        }
+        bytes_transferred += bytes_sent;
+        acct_info.iterations++;
+        /* we want to check in the 1st loop, just in case it was the 1st time
+           and we had to sync the dirty bitmap.
+           qemu_get_clock_ns() is a bit expensive, so we only check each some
+           iterations
+        */
+        if ((i & 63) == 0) {
+            uint64_t t1 = (qemu_get_clock_ns(rt_clock) - t0) / 1000000;
+            if (t1 > MAX_WAIT) {
+                DPRINTF("big wait: %" PRIu64 " milliseconds, %d iterations\n",
+                        t1, i);
+                break;
+            }
+        }
+        i++;
+    }
+
+    /* pages queued by qemu_put_buffer_async() must not outlive their block */
+    qemu_fflush(f);
+    qemu_mutex_unlock_ramlist();
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return done;
+}
+
+/*
+ * Tells the destination where each block is in the mapped-ram file: its
+ * name and length, then its offset in the file.  A zero length block name
+ * ends the list.
+ */
+static void ram_save_mapped(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MAPPED);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+        qemu_put_be64(f, MAPPED_RAM_ALIGN + block->mr->ram_addr);
+    }
+    qemu_put_byte(f, 0);
+}
+
+/* Called with the iothread lock held and the VM stopped */
+static int ram_save_complete(QEMUFile *f, void *opaque)
+{
+    migration_bitmap_sync();
+
+    qemu_mutex_lock_ramlist();
+
+    /* try transferring iterative blocks of memory */
+
+    /* flush all remaining blocks regardless of rate limiting */
+    while (true) {
+        int bytes_sent;
+
+        bytes_sent = ram_save_block(f, true);
+        /* no more blocks to sent */
+        if (bytes_sent < 0) {
+            break;
+        }
+        bytes_transferred += bytes_sent;
+    }
+
+    ram_streams_finish(f);
+    if (mapped_ram_bitmap) {
+        ram_save_mapped(f);
+    }
+    qemu_fflush(f);
+    qemu_mutex_unlock_ramlist();
+    migration_end();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+/*
+ * ram_save_pending: report how much RAM is still dirty
+ *
+ * Called from the migration thread without the iothread lock.  When the
+ * dirty set looks small enough to be sent within max_size, the dirty log
+ * is resynced (this briefly takes the iothread lock) so that the caller
+ * decides on up-to-date numbers.
+ */
+static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
+{
+    uint64_t remaining_size;
+
+    remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+
+    if (remaining_size <= max_size) {
+        qemu_mutex_lock_iothread();
+        migration_bitmap_sync();
+        qemu_mutex_unlock_iothread();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    }
+    return remaining_size;
+}
+
+/*
+ * Post-copy, source side.  Once the guest runs on the destination, it asks
+ * for the pages it faults on over the migration socket; they are sent
+ * ahead of the others, which are pushed in the background.
+ */
+
+/* Messages on the return path, from the destination */
+#define RAM_POSTCOPY_REQ_PAGE 1
+#define RAM_POSTCOPY_DONE     2
+
+/* Background pages sent between looks at the page requests */
+#define RAM_POSTCOPY_BATCH_PAGES 64
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static struct {
+    int fd;
+    QEMUFile *file;
+    QemuThread thread;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, RAMPageRequest) requests;
+    /* the destination has received all of RAM */
+    bool done;
+} RAMPostcopy;
+
+/*
+ * ram_save_postcopy: Switch to post-copy, with the VM stopped
+ *
+ * Instead of the dirty pages, the destination gets the ranges of pages
+ * that it has to drop and fetch again.  Returns 0.
+ */
+static int ram_save_postcopy(QEMUFile *f, void *opaque)
+{
+    migration_bitmap_sync();
+
+    qemu_mutex_lock_ramlist();
+    ram_streams_finish(f);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    ram_put_ranges(f, migration_bitmap);
+
+    /* the pages that follow the device state can not use CONTINUE yet */
+    RAMStreams.streams[0].last_sent_block = NULL;
+    qemu_fflush(f);
+    qemu_mutex_unlock_ramlist();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    return 0;
+}
+
+static void *ram_postcopy_return_thread(void *opaque)
+{
+    QEMUFile *f = RAMPostcopy.file;
+    RAMPageRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+    int cmd;
+
+    while (true) {
+        cmd = qemu_get_be32(f);
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+        if (cmd == RAM_POSTCOPY_DONE) {
+            DPRINTF("destination has all of RAM\n");
+            RAMPostcopy.done = true;
+            break;
+        }
+        if (cmd != RAM_POSTCOPY_REQ_PAGE) {
+            fprintf(stderr, "Unknown post-copy message %d\n", cmd);
+            break;
+        }
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        offset = qemu_get_be64(f);
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        /*
+         * Check the request and queue it under the ramlist lock, which
+         * ram_postcopy_send() also holds while it uses the block.
+         */
+        qemu_mutex_lock_ramlist();
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length) {
+            qemu_mutex_unlock_ramlist();
+            fprintf(stderr, "Bad post-copy page request %s:" RAM_ADDR_FMT
+                    "\n", id, offset);
+            break;
+        }
+
+        req = g_malloc(sizeof(*req));
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+        qemu_mutex_lock(&RAMPostcopy.lock);
+        QSIMPLEQ_INSERT_TAIL(&RAMPostcopy.requests, req, next);
+        qemu_mutex_unlock(&RAMPostcopy.lock);
+        qemu_mutex_unlock_ramlist();
+    }
+
+    return NULL;
+}
+
+/* Starts listening for page requests on the migration socket @fd */
+int ram_postcopy_outgoing_start(int fd)
+{
+    RAMPostcopy.fd = fd;
+    RAMPostcopy.file = qemu_fopen_socket(fd);
+    RAMPostcopy.done = false;
+    qemu_mutex_init(&RAMPostcopy.lock);
+    QSIMPLEQ_INIT(&RAMPostcopy.requests);
+    qemu_thread_create(&RAMPostcopy.thread, ram_postcopy_return_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+/*
+ * ram_postcopy_send: Send the pages that the destination is missing
+ *
+ * The pages it asked for go first, then a batch of the others.  There is
+ * no rate limiting: the guest is stopped here, and every page that is
+ * still here can stall it over there.
+ *
+ * Returns 1 once all of RAM has been sent, 0 if there is more to send,
+ * negative on error.
+ */
+int ram_postcopy_send(QEMUFile *f)
+{
+    RAMStream *st = &RAMStreams.streams[0];
+    RAMPageRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int ret = 0;
+    int i;
+
+    qemu_mutex_lock_ramlist();
+    st->file = f;
+
+    qemu_mutex_lock(&RAMPostcopy.lock);
+    while ((req = QSIMPLEQ_FIRST(&RAMPostcopy.requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&RAMPostcopy.requests, next);
+        qemu_mutex_unlock(&RAMPostcopy.lock);
+
+        /* it may have gone out in the background already */
+        if (migration_bitmap_test_and_reset_dirty(req->block->mr,
+                                                  req->offset)) {
+            DPRINTF("requested page %s:" RAM_ADDR_FMT "\n",
+                    req->block->idstr, req->offset);
+            ram_save_page(st, req->block, req->offset);
+        }
+        g_free(req);
+
+        qemu_mutex_lock(&RAMPostcopy.lock);
+    }
+    qemu_mutex_unlock(&RAMPostcopy.lock);
+
+    for (i = 0; i < RAM_POSTCOPY_BATCH_PAGES; i++) {
+        if (!ram_find_dirty_page(&block, &offset)) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            ret = 1;
+            break;
+        }
+        ram_save_page(st, block, offset);
+    }
+    bytes_transferred += ram_stream_acct(st);
+
+    qemu_fflush(f);
+    qemu_mutex_unlock_ramlist();
+
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    return ret;
+}
+
+/*
+ * Waits for the destination to confirm that it has all of RAM, or after a
+ * failure just stops listening to it.  Returns 0 if the destination has
+ * the whole guest, negative otherwise.
+ */
+int ram_postcopy_outgoing_finish(bool success)
+{
+    RAMPageRequest *req;
+
+    if (!success) {
+        /* wakes up the return path thread */
+        shutdown(RAMPostcopy.fd, 2);
+    }
+    qemu_thread_join(&RAMPostcopy.thread);
+
+    while ((req = QSIMPLEQ_FIRST(&RAMPostcopy.requests)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&RAMPostcopy.requests, next);
+        g_free(req);
+    }
+    qemu_fclose(RAMPostcopy.file);
+    RAMPostcopy.file = NULL;
+    qemu_mutex_destroy(&RAMPostcopy.lock);
+
+    if (!success || !RAMPostcopy.done) {
+        return -EIO;
+    }
+
+    qemu_mutex_lock_iothread();
+    migration_end();
+    qemu_mutex_unlock_iothread();
+    return 0;
+}
+
+/* @blockp holds the last block seen on @f, for RAM_SAVE_FLAG_CONTINUE */
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            RAMBlock **blockp,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = *blockp;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *blockp = block;
+            return memory_region_get_ram_ptr(block->mr) + offset;
+        }
+    }
+
+    *blockp = NULL;
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+static void ram_load_dup_page(void *host, uint8_t ch)
+{
+    memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+    if (ch == 0 &&
+        (!kvm_enabled() || kvm_has_sync_mmu())) {
+        qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
+/*
+ * Incoming side of the extra RAM streams.  Each has a thread that stores
+ * pages into guest memory until it gets RAM_SAVE_FLAG_EOS; the main
+ * channel sends RAM_SAVE_FLAG_SYNC once all of them have been ended.
+ * A stream that fails shuts its socket and the main channel down, so
+ * that neither the source nor ram_load() waits for it any longer.
+ */
+typedef struct RAMLoadStream {
+    QemuThread thread;
+    QEMUFile *file;
+    int fd;
+    int ret;
+    /* set by the thread just before it exits */
+    bool finished;
+} RAMLoadStream;
+
+static RAMLoadStream *ram_load_streams;
+static int ram_load_nr_streams;
+static QEMUFile *ram_load_main_file;
+
+/*
+ * Set by each stream thread when it finishes, so that ram_load() can go
+ * back to the main loop instead of joining threads that still run.
+ * Without eventfd support the threads are simply joined.
+ */
+static EventNotifier ram_load_streams_notifier;
+static bool ram_load_streams_have_notifier;
+static Coroutine *ram_load_streams_co;
+
+static void ram_load_stream_fail(RAMLoadStream *st, int ret)
+{
+    int fd = qemu_get_fd(ram_load_main_file);
+
+    st->ret = ret;
+    shutdown(st->fd, SHUT_RDWR);
+    qemu_file_set_error(ram_load_main_file, ret);
+    if (fd != -1) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
+
+static void *ram_load_stream_thread(void *opaque)
+{
+    RAMLoadStream *st = opaque;
+    QEMUFile *f = st->file;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    void *host;
+    int flags;
+    int ret;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (!(flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE))) {
+            ret = -EINVAL;
+            break;
+        }
+
+        host = host_from_stream_offset(f, &block, addr, flags);
+        if (!host) {
+            ret = -EINVAL;
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            ram_load_dup_page(host, qemu_get_byte(f));
+        } else {
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        }
+    }
+
+    if (ret) {
+        ram_load_stream_fail(st, ret);
+    }
+
+    /* st->ret must be visible before st->finished */
+    __sync_synchronize();
+    st->finished = true;
+    if (ram_load_streams_have_notifier) {
+        event_notifier_set(&ram_load_streams_notifier);
+    }
+    return NULL;
+}
+
+/*
+ * Takes over the sockets in @fds and starts receiving pages from them,
+ * next to the main channel @f.
+ */
+int ram_load_start_streams(QEMUFile *f, int *fds, int nr_fds)
+{
+    int i;
+
+    if (nr_fds == 0) {
+        return 0;
+    }
+    if (ram_load_streams) {
+        return -EBUSY;
+    }
+
+    ram_load_streams = g_malloc0(nr_fds * sizeof(*ram_load_streams));
+    ram_load_nr_streams = nr_fds;
+    ram_load_main_file = f;
+    ram_load_streams_have_notifier =
+        event_notifier_init(&ram_load_streams_notifier, 0) == 0;
+    for (i = 0; i < nr_fds; i++) {
+        RAMLoadStream *st = &ram_load_streams[i];
+
+        st->fd = fds[i];
+        st->file = qemu_fopen_socket(fds[i]);
+        qemu_thread_create(&st->thread, ram_load_stream_thread, st,
+                           QEMU_THREAD_JOINABLE);
+    }
+    return 0;
+}
+
+/*
+ * Joins the stream threads and closes their sockets, returns the first
+ * error.  With @abort, the sockets are shut down first so that threads
+ * still waiting for data give up.
+ */
+static int ram_load_stop_streams(bool abort)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < ram_load_nr_streams; i++) {
+        RAMLoadStream *st = &ram_load_streams[i];
+
+        if (abort) {
+            shutdown(st->fd, SHUT_RDWR);
+        }
+        qemu_thread_join(&st->thread);
+        if (st->ret < 0 && ret == 0) {
+            ret = st->ret;
+        }
+        qemu_fclose(st->file);
+        close(st->fd);
+    }
+
+    if (ram_load_streams_have_notifier) {
+        event_notifier_cleanup(&ram_load_streams_notifier);
+        ram_load_streams_have_notifier = false;
+    }
+    g_free(ram_load_streams);
+    ram_load_streams = NULL;
+    ram_load_nr_streams = 0;
+    ram_load_main_file = NULL;
+    return ret;
+}
+
+static bool ram_load_streams_finished(void)
+{
+    int i;
+
+    for (i = 0; i < ram_load_nr_streams; i++) {
+        if (!ram_load_streams[i].finished) {
+            return false;
+        }
+    }
+    __sync_synchronize();
+    return true;
+}
+
+static void ram_load_streams_event(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+    if (ram_load_streams_co) {
+        qemu_coroutine_enter(ram_load_streams_co, NULL);
+    }
+}
+
+/*
+ * Waits for the extra streams to end, returns the first error.  The
+ * incoming migration coroutine yields to the main loop in the meantime.
+ */
+static int ram_load_wait_streams(void)
+{
+    if (ram_load_streams_have_notifier && qemu_in_coroutine()) {
+        event_notifier_set_handler(&ram_load_streams_notifier,
+                                   ram_load_streams_event);
+        while (!ram_load_streams_finished()) {
+            ram_load_streams_co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+        }
+        ram_load_streams_co = NULL;
+        event_notifier_set_handler(&ram_load_streams_notifier, NULL);
+    }
+    return ram_load_stop_streams(false);
+}
+
+/*
+ * Reads the ranges written by ram_put_ranges() and calls @fn on each of
+ * them, with @opaque.  Returns 0 or the first error.
+ */
+static int ram_get_ranges(QEMUFile *f,
+                          int (*fn)(RAMBlock *block, uint64_t start,
+                                    uint64_t npages, void *opaque),
+                          void *opaque)
+{
+    RAMBlock *block;
+    uint64_t start, npages;
+    char id[256];
+    uint8_t len;
+    int ret;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        while ((npages = qemu_get_be64(f)) != 0) {
+            start = qemu_get_be64(f);
+            if (start + npages > (block->length >> TARGET_PAGE_BITS)) {
+                fprintf(stderr, "Bad range of pages in block %s\n", id);
+                return -EINVAL;
+            }
+            ret = fn(block, start, npages, opaque);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (qemu_file_get_error(f)) {
+            return qemu_file_get_error(f);
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
+/*
+ * These pages are zero on the source.  Here, the ones that the host never
+ * populated are zero too and are not even looked at; the others are
+ * cleared if needed, as this may be a loadvm into a used guest.
+ */
+static int ram_load_zero_range(RAMBlock *block, uint64_t start,
+                               uint64_t npages, void *opaque)
+{
+    int pagemap_fd = *(int *)opaque;
+    uint8_t *host = block->host + (start << TARGET_PAGE_BITS);
+    unsigned long *unpopulated = bitmap_new(npages);
+    uint64_t i;
+
+    if (pagemap_fd < 0 ||
+        ram_find_unpopulated(pagemap_fd, host, npages, unpopulated, 0) < 0) {
+        bitmap_zero(unpopulated, npages);
+    }
+    for (i = 0; i < npages; i++) {
+        uint8_t *page = host + (i << TARGET_PAGE_BITS);
+
+        if (!test_bit(i, unpopulated) && (!is_dup_page(page) || *page)) {
+            ram_load_dup_page(page, 0);
+        }
+    }
+
+    g_free(unpopulated);
+    return 0;
+}
+
+/*
+ * Post-copy, destination side.  The pages that the source still has are
+ * dropped, and userfaultfd reports the accesses to them: the fault thread
+ * asks the source for them, and the receiver thread places them as they
+ * arrive, which wakes up whoever was waiting.  Pages that were dropped
+ * during pre-copy because they were zero are simply mapped to zeroes.
+ */
+#ifdef CONFIG_USERFAULTFD
+static struct {
+    QEMUFile *file;
+    int fd;
+    int uffd;
+    int quit_fds[2];
+    QemuThread fault_thread;
+    QemuThread recv_thread;
+    /* protects missing, requested and the writes to fd */
+    QemuMutex lock;
+    unsigned long *missing;
+    unsigned long *requested;
+    uint8_t *page;
+    /* the missing pages are dropped and the fault thread is running */
+    bool faulting;
+} RAMPostcopyIncoming;
+
+static void ram_postcopy_request_page(RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t buf[4 + 1 + 256 + 8];
+    uint8_t len = strlen(block->idstr);
+    uint32_t cmd = cpu_to_be32(RAM_POSTCOPY_REQ_PAGE);
+    uint64_t addr = cpu_to_be64(offset);
+
+    memcpy(buf, &cmd, 4);
+    buf[4] = len;
+    memcpy(buf + 5, block->idstr, len);
+    memcpy(buf + 5 + len, &addr, 8);
+    if (qemu_send_full(RAMPostcopyIncoming.fd, buf, 5 + len + 8, 0) < 0) {
+        fprintf(stderr, "Could not request page %s:" RAM_ADDR_FMT "\n",
+                block->idstr, offset);
+    }
+}
+
+static void ram_postcopy_fault(uint64_t host)
+{
+    struct uffdio_zeropage zero;
+    RAMBlock *block;
+    ram_addr_t offset = 0;
+    unsigned long nr;
+
+    qemu_mutex_lock_ramlist();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (host >= (uintptr_t)block->host &&
+            host < (uintptr_t)block->host + block->length) {
+            offset = host - (uintptr_t)block->host;
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+    if (!block) {
+        fprintf(stderr, "Post-copy fault outside of RAM at 0x%" PRIx64 "\n",
+                host);
+        return;
+    }
+
+    nr = (block->offset + offset) >> TARGET_PAGE_BITS;
+    qemu_mutex_lock(&RAMPostcopyIncoming.lock);
+    if (test_bit(nr, RAMPostcopyIncoming.missing)) {
+        if (!test_and_set_bit(nr, RAMPostcopyIncoming.requested)) {
+            DPRINTF("requesting page %s:" RAM_ADDR_FMT "\n",
+                    block->idstr, offset);
+            ram_postcopy_request_page(block, offset);
+        }
+    } else {
+        zero.range.start = host;
+        zero.range.len = TARGET_PAGE_SIZE;
+        zero.mode = 0;
+        if (ioctl(RAMPostcopyIncoming.uffd, UFFDIO_ZEROPAGE, &zero) &&
+            errno == EEXIST) {
+            /* somebody else faulted on it first */
+            ioctl(RAMPostcopyIncoming.uffd, UFFDIO_WAKE, &zero.range);
+        }
+    }
+    qemu_mutex_unlock(&RAMPostcopyIncoming.lock);
+}
+
+static void *ram_postcopy_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    ssize_t len;
+
+    pfd[0].fd = RAMPostcopyIncoming.uffd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = RAMPostcopyIncoming.quit_fds[0];
+    pfd[1].events = POLLIN;
+
+    while (true) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        len = read(RAMPostcopyIncoming.uffd, &msg, sizeof(msg));
+        if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (len != sizeof(msg)) {
+            fprintf(stderr, "Could not read userfaultfd\n");
+            break;
+        }
+        if (msg.event == UFFD_EVENT_PAGEFAULT) {
+            ram_postcopy_fault(msg.arg.pagefault.address & TARGET_PAGE_MASK);
+        }
+    }
+
+    return NULL;
+}
+
+static int ram_postcopy_place_page(RAMBlock *block, ram_addr_t offset,
+                                   void *host)
+{
+    struct uffdio_copy copy;
+    int ret = 0;
+
+    copy.dst = (uintptr_t)host;
+    copy.src = (uintptr_t)RAMPostcopyIncoming.page;
+    copy.len = TARGET_PAGE_SIZE;
+    copy.mode = 0;
+
+    qemu_mutex_lock(&RAMPostcopyIncoming.lock);
+    if (ioctl(RAMPostcopyIncoming.uffd, UFFDIO_COPY, &copy)) {
+        if (errno == EEXIST) {
+            memcpy(host, RAMPostcopyIncoming.page, TARGET_PAGE_SIZE);
+        } else {
+            ret = -errno;
+        }
+    }
+    clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+              RAMPostcopyIncoming.missing);
+    qemu_mutex_unlock(&RAMPostcopyIncoming.lock);
+    return ret;
+}
+
+static void *ram_postcopy_recv_thread(void *opaque)
+{
+    QEMUFile *f = RAMPostcopyIncoming.file;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    uint32_t cmd;
+    void *host;
+    int flags;
+    int ret = 0;
+
+    while (true) {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+        if (!(flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE))) {
+            ret = -EINVAL;
+            break;
+        }
+
+        host = host_from_stream_offset(f, &block, addr, flags);
+        if (!host) {
+            ret = -EINVAL;
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(RAMPostcopyIncoming.page, qemu_get_byte(f),
+                   TARGET_PAGE_SIZE);
+        } else {
+            qemu_get_buffer(f, RAMPostcopyIncoming.page, TARGET_PAGE_SIZE);
+        }
+
+        ret = qemu_file_get_error(f);
+        if (ret == 0) {
+            ret = ram_postcopy_place_page(block, addr, host);
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        /* there is no way back, and part of the guest's memory is lost */
+        fprintf(stderr, "post-copy migration failed: %s\n", strerror(-ret));
+        exit(1);
+    }
+    DPRINTF("post-copy migration done\n");
+
+    /* the guest will not fault on anything anymore */
+    if (write(RAMPostcopyIncoming.quit_fds[1], "", 1) < 0) {
+        fprintf(stderr, "Could not stop the post-copy fault thread\n");
+    }
+    qemu_thread_join(&RAMPostcopyIncoming.fault_thread);
+    close(RAMPostcopyIncoming.uffd);
+    close(RAMPostcopyIncoming.quit_fds[0]);
+    close(RAMPostcopyIncoming.quit_fds[1]);
+
+    cmd = cpu_to_be32(RAM_POSTCOPY_DONE);
+    if (qemu_send_full(RAMPostcopyIncoming.fd, &cmd, sizeof(cmd), 0) < 0) {
+        fprintf(stderr, "Could not tell the source that post-copy is done\n");
+    }
+    qemu_fclose(f);
+    close(RAMPostcopyIncoming.fd);
+
+    qemu_mutex_destroy(&RAMPostcopyIncoming.lock);
+    g_free(RAMPostcopyIncoming.missing);
+    g_free(RAMPostcopyIncoming.requested);
+    qemu_vfree(RAMPostcopyIncoming.page);
+    memset(&RAMPostcopyIncoming, 0, sizeof(RAMPostcopyIncoming));
+
+    return NULL;
+}
+
+/* These pages will come later: drop them, until then the guest faults */
+static int ram_postcopy_drop_range(RAMBlock *block, uint64_t start,
+                                   uint64_t npages, void *opaque)
+{
+    bitmap_set(RAMPostcopyIncoming.missing,
+               (block->offset >> TARGET_PAGE_BITS) + start, npages);
+    if (qemu_madvise(block->host + (start << TARGET_PAGE_BITS),
+                     npages << TARGET_PAGE_BITS, QEMU_MADV_DONTNEED) < 0) {
+        fprintf(stderr, "Could not drop the pages of block %s\n",
+                block->idstr);
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Reads the ranges of pages that will come later, drops them and starts
+ * catching the accesses to them.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg;
+    RAMBlock *block;
+    int uffd;
+    int ret;
+
+    if (!migrate_use_postcopy() || qemu_get_fd(f) < 0 ||
+        RAMPostcopyIncoming.missing) {
+        fprintf(stderr, "Unexpected post-copy migration\n");
+        return -EINVAL;
+    }
+
+    RAMPostcopyIncoming.missing = bitmap_new(ram_pages);
+    RAMPostcopyIncoming.requested = bitmap_new(ram_pages);
+
+    ret = ram_get_ranges(f, ram_postcopy_drop_range, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0 || ioctl(uffd, UFFDIO_API, &api)) {
+        fprintf(stderr, "Could not open userfaultfd\n");
+        return -errno;
+    }
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        reg.range.start = (uintptr_t)block->host;
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(uffd, UFFDIO_REGISTER, &reg)) {
+            fprintf(stderr, "Could not register block %s with userfaultfd\n",
+                    block->idstr);
+            close(uffd);
+            return -errno;
+        }
+    }
+    if (qemu_pipe(RAMPostcopyIncoming.quit_fds) < 0) {
+        close(uffd);
+        return -errno;
+    }
+
+    RAMPostcopyIncoming.fd = qemu_get_fd(f);
+    RAMPostcopyIncoming.uffd = uffd;
+    qemu_mutex_init(&RAMPostcopyIncoming.lock);
+    qemu_thread_create(&RAMPostcopyIncoming.fault_thread,
+                       ram_postcopy_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    RAMPostcopyIncoming.faulting = true;
+    return 0;
+}
+
+/* Takes over @f, the rest of which are the pages that are still missing */
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    if (!RAMPostcopyIncoming.faulting) {
+        fprintf(stderr, "Post-copy device state without RAM\n");
+        return -EINVAL;
+    }
+
+    /* the receiver thread waits for the pages, not the main loop */
+    socket_set_block(qemu_get_fd(f));
+    RAMPostcopyIncoming.file = f;
+    RAMPostcopyIncoming.page = qemu_memalign(getpagesize(), TARGET_PAGE_SIZE);
+    qemu_thread_create(&RAMPostcopyIncoming.recv_thread,
+                       ram_postcopy_recv_thread, NULL, QEMU_THREAD_DETACHED);
+    return 0;
+}
+
+/*
+ * Post-copy needs userfaultfd to catch the accesses to the missing pages,
+ * and anonymous memory with pages of the host's size so that target pages
+ * can be dropped and placed one by one.
+ */
+bool ram_postcopy_supported(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int uffd;
+    bool ret;
+
+    if (TARGET_PAGE_SIZE != getpagesize() || mem_path) {
+        return false;
+    }
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        return false;
+    }
+    ret = ioctl(uffd, UFFDIO_API, &api) == 0;
+    close(uffd);
+    return ret;
+}
+#else
+static int ram_load_postcopy(QEMUFile *f)
+{
+    fprintf(stderr, "Post-copy migration is not supported on this host\n");
+    return -ENOTSUP;
+}
+
+int ram_postcopy_incoming_start(QEMUFile *f)
+{
+    return -ENOTSUP;
+}
+
+bool ram_postcopy_supported(void)
+{
+    return false;
+}
+#endif
+
+/*
+ * Incoming side of page compression and XBZRLE.  ram_load() reads each
+ * compressed or XBZRLE page into the buffer of an idle decoding thread,
+ * which writes the page straight into guest memory.  The threads are
+ * started on the first such page and stay until the end of the incoming
+ * migration.  A page is only sent once per section, so they are only
+ * waited for at the end of it.
+ */
+typedef enum {
+    DECODE_ZLIB,
+    DECODE_XBZRLE,
+} DecodeType;
+
+typedef struct DecodeWorker {
+    z_stream stream;
+    DecodeType type;
+    uint8_t *buf;
+    int len;
+    void *host;
+    /* first error of this thread */
+    int ret;
+} DecodeWorker;
+
+static struct {
+    /* NULL until the first compressed or XBZRLE page */
+    DecodeWorker *workers;
+    int nr_workers;
+    WorkerPool *pool;
+} Decode;
+
+static int decode_page(DecodeWorker *w)
+{
+    z_stream *stream = &w->stream;
+    int ret;
+
+    if (w->type == DECODE_XBZRLE) {
+        ret = xbzrle_decode_buffer(w->buf, w->len, w->host, TARGET_PAGE_SIZE);
+        if (ret == -1) {
+            fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
+            return -EINVAL;
+        } else if (ret > TARGET_PAGE_SIZE) {
+            fprintf(stderr,
+                    "Failed to load XBZRLE page - size %d exceeds %d!\n",
+                    ret, TARGET_PAGE_SIZE);
+            abort();
+        }
+        return 0;
+    }
+
+    inflateReset(stream);
+    stream->next_in = w->buf;
+    stream->avail_in = w->len;
+    stream->next_out = w->host;
+    stream->avail_out = TARGET_PAGE_SIZE;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END ||
+        stream->total_out != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load compressed page!\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void decode_work(void *opaque)
+{
+    DecodeWorker *w = opaque;
+    int ret;
+
+    ret = decode_page(w);
+    if (ret < 0 && !w->ret) {
+        w->ret = ret;
+    }
+}
+
+static int decode_start(void)
+{
+    int nr_workers = migrate_decompress_threads();
+    int i;
+
+    Decode.workers = g_malloc0(nr_workers * sizeof(*Decode.workers));
+    for (i = 0; i < nr_workers; i++) {
+        if (inflateInit(&Decode.workers[i].stream) != Z_OK) {
+            while (--i >= 0) {
+                inflateEnd(&Decode.workers[i].stream);
+                g_free(Decode.workers[i].buf);
+            }
+            g_free(Decode.workers);
+            Decode.workers = NULL;
+            return -ENOMEM;
+        }
+        Decode.workers[i].buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+    Decode.nr_workers = nr_workers;
+    Decode.pool = worker_pool_new(nr_workers, decode_work, Decode.workers,
+                                  sizeof(DecodeWorker));
+    return 0;
+}
+
+/* Waits for the pages being decoded, returns the first error */
+static int decode_wait(void)
+{
+    int i;
+
+    if (!Decode.workers) {
+        return 0;
+    }
+
+    worker_pool_wait(Decode.pool);
+    for (i = 0; i < Decode.nr_workers; i++) {
+        if (Decode.workers[i].ret) {
+            return Decode.workers[i].ret;
+        }
+    }
+    return 0;
+}
+
+static void decode_stop(void)
+{
+    int i;
+
+    if (!Decode.workers) {
+        return;
+    }
+
+    worker_pool_free(Decode.pool);
+    Decode.pool = NULL;
+    for (i = 0; i < Decode.nr_workers; i++) {
+        inflateEnd(&Decode.workers[i].stream);
+        g_free(Decode.workers[i].buf);
+    }
+
+    g_free(Decode.workers);
+    Decode.workers = NULL;
+    Decode.nr_workers = 0;
+}
+
+/*
+ * Reads @len bytes of @type encoded data for the page at @host and hands
+ * them to an idle thread
+ */
+static int decode_load_page(QEMUFile *f, DecodeType type, int len, void *host)
+{
+    DecodeWorker *w;
+    int i;
+
+    if (!Decode.workers && decode_start() < 0) {
+        return -ENOMEM;
+    }
+
+    i = worker_pool_get_idle(Decode.pool);
+    w = &Decode.workers[i];
+
+    /* an idle thread does not look at its buffer */
+    qemu_get_buffer(f, w->buf, len);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+
+    w->type = type;
+    w->len = len;
+    w->host = host;
+    worker_pool_kick(Decode.pool, i);
+    return 0;
+}
+
+static int load_compressed_page(QEMUFile *f, void *host)
+{
+    int len;
+
+    len = qemu_get_be16(f);
+    if (len == 0 || len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load compressed page - bad length %d!\n",
+                len);
+        return -EINVAL;
+    }
+
+    return decode_load_page(f, DECODE_ZLIB, len, host);
+}
+
+static int load_xbzrle(QEMUFile *f, void *host)
+{
+    unsigned int xh_len;
+    int xh_flags;
+
+    /* extract RLE header */
     xh_flags = qemu_get_byte(f);
     xh_len = qemu_get_be16(f);
 
     if (xh_flags != ENCODING_FLAG_XBZRLE) {
         fprintf(stderr, "Failed to load XBZRLE page - wrong compression!\n");
-        return -1;
+        return -EINVAL;
     }
 
     if (xh_len > TARGET_PAGE_SIZE) {
         fprintf(stderr, "Failed to load XBZRLE page - len overflow!\n");
-        return -1;
+        return -EINVAL;
+    }
+
+    return decode_load_page(f, DECODE_XBZRLE, xh_len, host);
+}
+
+/*
+ * Incoming side of mapped-ram.  Once the stream says where the blocks are
+ * in the file, they are read straight into guest memory by several
+ * threads, in chunks of MAPPED_LOAD_CHUNK.
+ */
+#define MAPPED_LOAD_CHUNK       (4 << 20)
+#define MAPPED_LOAD_THREADS_MAX 16
+
+typedef struct MappedLoadChunk {
+    uint8_t *host;
+    size_t size;
+    int64_t pos;
+} MappedLoadChunk;
+
+static struct {
+    QEMUFile *file;
+    MappedLoadChunk *chunks;
+    int nr_chunks;
+    /* protects next and ret */
+    QemuMutex lock;
+    int next;
+    int ret;
+} MappedLoad;
+
+static void *ram_load_mapped_thread(void *opaque)
+{
+    MappedLoadChunk *chunk;
+    int ret;
+
+    while (true) {
+        qemu_mutex_lock(&MappedLoad.lock);
+        if (MappedLoad.ret < 0 || MappedLoad.next == MappedLoad.nr_chunks) {
+            qemu_mutex_unlock(&MappedLoad.lock);
+            break;
+        }
+        chunk = &MappedLoad.chunks[MappedLoad.next++];
+        qemu_mutex_unlock(&MappedLoad.lock);
+
+        ret = qemu_get_buffer_at(MappedLoad.file, chunk->host, chunk->size,
+                                 chunk->pos);
+        if (ret < 0) {
+            qemu_mutex_lock(&MappedLoad.lock);
+            if (!MappedLoad.ret) {
+                MappedLoad.ret = ret;
+            }
+            qemu_mutex_unlock(&MappedLoad.lock);
+        }
     }
-    /* load data and decode */
-    qemu_get_buffer(f, XBZRLE.decoded_buf, xh_len);
 
-    /* decode RLE */
-    ret = xbzrle_decode_buffer(XBZRLE.decoded_buf, xh_len, host,
-                               TARGET_PAGE_SIZE);
-    if (ret == -1) {
-        fprintf(stderr, "Failed to load XBZRLE page - decode error!\n");
-        rc = -1;
-    } else  if (ret > TARGET_PAGE_SIZE) {
-        fprintf(stderr, "Failed to load XBZRLE page - size %d exceeds %d!\n",
-                ret, TARGET_PAGE_SIZE);
-        abort();
+    return NULL;
+}
+
+static int ram_load_mapped_threads(void)
+{
+    long nr_threads = 1;
+    QemuThread *threads;
+    int i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    nr_threads = MAX(nr_threads, 1);
+    nr_threads = MIN(nr_threads, MAPPED_LOAD_THREADS_MAX);
+    nr_threads = MIN(nr_threads, MappedLoad.nr_chunks);
+
+    qemu_mutex_init(&MappedLoad.lock);
+    MappedLoad.next = 0;
+    MappedLoad.ret = 0;
+
+    threads = g_malloc(nr_threads * sizeof(*threads));
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i], ram_load_mapped_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i]);
     }
+    g_free(threads);
+    qemu_mutex_destroy(&MappedLoad.lock);
 
-    return rc;
+    DPRINTF("Loaded %d chunks of mapped RAM with %ld threads\n",
+            MappedLoad.nr_chunks, nr_threads);
+    return MappedLoad.ret;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/* Reads the list written by ram_save_mapped(), then all of RAM */
+static int ram_load_mapped(QEMUFile *f)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block;
+    uint64_t length, pos, offset;
     char id[256];
     uint8_t len;
+    int ret = 0;
+
+    MappedLoad.file = f;
+    MappedLoad.chunks = NULL;
+    MappedLoad.nr_chunks = 0;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        length = qemu_get_be64(f);
+        pos = qemu_get_be64(f);
+        if (qemu_file_get_error(f)) {
+            ret = qemu_file_get_error(f);
+            goto out;
+        }
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || block->length != length) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            ret = -EINVAL;
+            goto out;
         }
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
-    }
+        for (offset = 0; offset < length; offset += MAPPED_LOAD_CHUNK) {
+            MappedLoadChunk *chunk;
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+            MappedLoad.chunks = g_realloc(MappedLoad.chunks,
+                                          (MappedLoad.nr_chunks + 1) *
+                                          sizeof(*MappedLoad.chunks));
+            chunk = &MappedLoad.chunks[MappedLoad.nr_chunks++];
+            chunk->host = memory_region_get_ram_ptr(block->mr) + offset;
+            chunk->size = MIN(length - offset, MAPPED_LOAD_CHUNK);
+            chunk->pos = pos + offset;
+        }
+    }
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        goto out;
+    }
+    if (!qemu_file_can_get_at(f)) {
+        fprintf(stderr, "A mapped-ram migration must be loaded from a "
+                "file: URI\n");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (MappedLoad.nr_chunks) {
+        ret = ram_load_mapped_threads();
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
-    return NULL;
+out:
+    g_free(MappedLoad.chunks);
+    MappedLoad.chunks = NULL;
+    MappedLoad.nr_chunks = 0;
+    return ret;
 }
 
+static RAMBlock *ram_load_block;
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
@@ -708,7 +3056,23 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         flags = addr & ~TARGET_PAGE_MASK;
         addr &= TARGET_PAGE_MASK;
 
-        if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+        if ((flags & RAM_SAVE_FLAG_ZERO_MAP) == RAM_SAVE_FLAG_ZERO_MAP) {
+            /* one descriptor for all the ranges of the record */
+            int pagemap_fd = ram_open_pagemap();
+
+            ret = ram_get_ranges(f, ram_load_zero_range, &pagemap_fd);
+            if (pagemap_fd >= 0) {
+                close(pagemap_fd);
+            }
+            if (ret < 0) {
+                goto done;
+            }
+        } else if ((flags & RAM_SAVE_FLAG_MAPPED) == RAM_SAVE_FLAG_MAPPED) {
+            ret = ram_load_mapped(f);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
             if (version_id == 4) {
                 /* Synchronize RAM block list */
                 char id[256];
@@ -744,45 +3108,63 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     total_ram_bytes -= length;
                 }
             }
-        }
-
-        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
-            uint8_t ch;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, &ram_load_block, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
-            ch = qemu_get_byte(f);
-            memset(host, ch, TARGET_PAGE_SIZE);
-#ifndef _WIN32
-            if (ch == 0 &&
-                (!kvm_enabled() || kvm_has_sync_mmu())) {
-                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-            }
-#endif
+            ram_load_dup_page(host, qemu_get_byte(f));
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, &ram_load_block, addr, flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host;
+
+            host = host_from_stream_offset(f, &ram_load_block, addr, flags);
+            if (!host) {
+                ret = -EINVAL;
+                goto done;
+            }
+
+            ret = load_compressed_page(f, host);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             if (!migrate_use_xbzrle()) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
-            void *host = host_from_stream_offset(f, addr, flags);
+            void *host = host_from_stream_offset(f, &ram_load_block, addr,
+                                                 flags);
             if (!host) {
-                return -EINVAL;
+                ret = -EINVAL;
+                goto done;
             }
 
-            if (load_xbzrle(f, addr, host) < 0) {
-                ret = -EINVAL;
+            ret = load_xbzrle(f, host);
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_SYNC) {
+            ret = ram_load_wait_streams();
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_load_postcopy(f);
+            if (ret < 0) {
                 goto done;
             }
         }
@@ -794,16 +3176,30 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    error = decode_wait();
+    if (ret == 0) {
+        ret = error;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration " PRIu64 "\n",
             ret, seq_iter);
     return ret;
 }
 
+/* Called once the whole incoming migration has been loaded */
+static void ram_load_cleanup(void *opaque)
+{
+    decode_stop();
+    ram_load_stop_streams(true);
+}
+
 SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_postcopy = ram_save_postcopy,
+    .save_live_pending = ram_save_pending,
     .load_state = ram_load,
+    .load_cleanup = ram_load_cleanup,
     .cancel = ram_migration_cancel,
 };
 
@@ -28,6 +28,7 @@
 #define BLK_MIG_FLAG_DEVICE_BLOCK       0x01
 #define BLK_MIG_FLAG_EOS                0x02
 #define BLK_MIG_FLAG_PROGRESS           0x04
+#define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
@@ -50,6 +51,7 @@ typedef struct BlkMigDevState {
     int64_t completed_sectors;
     int64_t total_sectors;
     int64_t dirty;
+    int inflight;           /* reads submitted and not completed yet */
     QSIMPLEQ_ENTRY(BlkMigDevState) entry;
     unsigned long *aio_bitmap;
 } BlkMigDevState;
@@ -71,6 +73,9 @@ typedef struct BlkMigState {
     int shared_base;
     QSIMPLEQ_HEAD(bmds_list, BlkMigDevState) bmds_list;
     QSIMPLEQ_HEAD(blk_list, BlkMigBlock) blk_list;
+    QSIMPLEQ_HEAD(free_list, BlkMigBlock) free_list;
+    int zero_blocks;
+    int aio_depth;
     int submitted;
     int read_done;
     int transferred;
@@ -84,19 +89,56 @@ typedef struct BlkMigState {
 
 static BlkMigState block_mig_state;
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+/* Blocks and their buffers are recycled through free_list, which is filled
+ * when the migration starts; the buffers are only freed at cleanup.
+ */
+static BlkMigBlock *blk_alloc(BlkMigDevState *bmds, int64_t sector,
+                              int nr_sectors)
+{
+    BlkMigBlock *blk = QSIMPLEQ_FIRST(&block_mig_state.free_list);
+
+    if (blk) {
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.free_list, entry);
+    } else {
+        blk = g_malloc(sizeof(BlkMigBlock));
+        blk->buf = qemu_blockalign(bmds->bs, BLOCK_SIZE);
+    }
+
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    return blk;
+}
+
+static void blk_free(BlkMigBlock *blk)
+{
+    QSIMPLEQ_INSERT_HEAD(&block_mig_state.free_list, blk, entry);
+}
+
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds, int64_t sector,
+                            int flags)
 {
     int len;
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
-                     | BLK_MIG_FLAG_DEVICE_BLOCK);
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS) | flags);
 
     /* device name */
-    len = strlen(blk->bmds->bs->device_name);
+    len = strlen(bmds->bs->device_name);
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)blk->bmds->bs->device_name, len);
+    qemu_put_buffer(f, (uint8_t *)bmds->bs->device_name, len);
+}
 
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    if (block_mig_state.zero_blocks &&
+        buffer_is_zero(blk->buf, blk->nr_sectors << BDRV_SECTOR_BITS)) {
+        blk_send_header(f, blk->bmds, blk->sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+        return;
+    }
+
+    blk_send_header(f, blk->bmds, blk->sector, BLK_MIG_FLAG_DEVICE_BLOCK);
     qemu_put_buffer(f, blk->buf, BLOCK_SIZE);
 }
 
@@ -197,6 +239,7 @@ static void blk_mig_read_cb(void *opaque, int ret)
 
     QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
     bmds_set_aio_inflight(blk->bmds, blk->sector, blk->nr_sectors, 0);
+    blk->bmds->inflight--;
 
     block_mig_state.submitted--;
     block_mig_state.read_done++;
@@ -209,7 +252,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     int64_t cur_sector = bmds->cur_sector;
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
-    int nr_sectors;
+    int nr_sectors, n;
 
     if (bmds->shared_base) {
         while (cur_sector < total_sectors &&
@@ -228,18 +271,27 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
-    /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
     if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
         nr_sectors = total_sectors - cur_sector;
     }
 
-    blk = g_malloc(sizeof(BlkMigBlock));
-    blk->buf = g_malloc(BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
+    /* Without a backing file, a chunk that is not allocated at all reads
+     * as zeroes; do not even read it.  Otherwise the full chunk is read,
+     * and blk_send() looks for zeroes.
+     */
+    if (block_mig_state.zero_blocks && !bs->backing_hd &&
+        !bdrv_is_allocated(bs, cur_sector, nr_sectors, &n) &&
+        n >= nr_sectors) {
+        blk_send_header(f, bmds, cur_sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+        bdrv_reset_dirty(bs, cur_sector, nr_sectors);
+        bmds->cur_sector = cur_sector + nr_sectors;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
+    blk = blk_alloc(bmds, cur_sector, nr_sectors);
 
     blk->iov.iov_base = blk->buf;
     blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
@@ -252,6 +304,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     blk->aiocb = bdrv_aio_readv(bs, cur_sector, &blk->qiov,
                                 nr_sectors, blk_mig_read_cb, blk);
     block_mig_state.submitted++;
+    bmds->inflight++;
 
     bdrv_reset_dirty(bs, cur_sector, nr_sectors);
     bmds->cur_sector = cur_sector + nr_sectors;
@@ -304,6 +357,9 @@ static void init_blk_migration_it(void *opaque, BlockDriverState *bs)
 
 static void init_blk_migration(QEMUFile *f)
 {
+    BlkMigDevState *bmds;
+    int i;
+
     block_mig_state.submitted = 0;
     block_mig_state.read_done = 0;
     block_mig_state.transferred = 0;
@@ -312,8 +368,17 @@ static void init_blk_migration(QEMUFile *f)
     block_mig_state.bulk_completed = 0;
     block_mig_state.total_time = 0;
     block_mig_state.reads = 0;
+    block_mig_state.zero_blocks = migrate_use_zero_blocks();
+    block_mig_state.aio_depth = migrate_block_aio_depth();
 
     bdrv_iterate(init_blk_migration_it, NULL);
+
+    /* enough buffers for a full queue of reads on every device */
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        for (i = 0; i < block_mig_state.aio_depth; i++) {
+            blk_free(blk_alloc(bmds, 0, 0));
+        }
+    }
 }
 
 static int blk_mig_save_bulked_block(QEMUFile *f)
@@ -325,6 +390,10 @@ static int blk_mig_save_bulked_block(QEMUFile *f)
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
         if (bmds->bulk_completed == 0) {
+            if (bmds->inflight >= block_mig_state.aio_depth) {
+                /* wait for some of its reads to complete */
+                return -1;
+            }
             if (mig_save_device_bulk(f, bmds) == 1) {
                 /* completed bulk section for this device */
                 bmds->bulk_completed = 1;
@@ -371,70 +440,77 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        if (bmds_aio_inflight(bmds, sector)) {
-            bdrv_drain_all();
-        }
-        if (bdrv_get_dirty(bmds->bs, sector)) {
+    /* an earlier pass already reached the end of the device */
+    if (bmds->cur_dirty >= total_sectors) {
+        return 1;
+    }
 
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            blk = g_malloc(sizeof(BlkMigBlock));
-            blk->buf = g_malloc(BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                blk->iov.iov_base = blk->buf;
-                blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
-                qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
-
-                if (block_mig_state.submitted == 0) {
-                    block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
-                }
+    /* jump straight to the next dirty chunk instead of testing each one */
+    sector = bdrv_get_next_dirty(bmds->bs, bmds->cur_dirty);
+    if (sector < 0 || sector >= total_sectors) {
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
 
-                blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
-                                            nr_sectors, blk_mig_read_cb, blk);
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-            } else {
-                ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    if (bmds_aio_inflight(bmds, sector)) {
+        bdrv_drain_all();
+    }
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    blk = blk_alloc(bmds, sector, nr_sectors);
 
-            bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
-            break;
+    if (is_async) {
+        blk->iov.iov_base = blk->buf;
+        blk->iov.iov_len = nr_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&blk->qiov, &blk->iov, 1);
+
+        if (block_mig_state.submitted == 0) {
+            block_mig_state.prev_time_offset = qemu_get_clock_ns(rt_clock);
+        }
+
+        blk->aiocb = bdrv_aio_readv(bmds->bs, sector, &blk->qiov,
+                                    nr_sectors, blk_mig_read_cb, blk);
+        block_mig_state.submitted++;
+        bmds->inflight++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+    } else {
+        ret = bdrv_read(bmds->bs, sector, blk->buf, nr_sectors);
+        if (ret < 0) {
+            goto error;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        blk_send(f, blk);
+        blk_free(blk);
     }
 
+    bdrv_reset_dirty(bmds->bs, sector, nr_sectors);
+    bmds->cur_dirty = sector;
+
     return (bmds->cur_dirty >= bmds->total_sectors);
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
     qemu_file_set_error(f, ret);
-    g_free(blk->buf);
-    g_free(blk);
+    blk_free(blk);
     return 0;
 }
 
+/* Returns 1 if a dirty chunk was sent or submitted, 0 if there are none
+ * left, and -1 if the devices that still have some are all busy.
+ */
 static int blk_mig_save_dirty_block(QEMUFile *f, int is_async)
 {
     BlkMigDevState *bmds;
     int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (is_async && bmds->inflight >= block_mig_state.aio_depth) {
+            ret = -1;
+            continue;
+        }
         if (mig_save_device_dirty(f, bmds, is_async) == 0) {
             ret = 1;
             break;
@@ -463,8 +539,7 @@ static void flush_blks(QEMUFile* f)
         blk_send(f, blk);
 
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
-        g_free(blk);
+        blk_free(blk);
 
         block_mig_state.read_done--;
         block_mig_state.transferred++;
@@ -485,7 +560,7 @@ static int64_t get_remaining_dirty(void)
         dirty += bdrv_get_dirty_count(bmds->bs);
     }
 
-    return dirty * BLOCK_SIZE;
+    return dirty << BDRV_SECTOR_BITS;
 }
 
 static int is_stage2_completed(void)
@@ -531,7 +606,12 @@ static void blk_mig_cleanup(void)
 
     while ((blk = QSIMPLEQ_FIRST(&block_mig_state.blk_list)) != NULL) {
         QSIMPLEQ_REMOVE_HEAD(&block_mig_state.blk_list, entry);
-        g_free(blk->buf);
+        blk_free(blk);
+    }
+
+    while ((blk = QSIMPLEQ_FIRST(&block_mig_state.free_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&block_mig_state.free_list, entry);
+        qemu_vfree(blk->buf);
         g_free(blk);
     }
 }
@@ -568,6 +648,9 @@ static int block_save_setup(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/* Called from the migration thread; the block layer needs the iothread
+ * lock, so take it for the whole iteration.
+ */
 static int block_save_iterate(QEMUFile *f, void *opaque)
 {
     int ret;
@@ -575,29 +658,35 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     DPRINTF("Enter save live iterate submitted %d transferred %d\n",
             block_mig_state.submitted, block_mig_state.transferred);
 
+    qemu_mutex_lock_iothread();
     flush_blks(f);
 
     ret = qemu_file_get_error(f);
     if (ret) {
         blk_mig_cleanup();
-        return ret;
+        goto out;
     }
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    /* Keep up to aio_depth reads in flight on each device, as long as
+     * what has been read but not sent yet fits in the rate limit.
+     */
+    while (block_mig_state.read_done * BLOCK_SIZE <
+           qemu_file_get_rate_limit(f) && !qemu_file_rate_limit(f)) {
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f);
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
+            } else if (ret < 0) {
+                /* the reads in flight are enough */
+                break;
             }
         } else {
-            if (blk_mig_save_dirty_block(f, 1) == 0) {
-                /* no more dirty blocks */
+            if (blk_mig_save_dirty_block(f, 1) <= 0) {
+                /* no more dirty blocks, or enough reads in flight */
                 break;
             }
         }
@@ -608,12 +697,16 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
     ret = qemu_file_get_error(f);
     if (ret) {
         blk_mig_cleanup();
-        return ret;
+        goto out;
     }
 
     qemu_put_be64(f, BLK_MIG_FLAG_EOS);
 
-    return is_stage2_completed();
+    ret = is_stage2_completed();
+
+out:
+    qemu_mutex_unlock_iothread();
+    return ret;
 }
 
 static int block_save_complete(QEMUFile *f, void *opaque)
@@ -657,6 +750,26 @@ static int block_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+static uint64_t block_save_pending(QEMUFile *f, void *opaque,
+                                   uint64_t max_size)
+{
+    uint64_t pending;
+
+    qemu_mutex_lock_iothread();
+    pending = get_remaining_dirty() +
+              (block_mig_state.submitted + block_mig_state.read_done) *
+              BLOCK_SIZE;
+
+    /* Report at least one block pending during bulk phase */
+    if (pending == 0 && !block_mig_state.bulk_completed) {
+        pending = BLOCK_SIZE;
+    }
+    qemu_mutex_unlock_iothread();
+
+    DPRINTF("Enter save live pending  %" PRIu64 "\n", pending);
+    return pending;
+}
+
 static int block_load(QEMUFile *f, void *opaque, int version_id)
 {
     static int banner_printed;
@@ -664,7 +777,7 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
     char device_name[256];
     int64_t addr;
     BlockDriverState *bs, *bs_prev = NULL;
-    uint8_t *buf;
+    uint8_t *buf = NULL;
     int64_t total_sectors = 0;
     int nr_sectors;
     int ret;
@@ -685,7 +798,8 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             if (!bs) {
                 fprintf(stderr, "Error unknown block device %s\n",
                         device_name);
-                return -EINVAL;
+                ret = -EINVAL;
+                goto out;
             }
 
             if (bs != bs_prev) {
@@ -694,7 +808,8 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 if (total_sectors <= 0) {
                     error_report("Error getting length of block device %s",
                                  device_name);
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto out;
                 }
             }
 
@@ -704,14 +819,18 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
 
-            buf = g_malloc(BLOCK_SIZE);
-
-            qemu_get_buffer(f, buf, BLOCK_SIZE);
-            ret = bdrv_write(bs, addr, buf, nr_sectors);
+            if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
+                ret = bdrv_write_zeroes(bs, addr, nr_sectors);
+            } else {
+                if (!buf) {
+                    buf = qemu_blockalign(bs, BLOCK_SIZE);
+                }
+                qemu_get_buffer(f, buf, BLOCK_SIZE);
+                ret = bdrv_write(bs, addr, buf, nr_sectors);
+            }
 
-            g_free(buf);
             if (ret < 0) {
-                return ret;
+                goto out;
             }
         } else if (flags & BLK_MIG_FLAG_PROGRESS) {
             if (!banner_printed) {
@@ -723,15 +842,18 @@ static int block_load(QEMUFile *f, void *opaque, int version_id)
             fflush(stdout);
         } else if (!(flags & BLK_MIG_FLAG_EOS)) {
             fprintf(stderr, "Unknown flags\n");
-            return -EINVAL;
+            ret = -EINVAL;
+            goto out;
         }
         ret = qemu_file_get_error(f);
         if (ret != 0) {
-            return ret;
+            goto out;
         }
     } while (!(flags & BLK_MIG_FLAG_EOS));
 
-    return 0;
+out:
+    qemu_vfree(buf);
+    return ret;
 }
 
 static void block_set_params(const MigrationParams *params, void *opaque)
@@ -753,6 +875,7 @@ SaveVMHandlers savevm_block_handlers = {
     .save_live_setup = block_save_setup,
     .save_live_iterate = block_save_iterate,
     .save_live_complete = block_save_complete,
+    .save_live_pending = block_save_pending,
     .load_state = block_load,
     .cancel = block_migration_cancel,
     .is_active = block_is_active,
@@ -762,6 +885,7 @@ void blk_mig_init(void)
 {
     QSIMPLEQ_INIT(&block_mig_state.bmds_list);
     QSIMPLEQ_INIT(&block_mig_state.blk_list);
+    QSIMPLEQ_INIT(&block_mig_state.free_list);
 
     register_savevm_live(NULL, "block", 0, 1, &savevm_block_handlers,
                          &block_mig_state);
@@ -22,17 +22,22 @@
  * THE SOFTWARE.
  */
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #include "block_int.h"
 #include "qemu-common.h"
 #include "qcow2.h"
 #include "trace.h"
 
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    int64_t lru_stamp;      /* value of lru_clock at the last access */
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
+    QLIST_ENTRY(Qcow2CachedTable) hash;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,8 +45,47 @@ struct Qcow2Cache {
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+
+    /* All tables live in one buffer, so a table pointer maps back to its
+     * entry with a division.  The host only backs the parts that are used. */
+    uint8_t*                table_array;
+    int                     table_size;
+
+    /* Cached tables indexed by offset; free entries are in no bucket */
+    QLIST_HEAD(, Qcow2CachedTable)* buckets;
+    unsigned int            nb_buckets;
+
+    /* Most recently used first, free entries at the tail */
+    QTAILQ_HEAD(Qcow2CacheLRU, Qcow2CachedTable) lru_list;
+    int64_t                 lru_clock;
+    int64_t                 clean_lru_clock;
+
+    uint64_t                hits;
+    uint64_t                misses;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return c->table_array + (size_t)i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t offset = (uint8_t *)table - c->table_array;
+    int i = offset / c->table_size;
+
+    assert(offset >= 0 && i < c->size && offset % c->table_size == 0);
+    return i;
+}
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    /* Tables are cluster aligned, so the low bits carry no information */
+    uint64_t h = (offset / c->table_size) * 0x9e3779b97f4a7c15ULL;
+
+    return (h >> 32) & (c->nb_buckets - 1);
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -50,10 +94,19 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
+    c->table_size = s->cluster_size;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_array = qemu_blockalign(bs, (size_t)num_tables * c->table_size);
+
+    c->nb_buckets = 1;
+    while (c->nb_buckets < num_tables) {
+        c->nb_buckets <<= 1;
+    }
+    c->buckets = g_malloc0(sizeof(*c->buckets) * c->nb_buckets);
 
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
     }
 
     return c;
@@ -65,15 +118,87 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+/* Returns the memory of a table to the host; it reads as zeroes afterwards */
+static void qcow2_cache_table_release(Qcow2Cache *c, int i)
+{
+#ifndef _WIN32
+    /* Only whole pages, small clusters share theirs with other tables */
+    uintptr_t page_size = getpagesize();
+    uintptr_t start = (uintptr_t)qcow2_cache_get_table_addr(c, i);
+    uintptr_t end = start + c->table_size;
+
+    start = (start + page_size - 1) & ~(page_size - 1);
+    end &= ~(page_size - 1);
+    if (end > start) {
+        qemu_madvise((void *)start, end - start, QEMU_MADV_DONTNEED);
+    }
+#endif
+}
+
+/* Forget the table held by entry @i and give its memory back to the host */
+static void qcow2_cache_entry_discard(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0 && !t->dirty);
+
+    if (t->offset) {
+        QLIST_REMOVE(t, hash);
+        t->offset = 0;
+    }
+    QTAILQ_REMOVE(&c->lru_list, t, lru);
+    QTAILQ_INSERT_TAIL(&c->lru_list, t, lru);
+
+    qcow2_cache_table_release(c, i);
+}
+
+/*
+ * Drops the clean tables that nobody has looked up since the previous call,
+ * so that a large cache only keeps the memory of its working set.
+ */
+void qcow2_cache_clean_unused(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2CachedTable *t = &c->entries[i];
+
+        /* Entries without an offset may be in the middle of a load */
+        if (t->offset && !t->ref && !t->dirty &&
+            t->lru_stamp <= c->clean_lru_clock) {
+            qcow2_cache_entry_discard(c, i);
+        }
+    }
+
+    c->clean_lru_clock = c->lru_clock;
+}
+
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats)
+{
+    int i, used = 0;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].offset) {
+            used++;
+        }
+    }
+
+    stats->size = (int64_t)c->size * c->table_size;
+    stats->used = (int64_t)used * c->table_size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,8 +245,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -187,38 +312,37 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
+    Qcow2CachedTable *t;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+    /* Free entries sit at the tail, so they are taken first */
+    QTAILQ_FOREACH_REVERSE(t, &c->lru_list, Qcow2CacheLRU, lru) {
+        if (!t->ref) {
+            return t - c->entries;
         }
+    }
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
+    /* This can't happen in current synchronous code, but leave the check
+     * here as a reminder for whoever starts using AIO with the cache */
+    abort();
+}
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
-    }
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CachedTable *t;
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    QLIST_FOREACH(t, &c->buckets[qcow2_cache_hash(c, offset)], hash) {
+        if (t->offset == offset) {
+            return t;
+        }
     }
-    return min_index;
+    return NULL;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
 
@@ -226,11 +350,13 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    t = qcow2_cache_lookup(c, offset);
+    if (t) {
+        i = t - c->entries;
+        c->hits++;
+        goto found;
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -239,6 +365,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     if (i < 0) {
         return i;
     }
+    t = &c->entries[i];
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -247,28 +374,32 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (t->offset) {
+        QLIST_REMOVE(t, hash);
+        t->offset = 0;
+    }
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    QLIST_INSERT_HEAD(&c->buckets[qcow2_cache_hash(c, offset)], t, hash);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    t->ref++;
+    t->lru_stamp = ++c->lru_clock;
+    QTAILQ_REMOVE(&c->lru_list, t, lru);
+    QTAILQ_INSERT_HEAD(&c->lru_list, t, lru);
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,16 +421,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -309,15 +432,8 @@ found:
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
@@ -771,6 +771,10 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
      * request has completed and updated the L2 table accordingly.
+     *
+     * Both ranges are half-open, so allocations of adjacent clusters don't
+     * wait for each other.  Sequential writes on a fresh image depend on
+     * this to run in parallel.
      */
     QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
 
@@ -779,7 +783,7 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = old_alloc->offset >> s->cluster_bits;
         uint64_t old_end = old_start + old_alloc->nb_clusters;
 
-        if (end < old_start || start > old_end) {
+        if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
             if (start < old_start) {
@@ -792,6 +796,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
             if (*nb_clusters == 0) {
                 /* Wait for the dependency to complete. We need to recheck
                  * the free/allocated clusters when we continue. */
+                trace_qcow2_alloc_wait_dependency(qemu_coroutine_self(),
+                                                  guest_offset,
+                                                  old_alloc->offset);
                 qemu_co_mutex_unlock(&s->lock);
                 qemu_co_queue_wait(&old_alloc->dependent_requests);
                 qemu_co_mutex_lock(&s->lock);
@@ -214,12 +214,46 @@ static void report_unsupported_feature(BlockDriverState *bs,
     }
 }
 
+static void cache_clean_timer_cb(void *opaque)
+{
+    BDRVQcowState *s = opaque;
+
+    qcow2_cache_clean_unused(s->l2_table_cache);
+    qcow2_cache_clean_unused(s->refcount_block_cache);
+    qemu_mod_timer(s->cache_clean_timer, qemu_get_clock_ms(vm_clock) +
+                   (int64_t)s->cache_clean_interval * 1000);
+}
+
+/* Converts the cache sizes requested for the drive into numbers of tables */
+static void read_cache_sizes(BlockDriverState *bs, int *l2_cache_size,
+                             int *refcount_cache_size)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (bs->l2_cache_size) {
+        *l2_cache_size = MAX(MIN_L2_CACHE_SIZE,
+                             MIN(bs->l2_cache_size / s->cluster_size,
+                                 INT_MAX));
+    } else {
+        *l2_cache_size = L2_CACHE_SIZE;
+    }
+
+    if (bs->refcount_cache_size) {
+        *refcount_cache_size = MAX(MIN_REFCOUNT_CACHE_SIZE,
+                                   MIN(bs->refcount_cache_size /
+                                       s->cluster_size, INT_MAX));
+    } else {
+        *refcount_cache_size = REFCOUNT_CACHE_SIZE;
+    }
+}
+
 static int qcow2_open(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    int l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -358,8 +392,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     }
 
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    read_cache_sizes(bs, &l2_cache_size, &refcount_cache_size);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -412,6 +447,14 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
 
+    s->cache_clean_interval = bs->cache_clean_interval;
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = qemu_new_timer_ms(vm_clock,
+                                                 cache_clean_timer_cb, s);
+        qemu_mod_timer(s->cache_clean_timer, qemu_get_clock_ms(vm_clock) +
+                       (int64_t)s->cache_clean_interval * 1000);
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -429,6 +472,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -782,6 +828,12 @@ static void qcow2_close(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     g_free(s->l1_table);
 
+    if (s->cache_clean_timer) {
+        qemu_del_timer(s->cache_clean_timer);
+        qemu_free_timer(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+
     qcow2_cache_flush(bs, s->l2_table_cache);
     qcow2_cache_flush(bs, s->refcount_block_cache);
 
@@ -1464,6 +1516,25 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static BlockCacheStatsList *qcow2_get_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockCacheStatsList *l2, *refcount;
+
+    l2 = g_malloc0(sizeof(*l2));
+    l2->value = g_malloc0(sizeof(*l2->value));
+    l2->value->name = g_strdup("l2");
+    qcow2_cache_get_stats(s->l2_table_cache, l2->value);
+
+    refcount = g_malloc0(sizeof(*refcount));
+    refcount->value = g_malloc0(sizeof(*refcount->value));
+    refcount->value->name = g_strdup("refcount");
+    qcow2_cache_get_stats(s->refcount_block_cache, refcount->value);
+
+    l2->next = refcount;
+    return l2;
+}
+
 
 static int qcow2_check(BlockDriverState *bs, BdrvCheckResult *result,
                        BdrvCheckMode fix)
@@ -1588,6 +1659,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_cache_stats = qcow2_get_cache_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -51,10 +51,13 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Default number of cached tables, unless sized by the user in bytes */
 #define L2_CACHE_SIZE 16
+#define MIN_L2_CACHE_SIZE 2
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
+#define MIN_REFCOUNT_CACHE_SIZE 4
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
@@ -132,6 +135,8 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    QEMUTimer *cache_clean_timer;
+    int cache_clean_interval; /* seconds, 0 if idle tables are kept */
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -311,5 +316,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_clean_unused(Qcow2Cache *c);
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats);
 
 #endif
@@ -132,6 +132,9 @@ typedef struct BDRVRawState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
     void *aio_ctx;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    void *io_uring_ctx;
 #endif
     uint8_t *aligned_buf;
     unsigned aligned_buf_size;
@@ -230,12 +233,14 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         s->aligned_buf_size = 32 * MAX_BLOCKSIZE;
         s->aligned_buf = qemu_memalign(MAX_BLOCKSIZE, s->aligned_buf_size);
         if (s->aligned_buf == NULL) {
+            ret = -errno;
             goto out_close;
         }
     }
 
     /* We're falling back to POSIX AIO in some cases so init always */
     if (paio_init() < 0) {
+        ret = -errno;
         goto out_free_buf;
     }
 
@@ -249,6 +254,8 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
 
         s->aio_ctx = laio_init();
         if (!s->aio_ctx) {
+            /* io_setup() returns its error instead of setting errno */
+            ret = -EINVAL;
             goto out_free_buf;
         }
         s->use_aio = 1;
@@ -260,6 +267,18 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
 #endif
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->io_uring_ctx = NULL;
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        s->io_uring_ctx = luring_init();
+        if (!s->io_uring_ctx) {
+            /* liburing does not reliably set errno */
+            ret = -EINVAL;
+            goto out_free_buf;
+        }
+    }
+#endif
+
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
         s->is_xfs = 1;
@@ -272,7 +291,7 @@ out_free_buf:
     qemu_vfree(s->aligned_buf);
 out_close:
     close(fd);
-    return -errno;
+    return ret;
 }
 
 static int raw_open(BlockDriverState *bs, const char *filename, int flags)
@@ -341,6 +360,14 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* misaligned requests need the bounce buffer of the thread pool */
+    if (s->io_uring_ctx && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -369,9 +396,79 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        return luring_submit(bs, s->io_uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
+static void raw_io_plug(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_io_plug(s->io_uring_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_io_unplug(s->io_uring_ctx);
+    }
+#endif
+}
+
+#ifdef CONFIG_LINUX_AIO
+/*
+ * Returns the file descriptor of a raw image (a raw-posix protocol, or the
+ * raw format on top of one) opened with aio=native, for callers that submit
+ * their requests with Linux AIO themselves.
+ */
+int raw_get_aio_fd(BlockDriverState *bs)
+{
+    BDRVRawState *s;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+
+    if (bs->drv == bdrv_find_format("raw")) {
+        bs = bs->file;
+    }
+
+    /* raw-posix has several protocols so just check for raw_aio_readv */
+    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
+        return -ENOTSUP;
+    }
+
+    s = bs->opaque;
+    if (!s->use_aio) {
+        return -ENOTSUP;
+    }
+    return s->fd;
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -381,6 +478,12 @@ static void raw_close(BlockDriverState *bs)
         if (s->aligned_buf != NULL)
             qemu_vfree(s->aligned_buf);
     }
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        luring_cleanup(s->io_uring_ctx);
+        s->io_uring_ctx = NULL;
+    }
+#endif
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -706,12 +809,60 @@ static int xfs_discard(BDRVRawState *s, int64_t sector_num, int nb_sectors)
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+typedef struct RawDiscardCo {
+    Coroutine *coroutine;
+    int ret;
+} RawDiscardCo;
+
+static void raw_discard_complete(void *opaque, int ret)
+{
+    RawDiscardCo *co = opaque;
+
+    co->ret = ret;
+    qemu_coroutine_enter(co->coroutine, NULL);
+}
+
+/* Punches a hole through io_uring, returns -ENOTSUP if it cannot */
+static coroutine_fn int luring_discard(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    RawDiscardCo co = {
+        .coroutine = qemu_coroutine_self(),
+    };
+
+    if (!luring_submit(bs, s->io_uring_ctx, s->fd, sector_num, NULL,
+                       nb_sectors, raw_discard_complete, &co,
+                       QEMU_AIO_DISCARD)) {
+        return -EIO;
+    }
+    qemu_coroutine_yield();
+
+    if (co.ret == -EOPNOTSUPP) {
+        return -ENOTSUP;
+    }
+    return co.ret;
+}
+#endif
+
 static coroutine_fn int raw_co_discard(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors)
 {
-#ifdef CONFIG_XFS
+#if defined(CONFIG_XFS) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring_ctx) {
+        int ret = luring_discard(bs, sector_num, nb_sectors);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
+#ifdef CONFIG_XFS
     if (s->is_xfs) {
         return xfs_discard(s, sector_num, nb_sectors);
     }
@@ -743,6 +894,8 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1011,6 +1164,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -1130,6 +1285,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -1229,6 +1386,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength     = raw_getlength,
@@ -1348,6 +1507,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength     = raw_getlength,
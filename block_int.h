@@ -30,6 +30,7 @@
 #include "qemu-coroutine.h"
 #include "qemu-timer.h"
 #include "qapi-types.h"
+#include "qemu/hbitmap.h"
 
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
@@ -212,6 +213,8 @@ struct BlockDriver {
     int (*bdrv_snapshot_load_tmp)(BlockDriverState *bs,
                                   const char *snapshot_name);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* Statistics of the metadata caches, for query-blockstats */
+    BlockCacheStatsList *(*bdrv_get_cache_stats)(const BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, const uint8_t *buf,
                              int64_t pos, int size);
@@ -246,6 +249,13 @@ struct BlockDriver {
 
     void (*bdrv_debug_event)(BlockDriverState *bs, BlkDebugEvent event);
 
+    /*
+     * Hold back requests until the matching unplug, to submit them in
+     * one go.  Drivers without these forward the calls to bs->file.
+     */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     /*
      * Returns 1 if newly created images are guaranteed to contain only
      * zeros, 0 otherwise.
@@ -303,6 +313,12 @@ struct BlockDriverState {
     QEMUTimer    *block_timer;
     bool         io_limits_enabled;
 
+    /* metadata cache sizes in bytes, 0 for the format's default, and the
+       interval in seconds for dropping idle tables, 0 to keep them */
+    uint64_t l2_cache_size;
+    uint64_t refcount_cache_size;
+    int cache_clean_interval;
+
     /* I/O stats (display with "info blockstats"). */
     uint64_t nr_bytes[BDRV_MAX_IOTYPE];
     uint64_t nr_ops[BDRV_MAX_IOTYPE];
@@ -324,8 +340,7 @@ struct BlockDriverState {
     bool iostatus_enabled;
     BlockDeviceIoStatus iostatus;
     char device_name[32];
-    unsigned long *dirty_bitmap;
-    int64_t dirty_count;
+    HBitmap *dirty_bitmap;
     int in_use; /* users other than guest access, eg. block migration */
     QTAILQ_ENTRY(BlockDriverState) list;
 
@@ -339,6 +354,9 @@ int get_tmp_filename(char *filename, int size);
 
 void bdrv_set_io_limits(BlockDriverState *bs,
                         BlockIOLimit *io_limits);
+void bdrv_set_metadata_cache(BlockDriverState *bs, uint64_t l2_cache_size,
+                             uint64_t refcount_cache_size,
+                             int cache_clean_interval);
 
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
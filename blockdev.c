@@ -293,6 +293,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     BlockIOLimit io_limits;
+    uint64_t l2_cache_size, refcount_cache_size, cache_clean_interval;
     int snapshot = 0;
     bool copy_on_read;
     int ret;
@@ -384,12 +385,18 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         }
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
+        if (!strcmp(buf, "threads")) {
             /* this is the default */
+#ifdef CONFIG_LINUX_AIO
+        } else if (!strcmp(buf, "native")) {
+            bdrv_flags |= BDRV_O_NATIVE_AIO;
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        } else if (!strcmp(buf, "io_uring")) {
+            bdrv_flags |= BDRV_O_IO_URING;
+#endif
         } else {
            error_report("invalid aio option");
            return NULL;
@@ -431,6 +438,16 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
         return NULL;
     }
 
+    /* image format metadata caches */
+    l2_cache_size = qemu_opt_get_size(opts, "l2-cache-size", 0);
+    refcount_cache_size = qemu_opt_get_size(opts, "refcount-cache-size", 0);
+    cache_clean_interval = qemu_opt_get_number(opts, "cache-clean-interval", 0);
+    if (cache_clean_interval > INT_MAX) {
+        error_report("invalid cache-clean-interval %" PRIu64,
+                     cache_clean_interval);
+        return NULL;
+    }
+
     on_write_error = BLOCK_ERR_STOP_ENOSPC;
     if ((buf = qemu_opt_get(opts, "werror")) != NULL) {
         if (type != IF_IDE && type != IF_SCSI && type != IF_VIRTIO && type != IF_NONE) {
@@ -544,6 +561,9 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     /* disk I/O throttling */
     bdrv_set_io_limits(dinfo->bdrv, &io_limits);
 
+    bdrv_set_metadata_cache(dinfo->bdrv, l2_cache_size, refcount_cache_size,
+                            cache_clean_interval);
+
     switch(type) {
     case IF_IDE:
     case IF_SCSI:
@@ -17,25 +17,37 @@
 #include "hw/hw.h"
 #include "qemu-timer.h"
 #include "qemu-char.h"
+#include "qemu-thread.h"
+#include "qemu_socket.h"
+#include "iov.h"
 #include "buffered_file.h"
+#include "migration.h"
+#include "sysemu.h"
+#include "trace.h"
 
 //#define DEBUG_BUFFERED_FILE
 
+/* An extra RAM stream.  It is written by its own sender thread, straight
+ * to the socket; only the byte count is shared with the main channel.
+ */
+typedef struct QEMUFileStream
+{
+    QEMUFile *file;
+    int fd;
+    size_t bytes_xfer;
+} QEMUFileStream;
+
 typedef struct QEMUFileBuffered
 {
-    BufferedPutFunc *put_buffer;
-    BufferedPutReadyFunc *put_ready;
-    BufferedWaitForUnfreezeFunc *wait_for_unfreeze;
-    BufferedCloseFunc *close;
-    void *opaque;
+    MigrationState *migration_state;
     QEMUFile *file;
-    int freeze_output;
     size_t bytes_xfer;
     size_t xfer_limit;
     uint8_t *buffer;
     size_t buffer_size;
     size_t buffer_capacity;
-    QEMUTimer *timer;
+    QEMUFileStream *streams[MIGRATION_STREAMS_MAX];
+    int nr_streams;
 } QEMUFileBuffered;
 
 #ifdef DEBUG_BUFFERED_FILE
@@ -46,6 +58,75 @@ typedef struct QEMUFileBuffered
     do { } while (0)
 #endif
 
+/* Time (in ms) of one rate limiting window */
+#define BUFFER_DELAY 100
+
+/* The sender threads only run while the migration thread waits for them,
+ * so the counters can be read and reset from the migration thread.
+ */
+static size_t buffered_bytes_xfer(QEMUFileBuffered *s)
+{
+    size_t bytes_xfer = s->bytes_xfer;
+    int i;
+
+    for (i = 1; i < s->nr_streams; i++) {
+        bytes_xfer += s->streams[i]->bytes_xfer;
+    }
+    return bytes_xfer;
+}
+
+static void buffered_reset_bytes_xfer(QEMUFileBuffered *s)
+{
+    int i;
+
+    s->bytes_xfer = 0;
+    for (i = 1; i < s->nr_streams; i++) {
+        s->streams[i]->bytes_xfer = 0;
+    }
+}
+
+static ssize_t buffered_stream_writev_buffer(void *opaque, struct iovec *iov,
+                                             int iovcnt)
+{
+    QEMUFileStream *st = opaque;
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t ret;
+
+    while (offset < size) {
+        ret = iov_send(st->fd, iov, iovcnt, offset, size - offset);
+        if (ret == -1 && socket_error() == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            DPRINTF("error writing stream, %zd\n", ret);
+            return ret < 0 ? -socket_error() : -EIO;
+        }
+        offset += ret;
+    }
+
+    st->bytes_xfer += offset;
+    return offset;
+}
+
+static int buffered_stream_put_buffer(void *opaque, const uint8_t *buf,
+                                      int64_t pos, int size)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+
+    return buffered_stream_writev_buffer(opaque, &iov, 1);
+}
+
+/* The socket itself belongs to the MigrationState */
+static int buffered_stream_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
 static void buffered_append(QEMUFileBuffered *s,
                             const uint8_t *buf, size_t size)
 {
@@ -70,6 +151,9 @@ static void buffered_append(QEMUFileBuffered *s,
     s->buffer_size += size;
 }
 
+/* Writes out everything that is buffered.  The migration fd is blocking,
+ * so this only returns early on error.
+ */
 static void buffered_flush(QEMUFileBuffered *s)
 {
     size_t offset = 0;
@@ -86,17 +170,11 @@ static void buffered_flush(QEMUFileBuffered *s)
     while (offset < s->buffer_size) {
         ssize_t ret;
 
-        ret = s->put_buffer(s->opaque, s->buffer + offset,
-                            s->buffer_size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
-
+        ret = migrate_fd_put_buffer(s->migration_state, s->buffer + offset,
+                                    s->buffer_size - offset);
         if (ret <= 0) {
             DPRINTF("error flushing data, %zd\n", ret);
-            qemu_file_set_error(s->file, ret);
+            qemu_file_set_error(s->file, ret < 0 ? ret : -EIO);
             break;
         } else {
             DPRINTF("flushed %zd byte(s)\n", ret);
@@ -112,8 +190,7 @@ static void buffered_flush(QEMUFileBuffered *s)
 static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
 {
     QEMUFileBuffered *s = opaque;
-    int offset = 0, error;
-    ssize_t ret;
+    int error;
 
     DPRINTF("putting %d bytes at %" PRId64 "\n", size, pos);
 
@@ -123,70 +200,74 @@ static int buffered_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, in
         return error;
     }
 
-    DPRINTF("unfreezing output\n");
-    s->freeze_output = 0;
+    if (size <= 0) {
+        return size;
+    }
 
-    buffered_flush(s);
+    buffered_append(s, buf, size);
+    s->bytes_xfer += size;
 
-    while (!s->freeze_output && offset < size) {
-        if (s->bytes_xfer > s->xfer_limit) {
-            DPRINTF("transfer limit exceeded when putting\n");
-            break;
-        }
+    return size;
+}
 
-        ret = s->put_buffer(s->opaque, buf + offset, size - offset);
-        if (ret == -EAGAIN) {
-            DPRINTF("backend not ready, freezing\n");
-            s->freeze_output = 1;
-            break;
-        }
+/* Vectored writes bypass the buffer and go straight to the fd; the
+ * migration thread owns it and it is blocking, so this does not return
+ * until everything is written.
+ */
+static ssize_t buffered_writev_buffer(void *opaque, struct iovec *iov,
+                                      int iovcnt)
+{
+    QEMUFileBuffered *s = opaque;
+    ssize_t ret;
 
-        if (ret <= 0) {
-            DPRINTF("error putting\n");
-            qemu_file_set_error(s->file, ret);
-            offset = -EINVAL;
-            break;
-        }
+    /* whatever went through buffered_put_buffer() comes first */
+    buffered_flush(s);
+    ret = qemu_file_get_error(s->file);
+    if (ret) {
+        return ret;
+    }
 
-        DPRINTF("put %zd byte(s)\n", ret);
-        offset += ret;
+    ret = migrate_fd_put_iov(s->migration_state, iov, iovcnt);
+    DPRINTF("wrote %zd byte(s) from %d iovec(s)\n", ret, iovcnt);
+    if (ret > 0) {
         s->bytes_xfer += ret;
     }
+    return ret;
+}
 
-    if (offset >= 0) {
-        DPRINTF("buffering %d bytes\n", size - offset);
-        buffered_append(s, buf + offset, size - offset);
-        offset = size;
-    }
+/* Positioned writes do not go through the stream at all, but they are
+ * accounted like it for the rate limit and the estimates.
+ */
+static ssize_t buffered_write_at(void *opaque, const uint8_t *buf,
+                                 size_t size, int64_t pos)
+{
+    QEMUFileBuffered *s = opaque;
+    ssize_t ret;
 
-    if (pos == 0 && size == 0) {
-        DPRINTF("file is ready\n");
-        if (s->bytes_xfer <= s->xfer_limit) {
-            DPRINTF("notifying client\n");
-            s->put_ready(s->opaque);
-        }
+    ret = migrate_fd_put_buffer_at(s->migration_state, buf, size, pos);
+    DPRINTF("wrote %zd byte(s) at %" PRId64 "\n", ret, pos);
+    if (ret > 0) {
+        s->bytes_xfer += ret;
     }
-
-    return offset;
+    return ret;
 }
 
 static int buffered_close(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
     int ret;
+    int i;
 
     DPRINTF("closing\n");
 
-    while (!qemu_file_get_error(s->file) && s->buffer_size) {
-        buffered_flush(s);
-        if (s->freeze_output)
-            s->wait_for_unfreeze(s->opaque);
-    }
+    buffered_flush(s);
+    ret = migrate_fd_close(s->migration_state);
 
-    ret = s->close(s->opaque);
+    for (i = 1; i < s->nr_streams; i++) {
+        qemu_fclose(s->streams[i]->file);
+        s->migration_state->stream_files[i] = NULL;
+    }
 
-    qemu_del_timer(s->timer);
-    qemu_free_timer(s->timer);
     g_free(s->buffer);
     g_free(s);
 
@@ -208,10 +289,8 @@ static int buffered_rate_limit(void *opaque)
     if (ret) {
         return ret;
     }
-    if (s->freeze_output)
-        return 1;
 
-    if (s->bytes_xfer > s->xfer_limit)
+    if (buffered_bytes_xfer(s) > s->xfer_limit)
         return 1;
 
     return 0;
@@ -227,8 +306,8 @@ static int64_t buffered_set_rate_limit(void *opaque, int64_t new_rate)
         new_rate = SIZE_MAX;
     }
 
-    s->xfer_limit = new_rate / 10;
-    
+    s->xfer_limit = new_rate / (1000 / BUFFER_DELAY);
+
 out:
     return s->xfer_limit;
 }
@@ -236,58 +315,213 @@ out:
 static int64_t buffered_get_rate_limit(void *opaque)
 {
     QEMUFileBuffered *s = opaque;
-  
+
     return s->xfer_limit;
 }
 
-static void buffered_rate_tick(void *opaque)
+/*
+ * Stop the guest and send the remaining state.  Runs with the iothread
+ * lock held.  Returns 0 on success, negative on error.
+ */
+static int buffered_complete(QEMUFileBuffered *s)
 {
-    QEMUFileBuffered *s = opaque;
+    MigrationState *ms = s->migration_state;
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int ret;
 
-    if (qemu_file_get_error(s->file)) {
-        buffered_close(s);
-        return;
-    }
+    DPRINTF("done iterating\n");
+    ms->old_vm_running = runstate_is_running();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    ret = qemu_savevm_state_complete(s->file);
+    ms->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    return ret;
+}
 
-    if (s->freeze_output)
-        return;
+/*
+ * Stop the guest, send the device state and let the destination run it
+ * while the rest of RAM follows, either on request or in the background.
+ * Returns 0 once the destination has all of RAM, negative on error.
+ */
+static int buffered_postcopy(QEMUFileBuffered *s)
+{
+    MigrationState *ms = s->migration_state;
+    int64_t start_time;
+    int ret;
 
-    s->bytes_xfer = 0;
+    DPRINTF("starting post-copy\n");
+    ret = ram_postcopy_outgoing_start(ms->fd);
+    if (ret < 0) {
+        return ret;
+    }
+
+    qemu_mutex_lock_iothread();
+    start_time = qemu_get_clock_ms(rt_clock);
+    ms->old_vm_running = runstate_is_running();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
 
+    ret = qemu_savevm_state_postcopy(s->file);
     buffered_flush(s);
+    if (ret >= 0) {
+        ret = qemu_file_get_error(s->file);
+    }
+    /* The destination only starts once it has all of the device state;
+     * from here on the guest must not be resumed here.
+     */
+    if (ret >= 0) {
+        ms->postcopy = true;
+    }
+    ms->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    qemu_mutex_unlock_iothread();
 
-    /* Add some checks around this */
-    s->put_ready(s->opaque);
+    while (ret == 0) {
+        ret = ram_postcopy_send(s->file);
+        buffered_flush(s);
+        if (ret >= 0 && qemu_file_get_error(s->file)) {
+            ret = qemu_file_get_error(s->file);
+        }
+    }
+
+    return ram_postcopy_outgoing_finish(ret > 0);
+}
+
+/*
+ * The migration thread.  It owns s->file: the stream is produced and
+ * written out from here, and the iothread lock is only taken for setup,
+ * for resyncing the dirty log (from the pending callbacks) and for the
+ * final stop-and-copy phase.  When it is done, the main loop is told to
+ * clean up through ms->cleanup_bh.
+ */
+static void *buffered_file_thread(void *opaque)
+{
+    QEMUFileBuffered *s = opaque;
+    MigrationState *ms = s->migration_state;
+    int64_t initial_time = qemu_get_clock_ms(rt_clock);
+    int64_t max_size = 0;
+    int passes = 0;
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    DPRINTF("beginning savevm\n");
+    ret = qemu_savevm_state_begin(s->file, &ms->params);
+    qemu_mutex_unlock_iothread();
+
+    while (ret >= 0 && ms->state == MIG_STATE_ACTIVE) {
+        int64_t current_time = qemu_get_clock_ms(rt_clock);
+        uint64_t pending_size;
+
+        if (buffered_bytes_xfer(s) < s->xfer_limit) {
+            pending_size = qemu_savevm_state_pending(s->file, max_size);
+            ms->est.pending = pending_size;
+            trace_migrate_pending(pending_size, max_size);
+            if (pending_size && pending_size >= max_size &&
+                migrate_use_postcopy() &&
+                passes >= migrate_postcopy_passes()) {
+                ret = buffered_postcopy(s);
+                if (ret >= 0) {
+                    ms->complete = true;
+                }
+                break;
+            } else if (pending_size && pending_size >= max_size) {
+                DPRINTF("iterate\n");
+                ret = qemu_savevm_state_iterate(s->file);
+                if (ret > 0) {
+                    passes++;
+                    migrate_pass_done(ms);
+                }
+            } else {
+                qemu_mutex_lock_iothread();
+                ret = buffered_complete(s);
+                qemu_mutex_unlock_iothread();
+                if (ret >= 0) {
+                    ms->complete = true;
+                }
+                break;
+            }
+        }
+
+        current_time = qemu_get_clock_ms(rt_clock);
+        if (current_time >= initial_time + BUFFER_DELAY) {
+            uint64_t transferred_bytes = buffered_bytes_xfer(s);
+            uint64_t time_spent = current_time - initial_time;
+
+            /* one window is too noisy on its own, decide on averages */
+            migrate_estimate_bandwidth(ms, transferred_bytes, time_spent);
+            max_size = migrate_estimate_max_size(ms);
+
+            trace_migrate_transferred(transferred_bytes, time_spent,
+                                      ms->est.bandwidth, max_size);
+
+            buffered_reset_bytes_xfer(s);
+            initial_time = current_time;
+        }
+
+        buffered_flush(s);
+        if (ret >= 0) {
+            ret = qemu_file_get_error(s->file);
+        }
+
+        if (ret >= 0 && buffered_bytes_xfer(s) >= s->xfer_limit) {
+            int64_t sleep_time = initial_time + BUFFER_DELAY -
+                                 qemu_get_clock_ms(rt_clock);
+            if (sleep_time > 0) {
+                /* usleep expects microseconds */
+                g_usleep(sleep_time * 1000);
+            }
+        }
+    }
+
+    if (ms->complete) {
+        buffered_flush(s);
+        if (qemu_file_get_error(s->file)) {
+            ms->complete = false;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    qemu_bh_schedule(ms->cleanup_bh);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
 }
 
-QEMUFile *qemu_fopen_ops_buffered(void *opaque,
-                                  size_t bytes_per_sec,
-                                  BufferedPutFunc *put_buffer,
-                                  BufferedPutReadyFunc *put_ready,
-                                  BufferedWaitForUnfreezeFunc *wait_for_unfreeze,
-                                  BufferedCloseFunc *close)
+QEMUFile *qemu_fopen_ops_buffered(MigrationState *migration_state)
 {
     QEMUFileBuffered *s;
+    int i;
 
     s = g_malloc0(sizeof(*s));
 
-    s->opaque = opaque;
-    s->xfer_limit = bytes_per_sec / 10;
-    s->put_buffer = put_buffer;
-    s->put_ready = put_ready;
-    s->wait_for_unfreeze = wait_for_unfreeze;
-    s->close = close;
+    s->migration_state = migration_state;
+    s->xfer_limit = migration_state->bandwidth_limit / (1000 / BUFFER_DELAY);
 
     s->file = qemu_fopen_ops(s, buffered_put_buffer, NULL,
                              buffered_close, buffered_rate_limit,
                              buffered_set_rate_limit,
-			     buffered_get_rate_limit);
+                             buffered_get_rate_limit);
+    if (migration_state->writev) {
+        qemu_file_set_writev(s->file, buffered_writev_buffer);
+    }
+    if (migration_state->write_at) {
+        qemu_file_set_positioned(s->file, buffered_write_at, NULL);
+    }
 
-    s->timer = qemu_new_timer_ms(rt_clock, buffered_rate_tick, s);
+    s->nr_streams = migration_state->nr_streams;
+    for (i = 1; i < s->nr_streams; i++) {
+        QEMUFileStream *st = g_malloc0(sizeof(*st));
+
+        st->fd = migration_state->stream_fds[i];
+        st->file = qemu_fopen_ops(st, buffered_stream_put_buffer, NULL,
+                                  buffered_stream_close, NULL, NULL, NULL);
+        qemu_file_set_writev(st->file, buffered_stream_writev_buffer);
+        s->streams[i] = st;
+        migration_state->stream_files[i] = st->file;
+    }
 
-    qemu_mod_timer(s->timer, qemu_get_clock_ms(rt_clock) + 100);
+    qemu_thread_create(&migration_state->thread, buffered_file_thread, s,
+                       QEMU_THREAD_JOINABLE);
 
     return s->file;
 }
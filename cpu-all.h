@@ -22,6 +22,7 @@
 #include "qemu-common.h"
 #include "qemu-tls.h"
 #include "cpu-common.h"
+#include "qemu-thread.h"
 
 /* some important defines:
  *
@@ -484,12 +485,25 @@ typedef struct RAMBlock {
 } RAMBlock;
 
 typedef struct RAMList {
+    QemuMutex mutex;
     uint8_t *phys_dirty;
+    /* one bit per page for the migration client, indexed like phys_dirty */
+    unsigned long *migration_dirty;
+    RAMBlock *mru_block;
     QLIST_HEAD(, RAMBlock) blocks;
+    uint32_t version;
     uint64_t dirty_pages;
 } RAMList;
 extern RAMList ram_list;
 
+/* Protects the list of RAM blocks against concurrent modification by code
+ * that walks it without holding the iothread lock (the migration thread).
+ * Lock ordering: iothread lock first, then ramlist lock.
+ */
+void qemu_mutex_lock_ramlist(void);
+void qemu_mutex_unlock_ramlist(void);
+ram_addr_t last_ram_offset(void);
+
 extern const char *mem_path;
 extern int mem_prealloc;
 
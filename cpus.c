@@ -725,9 +725,90 @@ static void qemu_kvm_wait_io_event(CPUArchState *env)
     qemu_wait_io_event_common(env);
 }
 
+/*
+ * vCPU throttling, to let a migration catch up with a guest that dirties
+ * memory faster than it can be sent.  Every period, the vCPUs are kicked
+ * out of the guest and sleep for throttle_percentage percent of it.
+ */
+
+/* Time the vCPUs run in each period */
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+#define CPU_THROTTLE_PCT_MAX 99
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+/* bumped once per period; vCPU threads sleep when they see it change */
+static unsigned int throttle_period;
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUArchState *env;
+
+    if (!throttle_percentage) {
+        return;
+    }
+
+    throttle_period++;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cpu_kick(env);
+    }
+    qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                   CPU_THROTTLE_TIMESLICE_NS * 100 /
+                   (100 - throttle_percentage));
+}
+
+/* Called from the vCPU threads, with the iothread lock held */
+static void cpu_throttle_sleep(unsigned int *period)
+{
+    int64_t sleep_ns;
+
+    if (*period == throttle_period) {
+        return;
+    }
+    *period = throttle_period;
+    if (!throttle_percentage) {
+        return;
+    }
+
+    sleep_ns = (int64_t)CPU_THROTTLE_TIMESLICE_NS * throttle_percentage /
+               (100 - throttle_percentage);
+    qemu_mutex_unlock(&qemu_global_mutex);
+    g_usleep(sleep_ns / 1000);
+    qemu_mutex_lock(&qemu_global_mutex);
+}
+
+void cpu_throttle_set(int percentage)
+{
+    bool start = !throttle_percentage;
+
+    throttle_percentage = MIN(MAX(percentage, 1), CPU_THROTTLE_PCT_MAX);
+    if (!throttle_timer) {
+        throttle_timer = qemu_new_timer_ns(rt_clock, cpu_throttle_timer_tick,
+                                           NULL);
+    }
+    if (start) {
+        qemu_mod_timer(throttle_timer, qemu_get_clock_ns(rt_clock) +
+                       CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+void cpu_throttle_stop(void)
+{
+    throttle_percentage = 0;
+    if (throttle_timer) {
+        qemu_del_timer(throttle_timer);
+    }
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return throttle_percentage;
+}
+
 static void *qemu_kvm_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
+    unsigned int period = 0;
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
@@ -755,6 +836,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
             }
         }
         qemu_kvm_wait_io_event(env);
+        cpu_throttle_sleep(&period);
     }
 
     return NULL;
@@ -807,6 +889,7 @@ static void tcg_exec_all(void);
 static void *qemu_tcg_cpu_thread_fn(void *arg)
 {
     CPUArchState *env = arg;
+    unsigned int period = 0;
 
     qemu_tcg_init_cpu_signals();
     qemu_thread_get_self(env->thread);
@@ -835,6 +918,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
             qemu_notify_event();
         }
         qemu_tcg_wait_io_event();
+        cpu_throttle_sleep(&period);
     }
 
     return NULL;
@@ -1046,9 +1130,19 @@ void cpu_stop_current(void)
     }
 }
 
+static bool qemu_in_vcpu_thread(void)
+{
+    return cpu_single_env && qemu_cpu_is_self(cpu_single_env);
+}
+
+/*
+ * A VCPU can only ask the main loop to stop the VM, since it can not
+ * wait for itself to pause.  Any other thread, such as the migration
+ * thread, stops it right away; it must hold the iothread lock.
+ */
 void vm_stop(RunState state)
 {
-    if (!qemu_thread_is_self(&io_thread)) {
+    if (qemu_in_vcpu_thread()) {
         qemu_system_vmstop_request(state);
         /*
          * FIXME: should not return to device code in case
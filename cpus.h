@@ -13,6 +13,10 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+void cpu_throttle_set(int percentage);
+void cpu_throttle_stop(void);
+int cpu_throttle_get_percentage(void);
+
 /* vl.c */
 extern int smp_cores;
 extern int smp_threads;
@@ -0,0 +1,293 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Dirty logging is enabled for a while, and the dirty bitmap is collected
+ * every DIRTY_RATE_SAMPLE_MS: once from KVM or TCG into the migration
+ * dirty bitmap, then word by word into our own.  This gives the rate at
+ * which each RAM block is dirtied, and how much memory the guest writes
+ * to within windows of increasing length (its working set), without
+ * starting a migration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "cpu.h"
+#include "cpu-all.h"
+#include "memory.h"
+#include "exec-memory.h"
+#include "bitmap.h"
+#include "bitops.h"
+#include "qemu-timer.h"
+#include "migration.h"
+#include "sysemu.h"
+#include "error.h"
+#include "qerror.h"
+#include "qmp-commands.h"
+
+//#define DEBUG_DIRTY_RATE
+
+#ifdef DEBUG_DIRTY_RATE
+#define DPRINTF(fmt, ...) \
+    do { printf("dirtyrate: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+/* Interval between two looks at the dirty bitmap */
+#define DIRTY_RATE_SAMPLE_MS    100
+/* Longest measurement, in seconds */
+#define DIRTY_RATE_MAX_TIME     60
+/* Working set points: after 1, 2, 4, ... samples, and at the end */
+#define DIRTY_RATE_WS_MAX       16
+
+typedef struct DirtyRateBlock {
+    RAMBlock *block;
+    char *idstr;
+    /* pages found dirty, summed over the samples */
+    uint64_t dirty_pages;
+} DirtyRateBlock;
+
+static struct {
+    DirtyRateStatus status;
+    int64_t calc_time;
+    QEMUTimer *timer;
+    Error *blocker;
+    uint32_t ram_list_version;
+    int64_t start_time;
+    int64_t elapsed;
+    int nr_samples;
+    int samples;
+    uint64_t ram_pages;
+    /* the pages dirtied since the last sample */
+    unsigned long *sample;
+    /* the pages dirtied since the measurement started, and their number */
+    unsigned long *touched;
+    uint64_t touched_pages;
+    DirtyRateBlock *blocks;
+    int nr_blocks;
+    int64_t ws_time[DIRTY_RATE_WS_MAX];
+    uint64_t ws_pages[DIRTY_RATE_WS_MAX];
+    int nr_ws;
+} DirtyRate;
+
+static void dirty_rate_sync(void)
+{
+    int i;
+
+    memory_global_sync_dirty_bitmap(get_system_memory());
+    for (i = 0; i < DirtyRate.nr_blocks; i++) {
+        DirtyRateBlock *b = &DirtyRate.blocks[i];
+
+        b->dirty_pages +=
+            memory_region_sync_migration_dirty(b->block->mr, 0,
+                                               b->block->length,
+                                               DirtyRate.sample);
+    }
+}
+
+/* Moves the sample into the pages touched so far */
+static void dirty_rate_merge(void)
+{
+    unsigned long *sample = DirtyRate.sample;
+    unsigned long *touched = DirtyRate.touched;
+    uint64_t i;
+
+    for (i = 0; i < BITS_TO_LONGS(DirtyRate.ram_pages); i++) {
+        if (sample[i]) {
+            DirtyRate.touched_pages += hweight_long(sample[i] & ~touched[i]);
+            touched[i] |= sample[i];
+            sample[i] = 0;
+        }
+    }
+}
+
+static void dirty_rate_stop(void)
+{
+    memory_global_dirty_log_stop();
+    qemu_del_timer(DirtyRate.timer);
+    qemu_free_timer(DirtyRate.timer);
+    DirtyRate.timer = NULL;
+
+    g_free(DirtyRate.sample);
+    DirtyRate.sample = NULL;
+    g_free(DirtyRate.touched);
+    DirtyRate.touched = NULL;
+
+    migrate_del_blocker(DirtyRate.blocker);
+    error_free(DirtyRate.blocker);
+    DirtyRate.blocker = NULL;
+
+    DirtyRate.status = DIRTY_RATE_STATUS_MEASURED;
+    DPRINTF("%d samples in %" PRId64 " ms\n", DirtyRate.samples,
+            DirtyRate.elapsed);
+}
+
+static void dirty_rate_sample(void *opaque)
+{
+    int64_t now = qemu_get_clock_ms(rt_clock);
+
+    /* the blocks went away or moved, keep what was measured until now */
+    if (ram_list.version != DirtyRate.ram_list_version) {
+        dirty_rate_stop();
+        return;
+    }
+
+    dirty_rate_sync();
+    dirty_rate_merge();
+    DirtyRate.samples++;
+    DirtyRate.elapsed = now - DirtyRate.start_time;
+
+    if ((DirtyRate.samples & (DirtyRate.samples - 1)) == 0 ||
+        DirtyRate.samples == DirtyRate.nr_samples) {
+        assert(DirtyRate.nr_ws < DIRTY_RATE_WS_MAX);
+        DirtyRate.ws_time[DirtyRate.nr_ws] = DirtyRate.elapsed;
+        DirtyRate.ws_pages[DirtyRate.nr_ws] = DirtyRate.touched_pages;
+        DirtyRate.nr_ws++;
+    }
+
+    if (DirtyRate.samples == DirtyRate.nr_samples) {
+        dirty_rate_stop();
+        return;
+    }
+    qemu_mod_timer(DirtyRate.timer, now + DIRTY_RATE_SAMPLE_MS);
+}
+
+static void dirty_rate_free_results(void)
+{
+    int i;
+
+    for (i = 0; i < DirtyRate.nr_blocks; i++) {
+        g_free(DirtyRate.blocks[i].idstr);
+    }
+    g_free(DirtyRate.blocks);
+    DirtyRate.blocks = NULL;
+    DirtyRate.nr_blocks = 0;
+    DirtyRate.nr_ws = 0;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    RAMBlock *block;
+    int i;
+
+    if (DirtyRate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_set(errp, QERR_DIRTY_RATE_ACTIVE);
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_TIME) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                  "a number of seconds between 1 and 60");
+        return;
+    }
+    /* those use the dirty log and the migration dirty bitmap themselves */
+    if (migrate_is_running()) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (savevm_live_is_running()) {
+        error_set(errp, QERR_SNAPSHOT_ACTIVE);
+        return;
+    }
+
+    dirty_rate_free_results();
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        DirtyRate.nr_blocks++;
+    }
+    DirtyRate.blocks = g_malloc0(DirtyRate.nr_blocks *
+                                 sizeof(*DirtyRate.blocks));
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        DirtyRate.blocks[i].block = block;
+        DirtyRate.blocks[i].idstr = g_strdup(block->idstr);
+        i++;
+    }
+
+    DirtyRate.calc_time = calc_time;
+    DirtyRate.nr_samples = calc_time * 1000 / DIRTY_RATE_SAMPLE_MS;
+    DirtyRate.samples = 0;
+    DirtyRate.elapsed = 0;
+    DirtyRate.ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    DirtyRate.sample = bitmap_new(DirtyRate.ram_pages);
+    DirtyRate.touched = bitmap_new(DirtyRate.ram_pages);
+    DirtyRate.touched_pages = 0;
+    DirtyRate.ram_list_version = ram_list.version;
+
+    error_set(&DirtyRate.blocker, QERR_DIRTY_RATE_ACTIVE);
+    migrate_add_blocker(DirtyRate.blocker);
+
+    /* whatever is dirty already is not part of the measurement */
+    memory_global_dirty_log_start();
+    dirty_rate_sync();
+    bitmap_zero(DirtyRate.sample, DirtyRate.ram_pages);
+    for (i = 0; i < DirtyRate.nr_blocks; i++) {
+        DirtyRate.blocks[i].dirty_pages = 0;
+    }
+
+    DirtyRate.status = DIRTY_RATE_STATUS_MEASURING;
+    DirtyRate.start_time = qemu_get_clock_ms(rt_clock);
+    DirtyRate.timer = qemu_new_timer_ms(rt_clock, dirty_rate_sample, NULL);
+    qemu_mod_timer(DirtyRate.timer,
+                   DirtyRate.start_time + DIRTY_RATE_SAMPLE_MS);
+}
+
+/* Converts @pages dirtied within @time_ms into MB/s */
+static int64_t dirty_rate_mbps(uint64_t pages, int64_t time_ms)
+{
+    if (time_ms <= 0) {
+        return 0;
+    }
+    return pages * TARGET_PAGE_SIZE * 1000 / time_ms >> 20;
+}
+
+bool dirty_rate_is_measuring(void)
+{
+    return DirtyRate.status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    DirtyRateBlockInfoList *blocks = NULL, *entry;
+    DirtyRateWorkingSetList *ws = NULL, *point;
+    uint64_t dirty_pages = 0;
+    int i;
+
+    info->status = DirtyRate.status;
+    info->calc_time = DirtyRate.calc_time;
+    if (DirtyRate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    for (i = DirtyRate.nr_blocks - 1; i >= 0; i--) {
+        DirtyRateBlock *b = &DirtyRate.blocks[i];
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = g_strdup(b->idstr);
+        entry->value->dirty_rate = dirty_rate_mbps(b->dirty_pages,
+                                                   DirtyRate.elapsed);
+        entry->next = blocks;
+        blocks = entry;
+        dirty_pages += b->dirty_pages;
+    }
+
+    for (i = DirtyRate.nr_ws - 1; i >= 0; i--) {
+        point = g_malloc0(sizeof(*point));
+        point->value = g_malloc0(sizeof(*point->value));
+        point->value->time = DirtyRate.ws_time[i];
+        point->value->bytes = DirtyRate.ws_pages[i] * TARGET_PAGE_SIZE;
+        point->next = ws;
+        ws = point;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_mbps(dirty_pages, DirtyRate.elapsed);
+    info->has_blocks = true;
+    info->blocks = blocks;
+    info->has_working_set = true;
+    info->working_set = ws;
+    return info;
+}
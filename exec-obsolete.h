@@ -25,6 +25,8 @@
 
 #ifndef CONFIG_USER_ONLY
 
+#include "bitops.h"
+
 ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr);
 ram_addr_t qemu_ram_alloc(ram_addr_t size, MemoryRegion *mr);
@@ -45,9 +47,18 @@ int cpu_physical_memory_set_dirty_tracking(int enable);
 #define CODE_DIRTY_FLAG      0x02
 #define MIGRATION_DIRTY_FLAG 0x08
 
+/* The migration client is not kept in phys_dirty, but in the
+ * ram_list.migration_dirty bitmap, so that it can be scanned and
+ * synced a word at a time.
+ */
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    int flags = ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+
+    if (test_bit(addr >> TARGET_PAGE_BITS, ram_list.migration_dirty)) {
+        flags |= MIGRATION_DIRTY_FLAG;
+    }
+    return flags;
 }
 
 /* read dirty bit (return 0 or 1) */
@@ -75,11 +86,12 @@ static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
     if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
-        !cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
-                                       MIGRATION_DIRTY_FLAG)) {
+        !test_and_set_bit(addr >> TARGET_PAGE_BITS, ram_list.migration_dirty)) {
         ram_list.dirty_pages++;
     }
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |=
+        dirty_flags & ~MIGRATION_DIRTY_FLAG;
+    return cpu_physical_memory_get_dirty_flags(addr);
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
@@ -93,11 +105,12 @@ static inline int cpu_physical_memory_clear_dirty_flags(ram_addr_t addr,
     int mask = ~dirty_flags;
 
     if ((dirty_flags & MIGRATION_DIRTY_FLAG) &&
-        cpu_physical_memory_get_dirty(addr, TARGET_PAGE_SIZE,
-                                      MIGRATION_DIRTY_FLAG)) {
+        test_and_clear_bit(addr >> TARGET_PAGE_BITS,
+                           ram_list.migration_dirty)) {
         ram_list.dirty_pages--;
     }
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] &= mask;
+    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] &= mask;
+    return cpu_physical_memory_get_dirty_flags(addr);
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -128,6 +141,12 @@ static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+void cpu_physical_memory_set_dirty_lebitmap(const unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            unsigned long pages);
+uint64_t cpu_physical_memory_sync_migration_dirty(unsigned long *dest,
+                                                  ram_addr_t start,
+                                                  ram_addr_t length);
 
 extern const IORangeOps memory_region_iorange_ops;
 
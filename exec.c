@@ -35,6 +35,8 @@
 #include "qemu-timer.h"
 #include "memory.h"
 #include "exec-memory.h"
+#include "bitmap.h"
+#include "host-utils.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -635,6 +637,7 @@ bool tcg_enabled(void)
 void cpu_exec_init_all(void)
 {
 #if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&ram_list.mutex);
     memory_map_init();
     io_mem_init();
 #endif
@@ -1861,6 +1864,106 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     }
 }
 
+/* Marks the pages set in a little endian @bitmap as dirty for every client,
+ * one bit per target page starting at @start.  The migration client gets
+ * whole words ORed in when @start is suitably aligned.
+ */
+void cpu_physical_memory_set_dirty_lebitmap(const unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            unsigned long pages)
+{
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long len = BITS_TO_LONGS(pages);
+    unsigned long i, j, c, page;
+    unsigned long *dest;
+
+    if (first % BITS_PER_LONG) {
+        for (i = 0; i < len; i++) {
+            c = leul_to_cpu(bitmap[i]);
+            if (i == len - 1 && pages % BITS_PER_LONG) {
+                c &= BITMAP_LAST_WORD_MASK(pages);
+            }
+            while (c != 0) {
+                j = ffsl(c) - 1;
+                c &= ~(1ul << j);
+                page = i * BITS_PER_LONG + j;
+                cpu_physical_memory_set_dirty(start +
+                                              page * TARGET_PAGE_SIZE);
+            }
+        }
+        return;
+    }
+
+    dest = ram_list.migration_dirty + first / BITS_PER_LONG;
+    for (i = 0; i < len; i++) {
+        if (bitmap[i] == 0) {
+            continue;
+        }
+        c = leul_to_cpu(bitmap[i]);
+        if (i == len - 1 && pages % BITS_PER_LONG) {
+            c &= BITMAP_LAST_WORD_MASK(pages);
+        }
+        ram_list.dirty_pages += ctpop64(c & ~dest[i]);
+        dest[i] |= c;
+        while (c != 0) {
+            j = ffsl(c) - 1;
+            c &= ~(1ul << j);
+            page = first + i * BITS_PER_LONG + j;
+            ram_list.phys_dirty[page] |= 0xff & ~MIGRATION_DIRTY_FLAG;
+        }
+    }
+}
+
+/* Moves the migration dirty bits of [start, start + length) into @dest,
+ * which is indexed by page number like ram_list.migration_dirty, and
+ * clears them.  Returns the number of pages that were not yet set in @dest.
+ */
+uint64_t cpu_physical_memory_sync_migration_dirty(unsigned long *dest,
+                                                  ram_addr_t start,
+                                                  ram_addr_t length)
+{
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    unsigned long *src = ram_list.migration_dirty;
+    unsigned long i, k, c;
+    uint64_t num_dirty = 0;
+    bool moved = false;
+
+    if (first % BITS_PER_LONG) {
+        for (i = first; i < first + pages; i++) {
+            if (test_and_clear_bit(i, src)) {
+                ram_list.dirty_pages--;
+                moved = true;
+                if (!test_and_set_bit(i, dest)) {
+                    num_dirty++;
+                }
+            }
+        }
+    } else {
+        for (i = 0; i < BITS_TO_LONGS(pages); i++) {
+            k = first / BITS_PER_LONG + i;
+            c = src[k];
+            if (i == BITS_TO_LONGS(pages) - 1 && pages % BITS_PER_LONG) {
+                c &= BITMAP_LAST_WORD_MASK(pages);
+            }
+            if (c == 0) {
+                continue;
+            }
+            num_dirty += ctpop64(c & ~dest[k]);
+            ram_list.dirty_pages -= ctpop64(c);
+            dest[k] |= c;
+            src[k] &= ~c;
+            moved = true;
+        }
+    }
+
+    /* writes through the TLB must go back to notdirty_mem_write */
+    if (moved && tcg_enabled()) {
+        tlb_reset_dirty_range_all(start, start + length, length);
+    }
+    return num_dirty;
+}
+
 int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -2467,7 +2570,17 @@ static ram_addr_t find_ram_offset(ram_addr_t size)
     return offset;
 }
 
-static ram_addr_t last_ram_offset(void)
+void qemu_mutex_lock_ramlist(void)
+{
+    qemu_mutex_lock(&ram_list.mutex);
+}
+
+void qemu_mutex_unlock_ramlist(void)
+{
+    qemu_mutex_unlock(&ram_list.mutex);
+}
+
+ram_addr_t last_ram_offset(void)
 {
     RAMBlock *block;
     ram_addr_t last = 0;
@@ -2518,6 +2631,7 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
 
+    qemu_mutex_lock_ramlist();
     new_block->mr = mr;
     new_block->offset = find_ram_offset(size);
     if (host) {
@@ -2550,10 +2664,19 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     new_block->length = size;
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
+    ram_list.mru_block = NULL;
+    ram_list.version++;
 
     ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
+    ram_list.migration_dirty = g_realloc(ram_list.migration_dirty,
+        BITS_TO_LONGS(last_ram_offset() >> TARGET_PAGE_BITS) *
+        sizeof(unsigned long));
+    bitmap_clear(ram_list.migration_dirty,
+                 new_block->offset >> TARGET_PAGE_BITS,
+                 size >> TARGET_PAGE_BITS);
     cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+    qemu_mutex_unlock_ramlist();
 
     if (kvm_enabled())
         kvm_setup_guest_memory(new_block->host, size);
@@ -2570,22 +2693,29 @@ void qemu_ram_free_from_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_list.mru_block = NULL;
+            ram_list.version++;
             g_free(block);
-            return;
+            break;
         }
     }
+    qemu_mutex_unlock_ramlist();
 }
 
 void qemu_ram_free(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    qemu_mutex_lock_ramlist();
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
             QLIST_REMOVE(block, next);
+            ram_list.mru_block = NULL;
+            ram_list.version++;
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
             } else if (mem_path) {
@@ -2611,9 +2741,10 @@ void qemu_ram_free(ram_addr_t addr)
 #endif
             }
             g_free(block);
-            return;
+            break;
         }
     }
+    qemu_mutex_unlock_ramlist();
 
 }
 
@@ -2690,33 +2821,36 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
+    /* Do not reorder the list: the migration thread walks it while only
+     * holding the ramlist lock.  Remember the last hit instead.  */
+    block = ram_list.mru_block;
+    if (block && addr - block->offset < block->length) {
+        goto found;
+    }
     QLIST_FOREACH(block, &ram_list.blocks, next) {
         if (addr - block->offset < block->length) {
-            /* Move this entry to to start of the list.  */
-            if (block != QLIST_FIRST(&ram_list.blocks)) {
-                QLIST_REMOVE(block, next);
-                QLIST_INSERT_HEAD(&ram_list.blocks, block, next);
-            }
-            if (xen_enabled()) {
-                /* We need to check if the requested address is in the RAM
-                 * because we don't want to map the entire memory in QEMU.
-                 * In that case just map until the end of the page.
-                 */
-                if (block->offset == 0) {
-                    return xen_map_cache(addr, 0, 0);
-                } else if (block->host == NULL) {
-                    block->host =
-                        xen_map_cache(block->offset, block->length, 1);
-                }
-            }
-            return block->host + (addr - block->offset);
+            goto found;
         }
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
     abort();
 
-    return NULL;
+found:
+    ram_list.mru_block = block;
+    if (xen_enabled()) {
+        /* We need to check if the requested address is in the RAM
+         * because we don't want to map the entire memory in QEMU.
+         * In that case just map until the end of the page.
+         */
+        if (block->offset == 0) {
+            return xen_map_cache(addr, 0, 0);
+        } else if (block->host == NULL) {
+            block->host =
+                xen_map_cache(block->offset, block->length, 1);
+        }
+    }
+    return block->host + (addr - block->offset);
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
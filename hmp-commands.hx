@@ -264,19 +264,33 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "live:-l,name:s?",
+        .params     = "[-l] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -l to save RAM while the VM keeps running; the snapshot"
+                      "\n\t\t\t is taken when the save completes",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-l] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-l}, the command returns at once and RAM is written while
+the VM runs, the way live migration sends it; the VM is only stopped for
+the last dirty pages, the device state and the disk snapshots, which are
+all taken at that point.  The snapshot is therefore that of the moment
+the save completes, not of the moment the command was issued; the guest
+keeps running and modifying RAM and disks in between.  If the guest
+changes its RAM faster than it can be saved, so that the VM would have
+to be stopped for longer than the maximum downtime (see
+@code{migrate_set_downtime}), the snapshot fails instead.  @code{info
+savevm} reports the outcome.  Live snapshots are refused while
+migration is blocked.
 ETEXI
 
     {
@@ -834,21 +848,124 @@ ETEXI
 
     {
         .name       = "migrate_set_cache_size",
-        .args_type  = "value:o",
-        .params     = "value",
+        .args_type  = "value:o,associativity:i?,admit:b?",
+        .params     = "value [associativity [admit]]",
         .help       = "set cache size (in bytes) for XBZRLE migrations,"
                       "the cache size will be rounded down to the nearest "
                       "power of 2.\n"
                       "The cache size affects the number of cache misses."
                       "In case of a high cache miss ratio you need to increase"
-                      " the cache size",
+                      " the cache size.\n"
+                      "associativity sets the number of pages per cache set "
+                      "(1 for a direct-mapped cache), admit on only caches "
+                      "pages once they have been sent twice. Both apply to "
+                      "the next migration; when omitted, they keep their "
+                      "current setting",
         .mhandler.cmd = hmp_migrate_set_cache_size,
     },
 
 STEXI
-@item migrate_set_cache_size @var{value}
+@item migrate_set_cache_size @var{value} [@var{associativity} [@var{admit}]]
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+@var{associativity} makes the cache set associative with that many pages
+per set; with @var{admit} set to @code{on} a page is only cached once it has
+been sent twice, @code{off} caches it right away.
+Without them, the associativity and admission setting are left unchanged.
+ETEXI
+
+    {
+        .name       = "migrate_set_xbzrle_threads",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of threads used for XBZRLE encoding "
+                      "(1 to 64). The cache is split between the threads",
+        .mhandler.cmd = hmp_migrate_set_xbzrle_threads,
+    },
+
+STEXI
+@item migrate_set_xbzrle_threads @var{value}
+@findex migrate_set_xbzrle_threads
+Set the number of XBZRLE encoder threads to @var{value}.
+ETEXI
+
+    {
+        .name       = "migrate_set_ram_streams",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of connections used by tcp and unix "
+                      "migrations (1 to 16)",
+        .mhandler.cmd = hmp_migrate_set_ram_streams,
+    },
+
+STEXI
+@item migrate_set_ram_streams @var{value}
+@findex migrate_set_ram_streams
+Spread guest RAM over @var{value} connections in tcp and unix migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:i,threads:i?,decompress_threads:i?",
+        .params     = "level [threads [decompress_threads]]",
+        .help       = "set the zlib level (0 to 9) and the number of "
+                      "compression and decompression threads (1 to 64) "
+                      "used with the compress capability",
+        .mhandler.cmd = hmp_migrate_set_compress_params,
+    },
+
+STEXI
+@item migrate_set_compress_params @var{level} [@var{threads} [@var{decompress_threads}]]
+@findex migrate_set_compress_params
+Compress migrated pages with zlib level @var{level}, using @var{threads}
+threads on the source and @var{decompress_threads} on the destination.
+ETEXI
+
+    {
+        .name       = "migrate_set_postcopy_passes",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of pre-copy passes before post-copy "
+                      "starts (0 to 100)",
+        .mhandler.cmd = hmp_migrate_set_postcopy_passes,
+    },
+
+STEXI
+@item migrate_set_postcopy_passes @var{value}
+@findex migrate_set_postcopy_passes
+Start the guest on the destination after @var{value} pre-copy passes, when
+the postcopy capability is on.
+ETEXI
+
+    {
+        .name       = "migrate_set_block_aio_depth",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of reads block migration keeps in "
+                      "flight on each device (1 to 256)",
+        .mhandler.cmd = hmp_migrate_set_block_aio_depth,
+    },
+
+STEXI
+@item migrate_set_block_aio_depth @var{value}
+@findex migrate_set_block_aio_depth
+Keep up to @var{value} reads in flight on each device during block migration.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "seconds:i",
+        .params     = "seconds",
+        .help       = "measure the dirty page rate for a few seconds "
+                      "(1 to 60)",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{seconds}
+@findex calc_dirty_rate
+Measure how fast the guest dirties its RAM during @var{seconds}, without
+migrating it.  See @code{info dirty_rate} for the results.
 ETEXI
 
     {
@@ -1433,6 +1550,9 @@ show profiling information
 show information about active capturing
 @item info snapshots
 show list of VM snapshots
+@item info savevm
+show the status of the last live snapshot (@code{savevm -l}) and, once
+it has completed, how long the VM was stopped for
 @item info status
 show the current VM status (running|paused)
 @item info pcmcia
@@ -1455,6 +1575,8 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info dirty_rate
+show the dirty page rate measurement
 @item info balloon
 show balloon information
 @item info qtree
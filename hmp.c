@@ -188,6 +188,44 @@ void hmp_info_migrate(Monitor *mon)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        if (info->xbzrle_cache->has_threads) {
+            XBZRLEThreadStatsList *thread;
+
+            for (thread = info->xbzrle_cache->threads; thread;
+                 thread = thread->next) {
+                monitor_printf(mon, "xbzrle thread %" PRId64 ": "
+                               "%" PRIu64 " kbytes, %" PRIu64 " pages, "
+                               "%" PRIu64 " cache miss, %" PRIu64
+                               " overflow\n",
+                               thread->value->id, thread->value->bytes >> 10,
+                               thread->value->pages,
+                               thread->value->cache_miss,
+                               thread->value->overflow);
+            }
+        }
+    }
+
+    if (info->has_convergence) {
+        monitor_printf(mon, "bandwidth: %" PRIu64 " kbytes/s\n",
+                       info->convergence->bandwidth >> 10);
+        monitor_printf(mon, "dirty rate: %" PRIu64 " kbytes/s\n",
+                       info->convergence->dirty_bytes_rate >> 10);
+        monitor_printf(mon, "compression ratio: %.2f\n",
+                       info->convergence->compression_ratio);
+        monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
+                       info->convergence->expected_downtime);
+        if (info->convergence->has_expected_time) {
+            monitor_printf(mon, "expected time to converge: %" PRIu64
+                           " milliseconds\n",
+                           info->convergence->expected_time);
+        } else {
+            monitor_printf(mon, "not converging\n");
+        }
+    }
+
+    if (info->has_cpu_throttle_percentage) {
+        monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                       info->cpu_throttle_percentage);
     }
 
     qapi_free_MigrationInfo(info);
@@ -215,8 +253,42 @@ void hmp_info_migrate_capabilities(Monitor *mon)
 
 void hmp_info_migrate_cache_size(Monitor *mon)
 {
+    MigrationCacheConfig *info = qmp_query_migrate_cache_config(NULL);
+
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
                    qmp_query_migrate_cache_size(NULL) >> 10);
+    monitor_printf(mon, "xbzrle cache associativity: %" PRId64 "\n",
+                   info->associativity);
+    monitor_printf(mon, "xbzrle cache admit on second dirty: %s\n",
+                   info->admit_on_second_dirty ? "on" : "off");
+
+    qapi_free_MigrationCacheConfig(info);
+}
+
+void hmp_info_dirty_rate(Monitor *mon)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+    DirtyRateWorkingSetList *ws;
+
+    monitor_printf(mon, "status: %s\n", DirtyRateStatus_lookup[info->status]);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " MB/s over %" PRId64
+                       " s\n", info->dirty_rate, info->calc_time);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " MB/s\n", block->value->id,
+                       block->value->dirty_rate);
+    }
+    if (info->has_working_set) {
+        monitor_printf(mon, "working set:\n");
+    }
+    for (ws = info->working_set; ws; ws = ws->next) {
+        monitor_printf(mon, "  %" PRId64 " ms: %" PRId64 " kbytes\n",
+                       ws->value->time, ws->value->bytes >> 10);
+    }
+
+    qapi_free_DirtyRateInfo(info);
 }
 
 void hmp_info_cpus(Monitor *mon)
@@ -313,6 +385,7 @@ void hmp_info_block(Monitor *mon)
 void hmp_info_blockstats(Monitor *mon)
 {
     BlockStatsList *stats_list, *stats;
+    BlockCacheStatsList *cache;
 
     stats_list = qmp_query_blockstats(NULL);
 
@@ -339,6 +412,20 @@ void hmp_info_blockstats(Monitor *mon)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+
+        for (cache = stats->value->stats->caches; cache;
+             cache = cache->next) {
+            monitor_printf(mon, "    %s cache: size=%" PRId64
+                           " used=%" PRId64
+                           " hits=%" PRId64
+                           " misses=%" PRId64
+                           "\n",
+                           cache->value->name,
+                           cache->value->size,
+                           cache->value->used,
+                           cache->value->hits,
+                           cache->value->misses);
+        }
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -790,9 +877,99 @@ void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
+    bool has_associativity = qdict_haskey(qdict, "associativity");
+    int64_t associativity = qdict_get_try_int(qdict, "associativity", 1);
+    bool has_admit = qdict_haskey(qdict, "admit");
+    bool admit = qdict_get_try_bool(qdict, "admit", 0);
+    Error *err = NULL;
+
+    qmp_migrate_set_cache_size(value, has_associativity, associativity,
+                               has_admit, admit, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_xbzrle_threads(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_xbzrle_threads(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_ram_streams(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_ram_streams(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_compress_params(Monitor *mon, const QDict *qdict)
+{
+    int64_t level = qdict_get_int(qdict, "level");
+    bool has_threads = qdict_haskey(qdict, "threads");
+    int64_t threads = qdict_get_try_int(qdict, "threads", 0);
+    bool has_decompress_threads = qdict_haskey(qdict, "decompress_threads");
+    int64_t decompress_threads = qdict_get_try_int(qdict,
+                                                   "decompress_threads", 0);
+    Error *err = NULL;
+
+    qmp_migrate_set_compress_params(true, level, has_threads, threads,
+                                    has_decompress_threads,
+                                    decompress_threads, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_postcopy_passes(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_postcopy_passes(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_block_aio_depth(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_block_aio_depth(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "seconds");
     Error *err = NULL;
 
-    qmp_migrate_set_cache_size(value, &err);
+    qmp_calc_dirty_rate(calc_time, &err);
     if (err) {
         monitor_printf(mon, "%s\n", error_get_pretty(err));
         error_free(err);
@@ -0,0 +1,53 @@
+/*
+ * Thread-safe guest to host memory mapping
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HOSTMEM_H
+#define HOSTMEM_H
+
+#include "memory.h"
+#include "qemu-thread.h"
+
+typedef struct {
+    void *host_addr;
+    target_phys_addr_t guest_addr;
+    uint64_t size;
+    bool readonly;
+} HostMemRegion;
+
+typedef struct {
+    /* The listener is invoked with the global mutex held, while lookups
+     * come from other threads, so the region array is protected by its own
+     * lock.  It is only replaced as a whole at the end of a memory
+     * transaction.
+     */
+    QemuMutex current_regions_lock;
+    HostMemRegion *current_regions;
+    size_t num_current_regions;
+
+    /* Regions of the memory map being built by the listener */
+    HostMemRegion *new_regions;
+    size_t num_new_regions;
+
+    MemoryListener listener;
+} HostMem;
+
+void hostmem_init(HostMem *hostmem);
+void hostmem_finalize(HostMem *hostmem);
+
+/**
+ * Map a guest physical address to a pointer
+ *
+ * Returns NULL unless [phys, phys + len) lies in a single RAM region, and
+ * that region is writable if @is_write.  Note that the returned pointer is
+ * not tracked by dirty logging, so anything written through it is missed
+ * by migration.
+ */
+void *hostmem_lookup(HostMem *hostmem, target_phys_addr_t phys,
+                     target_phys_addr_t len, bool is_write);
+
+#endif /* HOSTMEM_H */
@@ -0,0 +1,128 @@
+/*
+ * Linux AIO request queue
+ *
+ * Unlike linux-aio.c this does not go through the block layer and needs
+ * no main loop: the caller owns the iocbs, queues them with ioq_rdwr(),
+ * submits them with ioq_submit() and polls ioq_get_notifier() itself.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "ioq.h"
+
+#define MAX_EVENTS 128
+
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs)
+{
+    int rc;
+
+    ioq->fd = fd;
+    ioq->max_reqs = max_reqs;
+
+    memset(&ioq->io_ctx, 0, sizeof(ioq->io_ctx));
+    rc = io_setup(max_reqs, &ioq->io_ctx);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = event_notifier_init(&ioq->io_notifier, 0);
+    if (rc != 0) {
+        io_destroy(ioq->io_ctx);
+        return rc;
+    }
+
+    ioq->queue = g_malloc0(sizeof(ioq->queue[0]) * max_reqs);
+    ioq->queue_idx = 0;
+    return 0;
+}
+
+void ioq_cleanup(IOQueue *ioq)
+{
+    g_free(ioq->queue);
+
+    event_notifier_cleanup(&ioq->io_notifier);
+    io_destroy(ioq->io_ctx);
+}
+
+EventNotifier *ioq_get_notifier(IOQueue *ioq)
+{
+    return &ioq->io_notifier;
+}
+
+/* Prepares a read or write and queues it for the next ioq_submit() */
+void ioq_rdwr(IOQueue *ioq, struct iocb *iocb, bool read,
+              struct iovec *iov, unsigned int count, long long offset)
+{
+    assert(ioq->queue_idx < ioq->max_reqs);
+
+    if (read) {
+        io_prep_preadv(iocb, ioq->fd, iov, count, offset);
+    } else {
+        io_prep_pwritev(iocb, ioq->fd, iov, count, offset);
+    }
+    io_set_eventfd(iocb, event_notifier_get_fd(&ioq->io_notifier));
+    ioq->queue[ioq->queue_idx++] = iocb;
+}
+
+/*
+ * Submits everything queued with a single io_submit() if the kernel takes
+ * it all.  Whatever it refuses is completed through @completion with the
+ * error, so the queue is always empty afterwards.
+ */
+void ioq_submit(IOQueue *ioq, IOQueueCompletion *completion, void *opaque)
+{
+    unsigned int done = 0;
+    int retries = 0;
+    int ret = 0;
+
+    while (done < ioq->queue_idx) {
+        ret = io_submit(ioq->io_ctx, ioq->queue_idx - done,
+                        &ioq->queue[done]);
+        if (ret > 0) {
+            done += ret;
+            retries = 0;
+        } else if ((ret == -EAGAIN || ret == 0) && retries++ < 3) {
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    while (done < ioq->queue_idx) {
+        completion(ioq->queue[done++], ret < 0 ? ret : -EIO, opaque);
+    }
+    ioq->queue_idx = 0;
+}
+
+/*
+ * Calls @completion for every finished request, and returns how many there
+ * were.  Call this when the notifier fires, after clearing it.
+ */
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i, count = 0;
+
+    do {
+        do {
+            nevents = io_getevents(ioq->io_ctx, 0, MAX_EVENTS, events, &ts);
+        } while (nevents == -EINTR);
+        if (nevents < 0) {
+            break;
+        }
+
+        for (i = 0; i < nevents; i++) {
+            ssize_t ret = ((uint64_t)events[i].res2 << 32) | events[i].res;
+
+            completion(events[i].obj, ret, opaque);
+        }
+        count += nevents;
+    } while (nevents == MAX_EVENTS);
+
+    return count;
+}
@@ -0,0 +1,36 @@
+/*
+ * Linux AIO request queue
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef IOQ_H
+#define IOQ_H
+
+#include <libaio.h>
+#include "event_notifier.h"
+
+typedef struct {
+    int fd;                         /* file descriptor */
+    unsigned int max_reqs;          /* max length of queue */
+    io_context_t io_ctx;            /* Linux AIO context */
+    EventNotifier io_notifier;      /* Linux AIO eventfd */
+
+    struct iocb **queue;            /* iocbs waiting for io_submit() */
+    unsigned int queue_idx;         /* number of iocbs waiting */
+} IOQueue;
+
+typedef void IOQueueCompletion(struct iocb *iocb, ssize_t ret, void *opaque);
+
+int ioq_init(IOQueue *ioq, int fd, unsigned int max_reqs);
+void ioq_cleanup(IOQueue *ioq);
+EventNotifier *ioq_get_notifier(IOQueue *ioq);
+void ioq_rdwr(IOQueue *ioq, struct iocb *iocb, bool read,
+              struct iovec *iov, unsigned int count, long long offset);
+void ioq_submit(IOQueue *ioq, IOQueueCompletion *completion, void *opaque);
+int ioq_run_completion(IOQueue *ioq, IOQueueCompletion *completion,
+                       void *opaque);
+
+#endif /* IOQ_H */
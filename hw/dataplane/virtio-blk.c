@@ -0,0 +1,564 @@
+/*
+ * Dedicated thread for virtio-blk I/O processing
+ *
+ * With x-data-plane=on, a virtio-blk device is served by a thread of its
+ * own once the guest has kicked it for the first time.  The thread polls
+ * the virtqueue's ioeventfd, takes the requests straight from the vring
+ * in guest memory, submits them to the image file with Linux AIO and
+ * signals completions through the guest notifier, which is an irqfd when
+ * the irqchip is in the kernel.  None of this takes the global mutex, and
+ * none of it goes through the block layer: only raw images opened with
+ * cache=none,aio=native are supported, and I/O errors are always reported
+ * to the guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <sys/epoll.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu-error.h"
+#include "error.h"
+#include "qerror.h"
+#include "migration.h"
+#include "kvm.h"
+#include "iov.h"
+#include "block.h"
+#include "trace.h"
+#include "hw/virtio-blk.h"
+#include "hw/dataplane/hostmem.h"
+#include "hw/dataplane/vring.h"
+#include "hw/dataplane/ioq.h"
+#include "hw/dataplane/virtio-blk.h"
+
+enum {
+    SEG_MAX = 126,                  /* maximum number of I/O segments */
+    VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
+};
+
+/* What woke up the thread */
+enum {
+    EVENT_NOTIFY,                   /* the guest kicked the virtqueue */
+    EVENT_IO,                       /* Linux AIO completions */
+    EVENT_STOP,                     /* virtio_blk_data_plane_stop() */
+};
+
+typedef struct {
+    struct iocb iocb;               /* Linux AIO control block */
+    struct iovec iov[VRING_MAX];    /* the buffers of the request */
+    struct virtio_blk_inhdr *inhdr; /* status byte, in guest memory */
+    unsigned int head;              /* vring descriptor index */
+    bool read;
+    size_t size;                    /* bytes to transfer */
+    struct iovec *data_iov;         /* the data part of iov[] */
+    unsigned int data_cnt;
+    void *bounce_buf;               /* used for misaligned guest buffers */
+    struct iovec bounce_iov;
+} VirtIOBlockRequest;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool starting;
+    bool stopping;
+    bool failed;                    /* could not start, don't try again */
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+    bool read_only;
+    uint64_t nb_sectors;            /* image size */
+    unsigned int sector_mask;       /* logical block size, in sectors - 1 */
+
+    VirtIODevice *vdev;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *host_notifier;   /* doorbell */
+    EventNotifier *guest_notifier;  /* irq */
+    bool notify_pending;            /* requests were completed */
+
+    HostMem hostmem;                /* guest memory mapper */
+    QemuThread thread;
+    int epoll_fd;
+    EventNotifier stop_notifier;
+    IOQueue ioqueue;                /* Linux AIO queue */
+    VirtIOBlockRequest *requests;   /* indexed by descriptor head */
+    struct iovec iov[VRING_MAX];    /* scratch space for vring_pop() */
+
+    Error *migration_blocker;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIOBlockDataPlane *s)
+{
+    if (!s->notify_pending) {
+        return;
+    }
+    s->notify_pending = false;
+
+    if (vring_should_notify(s->vdev, &s->vring)) {
+        event_notifier_set(s->guest_notifier);
+    }
+}
+
+/* Writes the status and hands the buffers back to the guest */
+static void complete_request(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                             unsigned char status, size_t len)
+{
+    trace_virtio_blk_data_plane_complete_request(s, req->head, status);
+
+    stb_p(&req->inhdr->status, status);
+    vring_push(&s->vring, req->head, len + sizeof(*req->inhdr));
+    s->notify_pending = true;
+}
+
+static void complete_rdwr(struct iocb *iocb, ssize_t ret, void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
+    unsigned char status = VIRTIO_BLK_S_OK;
+    size_t len = 0;
+
+    if (ret != req->size) {
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (req->read) {
+        if (req->bounce_buf) {
+            iov_from_buf(req->data_iov, req->data_cnt, 0,
+                         req->bounce_buf, req->size);
+        }
+        len = req->size;
+    }
+
+    if (req->bounce_buf) {
+        qemu_vfree(req->bounce_buf);
+        req->bounce_buf = NULL;
+    }
+    complete_request(s, req, status, len);
+}
+
+/* O_DIRECT needs sector-aligned buffers */
+static bool iov_is_aligned(struct iovec *iov, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) &
+            (BDRV_SECTOR_SIZE - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, VirtIOBlockRequest *req,
+                        bool read, uint64_t sector,
+                        struct iovec *iov, unsigned int count)
+{
+    size_t size = iov_size(iov, count);
+
+    if ((!read && s->read_only) ||
+        (sector & s->sector_mask) ||
+        (size & ((s->sector_mask + 1) * BDRV_SECTOR_SIZE - 1)) ||
+        sector > s->nb_sectors ||
+        size / BDRV_SECTOR_SIZE > s->nb_sectors - sector) {
+        complete_request(s, req, VIRTIO_BLK_S_IOERR, 0);
+        return;
+    }
+
+    req->read = read;
+    req->size = size;
+    req->data_iov = iov;
+    req->data_cnt = count;
+    req->bounce_buf = NULL;
+
+    if (!iov_is_aligned(iov, count)) {
+        req->bounce_buf = qemu_memalign(BDRV_SECTOR_SIZE, size);
+        if (!read) {
+            iov_to_buf(iov, count, 0, req->bounce_buf, size);
+        }
+        req->bounce_iov.iov_base = req->bounce_buf;
+        req->bounce_iov.iov_len = size;
+        iov = &req->bounce_iov;
+        count = 1;
+    }
+
+    ioq_rdwr(&s->ioqueue, &req->iocb, read, iov, count,
+             sector * BDRV_SECTOR_SIZE);
+}
+
+/*
+ * Handles the request at @head, whose buffers are in s->iov.  Returns
+ * -EFAULT if the guest got the layout of the request wrong.
+ */
+static int process_request(VirtIOBlockDataPlane *s, unsigned int head,
+                           unsigned int out_num, unsigned int in_num)
+{
+    VirtIOBlockRequest *req = &s->requests[head];
+    struct iovec *iov = req->iov;
+    struct virtio_blk_outhdr *outhdr;
+    uint32_t type;
+    uint64_t sector;
+
+    trace_virtio_blk_data_plane_process_request(s, out_num, in_num, head);
+
+    memcpy(iov, s->iov, (out_num + in_num) * sizeof(iov[0]));
+    req->head = head;
+
+    if (out_num < 1 || in_num < 1 ||
+        iov[0].iov_len < sizeof(*outhdr) ||
+        iov[out_num + in_num - 1].iov_len < sizeof(*req->inhdr)) {
+        error_report("virtio-blk request headers missing");
+        vring_push(&s->vring, head, 0);
+        return -EFAULT;
+    }
+
+    outhdr = iov[0].iov_base;
+    req->inhdr = iov[out_num + in_num - 1].iov_base;
+    type = ldl_p(&outhdr->type);
+    sector = ldq_p(&outhdr->sector);
+
+    if (type & VIRTIO_BLK_T_FLUSH) {
+        /* writes are only acknowledged once they are on the image, so
+         * only the host's cache is left to flush */
+        complete_request(s, req, qemu_fdatasync(s->fd) == 0 ?
+                         VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR, 0);
+    } else if (type & VIRTIO_BLK_T_SCSI_CMD) {
+        complete_request(s, req, VIRTIO_BLK_S_UNSUPP, 0);
+    } else if (type & VIRTIO_BLK_T_GET_ID) {
+        const char *serial = s->blk->serial ? s->blk->serial : "";
+        size_t len;
+
+        if (in_num < 2) {
+            complete_request(s, req, VIRTIO_BLK_S_IOERR, 0);
+            return 0;
+        }
+        /*
+         * NB: per existing s/n string convention the string is
+         * terminated by '\0' only when shorter than buffer.
+         */
+        len = MIN(iov[out_num].iov_len, VIRTIO_BLK_ID_BYTES);
+        strncpy(iov[out_num].iov_base, serial, len);
+        complete_request(s, req, VIRTIO_BLK_S_OK, len);
+    } else if (type & VIRTIO_BLK_T_OUT) {
+        do_rdwr_cmd(s, req, false, sector, &iov[1], out_num - 1);
+    } else {
+        do_rdwr_cmd(s, req, true, sector, &iov[out_num], in_num - 1);
+    }
+    return 0;
+}
+
+/* Takes every request off the vring, and submits them together */
+static void handle_notify(VirtIOBlockDataPlane *s)
+{
+    unsigned int out_num, in_num;
+    int head;
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &s->vring);
+
+        for (;;) {
+            head = vring_pop(s->vdev, &s->vring, s->iov, ARRAY_SIZE(s->iov),
+                             &out_num, &in_num);
+            if (head < 0) {
+                break;
+            }
+            if (process_request(s, head, out_num, in_num) < 0) {
+                s->vring.broken = true;
+                head = -EFAULT;
+                break;
+            }
+        }
+
+        ioq_submit(&s->ioqueue, complete_rdwr, s);
+        notify_guest(s);
+
+        if (head != -EAGAIN) {
+            /* the guest broke the ring, leave it alone from now on */
+            break;
+        }
+        if (vring_enable_notification(s->vdev, &s->vring)) {
+            break; /* no more requests */
+        }
+    }
+}
+
+static void handle_io(VirtIOBlockDataPlane *s)
+{
+    ioq_run_completion(&s->ioqueue, complete_rdwr, s);
+    notify_guest(s);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIOBlockDataPlane *s = opaque;
+    struct epoll_event events[3];
+    bool stopping = false;
+    int nevents, i;
+
+    do {
+        nevents = epoll_wait(s->epoll_fd, events, ARRAY_SIZE(events), -1);
+        if (nevents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("virtio-blk data plane: epoll_wait failed: %s",
+                         strerror(errno));
+            abort();
+        }
+
+        for (i = 0; i < nevents; i++) {
+            switch (events[i].data.u32) {
+            case EVENT_NOTIFY:
+                event_notifier_test_and_clear(s->host_notifier);
+                /* what is left in the ring is for the next start */
+                if (!stopping) {
+                    handle_notify(s);
+                }
+                break;
+            case EVENT_IO:
+                event_notifier_test_and_clear(ioq_get_notifier(&s->ioqueue));
+                handle_io(s);
+                break;
+            case EVENT_STOP:
+                event_notifier_test_and_clear(&s->stop_notifier);
+                stopping = true;
+                break;
+            }
+        }
+    } while (!stopping || s->vring.inuse > 0);
+    return NULL;
+}
+
+static int data_plane_add_event(VirtIOBlockDataPlane *s, EventNotifier *e,
+                                uint32_t event)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u32 = event,
+    };
+
+    return epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, event_notifier_get_fd(e),
+                     &ev);
+}
+
+bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
+                                  VirtIOBlockDataPlane **dataplane)
+{
+    VirtIOBlockDataPlane *s;
+    int fd;
+
+    *dataplane = NULL;
+
+    if (!blk->data_plane) {
+        return true;
+    }
+
+    if (blk->scsi) {
+        error_report("device is incompatible with x-data-plane, "
+                     "use scsi=off");
+        return false;
+    }
+
+    /* guest RAM is written behind the back of TCG */
+    if (!kvm_enabled()) {
+        error_report("x-data-plane requires KVM");
+        return false;
+    }
+
+    fd = raw_get_aio_fd(blk->conf.bs);
+    if (fd < 0) {
+        error_report("drive is incompatible with x-data-plane, "
+                     "use format=raw,cache=none,aio=native");
+        return false;
+    }
+
+    s = g_new0(VirtIOBlockDataPlane, 1);
+    s->vdev = vdev;
+    s->fd = fd;
+    s->blk = blk;
+    s->sector_mask = blk->conf.logical_block_size / BDRV_SECTOR_SIZE - 1;
+
+    if (event_notifier_init(&s->stop_notifier, 0) < 0) {
+        error_report("virtio-blk: unable to create an event notifier");
+        g_free(s);
+        return false;
+    }
+
+    /* Prevent block operations that conflict with data plane thread */
+    bdrv_set_in_use(blk->conf.bs, 1);
+
+    /* Guest RAM is written without dirty logging */
+    error_set(&s->migration_blocker, QERR_DEVICE_FEATURE_BLOCKS_MIGRATION,
+              "virtio-blk", "x-data-plane");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
+{
+    if (!s) {
+        return;
+    }
+
+    virtio_blk_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    bdrv_set_in_use(s->blk->conf.bs, 0);
+    event_notifier_cleanup(&s->stop_notifier);
+    g_free(s);
+}
+
+/*
+ * Hands the virtqueue to the thread.  Returns false if the requests have
+ * to be processed by hw/virtio-blk.c instead, because the data plane could
+ * not be started.
+ */
+bool virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+    VirtQueue *vq;
+    int64_t length;
+
+    if (s->failed) {
+        return false;
+    }
+
+    /* A kick that does not come through the ioeventfd (or that raced with
+     * the ioeventfd being assigned or released) is forwarded, or dropped
+     * while we are in the middle of starting or stopping; the thread looks
+     * at the ring when it starts anyway.
+     */
+    if (s->started || s->starting) {
+        if (s->started && !s->stopping) {
+            event_notifier_set(s->host_notifier);
+        }
+        return true;
+    }
+
+    if (!binding->set_guest_notifiers || !binding->set_host_notifier) {
+        error_report("virtio-blk: x-data-plane is not supported by the "
+                     "transport");
+        goto fail;
+    }
+
+    s->starting = true;
+    trace_virtio_blk_data_plane_start(s);
+
+    length = bdrv_getlength(s->blk->conf.bs);
+    if (length < 0) {
+        error_report("virtio-blk: unable to get the size of the image");
+        goto fail;
+    }
+    s->nb_sectors = length / BDRV_SECTOR_SIZE;
+    s->read_only = bdrv_is_read_only(s->blk->conf.bs);
+
+    vq = virtio_get_queue(s->vdev, 0);
+    hostmem_init(&s->hostmem);
+    if (!vring_setup(&s->vring, s->vdev, 0, &s->hostmem)) {
+        goto fail_vring;
+    }
+    s->requests = g_new0(VirtIOBlockRequest, s->vring.num);
+
+    if (ioq_init(&s->ioqueue, s->fd, s->vring.num) < 0) {
+        error_report("virtio-blk: unable to set up Linux AIO");
+        goto fail_ioq;
+    }
+
+    s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epoll_fd < 0) {
+        error_report("virtio-blk: epoll_create1 failed: %s", strerror(errno));
+        goto fail_epoll;
+    }
+
+    /* Set up guest notifier (irq) */
+    if (binding->set_guest_notifiers(opaque, true) != 0) {
+        error_report("virtio-blk: unable to set up the guest notifier");
+        goto fail_guest_notifiers;
+    }
+    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
+
+    /* Set up virtqueue notify */
+    if (binding->set_host_notifier(opaque, 0, true) != 0) {
+        error_report("virtio-blk: unable to set up the host notifier");
+        goto fail_host_notifier;
+    }
+    s->host_notifier = virtio_queue_get_host_notifier(vq);
+
+    /* The thread polls it, not the main loop */
+    event_notifier_set_handler(s->host_notifier, NULL);
+
+    if (data_plane_add_event(s, s->host_notifier, EVENT_NOTIFY) < 0 ||
+        data_plane_add_event(s, ioq_get_notifier(&s->ioqueue),
+                             EVENT_IO) < 0 ||
+        data_plane_add_event(s, &s->stop_notifier, EVENT_STOP) < 0) {
+        error_report("virtio-blk: epoll_ctl failed: %s", strerror(errno));
+        goto fail_epoll_ctl;
+    }
+
+    s->starting = false;
+    s->started = true;
+
+    /* Pick up what the guest queued before we took over */
+    event_notifier_set(s->host_notifier);
+
+    qemu_thread_create(&s->thread, data_plane_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    return true;
+
+fail_epoll_ctl:
+    binding->set_host_notifier(opaque, 0, false);
+fail_host_notifier:
+    binding->set_guest_notifiers(opaque, false);
+fail_guest_notifiers:
+    close(s->epoll_fd);
+fail_epoll:
+    ioq_cleanup(&s->ioqueue);
+fail_ioq:
+    g_free(s->requests);
+    s->requests = NULL;
+    vring_teardown(&s->vring, s->vdev, 0);
+fail_vring:
+    hostmem_finalize(&s->hostmem);
+fail:
+    s->starting = false;
+    s->failed = true;
+    return false;
+}
+
+/*
+ * Waits for the requests in flight, and gives the virtqueue back to
+ * hw/virtio-blk.c.  Requests that are still in the ring are picked up
+ * by the next virtio_blk_data_plane_start().
+ */
+void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
+{
+    const VirtIOBindings *binding = s->vdev->binding;
+    void *opaque = s->vdev->binding_opaque;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_blk_data_plane_stop(s);
+
+    event_notifier_set(&s->stop_notifier);
+    qemu_thread_join(&s->thread);
+
+    close(s->epoll_fd);
+    ioq_cleanup(&s->ioqueue);
+    vring_teardown(&s->vring, s->vdev, 0);
+    hostmem_finalize(&s->hostmem);
+    g_free(s->requests);
+    s->requests = NULL;
+
+    binding->set_host_notifier(opaque, 0, false);
+
+    /* Clean up guest notifier (irq) */
+    binding->set_guest_notifiers(opaque, false);
+
+    s->started = false;
+    s->stopping = false;
+}
@@ -0,0 +1,350 @@
+/*
+ * Virtqueue access outside the global mutex
+ *
+ * The rings are mapped once when the data plane starts, and the buffers
+ * of every request are mapped with hostmem_lookup(), so none of this goes
+ * through cpu_physical_memory_map().  Unlike hw/virtio.c, a misbehaving
+ * guest only breaks the ring instead of terminating QEMU.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-barrier.h"
+#include "qemu-error.h"
+#include "trace.h"
+#include "vring.h"
+
+static inline uint16_t *vring_used_event(Vring *vring)
+{
+    return &vring->avail->ring[vring->num];
+}
+
+static inline uint16_t *vring_avail_event(Vring *vring)
+{
+    return (uint16_t *)&vring->used->ring[vring->num];
+}
+
+/* Map the guest's vring to host memory */
+bool vring_setup(Vring *vring, VirtIODevice *vdev, int n, HostMem *hostmem)
+{
+    unsigned int num = virtio_queue_get_num(vdev, n);
+
+    vring->hostmem = hostmem;
+    vring->num = num;
+    vring->desc = hostmem_lookup(hostmem,
+                                 virtio_queue_get_desc_addr(vdev, n),
+                                 num * sizeof(VringDesc), false);
+    vring->avail = hostmem_lookup(hostmem,
+                                  virtio_queue_get_avail_addr(vdev, n),
+                                  offsetof(VringAvail, ring) +
+                                  (num + 1) * sizeof(uint16_t), false);
+    vring->used = hostmem_lookup(hostmem,
+                                 virtio_queue_get_used_addr(vdev, n),
+                                 offsetof(VringUsed, ring) +
+                                 num * sizeof(VringUsedElem) +
+                                 sizeof(uint16_t), true);
+    if (!vring->desc || !vring->avail || !vring->used) {
+        error_report("virtio-blk: unable to map vring in guest RAM");
+        return false;
+    }
+
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = lduw_p(&vring->used->idx);
+    vring->signalled_used = 0;
+    vring->signalled_used_valid = false;
+    vring->inuse = 0;
+    vring->broken = false;
+
+    trace_vring_setup(virtio_queue_get_ring_addr(vdev, n),
+                      vring->desc, vring->avail, vring->used);
+    return true;
+}
+
+/* Hand the virtqueue back to hw/virtio.c; no request may be in flight */
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
+{
+    assert(vring->inuse == 0);
+
+    /* in case kicks were disabled when we stopped */
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) & ~VRING_USED_F_NO_NOTIFY);
+    }
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
+    virtio_queue_invalidate_signalled_used(vdev, n);
+}
+
+/* Disable guest->host notifies */
+void vring_disable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) | VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/* Enable guest->host notifies
+ *
+ * Return true if the vring is empty, false if there are more requests.
+ */
+bool vring_enable_notification(VirtIODevice *vdev, Vring *vring)
+{
+    if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        stw_p(vring_avail_event(vring), vring->last_avail_idx);
+    } else {
+        stw_p(&vring->used->flags,
+              lduw_p(&vring->used->flags) & ~VRING_USED_F_NO_NOTIFY);
+    }
+    smp_mb(); /* ensure update is seen before reading avail_idx */
+    return lduw_p(&vring->avail->idx) == vring->last_avail_idx;
+}
+
+/* Same as vring_notify() in hw/virtio.c */
+bool vring_should_notify(VirtIODevice *vdev, Vring *vring)
+{
+    uint16_t old, new;
+    bool v;
+
+    /* Flush out used index updates. This is paired
+     * with the barrier that the Guest executes when enabling
+     * interrupts. */
+    smp_mb();
+
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        vring->inuse == 0 &&
+        lduw_p(&vring->avail->idx) == vring->last_avail_idx) {
+        return true;
+    }
+
+    if (!(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return !(lduw_p(&vring->avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    old = vring->signalled_used;
+    v = vring->signalled_used_valid;
+    new = vring->signalled_used = vring->last_used_idx;
+    vring->signalled_used_valid = true;
+
+    if (unlikely(!v)) {
+        return true;
+    }
+
+    /* Same as vring_need_event() in hw/virtio.c */
+    return (uint16_t)(new - lduw_p(vring_used_event(vring)) - 1) <
+           (uint16_t)(new - old);
+}
+
+/* Map the buffer of a descriptor and append it to @iov */
+static int get_desc(Vring *vring, struct iovec iov[], unsigned int iov_max,
+                    unsigned int *out_num, unsigned int *in_num,
+                    VringDesc *desc)
+{
+    uint64_t addr = ldq_p(&desc->addr);
+    uint32_t len = ldl_p(&desc->len);
+    uint16_t flags = lduw_p(&desc->flags);
+    unsigned int num = *out_num + *in_num;
+    void *buf;
+
+    if (num >= iov_max) {
+        error_report("virtio-blk: too many descriptors in a request");
+        return -ENOBUFS;
+    }
+
+    if (flags & VRING_DESC_F_WRITE) {
+        *in_num += 1;
+    } else {
+        /* If it's an output descriptor, it must come before any inputs */
+        if (*in_num > 0) {
+            error_report("virtio-blk: descriptor has out after in");
+            return -EFAULT;
+        }
+        *out_num += 1;
+    }
+
+    buf = hostmem_lookup(vring->hostmem, addr, len,
+                         flags & VRING_DESC_F_WRITE);
+    if (!buf) {
+        error_report("virtio-blk: failed to map descriptor addr %#" PRIx64
+                     " len %u", addr, len);
+        return -EFAULT;
+    }
+    iov[num].iov_base = buf;
+    iov[num].iov_len = len;
+    return 0;
+}
+
+/* Walk the chain of an indirect descriptor table */
+static int get_indirect(Vring *vring, struct iovec iov[],
+                        unsigned int iov_max, unsigned int *out_num,
+                        unsigned int *in_num, VringDesc *indirect)
+{
+    uint64_t addr = ldq_p(&indirect->addr);
+    uint32_t len = ldl_p(&indirect->len);
+    VringDesc *table, *desc;
+    unsigned int count, i = 0, found = 0;
+    int ret;
+
+    /* Sanity check */
+    if (unlikely(len == 0 || len % sizeof(VringDesc))) {
+        error_report("virtio-blk: invalid length in indirect descriptor: "
+                     "len %u not multiple of %zu", len, sizeof(VringDesc));
+        return -EFAULT;
+    }
+    count = len / sizeof(VringDesc);
+
+    table = hostmem_lookup(vring->hostmem, addr, len, false);
+    if (!table) {
+        error_report("virtio-blk: failed to map indirect descriptor table "
+                     "addr %#" PRIx64 " len %u", addr, len);
+        return -EFAULT;
+    }
+
+    do {
+        desc = &table[i];
+
+        if (unlikely(++found > count)) {
+            error_report("virtio-blk: loop detected: last one at %u "
+                         "indirect size %u", i, count);
+            return -EFAULT;
+        }
+
+        if (unlikely(lduw_p(&desc->flags) & VRING_DESC_F_INDIRECT)) {
+            error_report("virtio-blk: nested indirect descriptor");
+            return -EFAULT;
+        }
+
+        ret = get_desc(vring, iov, iov_max, out_num, in_num, desc);
+        if (ret < 0) {
+            return ret;
+        }
+        i = lduw_p(&desc->next);
+    } while ((lduw_p(&desc->flags) & VRING_DESC_F_NEXT) && i < count);
+
+    if (lduw_p(&desc->flags) & VRING_DESC_F_NEXT) {
+        error_report("virtio-blk: indirect descriptor has next %u beyond "
+                     "the table size %u", i, count);
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/* This looks in the virtqueue and for the first available buffer, and
+ * converts it to an iovec for convenient access.  Since descriptors consist
+ * of some number of output then some number of input descriptors, it's
+ * actually two iovecs, but we pack them into one and note how many of each
+ * there were.
+ *
+ * This function returns the descriptor number found, or -EAGAIN if the
+ * ring is empty.  Any other negative value means the guest broke the ring;
+ * vring->broken is set and the data plane gives up on the queue.
+ */
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], unsigned int iov_max,
+              unsigned int *out_num, unsigned int *in_num)
+{
+    VringDesc *desc;
+    unsigned int i, head, found = 0, num = vring->num;
+    uint16_t avail_idx, last_avail_idx;
+    int ret;
+
+    /* If there was a fatal error then refuse operation */
+    if (vring->broken) {
+        return -EFAULT;
+    }
+
+    /* Check it isn't doing very strange things with descriptor numbers. */
+    last_avail_idx = vring->last_avail_idx;
+    avail_idx = lduw_p(&vring->avail->idx);
+    smp_rmb(); /* ensure ring contents are read after avail idx */
+
+    if (unlikely((uint16_t)(avail_idx - last_avail_idx) > num)) {
+        error_report("virtio-blk: guest moved avail index from %u to %u",
+                     last_avail_idx, avail_idx);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* If there's nothing new since last we looked. */
+    if (avail_idx == last_avail_idx) {
+        return -EAGAIN;
+    }
+
+    /* Grab the next descriptor number they're advertising, and increment
+     * the index we've seen. */
+    head = lduw_p(&vring->avail->ring[last_avail_idx % num]);
+
+    /* If their number is silly, that's an error. */
+    if (unlikely(head >= num)) {
+        error_report("virtio-blk: guest says index %u > %u is available",
+                     head, num);
+        ret = -EFAULT;
+        goto out;
+    }
+
+    if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+        stw_p(vring_avail_event(vring), avail_idx);
+    }
+
+    /* When we start there are none of either input nor output. */
+    *out_num = *in_num = 0;
+
+    i = head;
+    do {
+        if (unlikely(i >= num)) {
+            error_report("virtio-blk: desc index %u > %u, head = %u",
+                         i, num, head);
+            ret = -EFAULT;
+            goto out;
+        }
+        if (unlikely(++found > num)) {
+            error_report("virtio-blk: loop detected: last one at %u "
+                         "vq size %u head %u", i, num, head);
+            ret = -EFAULT;
+            goto out;
+        }
+        desc = &vring->desc[i];
+        if (lduw_p(&desc->flags) & VRING_DESC_F_INDIRECT) {
+            ret = get_indirect(vring, iov, iov_max, out_num, in_num, desc);
+        } else {
+            ret = get_desc(vring, iov, iov_max, out_num, in_num, desc);
+        }
+        if (ret < 0) {
+            goto out;
+        }
+
+        i = lduw_p(&desc->next);
+    } while (lduw_p(&desc->flags) & VRING_DESC_F_NEXT);
+
+    /* On success, increment avail index. */
+    vring->last_avail_idx++;
+    vring->inuse++;
+    return head;
+
+out:
+    assert(ret < 0);
+    if (ret == -EFAULT || ret == -ENOBUFS) {
+        vring->broken = true;
+    }
+    return ret;
+}
+
+/* After we've used one of their buffers, we tell them about it. */
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    VringUsedElem *used;
+    uint16_t new;
+
+    /* The virtqueue contains a ring of used buffers.  Get a pointer to the
+     * next entry in that used ring. */
+    used = &vring->used->ring[vring->last_used_idx % vring->num];
+    stl_p(&used->id, head);
+    stl_p(&used->len, len);
+
+    /* Make sure buffer is written before we update index. */
+    smp_wmb();
+
+    new = vring->last_used_idx = vring->last_used_idx + 1;
+    stw_p(&vring->used->idx, new);
+    vring->inuse--;
+}
@@ -0,0 +1,67 @@
+/*
+ * Virtqueue access outside the global mutex
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VRING_H
+#define VRING_H
+
+#include "qemu-common.h"
+#include "hostmem.h"
+#include "hw/virtio.h"
+
+/* The ring layout of the virtio specification */
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} QEMU_PACKED VringDesc;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[0];
+    /* followed by used_event */
+} QEMU_PACKED VringAvail;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} QEMU_PACKED VringUsedElem;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    VringUsedElem ring[0];
+    /* followed by avail_event */
+} QEMU_PACKED VringUsed;
+
+typedef struct {
+    HostMem *hostmem;               /* guest memory mapper */
+    unsigned int num;               /* ring size */
+    VringDesc *desc;                /* the rings, in guest memory */
+    VringAvail *avail;
+    VringUsed *used;
+    uint16_t last_avail_idx;        /* last processed avail ring index */
+    uint16_t last_used_idx;         /* last processed used ring index */
+    uint16_t signalled_used;        /* EVENT_IDX state */
+    bool signalled_used_valid;
+    unsigned int inuse;             /* requests popped but not pushed */
+    bool broken;                    /* was there a fatal error? */
+} Vring;
+
+bool vring_setup(Vring *vring, VirtIODevice *vdev, int n, HostMem *hostmem);
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
+void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
+bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
+bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
+int vring_pop(VirtIODevice *vdev, Vring *vring,
+              struct iovec iov[], unsigned int iov_max,
+              unsigned int *out_num, unsigned int *in_num);
+void vring_push(Vring *vring, unsigned int head, int len);
+
+#endif /* VRING_H */
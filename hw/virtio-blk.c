@@ -21,6 +21,9 @@
 #ifdef __linux__
 # include <scsi/sg.h>
 #endif
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+#include "hw/dataplane/virtio-blk.h"
+#endif
 
 typedef struct VirtIOBlock
 {
@@ -33,6 +36,9 @@ typedef struct VirtIOBlock
     VirtIOBlkConf *blk;
     unsigned short sector_mask;
     DeviceState *qdev;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlockDataPlane *dataplane;
+#endif
 } VirtIOBlock;
 
 static VirtIOBlock *to_virtio_blk(VirtIODevice *vdev)
@@ -415,11 +421,23 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
         .num_writes = 0,
     };
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* Some guests kick before setting VIRTIO_CONFIG_S_DRIVER_OK so start
+     * dataplane here instead of waiting for .set_status().
+     */
+    if (s->dataplane && virtio_blk_data_plane_start(s->dataplane)) {
+        return;
+    }
+#endif
+
+    /* submit everything the guest queued in one go */
+    bdrv_io_plug(s->bs);
     while ((req = virtio_blk_get_request(s))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -441,12 +459,14 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
         virtio_blk_handle_request(req, &mrb);
         req = req->next;
     }
 
     virtio_submit_multiwrite(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -454,6 +474,17 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 {
     VirtIOBlock *s = opaque;
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    /* the thread writes to guest memory, so it only runs with the VM */
+    if (s->dataplane) {
+        if (!running) {
+            virtio_blk_data_plane_stop(s->dataplane);
+        } else if (s->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK) {
+            virtio_blk_data_plane_start(s->dataplane);
+        }
+    }
+#endif
+
     if (!running)
         return;
 
@@ -465,6 +496,14 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
 
 static void virtio_blk_reset(VirtIODevice *vdev)
 {
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+#endif
+
     /*
      * This should cancel pending requests, but can't do nicely until there
      * are per-device request lists.
@@ -531,6 +570,17 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     return features;
 }
 
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
+{
+    VirtIOBlock *s = to_virtio_blk(vdev);
+
+    if (s->dataplane && !(status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_blk_data_plane_stop(s->dataplane);
+    }
+}
+#endif
+
 static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
     VirtIOBlock *s = opaque;
@@ -611,6 +661,9 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->vdev.get_config = virtio_blk_update_config;
     s->vdev.get_features = virtio_blk_get_features;
     s->vdev.reset = virtio_blk_reset;
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    s->vdev.set_status = virtio_blk_set_status;
+#endif
     s->bs = blk->conf.bs;
     s->conf = &blk->conf;
     s->blk = blk;
@@ -618,6 +671,12 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     s->vq = virtio_add_queue(&s->vdev, 128, virtio_blk_handle_output);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    if (!virtio_blk_data_plane_create(&s->vdev, blk, &s->dataplane)) {
+        virtio_cleanup(&s->vdev);
+        return NULL;
+    }
+#endif
 
     qemu_add_vm_change_state_handler(virtio_blk_dma_restart_cb, s);
     s->qdev = dev;
@@ -635,6 +694,10 @@ VirtIODevice *virtio_blk_init(DeviceState *dev, VirtIOBlkConf *blk)
 void virtio_blk_exit(VirtIODevice *vdev)
 {
     VirtIOBlock *s = to_virtio_blk(vdev);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    virtio_blk_data_plane_destroy(s->dataplane);
+    s->dataplane = NULL;
+#endif
     unregister_savevm(s->qdev, "virtio-blk", s);
     blockdev_mark_auto_del(s->bs);
     virtio_cleanup(vdev);
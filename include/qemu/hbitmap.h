@@ -0,0 +1,190 @@
+/*
+ * Hierarchical Bitmap Data Type
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HBITMAP_H
+#define HBITMAP_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "bitops.h"
+
+/*
+ * A bitmap of up to 2^HBITMAP_LOG_MAX_SIZE bits, where every word of a
+ * level has a bit set in the level above if it is not zero.  Finding the
+ * next set bit goes down from the top level, so it costs O(log n) however
+ * big the clean areas in between are.  Ranges of bits are set and cleared
+ * a word at a time.
+ */
+typedef struct HBitmap HBitmap;
+typedef struct HBitmapIter HBitmapIter;
+
+#define BITS_PER_LEVEL         (BITS_PER_LONG == 32 ? 5 : 6)
+
+/* For 32-bit, the largest that fits in a 4 GiB address space; for 64-bit,
+ * the number of sectors in 1 PiB.
+ */
+#define HBITMAP_LOG_MAX_SIZE   (BITS_PER_LONG == 32 ? 34 : 41)
+
+/* We need to place a sentinel in level 0 to speed up iteration.  Thus,
+ * we do this instead of HBITMAP_LOG_MAX_SIZE / BITS_PER_LEVEL.  The
+ * difference is that it allocates an extra level when HBITMAP_LOG_MAX_SIZE
+ * is an exact multiple of BITS_PER_LEVEL.
+ */
+#define HBITMAP_LEVELS         ((HBITMAP_LOG_MAX_SIZE / BITS_PER_LEVEL) + 1)
+
+struct HBitmapIter {
+    const HBitmap *hb;
+
+    /* Copied from hb for access in the inline functions (hb is opaque).  */
+    int granularity;
+
+    /* Entry offset into the last-level array of longs.  */
+    size_t pos;
+
+    /* The currently-active path in the tree.  Each item of cur[i] stores
+     * the bits (i.e. the subtrees) yet to be processed under that node.
+     */
+    unsigned long cur[HBITMAP_LEVELS];
+};
+
+/**
+ * hbitmap_alloc: Allocate a new, empty bitmap
+ *
+ * Returns the bitmap, to be freed with hbitmap_free()
+ *
+ * @size: number of items that the bitmap covers
+ * @granularity: 2^@granularity consecutive items share a bit, so that
+ * setting any of them sets them all
+ */
+HBitmap *hbitmap_alloc(uint64_t size, int granularity);
+
+/**
+ * hbitmap_empty: Returns whether no item is set in @hb
+ *
+ * @hb: bitmap
+ */
+bool hbitmap_empty(const HBitmap *hb);
+
+/**
+ * hbitmap_granularity: Returns the granularity @hb was allocated with
+ *
+ * @hb: bitmap
+ */
+int hbitmap_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_count: Returns the number of items set in @hb, which is a
+ * multiple of 2^granularity
+ *
+ * @hb: bitmap
+ */
+uint64_t hbitmap_count(const HBitmap *hb);
+
+/**
+ * hbitmap_set: Set a range of items, and the whole granules they are in
+ *
+ * @hb: bitmap
+ * @start: first item
+ * @count: number of items
+ */
+void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_reset: Clear a range of items, and the whole granules they
+ * are in
+ *
+ * @hb: bitmap
+ * @start: first item
+ * @count: number of items
+ */
+void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_get: Returns whether @item is set
+ *
+ * @hb: bitmap
+ * @item: item to test
+ */
+bool hbitmap_get(const HBitmap *hb, uint64_t item);
+
+/**
+ * hbitmap_free: Free a bitmap from hbitmap_alloc()
+ *
+ * @hb: bitmap
+ */
+void hbitmap_free(HBitmap *hb);
+
+/**
+ * hbitmap_iter_init: Start iterating over the items set in @hb
+ *
+ * The iterator only sees the items that were set before it was
+ * initialized; it must not be used after @hb has been freed.
+ *
+ * @hbi: iterator
+ * @hb: bitmap
+ * @first: first item to look at; at or past the end of @hb, the iterator
+ * is empty and hbitmap_iter_next() returns -1
+ */
+void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first);
+
+/* hbitmap_iter_skip_words: Internal function for hbitmap_iter_next() */
+unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi);
+
+/**
+ * hbitmap_iter_next: Returns the first item of the next set granule, or
+ * -1 when there is none left
+ *
+ * @hbi: iterator
+ */
+static inline int64_t hbitmap_iter_next(HBitmapIter *hbi)
+{
+    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
+    int64_t item;
+
+    if (cur == 0) {
+        cur = hbitmap_iter_skip_words(hbi);
+        if (cur == 0) {
+            return -1;
+        }
+    }
+
+    /* The next call will resume work from the next bit.  */
+    hbi->cur[HBITMAP_LEVELS - 1] = cur & (cur - 1);
+    item = ((uint64_t)hbi->pos << BITS_PER_LEVEL) + bitops_ffsl(cur);
+
+    return item << hbi->granularity;
+}
+
+/**
+ * hbitmap_iter_next_word: Returns the index of the next non-zero word of
+ * the last level, and the word in @p_cur, or -1 when there is none left
+ *
+ * @hbi: iterator
+ * @p_cur: the word
+ */
+static inline size_t hbitmap_iter_next_word(HBitmapIter *hbi,
+                                            unsigned long *p_cur)
+{
+    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
+
+    if (cur == 0) {
+        cur = hbitmap_iter_skip_words(hbi);
+        if (cur == 0) {
+            *p_cur = 0;
+            return -1;
+        }
+    }
+
+    /* The next call will resume work from the next word.  */
+    hbi->cur[HBITMAP_LEVELS - 1] = 0;
+    *p_cur = cur;
+    return hbi->pos;
+}
+
+#endif
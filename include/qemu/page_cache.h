@@ -27,8 +27,13 @@ typedef struct PageCache PageCache;
  * @cache pointer to the PageCache struct
  * @num_pages: cache maximal number of cached pages
  * @page_size: cache page size
+ * @ways: number of pages per set (rounded down to a power of 2), 1 for a
+ *        direct-mapped cache
+ * @admit_on_second_dirty: only insert a page the second time it is offered,
+ *                         so that pages written once do not evict others
  */
-PageCache *cache_init(int64_t num_pages, unsigned int page_size);
+PageCache *cache_init(int64_t num_pages, unsigned int page_size,
+                      unsigned int ways, bool admit_on_second_dirty);
 
 /**
  * cache_fini: free all cache resources
@@ -47,23 +52,28 @@ void cache_fini(PageCache *cache);
 bool cache_is_cached(const PageCache *cache, uint64_t addr);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * get_cached_data: Get the data cached for an addr, and mark it as
+ * recently used
  *
  * Returns pointer to the data cached or NULL if not cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr);
 
 /**
- * cache_insert: insert the page into the cache. the previous value will be overwritten
+ * cache_insert: insert a copy of the page into the cache. the previous value
+ * will be overwritten; if the set is full its least recently used page is
+ * evicted
+ *
+ * Returns 0 on success, -1 if the page was not admitted into the cache
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
  * @pdata: pointer to the page
  */
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata);
 
 /**
  * cache_resize: resize the page cache. In case of size reduction the extra
@@ -76,4 +86,11 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_associativity: Returns the number of pages per set
+ *
+ * @cache pointer to the PageCache struct
+ */
+unsigned int cache_get_associativity(const PageCache *cache);
+
 #endif
@@ -0,0 +1,76 @@
+/*
+ * Pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_WORKER_POOL_H
+#define QEMU_WORKER_POOL_H
+
+/*
+ * Each worker has its own opaque pointer, which describes the work it is
+ * given.  A worker is either idle or busy; the thread that owns the pool
+ * only touches the opaque of an idle worker, a worker thread only the
+ * opaque of its own worker while it is busy.
+ */
+typedef struct WorkerPool WorkerPool;
+
+typedef void WorkerFunc(void *opaque);
+
+/**
+ * worker_pool_new: Start a pool of worker threads
+ *
+ * Returns the new pool, with all its workers idle
+ *
+ * @nr_workers: number of threads
+ * @func: called in worker thread i with the address of element i of
+ *        @opaques for each piece of work
+ * @opaques: array of @nr_workers elements of @opaque_size bytes, usually
+ *           the per-worker state of the caller
+ * @opaque_size: size of an element of @opaques
+ */
+WorkerPool *worker_pool_new(int nr_workers, WorkerFunc *func, void *opaques,
+                            size_t opaque_size);
+
+/**
+ * worker_pool_free: Wait for the busy workers, then stop the threads and
+ * free the pool
+ *
+ * @pool: pool to free, may be NULL
+ */
+void worker_pool_free(WorkerPool *pool);
+
+/**
+ * worker_pool_kick: Make an idle worker run once
+ *
+ * @pool: pool of the worker
+ * @worker: index of the worker
+ */
+void worker_pool_kick(WorkerPool *pool, int worker);
+
+/**
+ * worker_pool_kick_all: Make every worker run once; they must all be idle
+ *
+ * @pool: pool of the workers
+ */
+void worker_pool_kick_all(WorkerPool *pool);
+
+/**
+ * worker_pool_get_idle: Wait until a worker is idle
+ *
+ * Returns the index of the idle worker
+ *
+ * @pool: pool of the workers
+ */
+int worker_pool_get_idle(WorkerPool *pool);
+
+/**
+ * worker_pool_wait: Wait until every worker is idle
+ *
+ * @pool: pool of the workers
+ */
+void worker_pool_wait(WorkerPool *pool);
+
+#endif
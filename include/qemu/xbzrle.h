@@ -0,0 +1,79 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+/* Encoder/decoder implementations, the best supported one is the default */
+typedef enum XBZRLEAccel {
+    XBZRLE_ACCEL_NONE,
+    XBZRLE_ACCEL_SSE2,
+    XBZRLE_ACCEL_AVX2,
+    XBZRLE_ACCEL_MAX,
+} XBZRLEAccel;
+
+/**
+ * xbzrle_encode_buffer: encode the difference between two pages
+ *
+ * Returns the encoded length, 0 if the pages are equal or -1 if the
+ * encoded data would not fit in @dlen bytes
+ *
+ * @old_buf: previous content of the page
+ * @new_buf: current content of the page
+ * @slen: page size
+ * @dst: output buffer
+ * @dlen: size of the output buffer
+ */
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_decode_buffer: apply an encoded difference to a page
+ *
+ * Returns the number of bytes of @dst covered, or -1 on malformed input
+ *
+ * @src: encoded data
+ * @slen: length of the encoded data
+ * @dst: page to update
+ * @dlen: page size
+ */
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/**
+ * xbzrle_accel_supported: Checks whether an implementation can be used
+ *
+ * Returns %true if it was built in and the host CPU supports it
+ *
+ * @accel: implementation
+ */
+bool xbzrle_accel_supported(XBZRLEAccel accel);
+
+/**
+ * xbzrle_set_accel: Select the implementation used by
+ * xbzrle_encode_buffer() and xbzrle_decode_buffer().  All of them produce
+ * the same encoding; this is meant for tests and benchmarks.
+ *
+ * Returns %false if @accel is not supported
+ *
+ * @accel: implementation
+ */
+bool xbzrle_set_accel(XBZRLEAccel accel);
+
+/**
+ * xbzrle_accel_name: Returns a printable name for @accel
+ *
+ * @accel: implementation
+ */
+const char *xbzrle_accel_name(XBZRLEAccel accel);
+
+#endif
@@ -358,6 +358,15 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     unsigned int len = ((section->size / TARGET_PAGE_SIZE) + HOST_LONG_BITS - 1) / HOST_LONG_BITS;
     unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
 
+    if (hpratio == 1) {
+        /* one bit per target page: hand over whole words */
+        memory_region_set_dirty_lebitmap(section->mr,
+                                         section->offset_within_region,
+                                         bitmap,
+                                         section->size / TARGET_PAGE_SIZE);
+        return 0;
+    }
+
     /*
      * bitmap-traveling is faster than memory-traveling (for addr...)
      * especially when most of the memory is not dirty.
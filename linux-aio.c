@@ -39,6 +39,11 @@ struct qemu_laio_state {
     io_context_t ctx;
     int efd;
     int count;
+
+    /* iocbs held back while plugged, submitted by ioq_submit() */
+    int plugged;
+    int ioq_len;
+    struct iocb *ioq[MAX_EVENTS];
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -119,6 +124,8 @@ static int qemu_laio_flush_cb(void *opaque)
     return (s->count > 0) ? 1 : 0;
 }
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -128,6 +135,11 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* it may still be held back by a plug */
+    if (laiocb->ctx->ioq_len > 0) {
+        ioq_submit(laiocb->ctx);
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -155,6 +167,56 @@ static AIOPool laio_pool = {
     .cancel             = laio_cancel,
 };
 
+/*
+ * Submits the iocbs held back while plugged.  io_submit() may take only
+ * part of them, in which case the rest is tried again; what the kernel
+ * refuses altogether is completed with the error.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    int done = 0, retries = 0;
+    int ret = 0;
+
+    while (done < s->ioq_len) {
+        ret = io_submit(s->ctx, s->ioq_len - done, &s->ioq[done]);
+        if (ret > 0) {
+            done += ret;
+            retries = 0;
+        } else if ((ret == -EAGAIN || ret == 0) && retries++ < 3) {
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    while (done < s->ioq_len) {
+        struct qemu_laiocb *laiocb =
+                container_of(s->ioq[done], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+        done++;
+    }
+    s->ioq_len = 0;
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->ioq_len > 0) {
+        ioq_submit(s);
+    }
+}
+
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -189,6 +251,18 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    if (s->plugged) {
+        /*
+         * Make room before queueing: a failed submission completes the
+         * request, and the caller of this one is not ready for that yet.
+         */
+        if (s->ioq_len == MAX_EVENTS) {
+            ioq_submit(s);
+        }
+        s->ioq[s->ioq_len++] = iocbs;
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
     return &laiocb->common;
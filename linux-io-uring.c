@@ -0,0 +1,462 @@
+/*
+ * Linux io_uring support.
+ *
+ * Unlike linux-aio.c this works without O_DIRECT, and it also takes
+ * flushes and discards off the thread pool.  Requests are only queued on
+ * the submission ring by luring_submit(); they are submitted together
+ * from a bottom half, so that everything a device model issues from one
+ * notification (e.g. a virtqueue kick) goes with a single io_uring_enter().
+ * Between bdrv_io_plug() and bdrv_io_unplug() they are submitted at the
+ * unplug instead.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu-aio.h"
+#include "qemu-queue.h"
+#include "block/raw-posix-aio.h"
+
+#include <sys/eventfd.h>
+#include <linux/falloc.h>
+#include <liburing.h>
+
+/*
+ * Submission ring size (per-device).  Requests that do not fit in the
+ * submission ring wait in a queue until the kernel has taken the ones
+ * before them.  Kernels without IORING_FEAT_NODROP drop completions when
+ * the completion ring (twice as big by default) overflows, so there no
+ * more requests than it holds are handed to the kernel at a time.
+ */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    BlockDriverAIOCB common;
+    struct LuringState *s;
+    int fd;
+    int type;
+    off_t offset;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    /* the rest of the request after a short read */
+    QEMUIOVector resubmit_qiov;
+    size_t total_read;
+    /* completed by luring_cancel() while the kernel still had it */
+    bool abandoned;
+    /* the submission queue entry, until the kernel has taken it */
+    struct io_uring_sqe *sqe;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringState {
+    struct io_uring ring;
+    int efd;
+    /* requests in flight, queued ones included */
+    int count;
+    /* requests queued but not taken by the kernel yet */
+    int queued;
+    /* in the submission ring, in submission order */
+    QSIMPLEQ_HEAD(, LuringAIOCB) in_ring;
+    /* waiting for room in the submission ring */
+    QSIMPLEQ_HEAD(, LuringAIOCB) pending;
+    /* no-ops left in the submission ring by failed requests */
+    int nops;
+    /* entries handed to the ring whose completion has not been seen */
+    int cq_used;
+    int cq_limit;
+    int plugged;
+    QEMUBH *submit_bh;
+} LuringState;
+
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb);
+static void luring_process_completions(LuringState *s);
+
+/* Fills the submission ring with the requests that wait for room */
+static void luring_fill_ring(LuringState *s)
+{
+    LuringAIOCB *acb;
+    struct io_uring_sqe *sqe;
+    QEMUIOVector *qiov;
+    off_t offset;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->pending)) &&
+           s->cq_used < s->cq_limit &&
+           (sqe = io_uring_get_sqe(&s->ring))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->pending, next);
+
+        qiov = acb->qiov;
+        offset = acb->offset;
+        switch (acb->type) {
+        case QEMU_AIO_WRITE:
+            io_uring_prep_writev(sqe, acb->fd, qiov->iov, qiov->niov, offset);
+            break;
+        case QEMU_AIO_READ:
+            if (acb->total_read) {
+                qiov = &acb->resubmit_qiov;
+                offset += acb->total_read;
+            }
+            io_uring_prep_readv(sqe, acb->fd, qiov->iov, qiov->niov, offset);
+            break;
+        case QEMU_AIO_FLUSH:
+            io_uring_prep_fsync(sqe, acb->fd, IORING_FSYNC_DATASYNC);
+            break;
+        case QEMU_AIO_DISCARD:
+            io_uring_prep_fallocate(sqe, acb->fd,
+                                    FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                    offset, acb->nbytes);
+            break;
+        default:
+            abort();
+        }
+        io_uring_sqe_set_data(sqe, acb);
+        acb->sqe = sqe;
+        s->cq_used++;
+        QSIMPLEQ_INSERT_TAIL(&s->in_ring, acb, next);
+    }
+}
+
+/*
+ * Fails everything that is queued after the kernel refused a submission.
+ * The entries already in the submission ring go to the kernel with the
+ * next submission anyway, so they become no-ops that the completion
+ * handler ignores.
+ */
+static void luring_fail_queued(LuringState *s, int ret)
+{
+    QSIMPLEQ_HEAD(, LuringAIOCB) failed = QSIMPLEQ_HEAD_INITIALIZER(failed);
+    LuringAIOCB *acb;
+
+    /* all of them first, callbacks may submit new requests */
+    QSIMPLEQ_FOREACH(acb, &s->in_ring, next) {
+        io_uring_prep_nop(acb->sqe);
+        io_uring_sqe_set_data(acb->sqe, NULL);
+        acb->sqe = NULL;
+        s->nops++;
+    }
+    QSIMPLEQ_CONCAT(&failed, &s->in_ring);
+    QSIMPLEQ_CONCAT(&failed, &s->pending);
+    s->queued = 0;
+
+    while ((acb = QSIMPLEQ_FIRST(&failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&failed, next);
+        acb->ret = ret;
+        luring_process_completion(s, acb);
+    }
+}
+
+/*
+ * Submits everything that is queued.  When the kernel runs out of
+ * resources, the submission is retried once one of our requests has
+ * completed; on any other error, or with nothing in flight to wait for,
+ * the queued requests complete with the error, so nothing is left queued
+ * forever.  Requests that would overflow the completion ring stay queued
+ * until luring_process_completions() has made room for them.
+ */
+static void luring_submit_queued(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+    LuringAIOCB *acb;
+    int ret, taken;
+
+    while (s->queued) {
+        luring_fill_ring(s);
+        if (!s->nops && QSIMPLEQ_EMPTY(&s->in_ring)) {
+            /* the completion ring is full */
+            break;
+        }
+
+        ret = io_uring_submit(&s->ring);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == 0 && (s->nops || !QSIMPLEQ_EMPTY(&s->in_ring))) {
+            /* nothing taken, retrying right away would not help */
+            ret = -EAGAIN;
+        }
+        if ((ret == -EAGAIN || ret == -EBUSY) && s->count > s->queued) {
+            /* wait for a request of ours to finish and free resources */
+            ret = io_uring_wait_cqe(&s->ring, &cqe);
+            if (ret == 0) {
+                luring_process_completions(s);
+            }
+            if (ret == 0 || ret == -EINTR || ret == -EAGAIN) {
+                continue;
+            }
+        }
+        if (ret < 0) {
+            luring_fail_queued(s, ret);
+            continue;
+        }
+
+        /* the kernel takes entries in order, left-over no-ops first */
+        taken = MIN(ret, s->nops);
+        s->nops -= taken;
+        ret -= taken;
+        while (ret-- > 0 && (acb = QSIMPLEQ_FIRST(&s->in_ring))) {
+            QSIMPLEQ_REMOVE_HEAD(&s->in_ring, next);
+            acb->sqe = NULL;
+            s->queued--;
+        }
+    }
+}
+
+static void luring_submit_bh(void *opaque)
+{
+    luring_submit_queued(opaque);
+}
+
+static void luring_release(LuringAIOCB *acb)
+{
+    if (acb->type == QEMU_AIO_READ) {
+        qemu_iovec_destroy(&acb->resubmit_qiov);
+    }
+    qemu_aio_release(acb);
+}
+
+/*
+ * Completes a request (calls the callback and frees the ACB), or queues
+ * the rest of it after a short read.
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    int ret = acb->ret;
+
+    if (ret >= 0 && acb->type == QEMU_AIO_READ) {
+        acb->total_read += ret;
+        if (ret > 0 && acb->total_read < acb->nbytes) {
+            /* Buffered reads may be short without being at EOF */
+            qemu_iovec_reset(&acb->resubmit_qiov);
+            qemu_iovec_concat(&acb->resubmit_qiov, acb->qiov,
+                              acb->total_read,
+                              acb->nbytes - acb->total_read);
+            acb->ret = -EINPROGRESS;
+            s->queued++;
+            QSIMPLEQ_INSERT_TAIL(&s->pending, acb, next);
+            qemu_bh_schedule(s->submit_bh);
+            return;
+        }
+        ret = acb->total_read;
+    }
+
+    s->count--;
+    if (ret >= 0 && !(acb->type & (QEMU_AIO_READ | QEMU_AIO_WRITE))) {
+        ret = 0;
+    } else if (ret == acb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (acb->type == QEMU_AIO_READ) {
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+    acb->ret = ret;
+
+    acb->common.cb(acb->common.opaque, ret);
+    luring_release(acb);
+}
+
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *acb = io_uring_cqe_get_data(cqe);
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->cq_used--;
+        if (!acb) {
+            /* the no-op left behind by a failed request */
+            continue;
+        }
+        if (acb->abandoned) {
+            luring_release(acb);
+            continue;
+        }
+        acb->ret = cqe->res;
+        luring_process_completion(s, acb);
+    }
+
+    /* requests held back because the completion ring was full */
+    if (s->queued && !s->plugged) {
+        qemu_bh_schedule(s->submit_bh);
+    }
+}
+
+static void luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    uint64_t val;
+    ssize_t ret;
+
+    do {
+        ret = read(s->efd, &val, sizeof(val));
+    } while (ret == -1 && errno == EINTR);
+
+    luring_process_completions(s);
+}
+
+static int luring_flush_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    return (s->count > 0) ? 1 : 0;
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    LuringAIOCB *acb = (LuringAIOCB *)blockacb;
+    LuringState *s = acb->s;
+    struct io_uring_cqe *cqe;
+    int ret;
+
+    /*
+     * Requests on files cannot be cancelled once they have been picked
+     * up by the kernel, so just wait for this one to finish.
+     */
+    while (acb->ret == -EINPROGRESS) {
+        luring_submit_queued(s);
+        if (acb->ret != -EINPROGRESS) {
+            break;
+        }
+        ret = io_uring_wait_cqe(&s->ring, &cqe);
+        if (ret == -EINTR || ret == -EAGAIN) {
+            continue;
+        }
+        if (ret < 0) {
+            /*
+             * The ring is unusable, so the completion may never be seen.
+             * Complete the request with the error; the ACB stays around
+             * in case the kernel does report it later.
+             */
+            luring_fail_queued(s, ret);
+            if (acb->ret == -EINPROGRESS) {
+                acb->abandoned = true;
+                acb->ret = ret;
+                s->count--;
+                acb->common.cb(acb->common.opaque, ret);
+            }
+            break;
+        }
+        luring_process_completions(s);
+    }
+}
+
+static AIOPool luring_pool = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+    .cancel             = luring_cancel,
+};
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    LuringState *s = aio_ctx;
+    LuringAIOCB *acb;
+
+    switch (type) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_FLUSH:
+    case QEMU_AIO_DISCARD:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_pool, bs, cb, opaque);
+    acb->s = s;
+    acb->fd = fd;
+    acb->type = type;
+    acb->offset = sector_num * 512;
+    acb->nbytes = (size_t)nb_sectors * 512;
+    acb->ret = -EINPROGRESS;
+    acb->qiov = qiov;
+    acb->total_read = 0;
+    acb->abandoned = false;
+    if (type == QEMU_AIO_READ) {
+        qemu_iovec_init(&acb->resubmit_qiov, qiov->niov);
+    }
+
+    s->count++;
+    s->queued++;
+    QSIMPLEQ_INSERT_TAIL(&s->pending, acb, next);
+    if (!s->plugged) {
+        qemu_bh_schedule(s->submit_bh);
+    }
+    return &acb->common;
+}
+
+void luring_io_plug(void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void luring_io_unplug(void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0) {
+        luring_submit_queued(s);
+    }
+}
+
+void *luring_init(void)
+{
+    LuringState *s;
+
+    s = g_malloc0(sizeof(*s));
+    QSIMPLEQ_INIT(&s->in_ring);
+    QSIMPLEQ_INIT(&s->pending);
+    s->efd = eventfd(0, 0);
+    if (s->efd == -1) {
+        goto out_free_state;
+    }
+    fcntl(s->efd, F_SETFL, O_NONBLOCK);
+
+    if (io_uring_queue_init(MAX_ENTRIES, &s->ring, 0) != 0) {
+        goto out_close_efd;
+    }
+    if (io_uring_register_eventfd(&s->ring, s->efd) != 0) {
+        goto out_queue_exit;
+    }
+    if (s->ring.features & IORING_FEAT_NODROP) {
+        s->cq_limit = INT_MAX;
+    } else {
+        s->cq_limit = *s->ring.cq.kring_entries;
+    }
+
+    s->submit_bh = qemu_bh_new(luring_submit_bh, s);
+    qemu_aio_set_fd_handler(s->efd, luring_completion_cb, NULL,
+        luring_flush_cb, s);
+
+    return s;
+
+out_queue_exit:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    close(s->efd);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *aio_ctx)
+{
+    LuringState *s = aio_ctx;
+
+    assert(s->count == 0);
+    qemu_aio_set_fd_handler(s->efd, NULL, NULL, NULL, NULL);
+    qemu_bh_delete(s->submit_bh);
+    io_uring_queue_exit(&s->ring);
+    close(s->efd);
+    g_free(s);
+}
@@ -1088,6 +1088,15 @@ void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
     return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
 }
 
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      const unsigned long *bitmap,
+                                      unsigned long pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr, pages);
+}
+
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     FlatRange *fr;
@@ -1125,6 +1134,16 @@ void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                                     1 << client);
 }
 
+uint64_t memory_region_sync_migration_dirty(MemoryRegion *mr,
+                                            target_phys_addr_t addr,
+                                            target_phys_addr_t size,
+                                            unsigned long *bitmap)
+{
+    assert(mr->terminates);
+    return cpu_physical_memory_sync_migration_dirty(bitmap,
+                                                    mr->ram_addr + addr, size);
+}
+
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
 {
     if (mr->alias) {
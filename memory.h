@@ -432,6 +432,23 @@ bool memory_region_get_dirty(MemoryRegion *mr, target_phys_addr_t addr,
 void memory_region_set_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                              target_phys_addr_t size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark the pages set in a bitmap as dirty
+ *
+ * Like memory_region_set_dirty(), but takes a little endian bitmap with
+ * one bit per target page, such as the one returned by the kvm dirty log.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the page
+ *        described by the first bit of @bitmap.
+ * @bitmap: the dirty pages.
+ * @pages: number of bits in @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr,
+                                      target_phys_addr_t addr,
+                                      const unsigned long *bitmap,
+                                      unsigned long pages);
+
 /**
  * memory_region_sync_dirty_bitmap: Synchronize a region's dirty bitmap with
  *                                  any external TLBs (e.g. kvm)
@@ -458,6 +475,25 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 void memory_region_reset_dirty(MemoryRegion *mr, target_phys_addr_t addr,
                                target_phys_addr_t size, unsigned client);
 
+/**
+ * memory_region_sync_migration_dirty: Move the migration dirty pages of a
+ *                                     range into a bitmap
+ *
+ * Sets the pages that are dirty for %DIRTY_MEMORY_MIGRATION in @bitmap and
+ * marks them as clean, working on whole bitmap words where possible.
+ *
+ * Returns the number of pages that were not already set in @bitmap.
+ *
+ * @mr: the region being synced.
+ * @addr: the start of the subrange being synced.
+ * @size: the size of the subrange being synced.
+ * @bitmap: the destination, indexed by ram_addr_t page number.
+ */
+uint64_t memory_region_sync_migration_dirty(MemoryRegion *mr,
+                                            target_phys_addr_t addr,
+                                            target_phys_addr_t size,
+                                            unsigned long *bitmap);
+
 /**
  * memory_region_set_readonly: Turn a memory region read-only (or read-write)
  *
@@ -103,9 +103,9 @@ static void fd_accept_incoming_migration(void *opaque)
 {
     QEMUFile *f = opaque;
 
-    process_incoming_migration(f);
     qemu_set_fd_handler2(qemu_stdio_fd(f), NULL, NULL, NULL, NULL);
-    qemu_fclose(f);
+    socket_set_nonblock(qemu_stdio_fd(f));
+    process_incoming_migration(f);
 }
 
 int fd_start_incoming_migration(const char *infd)
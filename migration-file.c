@@ -0,0 +1,183 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * With the mapped-ram capability, every page of guest RAM is written at
+ * a fixed offset of the file instead of into the stream, so that the file
+ * never grows beyond the size of guest RAM plus the device state, and the
+ * destination can read RAM back with several threads.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "migration.h"
+#include "qemu-char.h"
+#include "buffered_file.h"
+#include "block.h"
+
+//#define DEBUG_MIGRATION_FILE
+
+#ifdef DEBUG_MIGRATION_FILE
+#define DPRINTF(fmt, ...) \
+    do { printf("migration-file: " fmt, ## __VA_ARGS__); } while (0)
+#else
+#define DPRINTF(fmt, ...) \
+    do { } while (0)
+#endif
+
+typedef struct QEMU_PACKED MappedRAMHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t stream_offset;
+} MappedRAMHeader;
+
+static int file_errno(MigrationState *s)
+{
+    return errno;
+}
+
+static int file_write(MigrationState *s, const void *buf, size_t size)
+{
+    return write(s->fd, buf, size);
+}
+
+static ssize_t file_write_at(MigrationState *s, const void *buf, size_t size,
+                             int64_t pos)
+{
+    return pwrite(s->fd, buf, size, pos);
+}
+
+static int file_close(MigrationState *s)
+{
+    int ret;
+
+    DPRINTF("file_close\n");
+    if (s->fd != -1) {
+        ret = fsync(s->fd);
+        if (ret != 0) {
+            ret = -errno;
+            perror("migration-file: fsync");
+            close(s->fd);
+            s->fd = -1;
+            return ret;
+        }
+        ret = close(s->fd);
+        s->fd = -1;
+        if (ret != 0) {
+            ret = -errno;
+            perror("migration-file: close");
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reserves the room for RAM at the start of the file, and moves the file
+ * position behind it for the stream.  RAM is kept aligned to
+ * MAPPED_RAM_ALIGN, so that the pages could be written with O_DIRECT.
+ */
+static int file_write_header(int fd)
+{
+    MappedRAMHeader hdr;
+    uint64_t stream_offset;
+
+    stream_offset = MAPPED_RAM_ALIGN +
+        QEMU_ALIGN_UP(ram_mapped_size(), MAPPED_RAM_ALIGN);
+
+    hdr.magic = cpu_to_be32(MAPPED_RAM_MAGIC);
+    hdr.version = cpu_to_be32(MAPPED_RAM_VERSION);
+    hdr.stream_offset = cpu_to_be64(stream_offset);
+    if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        return -1;
+    }
+
+    DPRINTF("stream at %" PRIu64 "\n", stream_offset);
+    if (lseek(fd, stream_offset, SEEK_SET) == (off_t)-1) {
+        return -1;
+    }
+    return 0;
+}
+
+int file_start_outgoing_migration(MigrationState *s, const char *path)
+{
+    s->fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (s->fd == -1) {
+        DPRINTF("Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (migrate_use_mapped_ram()) {
+        if (file_write_header(s->fd) < 0) {
+            DPRINTF("Unable to write the header: %s\n", strerror(errno));
+            close(s->fd);
+            s->fd = -1;
+            return -1;
+        }
+        s->write_at = file_write_at;
+    }
+
+    s->get_error = file_errno;
+    s->write = file_write;
+    s->close = file_close;
+
+    migrate_fd_connect(s);
+    return 0;
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_stdio_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+/*
+ * The file either has the mapped-ram layout, or is a plain stream as
+ * written by "exec:cat > file".  In the former case RAM is read from
+ * the file by ram_load(), through qemu_get_buffer_at().
+ */
+int file_start_incoming_migration(const char *path)
+{
+    MappedRAMHeader hdr;
+    uint64_t stream_offset = 0;
+    QEMUFile *f;
+    int fd;
+
+    DPRINTF("Attempting to start an incoming migration from %s\n", path);
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd == -1) {
+        DPRINTF("Unable to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        be32_to_cpu(hdr.magic) == MAPPED_RAM_MAGIC) {
+        if (be32_to_cpu(hdr.version) != MAPPED_RAM_VERSION) {
+            fprintf(stderr, "Unsupported mapped-ram file version %u\n",
+                    be32_to_cpu(hdr.version));
+            close(fd);
+            return -EINVAL;
+        }
+        stream_offset = be64_to_cpu(hdr.stream_offset);
+    }
+
+    if (lseek(fd, stream_offset, SEEK_SET) == (off_t)-1) {
+        close(fd);
+        return -errno;
+    }
+
+    f = qemu_fdopen(fd, "rb");
+    if (f == NULL) {
+        DPRINTF("Unable to apply qemu wrapper to file descriptor\n");
+        close(fd);
+        return -errno;
+    }
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL, f);
+
+    return 0;
+}
@@ -15,6 +15,7 @@
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "iov.h"
 #include "migration.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
@@ -40,6 +41,12 @@ static int socket_write(MigrationState *s, const void * buf, size_t size)
     return send(s->fd, buf, size, 0);
 }
 
+static ssize_t socket_writev(MigrationState *s, struct iovec *iov, int iovcnt,
+                             size_t offset, size_t bytes)
+{
+    return iov_send(s->fd, iov, iovcnt, offset, bytes);
+}
+
 static int tcp_close(MigrationState *s)
 {
     int r = 0;
@@ -79,13 +86,44 @@ static void tcp_wait_for_connect(void *opaque)
     }
 }
 
+/* The extra RAM streams are connected first, so that they are in place
+ * by the time the main connection starts the migration thread.
+ */
+static int tcp_connect_streams(MigrationState *s, const char *host_port,
+                               Error **errp)
+{
+    int i, fd;
+
+    for (i = 1; i < s->ram_streams; i++) {
+        fd = inet_connect(host_port, true, errp);
+        if (fd < 0) {
+            goto fail;
+        }
+        if (migrate_add_stream(s, fd) < 0) {
+            error_set(errp, QERR_SOCKET_CONNECT_FAILED);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    DPRINTF("connecting stream %d failed\n", i);
+    migrate_close_streams(s);
+    return -1;
+}
+
 int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
                                  Error **errp)
 {
     s->get_error = socket_errno;
     s->write = socket_write;
+    s->writev = socket_writev;
     s->close = tcp_close;
 
+    if (tcp_connect_streams(s, host_port, errp) < 0) {
+        return -1;
+    }
+
     s->fd = inet_connect(host_port, false, errp);
 
     if (!error_is_set(errp)) {
@@ -95,6 +133,7 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
         qemu_set_fd_handler2(s->fd, NULL, NULL, tcp_wait_for_connect, s);
     } else if (error_is_type(*errp, QERR_SOCKET_CREATE_FAILED)) {
         DPRINTF("connect failed\n");
+        migrate_close_streams(s);
         return -1;
     } else if (error_is_type(*errp, QERR_SOCKET_CONNECT_FAILED)) {
         DPRINTF("connect failed\n");
@@ -102,6 +141,7 @@ int tcp_start_outgoing_migration(MigrationState *s, const char *host_port,
         return -1;
     } else {
         DPRINTF("unknown error\n");
+        migrate_close_streams(s);
         return -1;
     }
 
@@ -113,7 +153,6 @@ static void tcp_accept_incoming_migration(void *opaque)
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
-    QEMUFile *f;
     int c;
 
     do {
@@ -122,31 +161,15 @@ static void tcp_accept_incoming_migration(void *opaque)
 
     DPRINTF("accepted migration\n");
 
-    if (c == -1) {
-        fprintf(stderr, "could not accept migration connection\n");
-        goto out2;
-    }
-
-    f = qemu_fopen_socket(c);
-    if (f == NULL) {
-        fprintf(stderr, "could not qemu_fopen socket\n");
-        goto out;
-    }
-
-    process_incoming_migration(f);
-    qemu_fclose(f);
-out:
-    close(c);
-out2:
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
+    migrate_accept_incoming(s, c);
 }
 
 int tcp_start_incoming_migration(const char *host_port, Error **errp)
 {
     int s;
 
-    s = inet_listen(host_port, NULL, 256, SOCK_STREAM, 0, errp);
+    s = inet_listen(host_port, NULL, 256, SOCK_STREAM, 0,
+                    MIGRATION_STREAMS_MAX, errp);
 
     if (s < 0) {
         return -1;
@@ -15,6 +15,7 @@
 
 #include "qemu-common.h"
 #include "qemu_socket.h"
+#include "iov.h"
 #include "migration.h"
 #include "qemu-char.h"
 #include "buffered_file.h"
@@ -40,6 +41,12 @@ static int unix_write(MigrationState *s, const void * buf, size_t size)
     return write(s->fd, buf, size);
 }
 
+static ssize_t unix_writev(MigrationState *s, struct iovec *iov, int iovcnt,
+                           size_t offset, size_t bytes)
+{
+    return iov_send(s->fd, iov, iovcnt, offset, bytes);
+}
+
 static int unix_close(MigrationState *s)
 {
     int r = 0;
@@ -79,6 +86,27 @@ static void unix_wait_for_connect(void *opaque)
     }
 }
 
+static int unix_connect_streams(MigrationState *s, const char *path)
+{
+    int i, fd;
+
+    for (i = 1; i < s->ram_streams; i++) {
+        fd = unix_connect(path);
+        if (fd < 0) {
+            goto fail;
+        }
+        if (migrate_add_stream(s, fd) < 0) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    DPRINTF("connecting stream %d failed\n", i);
+    migrate_close_streams(s);
+    return -1;
+}
+
 int unix_start_outgoing_migration(MigrationState *s, const char *path)
 {
     struct sockaddr_un addr;
@@ -88,12 +116,20 @@ int unix_start_outgoing_migration(MigrationState *s, const char *path)
     snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
     s->get_error = unix_errno;
     s->write = unix_write;
+    s->writev = unix_writev;
     s->close = unix_close;
 
+    /* the extra RAM streams are in place before the migration starts */
+    if (unix_connect_streams(s, path) < 0) {
+        return -ECONNREFUSED;
+    }
+
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
     if (s->fd == -1) {
         DPRINTF("Unable to open socket");
-        return -errno;
+        ret = -errno;
+        migrate_close_streams(s);
+        return ret;
     }
 
     socket_set_nonblock(s->fd);
@@ -123,7 +159,6 @@ static void unix_accept_incoming_migration(void *opaque)
     struct sockaddr_un addr;
     socklen_t addrlen = sizeof(addr);
     int s = (intptr_t)opaque;
-    QEMUFile *f;
     int c;
 
     do {
@@ -132,24 +167,7 @@ static void unix_accept_incoming_migration(void *opaque)
 
     DPRINTF("accepted migration\n");
 
-    if (c == -1) {
-        fprintf(stderr, "could not accept migration connection\n");
-        goto out2;
-    }
-
-    f = qemu_fopen_socket(c);
-    if (f == NULL) {
-        fprintf(stderr, "could not qemu_fopen socket\n");
-        goto out;
-    }
-
-    process_incoming_migration(f);
-    qemu_fclose(f);
-out:
-    close(c);
-out2:
-    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
+    migrate_accept_incoming(s, c);
 }
 
 int unix_start_incoming_migration(const char *path)
@@ -176,7 +194,7 @@ int unix_start_incoming_migration(const char *path)
         fprintf(stderr, "bind(unix:%s): %s\n", addr.sun_path, strerror(errno));
         goto err;
     }
-    if (listen(s, 1) == -1) {
+    if (listen(s, MIGRATION_STREAMS_MAX) == -1) {
         fprintf(stderr, "listen(unix:%s): %s\n", addr.sun_path,
                 strerror(errno));
         ret = -errno;
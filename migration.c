@@ -18,10 +18,13 @@
 #include "monitor.h"
 #include "buffered_file.h"
 #include "sysemu.h"
+#include "cpus.h"
 #include "block.h"
 #include "qemu_socket.h"
+#include "iov.h"
 #include "block-migration.h"
 #include "qmp-commands.h"
+#include "qemu-coroutine.h"
 
 //#define DEBUG_MIGRATION
 
@@ -33,19 +36,39 @@
     do { } while (0)
 #endif
 
-enum {
-    MIG_STATE_ERROR,
-    MIG_STATE_SETUP,
-    MIG_STATE_CANCELLED,
-    MIG_STATE_ACTIVE,
-    MIG_STATE_COMPLETED,
-};
-
 #define MAX_THROTTLE  (32 << 20)      /* Migration speed throttling */
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration XBZRLE cache associativity, direct-mapped by default */
+#define DEFAULT_MIGRATE_CACHE_ASSOCIATIVITY 1
+#define MAX_MIGRATE_CACHE_ASSOCIATIVITY 64
+
+/* Migration XBZRLE encoder threads */
+#define DEFAULT_MIGRATE_XBZRLE_THREADS 1
+#define MAX_MIGRATE_XBZRLE_THREADS 64
+
+/* Migration page compression: zlib level and threads on each side */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+#define MAX_MIGRATE_COMPRESS_THREADS 64
+
+/* Pre-copy passes over the dirty state before switching to post-copy */
+#define DEFAULT_MIGRATE_POSTCOPY_PASSES 1
+#define MAX_MIGRATE_POSTCOPY_PASSES 100
+
+/* Block migration reads in flight per device */
+#define DEFAULT_MIGRATE_BLOCK_AIO_DEPTH 16
+#define MAX_MIGRATE_BLOCK_AIO_DEPTH 256
+
+/* Each connection of a multi-stream migration starts with this magic,
+ * followed by the stream index and the number of streams.  It can not
+ * be confused with QEMU_VM_FILE_MAGIC.
+ */
+#define MIGRATION_STREAM_MAGIC 0x514d5354
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -59,6 +82,15 @@ static MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .xbzrle_cache_associativity = DEFAULT_MIGRATE_CACHE_ASSOCIATIVITY,
+        .xbzrle_threads = DEFAULT_MIGRATE_XBZRLE_THREADS,
+        .ram_streams = 1,
+        .nr_streams = 1,
+        .postcopy_passes = DEFAULT_MIGRATE_POSTCOPY_PASSES,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
+        .block_aio_depth = DEFAULT_MIGRATE_BLOCK_AIO_DEPTH,
     };
 
     return &current_migration;
@@ -78,6 +110,8 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
         ret = unix_start_incoming_migration(p);
     else if (strstart(uri, "fd:", &p))
         ret = fd_start_incoming_migration(p);
+    else if (strstart(uri, "file:", &p))
+        ret = file_start_incoming_migration(p);
 #endif
     else {
         fprintf(stderr, "unknown migration protocol: %s\n", uri);
@@ -86,12 +120,26 @@ int qemu_start_incoming_migration(const char *uri, Error **errp)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+static void coroutine_fn process_incoming_migration_co(void *opaque)
 {
-    if (qemu_loadvm_state(f) < 0) {
+    QEMUFile *f = opaque;
+    int fd = qemu_get_fd(f);
+    int ret;
+
+    ret = qemu_loadvm_state(f);
+    if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+    if (ret == 0) {
+        /* qemu_fclose() leaves sockets open */
+        qemu_fclose(f);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    /* else @f and its socket belong to the post-copy page receiver */
+
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -106,6 +154,18 @@ void process_incoming_migration(QEMUFile *f)
     }
 }
 
+/*
+ * Loads the incoming migration from @f, which must be non-blocking, in a
+ * coroutine that waits in the main loop for the data.  This returns as
+ * soon as it has to wait; @f is closed when the migration is done.
+ */
+void process_incoming_migration(QEMUFile *f)
+{
+    Coroutine *co = qemu_coroutine_create(process_incoming_migration_co);
+
+    qemu_coroutine_enter(co, f);
+}
+
 /* amount of nanoseconds we are willing to wait for migration to be down.
  * the choice of nanoseconds is because it is the maximum resolution that
  * get_clock() can achieve. It is an internal measure. All user-visible
@@ -117,6 +177,90 @@ uint64_t migrate_max_downtime(void)
     return max_downtime;
 }
 
+/* A sample weighs about as much as everything measured over this many ms
+ * before it, however often the averages are updated.
+ */
+#define MIGRATION_ESTIMATE_PERIOD 1000
+
+/* XBZRLE and duplicate pages can make the RAM sent so far look much
+ * cheaper than what is left; do not count on more than this.
+ */
+#define MIGRATION_MIN_WIRE_RATIO (1.0 / 32)
+
+static double migrate_average(double avg, int *samples, double sample,
+                              int64_t time_ms)
+{
+    double weight;
+
+    if ((*samples)++ == 0) {
+        return sample;
+    }
+    weight = (double)time_ms / (time_ms + MIGRATION_ESTIMATE_PERIOD);
+    return avg + weight * (sample - avg);
+}
+
+/* Called by the migration thread with the bytes it wrote in @time_ms */
+void migrate_estimate_bandwidth(MigrationState *s, uint64_t bytes,
+                                int64_t time_ms)
+{
+    MigrationEstimator *est = &s->est;
+    uint64_t ram_bytes = ram_bytes_transferred();
+    uint64_t ram_raw_bytes = ram_raw_bytes_transferred();
+
+    if (time_ms <= 0) {
+        return;
+    }
+
+    est->bandwidth = migrate_average(est->bandwidth, &est->bandwidth_samples,
+                                     (double)bytes / time_ms, time_ms);
+
+    if (ram_raw_bytes > est->ram_raw_bytes && ram_bytes >= est->ram_bytes) {
+        est->wire_ratio = migrate_average(est->wire_ratio,
+                                          &est->ratio_samples,
+                                          (double)(ram_bytes - est->ram_bytes) /
+                                          (ram_raw_bytes - est->ram_raw_bytes),
+                                          time_ms);
+    }
+    est->ram_bytes = ram_bytes;
+    est->ram_raw_bytes = ram_raw_bytes;
+}
+
+/* Called whenever the dirty log is synced, with the RAM newly dirtied
+ * by the guest in @time_ms
+ */
+void migrate_estimate_dirty_rate(uint64_t bytes, int64_t time_ms)
+{
+    MigrationEstimator *est = &migrate_get_current()->est;
+
+    est->dirty_rate = migrate_average(est->dirty_rate, &est->dirty_samples,
+                                      (double)bytes / time_ms, time_ms);
+    est->pass_dirty_bytes += bytes;
+    est->pass_dirty_time += time_ms;
+}
+
+static double migrate_wire_ratio(MigrationEstimator *est)
+{
+    if (!est->ratio_samples) {
+        return 1.0;
+    }
+    return MAX(est->wire_ratio, MIGRATION_MIN_WIRE_RATIO);
+}
+
+/*
+ * How much dirty RAM can be sent within the downtime limit, as reported
+ * by the pending callbacks.  0 until the bandwidth has been measured.
+ */
+uint64_t migrate_estimate_max_size(MigrationState *s)
+{
+    MigrationEstimator *est = &s->est;
+
+    if (!est->bandwidth_samples) {
+        return 0;
+    }
+    return est->bandwidth * migrate_max_downtime() / 1000000 /
+           migrate_wire_ratio(est);
+}
+
 MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
 {
     MigrationCapabilityStatusList *head = NULL;
@@ -141,6 +285,34 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+static void get_xbzrle_thread_stats(XBZRLECacheStats *stats)
+{
+    const XBZRLEThreadAcct *acct;
+    XBZRLEThreadStatsList *head = NULL, *entry;
+    int i, nr_threads;
+
+    acct = xbzrle_mig_thread_acct(&nr_threads);
+    if (nr_threads <= 1) {
+        return;
+    }
+
+    /* build the list back to front so that it is sorted by thread */
+    for (i = nr_threads - 1; i >= 0; i--) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = i;
+        entry->value->bytes = acct[i].bytes;
+        entry->value->pages = acct[i].pages;
+        entry->value->cache_miss = acct[i].cache_miss;
+        entry->value->overflow = acct[i].overflows;
+        entry->next = head;
+        head = entry;
+    }
+
+    stats->has_threads = true;
+    stats->threads = head;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -151,7 +323,82 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        get_xbzrle_thread_stats(info->xbzrle_cache);
+    }
+}
+
+/* Auto-converge: once the guest has outpaced the migration for this many
+ * passes in a row, throttle its vCPUs, and more after every such pass.
+ */
+#define MIGRATION_THROTTLE_PASSES 3
+#define MIGRATION_THROTTLE_INITIAL 20
+#define MIGRATION_THROTTLE_STEP 10
+
+/* Called by the migration thread at the end of every pass over RAM */
+void migrate_pass_done(MigrationState *s)
+{
+    MigrationEstimator *est = &s->est;
+    double dirty_rate;
+    int percentage;
+
+    if (!est->pass_dirty_time || !est->bandwidth_samples) {
+        return;
+    }
+    /* on the wire, and against what the dirty log showed during this pass */
+    dirty_rate = (double)est->pass_dirty_bytes / est->pass_dirty_time *
+                 migrate_wire_ratio(est);
+    est->pass_dirty_bytes = 0;
+    est->pass_dirty_time = 0;
+
+    if (dirty_rate < est->bandwidth) {
+        s->unconverged_passes = 0;
+        return;
     }
+    if (++s->unconverged_passes < MIGRATION_THROTTLE_PASSES ||
+        !migrate_auto_converge()) {
+        return;
+    }
+
+    qemu_mutex_lock_iothread();
+    percentage = cpu_throttle_get_percentage();
+    cpu_throttle_set(percentage ? percentage + MIGRATION_THROTTLE_STEP :
+                     MIGRATION_THROTTLE_INITIAL);
+    DPRINTF("throttling vCPUs by %d%%\n", cpu_throttle_get_percentage());
+    qemu_mutex_unlock_iothread();
+}
+
+static void get_migration_convergence(MigrationInfo *info, MigrationState *s)
+{
+    MigrationEstimator *est = &s->est;
+    MigrationConvergence *conv;
+    double ratio, dirty_rate, pending, downtime_bytes;
+
+    if (!est->bandwidth_samples || est->bandwidth <= 0) {
+        return;
+    }
+
+    /* everything in bytes on the wire, and per ms */
+    ratio = migrate_wire_ratio(est);
+    dirty_rate = est->dirty_rate * ratio;
+    pending = est->pending * ratio;
+    downtime_bytes = est->bandwidth * migrate_max_downtime() / 1000000;
+
+    conv = g_malloc0(sizeof(*conv));
+    conv->bandwidth = est->bandwidth * 1000;
+    conv->dirty_bytes_rate = est->dirty_rate * 1000;
+    conv->compression_ratio = 1 / ratio;
+    conv->expected_downtime = pending / est->bandwidth;
+    conv->converging = dirty_rate < est->bandwidth;
+    if (conv->converging) {
+        conv->has_expected_time = true;
+        if (pending > downtime_bytes) {
+            conv->expected_time = (pending - downtime_bytes) /
+                                  (est->bandwidth - dirty_rate);
+        }
+    }
+
+    info->has_convergence = true;
+    info->convergence = conv;
 }
 
 MigrationInfo *qmp_query_migrate(Error **errp)
@@ -187,6 +434,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_migration_convergence(info, s);
+
+        if (migrate_auto_converge()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
@@ -228,6 +481,14 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
         return;
     }
 
+    for (cap = params; cap; cap = cap->next) {
+        if (cap->value->capability == MIGRATION_CAPABILITY_POSTCOPY &&
+            cap->value->state && !ram_postcopy_supported()) {
+            error_set(errp, QERR_NOT_SUPPORTED);
+            return;
+        }
+    }
+
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
     }
@@ -251,6 +512,7 @@ static int migrate_fd_cleanup(MigrationState *s)
         close(s->fd);
         s->fd = -1;
     }
+    migrate_close_streams(s);
 
     return ret;
 }
@@ -263,39 +525,50 @@ void migrate_fd_error(MigrationState *s)
     migrate_fd_cleanup(s);
 }
 
-static void migrate_fd_completed(MigrationState *s)
+/*
+ * Runs in the main loop once the migration thread is done, either because
+ * it completed, failed, or noticed that the migration was cancelled.
+ */
+static void migrate_fd_thread_done(void *opaque)
 {
-    DPRINTF("setting completed state\n");
-    if (migrate_fd_cleanup(s) < 0) {
-        s->state = MIG_STATE_ERROR;
-    } else {
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->cleanup_bh);
+    s->cleanup_bh = NULL;
+
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&s->thread);
+    qemu_mutex_lock_iothread();
+    cpu_throttle_stop();
+
+    if (!s->complete) {
+        qemu_savevm_state_cancel(s->file);
+    }
+
+    if (s->state == MIG_STATE_CANCELLED) {
+        migrate_fd_cleanup(s);
+    } else if (s->complete && migrate_fd_cleanup(s) >= 0) {
+        DPRINTF("setting completed state\n");
         s->state = MIG_STATE_COMPLETED;
         runstate_set(RUN_STATE_POSTMIGRATE);
+        notifier_list_notify(&migration_state_notifiers, s);
+    } else {
+        migrate_fd_error(s);
     }
-    notifier_list_notify(&migration_state_notifiers, s);
-}
 
-static void migrate_fd_put_notify(void *opaque)
-{
-    MigrationState *s = opaque;
-
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    qemu_file_put_notify(s->file);
-    if (s->file && qemu_file_get_error(s->file)) {
-        migrate_fd_error(s);
+    s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
+    /* after a failed post-copy, the guest may live on the destination */
+    if (s->state != MIG_STATE_COMPLETED && s->old_vm_running &&
+        !s->postcopy) {
+        vm_start();
     }
 }
 
-static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
-                                     size_t size)
+ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
+                              size_t size)
 {
-    MigrationState *s = opaque;
     ssize_t ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        return -EIO;
-    }
-
     do {
         ret = s->write(s, data, size);
     } while (ret == -1 && ((s->get_error(s)) == EINTR));
@@ -303,91 +576,323 @@ static ssize_t migrate_fd_put_buffer(void *opaque, const void *data,
     if (ret == -1)
         ret = -(s->get_error(s));
 
-    if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
-    }
-
     return ret;
 }
 
-static void migrate_fd_put_ready(void *opaque)
+/* Writes all of @iov to the (blocking) migration fd.  Returns the number
+ * of bytes written or a negative error number.
+ */
+ssize_t migrate_fd_put_iov(MigrationState *s, struct iovec *iov, int iovcnt)
 {
-    MigrationState *s = opaque;
-    int ret;
+    size_t size = iov_size(iov, iovcnt);
+    size_t offset = 0;
+    ssize_t ret;
 
-    if (s->state != MIG_STATE_ACTIVE) {
-        DPRINTF("put_ready returning because of non-active state\n");
-        return;
+    while (offset < size) {
+        ret = s->writev(s, iov, iovcnt, offset, size - offset);
+        if (ret == -1 && s->get_error(s) == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            return -(s->get_error(s));
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        offset += ret;
     }
 
-    DPRINTF("iterate\n");
-    ret = qemu_savevm_state_iterate(s->file);
-    if (ret < 0) {
-        migrate_fd_error(s);
-    } else if (ret == 1) {
-        int old_vm_running = runstate_is_running();
+    return offset;
+}
 
-        DPRINTF("done iterating\n");
-        qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
-        vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+/* Writes all of @data at @pos of the migration file.  Returns the number
+ * of bytes written or a negative error number.
+ */
+ssize_t migrate_fd_put_buffer_at(MigrationState *s, const void *data,
+                                 size_t size, int64_t pos)
+{
+    size_t offset = 0;
+    ssize_t ret;
 
-        if (qemu_savevm_state_complete(s->file) < 0) {
-            migrate_fd_error(s);
-        } else {
-            migrate_fd_completed(s);
+    while (offset < size) {
+        ret = s->write_at(s, (const uint8_t *)data + offset, size - offset,
+                          pos + offset);
+        if (ret == -1 && s->get_error(s) == EINTR) {
+            continue;
+        }
+        if (ret == -1) {
+            return -(s->get_error(s));
         }
-        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
-        if (s->state != MIG_STATE_COMPLETED) {
-            if (old_vm_running) {
-                vm_start();
-            }
+        if (ret == 0) {
+            return -EIO;
         }
+        offset += ret;
     }
+
+    return offset;
 }
 
+/* The cleanup of the migration state happens in migrate_fd_thread_done(),
+ * once the migration thread has noticed the new state.
+ */
 static void migrate_fd_cancel(MigrationState *s)
 {
     if (s->state != MIG_STATE_ACTIVE)
         return;
 
+    /* the source does not have the whole guest anymore */
+    if (s->postcopy) {
+        DPRINTF("post-copy migration can not be cancelled\n");
+        return;
+    }
+
     DPRINTF("cancelling migration\n");
 
     s->state = MIG_STATE_CANCELLED;
     notifier_list_notify(&migration_state_notifiers, s);
-    qemu_savevm_state_cancel(s->file);
+}
 
-    migrate_fd_cleanup(s);
+int migrate_fd_close(MigrationState *s)
+{
+    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    return s->close(s);
 }
 
-static void migrate_fd_wait_for_unfreeze(void *opaque)
+static int migrate_send_stream_header(int fd, int index, int nr_streams)
 {
-    MigrationState *s = opaque;
-    int ret;
+    uint32_t hdr[3];
 
-    DPRINTF("wait for unfreeze\n");
-    if (s->state != MIG_STATE_ACTIVE)
-        return;
+    hdr[0] = cpu_to_be32(MIGRATION_STREAM_MAGIC);
+    hdr[1] = cpu_to_be32(index);
+    hdr[2] = cpu_to_be32(nr_streams);
+    return send_all(fd, hdr, sizeof(hdr));
+}
 
-    do {
-        fd_set wfds;
+/* Adds an extra RAM stream on the connected socket @fd, which is closed
+ * together with the migration.  Returns 0 or -1.
+ */
+int migrate_add_stream(MigrationState *s, int fd)
+{
+    int index = s->nr_streams;
+
+    assert(index < MIGRATION_STREAMS_MAX);
+    s->stream_fds[index] = fd;
+    s->nr_streams++;
 
-        FD_ZERO(&wfds);
-        FD_SET(s->fd, &wfds);
+    socket_set_block(fd);
+    return migrate_send_stream_header(fd, index, s->ram_streams);
+}
 
-        ret = select(s->fd + 1, NULL, &wfds, NULL, NULL);
-    } while (ret == -1 && (s->get_error(s)) == EINTR);
+void migrate_close_streams(MigrationState *s)
+{
+    int i;
 
-    if (ret == -1) {
-        qemu_file_set_error(s->file, -s->get_error(s));
+    for (i = 1; i < s->nr_streams; i++) {
+        close(s->stream_fds[i]);
     }
+    s->nr_streams = 1;
 }
 
-static int migrate_fd_close(void *opaque)
+/*
+ * Connections of an incoming migration, from the first one that is
+ * accepted until all the streams announced by their headers are there.
+ * They are collected from the main loop, and given up on after
+ * MIGRATION_ACCEPT_TIMEOUT ms.
+ */
+#define MIGRATION_ACCEPT_TIMEOUT 30000
+
+typedef struct IncomingStreams {
+    int listen_fd;
+    /* accepted connections whose header has not been read yet */
+    int pending[MIGRATION_STREAMS_MAX];
+    int nr_pending;
+    /* connections by stream index, -1 until their header arrives */
+    int fds[MIGRATION_STREAMS_MAX];
+    int nr_streams;
+    int received;
+    QEMUTimer *timer;
+} IncomingStreams;
+
+static IncomingStreams *incoming_streams;
+
+static void incoming_streams_free(IncomingStreams *is)
 {
-    MigrationState *s = opaque;
+    int i;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
-    return s->close(s);
+    for (i = 0; i < is->nr_pending; i++) {
+        qemu_set_fd_handler2(is->pending[i], NULL, NULL, NULL, NULL);
+    }
+    qemu_set_fd_handler2(is->listen_fd, NULL, NULL, NULL, NULL);
+    close(is->listen_fd);
+    qemu_del_timer(is->timer);
+    qemu_free_timer(is->timer);
+    g_free(is);
+    incoming_streams = NULL;
+}
+
+static void incoming_streams_fail(IncomingStreams *is, const char *reason)
+{
+    int i;
+
+    fprintf(stderr, "migration: %s\n", reason);
+    for (i = 0; i < is->nr_pending; i++) {
+        closesocket(is->pending[i]);
+    }
+    for (i = 0; i < MIGRATION_STREAMS_MAX; i++) {
+        if (is->fds[i] != -1) {
+            closesocket(is->fds[i]);
+        }
+    }
+    incoming_streams_free(is);
+}
+
+static void incoming_streams_timeout(void *opaque)
+{
+    incoming_streams_fail(opaque, "timed out waiting for the streams");
+}
+
+/* Starts loading the migration once every connection is there */
+static void incoming_streams_start(IncomingStreams *is, int nr_streams)
+{
+    int fds[MIGRATION_STREAMS_MAX];
+    QEMUFile *f;
+    int i;
+
+    memcpy(fds, is->fds, sizeof(fds));
+    is->nr_pending = 0;
+    incoming_streams_free(is);
+
+    f = qemu_fopen_socket(fds[0]);
+    if (f == NULL) {
+        fprintf(stderr, "could not qemu_fopen socket\n");
+        goto fail;
+    }
+    /* the extra streams are read by threads, the main channel is not */
+    for (i = 1; i < nr_streams; i++) {
+        socket_set_block(fds[i]);
+    }
+    if (ram_load_start_streams(f, fds + 1, nr_streams - 1) < 0) {
+        fprintf(stderr, "could not start migration streams\n");
+        qemu_fclose(f);
+        goto fail;
+    }
+
+    socket_set_nonblock(fds[0]);
+    process_incoming_migration(f);
+    return;
+
+fail:
+    for (i = 0; i < nr_streams; i++) {
+        closesocket(fds[i]);
+    }
+}
+
+static void incoming_streams_drop_pending(IncomingStreams *is, int fd)
+{
+    int i;
+
+    qemu_set_fd_handler2(fd, NULL, NULL, NULL, NULL);
+    for (i = 0; i < is->nr_pending; i++) {
+        if (is->pending[i] == fd) {
+            is->pending[i] = is->pending[--is->nr_pending];
+            break;
+        }
+    }
+}
+
+/*
+ * Called when an accepted connection has data.  It is only read once
+ * the whole stream header is there; a connection that starts with
+ * something else is the main channel of a single-stream migration.
+ */
+static void incoming_streams_read_header(void *opaque)
+{
+    IncomingStreams *is = incoming_streams;
+    int fd = (intptr_t)opaque;
+    uint32_t hdr[3];
+    int ret, index, n;
+
+    ret = qemu_recv(fd, hdr, sizeof(hdr), MSG_PEEK | MSG_DONTWAIT);
+    if (ret < 0 && (socket_error() == EINTR || socket_error() == EAGAIN ||
+                    socket_error() == EWOULDBLOCK)) {
+        return;
+    }
+    if (ret <= 0) {
+        incoming_streams_fail(is, "connection closed before its header");
+        return;
+    }
+
+    if (ret >= sizeof(hdr[0]) &&
+        be32_to_cpu(hdr[0]) != MIGRATION_STREAM_MAGIC) {
+        if (is->nr_streams || is->nr_pending > 1) {
+            incoming_streams_fail(is, "unexpected connection");
+            return;
+        }
+        incoming_streams_drop_pending(is, fd);
+        is->fds[0] = fd;
+        incoming_streams_start(is, 1);
+        return;
+    }
+    if (ret < sizeof(hdr)) {
+        /* the rest of the header is on its way */
+        return;
+    }
+
+    qemu_recv(fd, hdr, sizeof(hdr), 0);
+    index = be32_to_cpu(hdr[1]);
+    n = be32_to_cpu(hdr[2]);
+    if (n < 2 || n > MIGRATION_STREAMS_MAX ||
+        (is->nr_streams && n != is->nr_streams) ||
+        index < 0 || index >= n || is->fds[index] != -1) {
+        incoming_streams_fail(is, "bad stream header");
+        return;
+    }
+    DPRINTF("accepted stream %d of %d\n", index, n);
+
+    incoming_streams_drop_pending(is, fd);
+    is->nr_streams = n;
+    is->fds[index] = fd;
+    if (++is->received == n) {
+        incoming_streams_start(is, n);
+    }
+}
+
+/*
+ * Takes over the connection @fd that was just accepted on @listen_fd,
+ * or -1 if accepting failed.  Once the main channel and all the extra RAM streams announced by the
+ * stream headers have been accepted, the migration is loaded; until
+ * then, further connections are accepted by calling this again.
+ * @listen_fd is closed once all of them are there, or on failure.
+ */
+void migrate_accept_incoming(int listen_fd, int fd)
+{
+    IncomingStreams *is = incoming_streams;
+    int i;
+
+    if (!is) {
+        is = incoming_streams = g_malloc0(sizeof(*is));
+        is->listen_fd = listen_fd;
+        for (i = 0; i < MIGRATION_STREAMS_MAX; i++) {
+            is->fds[i] = -1;
+        }
+        is->timer = qemu_new_timer_ms(rt_clock, incoming_streams_timeout, is);
+        qemu_mod_timer(is->timer,
+                       qemu_get_clock_ms(rt_clock) + MIGRATION_ACCEPT_TIMEOUT);
+    }
+    assert(is->listen_fd == listen_fd);
+
+    if (fd == -1) {
+        incoming_streams_fail(is, "could not accept migration connection");
+        return;
+    }
+    if (is->nr_pending + is->received == MIGRATION_STREAMS_MAX) {
+        closesocket(fd);
+        incoming_streams_fail(is, "too many connections");
+        return;
+    }
+    is->pending[is->nr_pending++] = fd;
+    qemu_set_fd_handler2(fd, NULL, incoming_streams_read_header, NULL,
+                         (void *)(intptr_t)fd);
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -405,6 +910,14 @@ bool migration_is_active(MigrationState *s)
     return s->state == MIG_STATE_ACTIVE;
 }
 
+/* Whether the RAM and block save handlers are in use by a migration */
+bool migrate_is_running(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->state == MIG_STATE_ACTIVE || s->cleanup_bh;
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIG_STATE_COMPLETED;
@@ -418,24 +931,24 @@ bool migration_has_failed(MigrationState *s)
 
 void migrate_fd_connect(MigrationState *s)
 {
-    int ret;
+    /* The migration thread does blocking writes */
+    socket_set_block(s->fd);
 
-    s->state = MIG_STATE_ACTIVE;
-    s->file = qemu_fopen_ops_buffered(s,
-                                      s->bandwidth_limit,
-                                      migrate_fd_put_buffer,
-                                      migrate_fd_put_ready,
-                                      migrate_fd_wait_for_unfreeze,
-                                      migrate_fd_close);
-
-    DPRINTF("beginning savevm\n");
-    ret = qemu_savevm_state_begin(s->file, &s->params);
-    if (ret < 0) {
-        DPRINTF("failed, %d\n", ret);
+    if (s->nr_streams > 1 &&
+        migrate_send_stream_header(s->fd, 0, s->nr_streams) < 0) {
+        DPRINTF("could not send the stream header\n");
         migrate_fd_error(s);
         return;
     }
-    migrate_fd_put_ready(s);
+
+    s->state = MIG_STATE_ACTIVE;
+    s->complete = false;
+    s->old_vm_running = false;
+
+    s->cleanup_bh = qemu_bh_new(migrate_fd_thread_done, s);
+    s->file = qemu_fopen_ops_buffered(s);
+
+    notifier_list_notify(&migration_state_notifiers, s);
 }
 
 static MigrationState *migrate_init(const MigrationParams *params)
@@ -444,6 +957,16 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int64_t xbzrle_cache_associativity = s->xbzrle_cache_associativity;
+    bool xbzrle_cache_admit_on_second_dirty =
+        s->xbzrle_cache_admit_on_second_dirty;
+    int64_t xbzrle_threads = s->xbzrle_threads;
+    int64_t ram_streams = s->ram_streams;
+    int64_t postcopy_passes = s->postcopy_passes;
+    int64_t compress_level = s->compress_level;
+    int64_t compress_threads = s->compress_threads;
+    int64_t decompress_threads = s->decompress_threads;
+    int64_t block_aio_depth = s->block_aio_depth;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -454,6 +977,16 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->xbzrle_cache_associativity = xbzrle_cache_associativity;
+    s->xbzrle_cache_admit_on_second_dirty = xbzrle_cache_admit_on_second_dirty;
+    s->xbzrle_threads = xbzrle_threads;
+    s->ram_streams = ram_streams;
+    s->nr_streams = 1;
+    s->postcopy_passes = postcopy_passes;
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
+    s->block_aio_depth = block_aio_depth;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -474,6 +1007,17 @@ void migrate_del_blocker(Error *reason)
     migration_blockers = g_slist_remove(migration_blockers, reason);
 }
 
+bool migration_is_blocked(Error **errp)
+{
+    if (migration_blockers) {
+        if (errp) {
+            *errp = error_copy(migration_blockers->data);
+        }
+        return true;
+    }
+    return false;
+}
+
 void qmp_migrate(const char *uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
                  Error **errp)
@@ -486,7 +1030,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.blk = blk;
     params.shared = inc;
 
-    if (s->state == MIG_STATE_ACTIVE) {
+    /* a cancelled migration may still be waiting for its thread to exit */
+    if (s->state == MIG_STATE_ACTIVE || s->cleanup_bh) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -495,11 +1040,34 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
-    if (migration_blockers) {
-        *errp = error_copy(migration_blockers->data);
+    if (migration_is_blocked(errp)) {
         return;
     }
 
+    /* the destination asks for pages over the migration socket */
+    if (migrate_use_postcopy() && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                  "a tcp: or unix: URI for post-copy migration");
+        return;
+    }
+
+    /* pages go to their place in a file, and only there */
+    if (migrate_use_mapped_ram()) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
+                      "a file: URI for mapped-ram migration");
+            return;
+        }
+        if (migrate_use_xbzrle() || migrate_use_compression() ||
+            migrate_use_postcopy() || migrate_ram_streams() > 1) {
+            error_set(errp, QERR_INVALID_PARAMETER_VALUE, "capabilities",
+                      "no xbzrle, compress, postcopy or extra RAM streams "
+                      "with mapped-ram");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -511,6 +1079,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         ret = unix_start_outgoing_migration(s, p);
     } else if (strstart(uri, "fd:", &p)) {
         ret = fd_start_outgoing_migration(s, p);
+    } else if (strstart(uri, "file:", &p)) {
+        ret = file_start_outgoing_migration(s, p);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -534,9 +1104,13 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
-void qmp_migrate_set_cache_size(int64_t value, Error **errp)
+void qmp_migrate_set_cache_size(int64_t value, bool has_associativity,
+                                int64_t associativity,
+                                bool has_admit_on_second_dirty,
+                                bool admit_on_second_dirty, Error **errp)
 {
     MigrationState *s = migrate_get_current();
+    int64_t new_size;
 
     /* Check for truncation */
     if (value != (size_t)value) {
@@ -545,7 +1119,28 @@ void qmp_migrate_set_cache_size(int64_t value, Error **errp)
         return;
     }
 
-    s->xbzrle_cache_size = xbzrle_cache_resize(value);
+    if (has_associativity && (associativity < 1 ||
+        associativity > MAX_MIGRATE_CACHE_ASSOCIATIVITY)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "associativity",
+                  "a value between 1 and 64");
+        return;
+    }
+
+    new_size = xbzrle_cache_resize(value);
+    if (new_size < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
+                  "a size the cache can be resized to, of one page or more");
+        return;
+    }
+    s->xbzrle_cache_size = new_size;
+
+    /* these two only apply to the caches of the next migration */
+    if (has_associativity) {
+        s->xbzrle_cache_associativity = pow2floor(associativity);
+    }
+    if (has_admit_on_second_dirty) {
+        s->xbzrle_cache_admit_on_second_dirty = admit_on_second_dirty;
+    }
 }
 
 int64_t qmp_query_migrate_cache_size(Error **errp)
@@ -553,6 +1148,161 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+MigrationCacheConfig *qmp_query_migrate_cache_config(Error **errp)
+{
+    MigrationCacheConfig *info = g_malloc0(sizeof(*info));
+
+    info->associativity = migrate_xbzrle_cache_associativity();
+    info->admit_on_second_dirty = migrate_xbzrle_cache_admit_on_second_dirty();
+
+    return info;
+}
+
+void qmp_migrate_set_xbzrle_threads(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATE_XBZRLE_THREADS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of threads between 1 and 64");
+        return;
+    }
+
+    s->xbzrle_threads = value;
+}
+
+int64_t qmp_query_migrate_xbzrle_threads(Error **errp)
+{
+    return migrate_xbzrle_threads();
+}
+
+void qmp_migrate_set_ram_streams(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MIGRATION_STREAMS_MAX) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of streams between 1 and 16");
+        return;
+    }
+
+    s->ram_streams = value;
+}
+
+int64_t qmp_query_migrate_ram_streams(Error **errp)
+{
+    return migrate_ram_streams();
+}
+
+void qmp_migrate_set_postcopy_passes(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 0 || value > MAX_MIGRATE_POSTCOPY_PASSES) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of passes between 0 and 100");
+        return;
+    }
+
+    s->postcopy_passes = value;
+}
+
+int64_t qmp_query_migrate_postcopy_passes(Error **errp)
+{
+    return migrate_postcopy_passes();
+}
+
+void qmp_migrate_set_block_aio_depth(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATE_BLOCK_AIO_DEPTH) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of reads between 1 and 256");
+        return;
+    }
+
+    s->block_aio_depth = value;
+}
+
+int64_t qmp_query_migrate_block_aio_depth(Error **errp)
+{
+    return migrate_block_aio_depth();
+}
+
+void qmp_migrate_set_compress_params(bool has_level, int64_t level,
+                                     bool has_threads, int64_t threads,
+                                     bool has_decompress_threads,
+                                     int64_t decompress_threads,
+                                     Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_level && (level < 0 || level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "level",
+                  "a compression level between 0 and 9");
+        return;
+    }
+    if (has_threads && (threads < 1 ||
+                        threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "a number of threads between 1 and 64");
+        return;
+    }
+    if (has_decompress_threads && (decompress_threads < 1 ||
+        decompress_threads > MAX_MIGRATE_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a number of threads between 1 and 64");
+        return;
+    }
+
+    if (has_level) {
+        s->compress_level = level;
+    }
+    if (has_threads) {
+        s->compress_threads = threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+}
+
+MigrationCompressParams *qmp_query_migrate_compress_params(Error **errp)
+{
+    MigrationCompressParams *params = g_malloc0(sizeof(*params));
+
+    params->level = migrate_compress_level();
+    params->threads = migrate_compress_threads();
+    params->decompress_threads = migrate_decompress_threads();
+
+    return params;
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -590,3 +1340,153 @@ int64_t migrate_xbzrle_cache_size(void)
 
     return s->xbzrle_cache_size;
 }
+
+int migrate_xbzrle_cache_associativity(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->xbzrle_cache_associativity;
+}
+
+bool migrate_xbzrle_cache_admit_on_second_dirty(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->xbzrle_cache_admit_on_second_dirty;
+}
+
+int migrate_xbzrle_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->xbzrle_threads;
+}
+
+int migrate_ram_streams(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->ram_streams;
+}
+
+int migrate_use_postcopy(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY];
+}
+
+int migrate_postcopy_passes(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->postcopy_passes;
+}
+
+int migrate_auto_converge(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
+}
+
+int migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_use_zero_map(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_MAP];
+}
+
+int migrate_use_zero_blocks(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
+}
+
+int migrate_use_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+int migrate_block_aio_depth(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->block_aio_depth;
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_threads;
+}
+
+/* Returns the QEMUFile of extra RAM stream @index (counting from 1) of
+ * the active migration, or NULL if there is no such stream.
+ */
+QEMUFile *migrate_get_stream(int index)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    if (s->state != MIG_STATE_ACTIVE || index >= s->nr_streams) {
+        return NULL;
+    }
+    return s->stream_files[index];
+}
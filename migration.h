@@ -20,14 +20,52 @@
 #include "error.h"
 #include "vmstate.h"
 #include "qapi-types.h"
+#include "qemu-thread.h"
+#include "main-loop.h"
 
 struct MigrationParams {
     bool blk;
     bool shared;
 };
 
+enum {
+    MIG_STATE_ERROR,
+    MIG_STATE_SETUP,
+    MIG_STATE_CANCELLED,
+    MIG_STATE_ACTIVE,
+    MIG_STATE_COMPLETED,
+};
+
+/* Upper limit for the number of connections of one migration */
+#define MIGRATION_STREAMS_MAX 16
+
+/* A mapped-ram file starts with a header (magic, version and offset of
+ * the stream, big endian), then has every page of guest RAM at
+ * MAPPED_RAM_ALIGN plus its ram_addr_t, and ends with the migration stream.
+ */
+#define MAPPED_RAM_MAGIC   0x514d5241
+#define MAPPED_RAM_VERSION 1
+#define MAPPED_RAM_ALIGN   (1 << 20)
+
 typedef struct MigrationState MigrationState;
 
+/* Moving averages the stop-and-copy decision is based on.  They are
+ * updated from the migration thread; everybody else only reads them.
+ */
+typedef struct MigrationEstimator {
+    int bandwidth_samples;
+    double bandwidth;           /* bytes per ms written out */
+    int dirty_samples;
+    double dirty_rate;          /* bytes of RAM per ms newly dirtied */
+    int ratio_samples;
+    double wire_ratio;          /* bytes written out per byte of RAM sent */
+    uint64_t pass_dirty_bytes;  /* dirty rate samples of the current pass */
+    int64_t pass_dirty_time;
+    uint64_t ram_bytes;         /* RAM counters at the previous sample */
+    uint64_t ram_raw_bytes;
+    uint64_t pending;           /* last result of the pending callbacks */
+} MigrationEstimator;
+
 struct MigrationState
 {
     int64_t bandwidth_limit;
@@ -37,11 +75,40 @@ struct MigrationState
     int (*get_error)(MigrationState *s);
     int (*close)(MigrationState *s);
     int (*write)(MigrationState *s, const void *buff, size_t size);
+    /* optional; writes @bytes bytes of @iov, skipping the first @offset */
+    ssize_t (*writev)(MigrationState *s, struct iovec *iov, int iovcnt,
+                      size_t offset, size_t bytes);
+    /* optional; writes at @pos of a file, see qemu_put_buffer_at() */
+    ssize_t (*write_at)(MigrationState *s, const void *buf, size_t size,
+                        int64_t pos);
     void *opaque;
     MigrationParams params;
     int64_t total_time;
+    int64_t downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int64_t xbzrle_cache_associativity;
+    bool xbzrle_cache_admit_on_second_dirty;
+    int64_t xbzrle_threads;
+    int64_t ram_streams;
+    /* Connections in use, s->fd included; stream_fds[0] is unused */
+    int nr_streams;
+    int stream_fds[MIGRATION_STREAMS_MAX];
+    QEMUFile *stream_files[MIGRATION_STREAMS_MAX];
+    int64_t postcopy_passes;
+    int64_t compress_level;
+    int64_t compress_threads;
+    int64_t decompress_threads;
+    int64_t block_aio_depth;
+    /* the destination may be running the guest already */
+    bool postcopy;
+    MigrationEstimator est;
+    /* passes in a row that the guest dirtied RAM faster than it was sent */
+    int unconverged_passes;
+    QemuThread thread;
+    QEMUBH *cleanup_bh;
+    bool complete;
+    bool old_vm_running;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -50,6 +117,12 @@ int qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
 
+void migrate_estimate_bandwidth(MigrationState *s, uint64_t bytes,
+                                int64_t time_ms);
+void migrate_estimate_dirty_rate(uint64_t bytes, int64_t time_ms);
+uint64_t migrate_estimate_max_size(MigrationState *s);
+void migrate_pass_done(MigrationState *s);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
@@ -71,22 +144,46 @@ int fd_start_incoming_migration(const char *path);
 
 int fd_start_outgoing_migration(MigrationState *s, const char *fdname);
 
+int file_start_incoming_migration(const char *path);
+
+int file_start_outgoing_migration(MigrationState *s, const char *path);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
 
+ssize_t migrate_fd_put_buffer(MigrationState *s, const void *data,
+                              size_t size);
+ssize_t migrate_fd_put_iov(MigrationState *s, struct iovec *iov, int iovcnt);
+ssize_t migrate_fd_put_buffer_at(MigrationState *s, const void *data,
+                                 size_t size, int64_t pos);
+int migrate_fd_close(MigrationState *s);
+int migrate_add_stream(MigrationState *s, int fd);
+void migrate_close_streams(MigrationState *s);
+void migrate_accept_incoming(int listen_fd, int fd);
+
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_is_active(MigrationState *);
+bool migrate_is_running(void);
+bool dirty_rate_is_measuring(void);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
 
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+uint64_t ram_mapped_size(void);
+uint64_t ram_raw_bytes_transferred(void);
 
 extern SaveVMHandlers savevm_ram_handlers;
 
+bool ram_postcopy_supported(void);
+int ram_postcopy_outgoing_start(int fd);
+int ram_postcopy_send(QEMUFile *f);
+int ram_postcopy_outgoing_finish(bool success);
+int ram_postcopy_incoming_start(QEMUFile *f);
+
 uint64_t dup_mig_bytes_transferred(void);
 uint64_t dup_mig_pages_transferred(void);
 uint64_t norm_mig_bytes_transferred(void);
@@ -96,6 +193,16 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 
+/* XBZRLE statistics of a single encoder thread */
+typedef struct XBZRLEThreadAcct {
+    uint64_t bytes;
+    uint64_t pages;
+    uint64_t cache_miss;
+    uint64_t overflows;
+} XBZRLEThreadAcct;
+
+const XBZRLEThreadAcct *xbzrle_mig_thread_acct(int *nr_threads);
+
 /**
  * @migrate_add_blocker - prevent migration from proceeding
  *
@@ -110,12 +217,36 @@ void migrate_add_blocker(Error *reason);
  */
 void migrate_del_blocker(Error *reason);
 
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen);
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+/**
+ * @migration_is_blocked - check for the blockers of migration
+ *
+ * @errp - set to a copy of the first blocking error, if there is one
+ *
+ * Anything that saves the VM state while it runs must refuse to start
+ * when this returns true, not only migration.
+ */
+bool migration_is_blocked(Error **errp);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+int migrate_xbzrle_cache_associativity(void);
+bool migrate_xbzrle_cache_admit_on_second_dirty(void);
+int migrate_xbzrle_threads(void);
+int migrate_ram_streams(void);
+int migrate_use_postcopy(void);
+int migrate_postcopy_passes(void);
+int migrate_auto_converge(void);
+int migrate_use_compression(void);
+int migrate_use_zero_map(void);
+int migrate_use_zero_blocks(void);
+int migrate_use_mapped_ram(void);
+int migrate_block_aio_depth(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+QEMUFile *migrate_get_stream(int index);
+
+int ram_load_start_streams(QEMUFile *f, int *fds, int nr_fds);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
@@ -2585,6 +2585,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show the currently saved VM snapshots",
         .mhandler.info = do_info_snapshots,
     },
+    {
+        .name       = "savevm",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the status of the last live snapshot",
+        .mhandler.info = do_info_savevm,
+    },
     {
         .name       = "status",
         .args_type  = "",
@@ -2675,6 +2682,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.info = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the dirty page rate measurement",
+        .mhandler.info = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
@@ -3812,6 +3826,12 @@ static const mon_cmd_t *monitor_parse_command(Monitor *mon,
                 while (qemu_isspace(*p)) {
                     p++;
                 }
+                if (*typestr == '?') {
+                    typestr++;
+                    if (*p == '\0') {
+                        break;
+                    }
+                }
                 beg = p;
                 while (qemu_isgraph(*p)) {
                     p++;
@@ -176,7 +176,7 @@ int tcp_socket_incoming_spec(const char *address_and_port)
 {
     char *ostr  = NULL;
     int olen = 0;
-    return inet_listen(address_and_port, ostr, olen, SOCK_STREAM, 0, NULL);
+    return inet_listen(address_and_port, ostr, olen, SOCK_STREAM, 0, 1, NULL);
 }
 
 int unix_socket_incoming(const char *path)
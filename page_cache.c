@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is base on a hash of the page address, with optional
+ * set associativity
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -36,21 +37,62 @@
 
 typedef struct CacheItem CacheItem;
 
+/* An unused item has it_addr == -1 */
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
-    uint8_t *it_data;
 };
 
+/*
+ * The cache is made of num_sets sets of ways items each; a page can only
+ * live in the set selected by its address.  ways == 1 is a direct-mapped
+ * cache.  Inside a set the item with the lowest age, i.e. the least
+ * recently used one, is evicted first.
+ *
+ * The data of all items lives in one slab, item i owning the i-th page of
+ * it, so that a big cache is a single mapping that can use huge pages
+ * rather than millions of small allocations.
+ */
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *data;
     unsigned int page_size;
     int64_t max_num_items;
+    unsigned int ways;
+    int64_t num_sets;
+    /* with admit_on_second_dirty, the addresses of pages that missed once */
+    bool admit_on_second_dirty;
+    uint64_t *seen;
     uint64_t max_item_age;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static uint64_t *cache_alloc_seen(int64_t num_pages)
+{
+    uint64_t *seen;
+    int64_t i;
+
+    seen = g_malloc(num_pages * sizeof(*seen));
+    for (i = 0; i < num_pages; i++) {
+        seen[i] = -1;
+    }
+    return seen;
+}
+
+static uint8_t *cache_alloc_data(int64_t num_pages, unsigned int page_size)
+{
+    size_t size = num_pages * page_size;
+    uint8_t *data;
+
+    /* pages are only touched when first inserted, so this costs no RSS */
+    data = qemu_vmalloc(size);
+    qemu_madvise(data, size, QEMU_MADV_HUGEPAGE);
+
+    return data;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size,
+                      unsigned int ways, bool admit_on_second_dirty)
 {
     int64_t i;
 
@@ -61,6 +103,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         return NULL;
     }
 
+    if (ways == 0) {
+        DPRINTF("invalid associativity\n");
+        return NULL;
+    }
+
     cache = g_malloc(sizeof(*cache));
 
     /* round down to the nearest power of 2 */
@@ -68,80 +115,142 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         num_pages = pow2floor(num_pages);
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
+    if (!is_power_of_2(ways)) {
+        ways = pow2floor(ways);
+    }
+    if (ways > num_pages) {
+        ways = num_pages;
+    }
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = ways;
+    cache->num_sets = num_pages / ways;
+    cache->admit_on_second_dirty = admit_on_second_dirty;
+    cache->seen = NULL;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
+    cache->data = cache_alloc_data(num_pages, page_size);
+
+    if (admit_on_second_dirty) {
+        cache->seen = cache_alloc_seen(num_pages);
+    }
 
     return cache;
 }
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
+    qemu_vfree(cache->data);
+    cache->data = NULL;
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->seen);
+    cache->seen = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+unsigned int cache_get_associativity(const PageCache *cache)
 {
-    size_t pos;
+    return cache->ways;
+}
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+static uint8_t *cache_get_data(const PageCache *cache, const CacheItem *it)
+{
+    return cache->data + (it - cache->page_cache) * cache->page_size;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
+
+    g_assert(cache->num_sets);
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[set * cache->ways];
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
 
-    return (cache->page_cache[pos].it_addr == addr);
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+/* Returns a free item of addr's set, or the least recently used one */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set, *victim;
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    set = victim = cache_get_set(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == -1) {
+            return &set[i];
+        }
+        if (set[i].it_age < victim->it_age) {
+            victim = &set[i];
+        }
+    }
 
-    pos = cache_get_cache_pos(cache, addr);
+    return victim;
+}
 
-    return &cache->page_cache[pos];
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
+{
+    return cache_get_by_addr(cache, addr) != NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    it->it_age = ++cache->max_item_age;
+    return cache_get_data(cache, it);
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+/*
+ * Records a miss on addr.  Returns true if addr already missed before,
+ * i.e. this is (at least) the second time the page is dirty.
+ */
+static bool cache_seen_before(PageCache *cache, uint64_t addr)
+{
+    size_t pos = (addr / cache->page_size) & (cache->max_num_items - 1);
+
+    if (cache->seen[pos] == addr) {
+        return true;
+    }
+    cache->seen[pos] = addr;
+    return false;
+}
+
+int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 {
 
     CacheItem *it = NULL;
@@ -149,16 +258,24 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        if (cache->admit_on_second_dirty && !cache_seen_before(cache, addr)) {
+            return -1;
+        }
 
-    if (!it->it_data) {
-        cache->num_items++;
+        it = cache_get_victim(cache, addr);
+        if (it->it_addr == -1) {
+            cache->num_items++;
+        }
+        it->it_addr = addr;
     }
 
-    it->it_data = pdata;
+    /* actual update of entry */
+    memcpy(cache_get_data(cache, it), pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
-    it->it_addr = addr;
+
+    return 0;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
@@ -180,36 +297,39 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
+    new_cache = cache_init(new_num_pages, cache->page_size, cache->ways,
+                           cache->admit_on_second_dirty);
     if (!(new_cache)) {
         DPRINTF("Error creating new cache\n");
         return -1;
     }
 
-    /* move all data from old cache */
+    /* copy the data over, keeping the MRU pages of each set */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data) {
-                /* keep the MRU page */
-                if (new_it->it_age >= old_it->it_age) {
-                    g_free(old_it->it_data);
-                } else {
-                    g_free(new_it->it_data);
-                    new_it->it_data = old_it->it_data;
-                    new_it->it_age = old_it->it_age;
-                    new_it->it_addr = old_it->it_addr;
-                }
-            } else {
-                cache_insert(new_cache, old_it->it_addr, old_it->it_data);
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (new_it->it_addr == -1) {
+                new_cache->num_items++;
+            } else if (new_it->it_age >= old_it->it_age) {
+                continue;
             }
+            memcpy(cache_get_data(new_cache, new_it),
+                   cache_get_data(cache, old_it), cache->page_size);
+            new_it->it_age = old_it->it_age;
+            new_it->it_addr = old_it->it_addr;
         }
     }
 
+    qemu_vfree(cache->data);
+    g_free(cache->page_cache);
+    g_free(cache->seen);
+    cache->data = new_cache->data;
     cache->page_cache = new_cache->page_cache;
+    cache->seen = new_cache->seen;
     cache->max_num_items = new_cache->max_num_items;
+    cache->ways = new_cache->ways;
+    cache->num_sets = new_cache->num_sets;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
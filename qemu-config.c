@@ -61,7 +61,7 @@ static QemuOptsList qemu_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -114,6 +114,18 @@ static QemuOptsList qemu_drive_opts = {
             .name = "copy-on-read",
             .type = QEMU_OPT_BOOL,
             .help = "copy read data from backing file into image file",
+        },{
+            .name = "l2-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum qcow2 L2 table cache size",
+        },{
+            .name = "refcount-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "maximum qcow2 refcount block cache size",
+        },{
+            .name = "cache-clean-interval",
+            .type = QEMU_OPT_NUMBER,
+            .help = "interval in seconds for dropping unused cached tables",
         },
         { /* end of list */ }
     },
@@ -31,6 +31,27 @@
 typedef int (QEMUFilePutBufferFunc)(void *opaque, const uint8_t *buf,
                                     int64_t pos, int size);
 
+/* Write out a vector of buffers, in order.  Used instead of
+ * QEMUFilePutBufferFunc when set with qemu_file_set_writev(), so that
+ * qemu_put_buffer_async() does not need to copy.  Returns the number of
+ * bytes written, which is less than the total only on error, or a
+ * negative error number.
+ */
+typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
+                                           int iovcnt);
+
+/* Write or read a chunk of data at an absolute position of the underlying
+ * file, independently of the stream.  Used instead of the stream for data
+ * that has a fixed place in the file, when set with
+ * qemu_file_set_positioned().  The read function may be called from
+ * several threads at once.  Returns the number of bytes transferred, or a
+ * negative error number.
+ */
+typedef ssize_t (QEMUFileWriteAtFunc)(void *opaque, const uint8_t *buf,
+                                      size_t size, int64_t pos);
+typedef ssize_t (QEMUFileReadAtFunc)(void *opaque, uint8_t *buf,
+                                     size_t size, int64_t pos);
+
 /* Read a chunk of data from a file at the given position.  The pos argument
  * can be ignored if the file is only be used for streaming.  The number of
  * bytes actually read should be returned.
@@ -65,15 +86,25 @@ QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
                          QEMUFileRateLimit *rate_limit,
                          QEMUFileSetRateLimit *set_rate_limit,
                          QEMUFileGetRateLimit *get_rate_limit);
+void qemu_file_set_writev(QEMUFile *f, QEMUFileWritevBufferFunc *writev_buffer);
+void qemu_file_set_positioned(QEMUFile *f, QEMUFileWriteAtFunc *write_at,
+                              QEMUFileReadAtFunc *read_at);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd);
 QEMUFile *qemu_popen(FILE *popen_file, const char *mode);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_stdio_fd(QEMUFile *f);
+int qemu_get_fd(QEMUFile *f);
 void qemu_fflush(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
+void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+bool qemu_file_can_put_at(QEMUFile *f);
+bool qemu_file_can_get_at(QEMUFile *f);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos);
+int qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos);
 void qemu_put_byte(QEMUFile *f, int v);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
@@ -88,6 +119,10 @@ void qemu_put_be32(QEMUFile *f, unsigned int v);
 void qemu_put_be64(QEMUFile *f, uint64_t v);
 int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size);
 int qemu_get_byte(QEMUFile *f);
+/* Look ahead in the stream without consuming it, then skip what was seen */
+int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset);
+int qemu_peek_byte(QEMUFile *f, int offset);
+void qemu_file_skip(QEMUFile *f, int size);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
@@ -106,11 +141,6 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f);
 int qemu_file_get_error(QEMUFile *f);
 void qemu_file_set_error(QEMUFile *f, int error);
 
-/* Try to send any outstanding data.  This function is useful when output is
- * halted due to rate limiting or EAGAIN errors occur as it can be used to
- * resume output. */
-void qemu_file_put_notify(QEMUFile *f);
-
 static inline void qemu_put_be64s(QEMUFile *f, const uint64_t *pv)
 {
     qemu_put_be64(f, *pv);
@@ -1372,6 +1372,204 @@ static const cmdinfo_t aio_flush_cmd = {
     .oneline    = "completes all outstanding aio requests"
 };
 
+typedef struct RandReadState {
+    int64_t size;
+    int depth;
+    int inflight;
+    int done;
+    int error;
+} RandReadState;
+
+typedef struct RandReadReq {
+    RandReadState *state;
+    QEMUIOVector qiov;
+    void *buf;
+    bool busy;
+} RandReadReq;
+
+static void randread_done(void *opaque, int ret)
+{
+    RandReadReq *req = opaque;
+    RandReadState *state = req->state;
+
+    if (ret < 0 && !state->error) {
+        state->error = ret;
+    }
+    req->busy = false;
+    state->inflight--;
+    state->done++;
+}
+
+static void randread_help(void)
+{
+    printf(
+"\n"
+" reads blocks at random offsets, keeping several requests in flight\n"
+"\n"
+" Example:\n"
+" 'randread -d 32 -n 100000 4k' - 100000 reads of 4k, 32 at a time\n"
+"\n"
+" Issues asynchronous reads of the given size at random, aligned offsets\n"
+" of the currently open file, and reports the throughput and the CPU\n"
+" time spent per request.\n"
+" -d, -- number of requests in flight (default 64)\n"
+" -n, -- number of requests (default 100000)\n"
+" -p, -- plug the queue while refilling it, like a virtqueue kick\n"
+" -C, -- report statistics in a machine parsable format\n"
+" -q, -- quiet mode, do not show I/O statistics\n"
+"\n");
+}
+
+static int randread_f(int argc, char **argv);
+
+static const cmdinfo_t randread_cmd = {
+    .name       = "randread",
+    .cfunc      = randread_f,
+    .argmin     = 1,
+    .argmax     = -1,
+    .args       = "[-pCq] [-d depth] [-n count] len",
+    .oneline    = "reads a number of bytes at random offsets",
+    .help       = randread_help,
+};
+
+static int randread_f(int argc, char **argv)
+{
+    RandReadState state = { .depth = 64 };
+    RandReadReq *reqs;
+    struct timeval t1, t2;
+    clock_t c1, c2;
+    int Cflag = 0, qflag = 0, pflag = 0;
+    int64_t length, blocks;
+    int c, i, count = 100000, issued = 0;
+
+    while ((c = getopt(argc, argv, "Cd:n:pq")) != EOF) {
+        switch (c) {
+        case 'C':
+            Cflag = 1;
+            break;
+        case 'd':
+            state.depth = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'p':
+            pflag = 1;
+            break;
+        case 'q':
+            qflag = 1;
+            break;
+        default:
+            return command_usage(&randread_cmd);
+        }
+    }
+
+    if (optind != argc - 1 || state.depth <= 0 || count <= 0) {
+        return command_usage(&randread_cmd);
+    }
+
+    state.size = cvtnum(argv[optind]);
+    if (state.size < 0) {
+        printf("non-numeric length argument -- %s\n", argv[optind]);
+        return 0;
+    }
+    if (state.size == 0 || state.size & 0x1ff || state.size > INT_MAX) {
+        printf("length argument %" PRId64 " is not a valid request size\n",
+               state.size);
+        return 0;
+    }
+
+    length = bdrv_getlength(bs);
+    if (length < 0) {
+        printf("cannot get the length: %s\n", strerror(-length));
+        return 0;
+    }
+    blocks = length / state.size;
+    if (blocks == 0) {
+        printf("the file is smaller than the request size\n");
+        return 0;
+    }
+
+    reqs = g_new0(RandReadReq, state.depth);
+    for (i = 0; i < state.depth; i++) {
+        reqs[i].state = &state;
+        reqs[i].buf = qemu_io_alloc(state.size, 0xab);
+        qemu_iovec_init(&reqs[i].qiov, 1);
+        qemu_iovec_add(&reqs[i].qiov, reqs[i].buf, state.size);
+    }
+
+    gettimeofday(&t1, NULL);
+    c1 = clock();
+    while (state.done < count && !state.error) {
+        if (pflag) {
+            bdrv_io_plug(bs);
+        }
+        for (i = 0; i < state.depth && issued < count; i++) {
+            int64_t offset;
+
+            if (reqs[i].busy) {
+                continue;
+            }
+            offset = ((((int64_t)random() << 31) | random()) % blocks) *
+                     state.size;
+            reqs[i].busy = true;
+            state.inflight++;
+            issued++;
+            if (!bdrv_aio_readv(bs, offset >> 9, &reqs[i].qiov,
+                                state.size >> 9, randread_done, &reqs[i])) {
+                randread_done(&reqs[i], -EIO);
+            }
+        }
+        if (pflag) {
+            bdrv_io_unplug(bs);
+        }
+        if (state.inflight) {
+            main_loop_wait(false);
+        }
+    }
+    while (state.inflight) {
+        main_loop_wait(false);
+    }
+    c2 = clock();
+    gettimeofday(&t2, NULL);
+
+    if (state.error) {
+        printf("randread failed: %s\n", strerror(-state.error));
+        goto out;
+    }
+
+    /* Finally, report back -- -C gives a parsable format */
+    if (!qflag) {
+        double total = (double)state.size * state.done;
+        double cpu = (double)(c2 - c1) / CLOCKS_PER_SEC * 1e6 / state.done;
+        char s1[64], s2[64], ts[64];
+
+        t2 = tsub(t2, t1);
+        timestr(&t2, ts, sizeof(ts), Cflag ? VERBOSE_FIXED_TIME : 0);
+        if (!Cflag) {
+            cvtstr(total, s1, sizeof(s1));
+            cvtstr(tdiv(total, t2), s2, sizeof(s2));
+            printf("randread %d x %" PRId64 " bytes, %d in flight\n",
+                   state.done, state.size, state.depth);
+            printf("%s, %d ops; %s (%s/sec and %.4f ops/sec)\n",
+                   s1, state.done, ts, s2, tdiv((double)state.done, t2));
+            printf("%.3f us of CPU time per op\n", cpu);
+        } else {/* bytes,ops,time,bytes/sec,ops/sec,cpu us/op */
+            printf("%.0f,%d,%s,%.3f,%.3f,%.3f\n",
+                   total, state.done, ts, tdiv(total, t2),
+                   tdiv((double)state.done, t2), cpu);
+        }
+    }
+
+out:
+    for (i = 0; i < state.depth; i++) {
+        qemu_iovec_destroy(&reqs[i].qiov);
+        qemu_io_free(reqs[i].buf);
+    }
+    g_free(reqs);
+    return 0;
+}
+
 static int flush_f(int argc, char **argv)
 {
     bdrv_flush(bs);
@@ -1795,6 +1993,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -u, --io-uring       use io_uring (on Linux only)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
 "  -h, --help           display this help and exit\n"
@@ -1808,7 +2007,7 @@ int main(int argc, char **argv)
 {
     int readonly = 0;
     int growable = 0;
-    const char *sopt = "hVc:rsnmgkt:T:";
+    const char *sopt = "hVc:rsnmgkut:T:";
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -1820,6 +2019,7 @@ int main(int argc, char **argv)
         { "misalign", 0, NULL, 'm' },
         { "growable", 0, NULL, 'g' },
         { "native-aio", 0, NULL, 'k' },
+        { "io-uring", 0, NULL, 'u' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
         { NULL, 0, NULL, 0 }
@@ -1853,6 +2053,9 @@ int main(int argc, char **argv)
         case 'k':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'u':
+            flags |= BDRV_O_IO_URING;
+            break;
         case 't':
             if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
                 error_report("Invalid cache option: %s", optarg);
@@ -1898,6 +2101,7 @@ int main(int argc, char **argv)
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
     add_command(&aio_flush_cmd);
+    add_command(&randread_cmd);
     add_command(&flush_cmd);
     add_command(&truncate_cmd);
     add_command(&length_cmd);
@@ -140,8 +140,10 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
+    "       [,l2-cache-size=size][,refcount-cache-size=size]\n"
+    "       [,cache-clean-interval=seconds]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
@@ -176,7 +178,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Native Linux AIO is only used with cache=none or cache=directsync; io_uring works with every cache mode and also handles flushes and discards.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -196,6 +198,16 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item l2-cache-size=@var{size}
+@itemx refcount-cache-size=@var{size}
+Maximum size in bytes of the qcow2 L2 table cache and refcount block cache.
+Each cached table takes one cluster.  By default 16 L2 tables and 4 refcount
+blocks are cached; with 64k clusters, every megabyte of L2 cache covers
+8 GB of the virtual disk.
+@item cache-clean-interval=@var{seconds}
+Every @var{seconds} seconds, drop the cached qcow2 tables that were not used
+since the previous pass and return their memory to the host.  0, the default,
+keeps them.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -54,6 +54,9 @@ static QemuOptsList dummy_opts = {
         },{
             .name = "block",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "backlog",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end if list */ }
     },
@@ -190,7 +193,7 @@ int inet_listen_opts(QemuOpts *opts, int port_offset, Error **errp)
     return -1;
 
 listen:
-    if (listen(slisten,1) != 0) {
+    if (listen(slisten, qemu_opt_get_number(opts, "backlog", 1)) != 0) {
         error_set(errp, QERR_SOCKET_LISTEN_FAILED);
         perror("listen");
         closesocket(slisten);
@@ -455,14 +458,17 @@ static int inet_parse(QemuOpts *opts, const char *str)
 }
 
 int inet_listen(const char *str, char *ostr, int olen,
-                int socktype, int port_offset, Error **errp)
+                int socktype, int port_offset, int backlog, Error **errp)
 {
     QemuOpts *opts;
     char *optstr;
+    char buf[16];
     int sock = -1;
 
     opts = qemu_opts_create(&dummy_opts, NULL, 0, NULL);
     if (inet_parse(opts, str) == 0) {
+        snprintf(buf, sizeof(buf), "%d", backlog);
+        qemu_opt_set(opts, "backlog", buf);
         sock = inet_listen_opts(opts, port_offset, errp);
         if (sock != -1 && ostr) {
             optstr = strchr(str, ',');
@@ -135,6 +135,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_DEVICE_NOT_REMOVABLE,
         .desc      = "Device '%(device)' is not removable",
     },
+    {
+        .error_fmt = QERR_DIRTY_RATE_ACTIVE,
+        .desc      = "There's a dirty page rate measurement in progress",
+    },
     {
         .error_fmt = QERR_DUPLICATE_ID,
         .desc      = "Duplicate ID '%(id)' for %(object)",
@@ -282,6 +286,10 @@ static const QErrorStringTable qerror_table[] = {
         .error_fmt = QERR_SET_PASSWD_FAILED,
         .desc      = "Could not set password",
     },
+    {
+        .error_fmt = QERR_SNAPSHOT_ACTIVE,
+        .desc      = "There's a live snapshot in progress",
+    },
     {
         .error_fmt = QERR_TOO_MANY_FILES,
         .desc      = "Too many open files",
@@ -497,6 +497,8 @@ Notes:
 (2) All boolean arguments default to false
 (3) The user Monitor's "detach" argument is invalid in QMP and should not
     be used
+(4) "file:<path>" writes the migration to a file, which is loaded with
+    "-incoming file:<path>"; see the "mapped-ram" capability
 
 EQMP
 
@@ -522,7 +524,7 @@ Example:
 EQMP
 {
         .name       = "migrate-set-cache-size",
-        .args_type  = "value:o",
+        .args_type  = "value:o,associativity:i?,admit-on-second-dirty:b?",
         .mhandler.cmd_new = qmp_marshal_input_migrate_set_cache_size,
     },
 
@@ -530,12 +532,17 @@ SQMP
 migrate-set-cache-size
 ---------------------
 
-Set cache size to be used by XBZRLE migration, the cache size will be rounded
-down to the nearest power of 2
+Set cache size to be used by XBZRLE migration.  The cache has one shard per
+XBZRLE thread, each rounded down to the nearest power of 2 pages, so it may be
+smaller than requested; query-migrate-cache-size returns its real size
 
 Arguments:
 
 - "value": cache size in bytes (json-int)
+- "associativity": pages per cache set, 1 for a direct-mapped cache; rounded
+                   down to the nearest power of 2 (json-int, optional)
+- "admit-on-second-dirty": only cache pages sent at least twice
+                           (json-bool, optional)
 
 Example:
 
@@ -563,6 +570,338 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "query-migrate-cache-config",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_cache_config,
+    },
+
+SQMP
+query-migrate-cache-config
+--------------------------
+
+Show the organization of the cache to be used by XBZRLE migration
+
+returns a json-object with the following information:
+- "associativity" : json-int
+- "admit-on-second-dirty" : json-bool
+
+Example:
+
+-> { "execute": "query-migrate-cache-config" }
+<- { "return": { "associativity": 8, "admit-on-second-dirty": false } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-xbzrle-threads",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_xbzrle_threads,
+    },
+
+SQMP
+migrate-set-xbzrle-threads
+--------------------------
+
+Set the number of threads used for XBZRLE encoding, the XBZRLE cache is
+split evenly between them. Fails while a migration is active
+
+Arguments:
+
+- "value": number of threads, between 1 and 64 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-xbzrle-threads", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-xbzrle-threads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_xbzrle_threads,
+    },
+
+SQMP
+query-migrate-xbzrle-threads
+----------------------------
+
+Show the number of threads used for XBZRLE encoding
+
+returns a json-int
+
+Example:
+
+-> { "execute": "query-migrate-xbzrle-threads" }
+<- { "return": 4 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-ram-streams",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_ram_streams,
+    },
+
+SQMP
+migrate-set-ram-streams
+-----------------------
+
+Set the number of connections used by tcp and unix migrations.  Guest RAM
+is spread over them, device state goes over the first one.  Fails while a
+migration is active
+
+Arguments:
+
+- "value": number of connections, between 1 and 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-ram-streams", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-ram-streams",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_ram_streams,
+    },
+
+SQMP
+query-migrate-ram-streams
+-------------------------
+
+Show the number of connections used by tcp and unix migrations
+
+returns a json-int
+
+Example:
+
+-> { "execute": "query-migrate-ram-streams" }
+<- { "return": 4 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-compress-params",
+        .args_type  = "level:i?,threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_compress_params,
+    },
+
+SQMP
+migrate-set-compress-params
+---------------------------
+
+Set the parameters of migration page compression, used when the "compress"
+capability is on.  Fails while a migration is active
+
+Arguments:
+
+- "level": zlib compression level, between 0 and 9 (json-int, optional)
+- "threads": number of compression threads, between 1 and 64 (json-int,
+  optional)
+- "decompress-threads": number of decompression threads on the
+  destination, between 1 and 64; they decode XBZRLE pages too (json-int,
+  optional)
+
+Example:
+
+-> { "execute": "migrate-set-compress-params",
+     "arguments": { "level": 6, "threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-compress-params",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_compress_params,
+    },
+
+SQMP
+query-migrate-compress-params
+-----------------------------
+
+Show the parameters of migration page compression
+
+returns a json-object with the following information:
+- "level": zlib compression level (json-int)
+- "threads": number of compression threads (json-int)
+- "decompress-threads": number of decompression threads (json-int)
+
+Example:
+
+-> { "execute": "query-migrate-compress-params" }
+<- { "return": { "level": 1, "threads": 8, "decompress-threads": 2 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-postcopy-passes",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_postcopy_passes,
+    },
+
+SQMP
+migrate-set-postcopy-passes
+---------------------------
+
+Set the number of pre-copy passes over the dirty pages after which a
+migration with the "postcopy" capability starts the guest on the
+destination.  Fails while a migration is active
+
+Arguments:
+
+- "value": number of passes, between 0 and 100 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-postcopy-passes", "arguments": { "value": 2 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-postcopy-passes",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_postcopy_passes,
+    },
+
+SQMP
+query-migrate-postcopy-passes
+-----------------------------
+
+Show the number of pre-copy passes of a post-copy migration
+
+returns a json-int
+
+Example:
+
+-> { "execute": "query-migrate-postcopy-passes" }
+<- { "return": 1 }
+
+EQMP
+
+    {
+        .name       = "migrate-set-block-aio-depth",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_block_aio_depth,
+    },
+
+SQMP
+migrate-set-block-aio-depth
+---------------------------
+
+Set the number of reads that block migration keeps in flight on each
+device.  Fails while a migration is active
+
+Arguments:
+
+- "value": number of reads, between 1 and 256 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-block-aio-depth", "arguments": { "value": 32 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-block-aio-depth",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_block_aio_depth,
+    },
+
+SQMP
+query-migrate-block-aio-depth
+-----------------------------
+
+Show the number of reads that block migration keeps in flight on each
+device
+
+returns a json-int
+
+Example:
+
+-> { "execute": "query-migrate-block-aio-depth" }
+<- { "return": 16 }
+
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Measure how fast the guest dirties its RAM, without migrating it.  Dirty
+logging is enabled for the given time, and the dirty bitmap is looked at
+every 100 ms.  Migrations and snapshots are refused meanwhile.
+
+Arguments:
+
+- "calc-time": length of the measurement, between 1 and 60 seconds
+  (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the results of the dirty page rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "calc-time": length of the measurement, in seconds (json-int)
+- "dirty-rate": MB dirtied per second, once measured (json-int, optional)
+- "blocks": a json-array of the rate of each RAM block, once measured,
+  with the following members (optional):
+         - "id": name of the RAM block (json-string)
+         - "dirty-rate": MB dirtied per second (json-int)
+- "working-set": a json-array of the memory dirtied after 1, 2, 4, ...
+  samples and at the end, once measured, with the following members
+  (optional):
+         - "time": milliseconds since the start (json-int)
+         - "bytes": bytes dirtied at least once meanwhile (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "calc-time": 1,
+        "dirty-rate": 48,
+        "blocks": [ { "id": "pc.ram", "dirty-rate": 47 },
+                    { "id": "vga.vram", "dirty-rate": 1 } ],
+        "working-set": [ { "time": 100, "bytes": 5242880 },
+                         { "time": 200, "bytes": 9437184 },
+                         { "time": 400, "bytes": 16777216 },
+                         { "time": 800, "bytes": 29360128 },
+                         { "time": 1000, "bytes": 33554432 } ]
+     }
+   }
+
 EQMP
 
     {
@@ -1451,6 +1790,13 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "caches": metadata caches of the image format, if any (json-array).
+                Each one is a json-object with:
+        - "name": "l2" or "refcount" for qcow2 (json-string)
+        - "size": maximum size of the cache in bytes (json-int)
+        - "used": bytes holding cached tables (json-int)
+        - "hits": lookups served from the cache (json-int)
+        - "misses": lookups that loaded the table (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2138,6 +2484,30 @@ The main json-object contains the following:
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of cache misses
          - "overflow": number of XBZRLE overflows
+         - "threads": only present if more than one encoder thread is used.
+           It is a json-array with one json-object per encoder thread:
+             - "id": thread index
+             - "bytes": XBZRLE bytes transferred by this thread
+             - "pages": number of XBZRLE pages encoded by this thread
+             - "cache-miss": number of cache misses in this thread
+             - "overflow": number of XBZRLE overflows in this thread
+- "convergence": only present if "status" is "active" and the bandwidth has
+  been measured.  It is a json-object with moving averages over roughly the
+  last second, and what they predict:
+         - "bandwidth": bytes written out per second (json-int)
+         - "dirty-bytes-rate": bytes of RAM dirtied again per second
+           (json-int)
+         - "compression-ratio": bytes of RAM sent per byte on the wire
+           (json-number)
+         - "expected-downtime": ms the guest would be stopped for if the
+           migration completed now (json-int)
+         - "converging": whether RAM is sent faster than it is dirtied
+           (json-bool)
+         - "expected-time": only present if "converging" is true, ms until
+           the remaining state fits in the downtime limit (json-int)
+- "cpu-throttle-percentage": only present if "status" is "active" and
+  auto-converge is on, percentage of time the vCPUs are kept from running
+  (json-int)
 Examples:
 
 1. Before the first migration
@@ -2181,6 +2551,14 @@ Examples:
             "duplicate":123,
             "normal":123,
             "normal-bytes":123456
+         },
+         "convergence":{
+            "bandwidth":104857600,
+            "dirty-bytes-rate":20971520,
+            "compression-ratio":1.25,
+            "expected-downtime":240,
+            "converging":true,
+            "expected-time":1800
          }
       }
    }
@@ -2249,6 +2627,18 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": xbzrle support
+- "postcopy": start the guest on the destination before all of RAM is
+  there; needs to be enabled on the destination too
+- "auto-converge": slow down the vCPUs if the guest dirties memory faster
+  than it can be sent
+- "compress": compress the pages sent in full, see
+  migrate-set-compress-params
+- "zero-map": skip the pages that the host never populated, the
+  destination must support it
+- "zero-blocks": send unallocated and zero disk chunks of a block
+  migration as short records, the destination must support it
+- "mapped-ram": write RAM at fixed offsets of a file: migration target,
+  and read it back with several threads
 
 Arguments:
 
@@ -2273,6 +2663,12 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "postcopy" : post-copy state (json-bool)
+         - "auto-converge" : auto-converge state (json-bool)
+         - "compress" : page compression state (json-bool)
+         - "zero-map" : zero page map state (json-bool)
+         - "zero-blocks" : zero block records state (json-bool)
+         - "mapped-ram" : mapped RAM file state (json-bool)
 
 Arguments:
 
@@ -82,6 +82,8 @@
 #include "qemu_socket.h"
 #include "qemu-queue.h"
 #include "qemu-timer.h"
+#include "qemu-coroutine.h"
+#include "qemu-thread.h"
 #include "cpus.h"
 #include "memory.h"
 #include "qmp-commands.h"
@@ -159,1006 +161,74 @@ void qemu_announce_self(void)
 /***********************************************************/
 /* savevm/loadvm support */
 
-#define IO_BUF_SIZE 32768
-
-struct QEMUFile {
-    QEMUFilePutBufferFunc *put_buffer;
-    QEMUFileGetBufferFunc *get_buffer;
-    QEMUFileCloseFunc *close;
-    QEMUFileRateLimit *rate_limit;
-    QEMUFileSetRateLimit *set_rate_limit;
-    QEMUFileGetRateLimit *get_rate_limit;
-    void *opaque;
-    int is_write;
-
-    int64_t buf_offset; /* start of buffer when writing, end of buffer
-                           when reading */
-    int buf_index;
-    int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
-
-    int last_error;
-};
-
-typedef struct QEMUFileStdio
-{
-    FILE *stdio_file;
-    QEMUFile *file;
-} QEMUFileStdio;
-
-typedef struct QEMUFileSocket
-{
-    int fd;
-    QEMUFile *file;
-} QEMUFileSocket;
-
-static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
-{
-    QEMUFileSocket *s = opaque;
-    ssize_t len;
-
-    do {
-        len = qemu_recv(s->fd, buf, size, 0);
-    } while (len == -1 && socket_error() == EINTR);
-
-    if (len == -1)
-        len = -socket_error();
-
-    return len;
-}
-
-static int socket_close(void *opaque)
-{
-    QEMUFileSocket *s = opaque;
-    g_free(s);
-    return 0;
-}
-
-static int stdio_put_buffer(void *opaque, const uint8_t *buf, int64_t pos, int size)
-{
-    QEMUFileStdio *s = opaque;
-    return fwrite(buf, 1, size, s->stdio_file);
-}
-
-static int stdio_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
-{
-    QEMUFileStdio *s = opaque;
-    FILE *fp = s->stdio_file;
-    int bytes;
-
-    do {
-        clearerr(fp);
-        bytes = fread(buf, 1, size, fp);
-    } while ((bytes == 0) && ferror(fp) && (errno == EINTR));
-    return bytes;
-}
-
-static int stdio_pclose(void *opaque)
-{
-    QEMUFileStdio *s = opaque;
-    int ret;
-    ret = pclose(s->stdio_file);
-    if (ret == -1) {
-        ret = -errno;
-    }
-    g_free(s);
-    return ret;
-}
-
-static int stdio_fclose(void *opaque)
-{
-    QEMUFileStdio *s = opaque;
-    int ret = 0;
-    if (fclose(s->stdio_file) == EOF) {
-        ret = -errno;
-    }
-    g_free(s);
-    return ret;
-}
-
-QEMUFile *qemu_popen(FILE *stdio_file, const char *mode)
-{
-    QEMUFileStdio *s;
-
-    if (stdio_file == NULL || mode == NULL || (mode[0] != 'r' && mode[0] != 'w') || mode[1] != 0) {
-        fprintf(stderr, "qemu_popen: Argument validity check failed\n");
-        return NULL;
-    }
-
-    s = g_malloc0(sizeof(QEMUFileStdio));
-
-    s->stdio_file = stdio_file;
-
-    if(mode[0] == 'r') {
-        s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_pclose, 
-				 NULL, NULL, NULL);
-    } else {
-        s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_pclose, 
-				 NULL, NULL, NULL);
-    }
-    return s->file;
-}
-
-QEMUFile *qemu_popen_cmd(const char *command, const char *mode)
-{
-    FILE *popen_file;
-
-    popen_file = popen(command, mode);
-    if(popen_file == NULL) {
-        return NULL;
-    }
-
-    return qemu_popen(popen_file, mode);
-}
-
-int qemu_stdio_fd(QEMUFile *f)
-{
-    QEMUFileStdio *p;
-    int fd;
-
-    p = (QEMUFileStdio *)f->opaque;
-    fd = fileno(p->stdio_file);
-
-    return fd;
-}
-
-QEMUFile *qemu_fdopen(int fd, const char *mode)
-{
-    QEMUFileStdio *s;
-
-    if (mode == NULL ||
-	(mode[0] != 'r' && mode[0] != 'w') ||
-	mode[1] != 'b' || mode[2] != 0) {
-        fprintf(stderr, "qemu_fdopen: Argument validity check failed\n");
-        return NULL;
-    }
-
-    s = g_malloc0(sizeof(QEMUFileStdio));
-    s->stdio_file = fdopen(fd, mode);
-    if (!s->stdio_file)
-        goto fail;
-
-    if(mode[0] == 'r') {
-        s->file = qemu_fopen_ops(s, NULL, stdio_get_buffer, stdio_fclose, 
-				 NULL, NULL, NULL);
-    } else {
-        s->file = qemu_fopen_ops(s, stdio_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
-    }
-    return s->file;
-
-fail:
-    g_free(s);
-    return NULL;
-}
-
-QEMUFile *qemu_fopen_socket(int fd)
-{
-    QEMUFileSocket *s = g_malloc0(sizeof(QEMUFileSocket));
-
-    s->fd = fd;
-    s->file = qemu_fopen_ops(s, NULL, socket_get_buffer, socket_close, 
-			     NULL, NULL, NULL);
-    return s->file;
-}
-
-static int file_put_buffer(void *opaque, const uint8_t *buf,
-                            int64_t pos, int size)
-{
-    QEMUFileStdio *s = opaque;
-    fseek(s->stdio_file, pos, SEEK_SET);
-    return fwrite(buf, 1, size, s->stdio_file);
-}
-
-static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
-{
-    QEMUFileStdio *s = opaque;
-    fseek(s->stdio_file, pos, SEEK_SET);
-    return fread(buf, 1, size, s->stdio_file);
-}
-
-QEMUFile *qemu_fopen(const char *filename, const char *mode)
-{
-    QEMUFileStdio *s;
-
-    if (mode == NULL ||
-	(mode[0] != 'r' && mode[0] != 'w') ||
-	mode[1] != 'b' || mode[2] != 0) {
-        fprintf(stderr, "qemu_fopen: Argument validity check failed\n");
-        return NULL;
-    }
-
-    s = g_malloc0(sizeof(QEMUFileStdio));
-
-    s->stdio_file = fopen(filename, mode);
-    if (!s->stdio_file)
-        goto fail;
-    
-    if(mode[0] == 'w') {
-        s->file = qemu_fopen_ops(s, file_put_buffer, NULL, stdio_fclose, 
-				 NULL, NULL, NULL);
-    } else {
-        s->file = qemu_fopen_ops(s, NULL, file_get_buffer, stdio_fclose, 
-			       NULL, NULL, NULL);
-    }
-    return s->file;
-fail:
-    g_free(s);
-    return NULL;
-}
-
-static int block_put_buffer(void *opaque, const uint8_t *buf,
-                           int64_t pos, int size)
-{
-    bdrv_save_vmstate(opaque, buf, pos, size);
-    return size;
-}
-
-static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
-{
-    return bdrv_load_vmstate(opaque, buf, pos, size);
-}
-
-static int bdrv_fclose(void *opaque)
-{
-    return bdrv_flush(opaque);
-}
-
-static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
-{
-    if (is_writable)
-        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
-			      NULL, NULL, NULL);
-    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
-}
-
-QEMUFile *qemu_fopen_ops(void *opaque, QEMUFilePutBufferFunc *put_buffer,
-                         QEMUFileGetBufferFunc *get_buffer,
-                         QEMUFileCloseFunc *close,
-                         QEMUFileRateLimit *rate_limit,
-                         QEMUFileSetRateLimit *set_rate_limit,
-                         QEMUFileGetRateLimit *get_rate_limit)
-{
-    QEMUFile *f;
-
-    f = g_malloc0(sizeof(QEMUFile));
-
-    f->opaque = opaque;
-    f->put_buffer = put_buffer;
-    f->get_buffer = get_buffer;
-    f->close = close;
-    f->rate_limit = rate_limit;
-    f->set_rate_limit = set_rate_limit;
-    f->get_rate_limit = get_rate_limit;
-    f->is_write = 0;
-
-    return f;
-}
-
-int qemu_file_get_error(QEMUFile *f)
-{
-    return f->last_error;
-}
-
-void qemu_file_set_error(QEMUFile *f, int ret)
-{
-    f->last_error = ret;
-}
-
-/** Sets last_error conditionally
- *
- * Sets last_error only if ret is negative _and_ no error
- * was set before.
- */
-static void qemu_file_set_if_error(QEMUFile *f, int ret)
-{
-    if (ret < 0 && !f->last_error) {
-        qemu_file_set_error(f, ret);
-    }
-}
-
-/** Flushes QEMUFile buffer
- *
- * In case of error, last_error is set.
- */
-void qemu_fflush(QEMUFile *f)
-{
-    if (!f->put_buffer)
-        return;
-
-    if (f->is_write && f->buf_index > 0) {
-        int len;
-
-        len = f->put_buffer(f->opaque, f->buf, f->buf_offset, f->buf_index);
-        if (len > 0)
-            f->buf_offset += f->buf_index;
-        else
-            qemu_file_set_error(f, -EINVAL);
-        f->buf_index = 0;
-    }
-}
-
-static void qemu_fill_buffer(QEMUFile *f)
-{
-    int len;
-    int pending;
-
-    if (!f->get_buffer)
-        return;
-
-    if (f->is_write)
-        abort();
-
-    pending = f->buf_size - f->buf_index;
-    if (pending > 0) {
-        memmove(f->buf, f->buf + f->buf_index, pending);
-    }
-    f->buf_index = 0;
-    f->buf_size = pending;
-
-    len = f->get_buffer(f->opaque, f->buf + pending, f->buf_offset,
-                        IO_BUF_SIZE - pending);
-    if (len > 0) {
-        f->buf_size += len;
-        f->buf_offset += len;
-    } else if (len == 0) {
-        f->last_error = -EIO;
-    } else if (len != -EAGAIN)
-        qemu_file_set_error(f, len);
-}
-
-/** Calls close function and set last_error if needed
- *
- * Internal function. qemu_fflush() must be called before this.
- *
- * Returns f->close() return value, or 0 if close function is not set.
- */
-static int qemu_close(QEMUFile *f)
-{
-    int ret = 0;
-    if (f->close) {
-        ret = f->close(f->opaque);
-        qemu_file_set_if_error(f, ret);
-    }
-    return ret;
-}
-
-/** Closes the file
- *
- * Returns negative error value if any error happened on previous operations or
- * while closing the file. Returns 0 or positive number on success.
- *
- * The meaning of return value on success depends on the specific backend
- * being used.
- */
-int qemu_fclose(QEMUFile *f)
-{
-    int ret;
-    qemu_fflush(f);
-    ret = qemu_close(f);
-    /* If any error was spotted before closing, we should report it
-     * instead of the close() return value.
-     */
-    if (f->last_error) {
-        ret = f->last_error;
-    }
-    g_free(f);
-    return ret;
-}
-
-void qemu_file_put_notify(QEMUFile *f)
-{
-    f->put_buffer(f->opaque, NULL, 0, 0);
-}
-
-void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
-{
-    int l;
-
-    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
-        fprintf(stderr,
-                "Attempted to write to buffer while read buffer is not empty\n");
-        abort();
-    }
-
-    while (!f->last_error && size > 0) {
-        l = IO_BUF_SIZE - f->buf_index;
-        if (l > size)
-            l = size;
-        memcpy(f->buf + f->buf_index, buf, l);
-        f->is_write = 1;
-        f->buf_index += l;
-        buf += l;
-        size -= l;
-        if (f->buf_index >= IO_BUF_SIZE)
-            qemu_fflush(f);
-    }
-}
-
-void qemu_put_byte(QEMUFile *f, int v)
-{
-    if (!f->last_error && f->is_write == 0 && f->buf_index > 0) {
-        fprintf(stderr,
-                "Attempted to write to buffer while read buffer is not empty\n");
-        abort();
-    }
-
-    f->buf[f->buf_index++] = v;
-    f->is_write = 1;
-    if (f->buf_index >= IO_BUF_SIZE)
-        qemu_fflush(f);
-}
-
-static void qemu_file_skip(QEMUFile *f, int size)
-{
-    if (f->buf_index + size <= f->buf_size) {
-        f->buf_index += size;
-    }
-}
-
-static int qemu_peek_buffer(QEMUFile *f, uint8_t *buf, int size, size_t offset)
-{
-    int pending;
-    int index;
-
-    if (f->is_write) {
-        abort();
-    }
-
-    index = f->buf_index + offset;
-    pending = f->buf_size - index;
-    if (pending < size) {
-        qemu_fill_buffer(f);
-        index = f->buf_index + offset;
-        pending = f->buf_size - index;
-    }
-
-    if (pending <= 0) {
-        return 0;
-    }
-    if (size > pending) {
-        size = pending;
-    }
-
-    memcpy(buf, f->buf + index, size);
-    return size;
-}
-
-int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
-{
-    int pending = size;
-    int done = 0;
-
-    while (pending > 0) {
-        int res;
-
-        res = qemu_peek_buffer(f, buf, pending, 0);
-        if (res == 0) {
-            return done;
-        }
-        qemu_file_skip(f, res);
-        buf += res;
-        pending -= res;
-        done += res;
-    }
-    return done;
-}
-
-static int qemu_peek_byte(QEMUFile *f, int offset)
-{
-    int index = f->buf_index + offset;
-
-    if (f->is_write) {
-        abort();
-    }
-
-    if (index >= f->buf_size) {
-        qemu_fill_buffer(f);
-        index = f->buf_index + offset;
-        if (index >= f->buf_size) {
-            return 0;
-        }
-    }
-    return f->buf[index];
-}
-
-int qemu_get_byte(QEMUFile *f)
-{
-    int result;
-
-    result = qemu_peek_byte(f, 0);
-    qemu_file_skip(f, 1);
-    return result;
-}
-
-int64_t qemu_ftell(QEMUFile *f)
-{
-    return f->buf_offset - f->buf_size + f->buf_index;
-}
-
-int64_t qemu_fseek(QEMUFile *f, int64_t pos, int whence)
-{
-    if (whence == SEEK_SET) {
-        /* nothing to do */
-    } else if (whence == SEEK_CUR) {
-        pos += qemu_ftell(f);
-    } else {
-        /* SEEK_END not supported */
-        return -1;
-    }
-    if (f->put_buffer) {
-        qemu_fflush(f);
-        f->buf_offset = pos;
-    } else {
-        f->buf_offset = pos;
-        f->buf_index = 0;
-        f->buf_size = 0;
-    }
-    return pos;
-}
-
-int qemu_file_rate_limit(QEMUFile *f)
-{
-    if (f->rate_limit)
-        return f->rate_limit(f->opaque);
-
-    return 0;
-}
-
-int64_t qemu_file_get_rate_limit(QEMUFile *f)
-{
-    if (f->get_rate_limit)
-        return f->get_rate_limit(f->opaque);
-
-    return 0;
-}
-
-int64_t qemu_file_set_rate_limit(QEMUFile *f, int64_t new_rate)
-{
-    /* any failed or completed migration keeps its state to allow probing of
-     * migration data, but has no associated file anymore */
-    if (f && f->set_rate_limit)
-        return f->set_rate_limit(f->opaque, new_rate);
-
-    return 0;
-}
-
-void qemu_put_be16(QEMUFile *f, unsigned int v)
-{
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
-}
-
-void qemu_put_be32(QEMUFile *f, unsigned int v)
-{
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
-}
-
-void qemu_put_be64(QEMUFile *f, uint64_t v)
-{
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
-}
-
-unsigned int qemu_get_be16(QEMUFile *f)
-{
-    unsigned int v;
-    v = qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
-}
-
-unsigned int qemu_get_be32(QEMUFile *f)
-{
-    unsigned int v;
-    v = qemu_get_byte(f) << 24;
-    v |= qemu_get_byte(f) << 16;
-    v |= qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
-}
-
-uint64_t qemu_get_be64(QEMUFile *f)
-{
-    uint64_t v;
-    v = (uint64_t)qemu_get_be32(f) << 32;
-    v |= qemu_get_be32(f);
-    return v;
-}
-
-
-/* timer */
-
-void qemu_put_timer(QEMUFile *f, QEMUTimer *ts)
-{
-    uint64_t expire_time;
-
-    expire_time = qemu_timer_expire_time_ns(ts);
-    qemu_put_be64(f, expire_time);
-}
-
-void qemu_get_timer(QEMUFile *f, QEMUTimer *ts)
-{
-    uint64_t expire_time;
-
-    expire_time = qemu_get_be64(f);
-    if (expire_time != -1) {
-        qemu_mod_timer_ns(ts, expire_time);
-    } else {
-        qemu_del_timer(ts);
-    }
-}
-
-
-/* bool */
-
-static int get_bool(QEMUFile *f, void *pv, size_t size)
-{
-    bool *v = pv;
-    *v = qemu_get_byte(f);
-    return 0;
-}
-
-static void put_bool(QEMUFile *f, void *pv, size_t size)
-{
-    bool *v = pv;
-    qemu_put_byte(f, *v);
-}
-
-const VMStateInfo vmstate_info_bool = {
-    .name = "bool",
-    .get  = get_bool,
-    .put  = put_bool,
-};
-
-/* 8 bit int */
-
-static int get_int8(QEMUFile *f, void *pv, size_t size)
-{
-    int8_t *v = pv;
-    qemu_get_s8s(f, v);
-    return 0;
-}
-
-static void put_int8(QEMUFile *f, void *pv, size_t size)
-{
-    int8_t *v = pv;
-    qemu_put_s8s(f, v);
-}
-
-const VMStateInfo vmstate_info_int8 = {
-    .name = "int8",
-    .get  = get_int8,
-    .put  = put_int8,
-};
-
-/* 16 bit int */
-
-static int get_int16(QEMUFile *f, void *pv, size_t size)
-{
-    int16_t *v = pv;
-    qemu_get_sbe16s(f, v);
-    return 0;
-}
-
-static void put_int16(QEMUFile *f, void *pv, size_t size)
-{
-    int16_t *v = pv;
-    qemu_put_sbe16s(f, v);
-}
-
-const VMStateInfo vmstate_info_int16 = {
-    .name = "int16",
-    .get  = get_int16,
-    .put  = put_int16,
-};
-
-/* 32 bit int */
-
-static int get_int32(QEMUFile *f, void *pv, size_t size)
-{
-    int32_t *v = pv;
-    qemu_get_sbe32s(f, v);
-    return 0;
-}
-
-static void put_int32(QEMUFile *f, void *pv, size_t size)
-{
-    int32_t *v = pv;
-    qemu_put_sbe32s(f, v);
-}
-
-const VMStateInfo vmstate_info_int32 = {
-    .name = "int32",
-    .get  = get_int32,
-    .put  = put_int32,
-};
-
-/* 32 bit int. See that the received value is the same than the one
-   in the field */
-
-static int get_int32_equal(QEMUFile *f, void *pv, size_t size)
-{
-    int32_t *v = pv;
-    int32_t v2;
-    qemu_get_sbe32s(f, &v2);
-
-    if (*v == v2)
-        return 0;
-    return -EINVAL;
-}
-
-const VMStateInfo vmstate_info_int32_equal = {
-    .name = "int32 equal",
-    .get  = get_int32_equal,
-    .put  = put_int32,
-};
-
-/* 32 bit int. See that the received value is the less or the same
-   than the one in the field */
-
-static int get_int32_le(QEMUFile *f, void *pv, size_t size)
-{
-    int32_t *old = pv;
-    int32_t new;
-    qemu_get_sbe32s(f, &new);
-
-    if (*old <= new)
-        return 0;
-    return -EINVAL;
-}
-
-const VMStateInfo vmstate_info_int32_le = {
-    .name = "int32 equal",
-    .get  = get_int32_le,
-    .put  = put_int32,
-};
-
-/* 64 bit int */
-
-static int get_int64(QEMUFile *f, void *pv, size_t size)
-{
-    int64_t *v = pv;
-    qemu_get_sbe64s(f, v);
-    return 0;
-}
-
-static void put_int64(QEMUFile *f, void *pv, size_t size)
-{
-    int64_t *v = pv;
-    qemu_put_sbe64s(f, v);
-}
-
-const VMStateInfo vmstate_info_int64 = {
-    .name = "int64",
-    .get  = get_int64,
-    .put  = put_int64,
-};
-
-/* 8 bit unsigned int */
-
-static int get_uint8(QEMUFile *f, void *pv, size_t size)
-{
-    uint8_t *v = pv;
-    qemu_get_8s(f, v);
-    return 0;
-}
-
-static void put_uint8(QEMUFile *f, void *pv, size_t size)
-{
-    uint8_t *v = pv;
-    qemu_put_8s(f, v);
-}
-
-const VMStateInfo vmstate_info_uint8 = {
-    .name = "uint8",
-    .get  = get_uint8,
-    .put  = put_uint8,
-};
-
-/* 16 bit unsigned int */
-
-static int get_uint16(QEMUFile *f, void *pv, size_t size)
-{
-    uint16_t *v = pv;
-    qemu_get_be16s(f, v);
-    return 0;
-}
-
-static void put_uint16(QEMUFile *f, void *pv, size_t size)
-{
-    uint16_t *v = pv;
-    qemu_put_be16s(f, v);
-}
-
-const VMStateInfo vmstate_info_uint16 = {
-    .name = "uint16",
-    .get  = get_uint16,
-    .put  = put_uint16,
-};
-
-/* 32 bit unsigned int */
-
-static int get_uint32(QEMUFile *f, void *pv, size_t size)
-{
-    uint32_t *v = pv;
-    qemu_get_be32s(f, v);
-    return 0;
-}
-
-static void put_uint32(QEMUFile *f, void *pv, size_t size)
-{
-    uint32_t *v = pv;
-    qemu_put_be32s(f, v);
-}
-
-const VMStateInfo vmstate_info_uint32 = {
-    .name = "uint32",
-    .get  = get_uint32,
-    .put  = put_uint32,
-};
-
-/* 32 bit uint. See that the received value is the same than the one
-   in the field */
-
-static int get_uint32_equal(QEMUFile *f, void *pv, size_t size)
-{
-    uint32_t *v = pv;
-    uint32_t v2;
-    qemu_get_be32s(f, &v2);
-
-    if (*v == v2) {
-        return 0;
-    }
-    return -EINVAL;
-}
-
-const VMStateInfo vmstate_info_uint32_equal = {
-    .name = "uint32 equal",
-    .get  = get_uint32_equal,
-    .put  = put_uint32,
-};
-
-/* 64 bit unsigned int */
-
-static int get_uint64(QEMUFile *f, void *pv, size_t size)
-{
-    uint64_t *v = pv;
-    qemu_get_be64s(f, v);
-    return 0;
-}
-
-static void put_uint64(QEMUFile *f, void *pv, size_t size)
-{
-    uint64_t *v = pv;
-    qemu_put_be64s(f, v);
-}
-
-const VMStateInfo vmstate_info_uint64 = {
-    .name = "uint64",
-    .get  = get_uint64,
-    .put  = put_uint64,
-};
-
-/* 8 bit int. See that the received value is the same than the one
-   in the field */
+/* A file in memory; it carries the device state of a post-copy migration */
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} QEMUFileBuffer;
 
-static int get_uint8_equal(QEMUFile *f, void *pv, size_t size)
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
 {
-    uint8_t *v = pv;
-    uint8_t v2;
-    qemu_get_8s(f, &v2);
+    QEMUFileBuffer *s = opaque;
 
-    if (*v == v2)
-        return 0;
-    return -EINVAL;
+    if (s->size + size > s->capacity) {
+        s->capacity = MAX(s->capacity * 2, s->size + size);
+        s->data = g_realloc(s->data, s->capacity);
+    }
+    memcpy(s->data + s->size, buf, size);
+    s->size += size;
+    return size;
 }
 
-const VMStateInfo vmstate_info_uint8_equal = {
-    .name = "uint8 equal",
-    .get  = get_uint8_equal,
-    .put  = put_uint8,
-};
-
-/* 16 bit unsigned int int. See that the received value is the same than the one
-   in the field */
-
-static int get_uint16_equal(QEMUFile *f, void *pv, size_t size)
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    uint16_t *v = pv;
-    uint16_t v2;
-    qemu_get_be16s(f, &v2);
+    QEMUFileBuffer *s = opaque;
 
-    if (*v == v2)
+    if (pos >= s->size) {
         return 0;
-    return -EINVAL;
+    }
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
 }
 
-const VMStateInfo vmstate_info_uint16_equal = {
-    .name = "uint16 equal",
-    .get  = get_uint16_equal,
-    .put  = put_uint16,
-};
-
-/* timers  */
-
-static int get_timer(QEMUFile *f, void *pv, size_t size)
+static int buffer_close(void *opaque)
 {
-    QEMUTimer *v = pv;
-    qemu_get_timer(f, v);
-    return 0;
-}
+    QEMUFileBuffer *s = opaque;
 
-static void put_timer(QEMUFile *f, void *pv, size_t size)
-{
-    QEMUTimer *v = pv;
-    qemu_put_timer(f, v);
+    g_free(s->data);
+    g_free(s);
+    return 0;
 }
 
-const VMStateInfo vmstate_info_timer = {
-    .name = "timer",
-    .get  = get_timer,
-    .put  = put_timer,
-};
-
-/* uint8_t buffers */
-
-static int get_buffer(QEMUFile *f, void *pv, size_t size)
+static int block_put_buffer(void *opaque, const uint8_t *buf,
+                           int64_t pos, int size)
 {
-    uint8_t *v = pv;
-    qemu_get_buffer(f, v, size);
-    return 0;
+    bdrv_save_vmstate(opaque, buf, pos, size);
+    return size;
 }
 
-static void put_buffer(QEMUFile *f, void *pv, size_t size)
+static int block_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 {
-    uint8_t *v = pv;
-    qemu_put_buffer(f, v, size);
+    return bdrv_load_vmstate(opaque, buf, pos, size);
 }
 
-const VMStateInfo vmstate_info_buffer = {
-    .name = "buffer",
-    .get  = get_buffer,
-    .put  = put_buffer,
-};
-
-/* unused buffers: space that was used for some fields that are
-   not useful anymore */
-
-static int get_unused_buffer(QEMUFile *f, void *pv, size_t size)
+static int bdrv_fclose(void *opaque)
 {
-    uint8_t buf[1024];
-    int block_len;
-
-    while (size > 0) {
-        block_len = MIN(sizeof(buf), size);
-        size -= block_len;
-        qemu_get_buffer(f, buf, block_len);
-    }
-   return 0;
+    return bdrv_flush(opaque);
 }
 
-static void put_unused_buffer(QEMUFile *f, void *pv, size_t size)
+static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
 {
-    static const uint8_t buf[1024];
-    int block_len;
-
-    while (size > 0) {
-        block_len = MIN(sizeof(buf), size);
-        size -= block_len;
-        qemu_put_buffer(f, buf, block_len);
-    }
+    if (is_writable)
+        return qemu_fopen_ops(bs, block_put_buffer, NULL, bdrv_fclose, 
+			      NULL, NULL, NULL);
+    return qemu_fopen_ops(bs, NULL, block_get_buffer, bdrv_fclose, NULL, NULL, NULL);
 }
 
-const VMStateInfo vmstate_info_unused_buffer = {
-    .name = "unused_buffer",
-    .get  = get_unused_buffer,
-    .put  = put_unused_buffer,
-};
-
 typedef struct CompatEntry {
     char idstr[256];
     int instance_id;
@@ -1184,6 +254,17 @@ static QTAILQ_HEAD(savevm_handlers, SaveStateEntry) savevm_handlers =
     QTAILQ_HEAD_INITIALIZER(savevm_handlers);
 static int global_section_id;
 
+/* "instance_id/idstr" -> SaveStateEntry, built by find_se() on demand */
+static GHashTable *savevm_section_table;
+
+static void savevm_handlers_changed(void)
+{
+    if (savevm_section_table) {
+        g_hash_table_destroy(savevm_section_table);
+        savevm_section_table = NULL;
+    }
+}
+
 static int calculate_new_instance_id(const char *idstr)
 {
     SaveStateEntry *se;
@@ -1264,6 +345,7 @@ int register_savevm_live(DeviceState *dev,
     assert(!se->compat || se->instance_id == 0);
     /* add at the end of list */
     QTAILQ_INSERT_TAIL(&savevm_handlers, se, entry);
+    savevm_handlers_changed();
     return 0;
 }
 
@@ -1300,6 +382,7 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
     QTAILQ_FOREACH_SAFE(se, &savevm_handlers, entry, new_se) {
         if (strcmp(se->idstr, id) == 0 && se->opaque == opaque) {
             QTAILQ_REMOVE(&savevm_handlers, se, entry);
+            savevm_handlers_changed();
             if (se->compat) {
                 g_free(se->compat);
             }
@@ -1351,6 +434,7 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
     assert(!se->compat || se->instance_id == 0);
     /* add at the end of list */
     QTAILQ_INSERT_TAIL(&savevm_handlers, se, entry);
+    savevm_handlers_changed();
     return 0;
 }
 
@@ -1369,6 +453,7 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     QTAILQ_FOREACH_SAFE(se, &savevm_handlers, entry, new_se) {
         if (se->vmsd == vmsd && se->opaque == opaque) {
             QTAILQ_REMOVE(&savevm_handlers, se, entry);
+            savevm_handlers_changed();
             if (se->compat) {
                 g_free(se->compat);
             }
@@ -1377,142 +462,6 @@ void vmstate_unregister(DeviceState *dev, const VMStateDescription *vmsd,
     }
 }
 
-static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
-                                    void *opaque);
-static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
-                                   void *opaque);
-
-int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
-                       void *opaque, int version_id)
-{
-    VMStateField *field = vmsd->fields;
-    int ret;
-
-    if (version_id > vmsd->version_id) {
-        return -EINVAL;
-    }
-    if (version_id < vmsd->minimum_version_id_old) {
-        return -EINVAL;
-    }
-    if  (version_id < vmsd->minimum_version_id) {
-        return vmsd->load_state_old(f, opaque, version_id);
-    }
-    if (vmsd->pre_load) {
-        int ret = vmsd->pre_load(opaque);
-        if (ret)
-            return ret;
-    }
-    while(field->name) {
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *base_addr = opaque + field->offset;
-            int i, n_elems = 1;
-            int size = field->size;
-
-            if (field->flags & VMS_VBUFFER) {
-                size = *(int32_t *)(opaque+field->size_offset);
-                if (field->flags & VMS_MULTIPLY) {
-                    size *= field->size;
-                }
-            }
-            if (field->flags & VMS_ARRAY) {
-                n_elems = field->num;
-            } else if (field->flags & VMS_VARRAY_INT32) {
-                n_elems = *(int32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT32) {
-                n_elems = *(uint32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT16) {
-                n_elems = *(uint16_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT8) {
-                n_elems = *(uint8_t *)(opaque+field->num_offset);
-            }
-            if (field->flags & VMS_POINTER) {
-                base_addr = *(void **)base_addr + field->start;
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr, field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
-
-                }
-                if (ret < 0) {
-                    return ret;
-                }
-            }
-        }
-        field++;
-    }
-    ret = vmstate_subsection_load(f, vmsd, opaque);
-    if (ret != 0) {
-        return ret;
-    }
-    if (vmsd->post_load) {
-        return vmsd->post_load(opaque, version_id);
-    }
-    return 0;
-}
-
-void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
-                        void *opaque)
-{
-    VMStateField *field = vmsd->fields;
-
-    if (vmsd->pre_save) {
-        vmsd->pre_save(opaque);
-    }
-    while(field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = opaque + field->offset;
-            int i, n_elems = 1;
-            int size = field->size;
-
-            if (field->flags & VMS_VBUFFER) {
-                size = *(int32_t *)(opaque+field->size_offset);
-                if (field->flags & VMS_MULTIPLY) {
-                    size *= field->size;
-                }
-            }
-            if (field->flags & VMS_ARRAY) {
-                n_elems = field->num;
-            } else if (field->flags & VMS_VARRAY_INT32) {
-                n_elems = *(int32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT32) {
-                n_elems = *(uint32_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT16) {
-                n_elems = *(uint16_t *)(opaque+field->num_offset);
-            } else if (field->flags & VMS_VARRAY_UINT8) {
-                n_elems = *(uint8_t *)(opaque+field->num_offset);
-            }
-            if (field->flags & VMS_POINTER) {
-                base_addr = *(void **)base_addr + field->start;
-            }
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr);
-                } else {
-                    field->info->put(f, addr, size);
-                }
-            }
-        }
-        field++;
-    }
-    vmstate_subsection_save(f, vmsd, opaque);
-}
-
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se, int version_id)
 {
     if (!se->vmsd) {         /* Old style */
@@ -1539,7 +488,9 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_PART         0x02
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
-#define QEMU_VM_SUBSECTION           0x05
+/* 0x05 is QEMU_VM_SUBSECTION, in vmstate.c */
+/* the device state, as one blob, followed by the post-copy phase */
+#define QEMU_VM_POSTCOPY             0x06
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1650,20 +601,14 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     if (ret != 0) {
         return ret;
     }
-    ret = qemu_file_get_error(f);
-    if (ret != 0) {
-        qemu_savevm_state_cancel(f);
-    }
-    return ret;
+    return qemu_file_get_error(f);
 }
 
-int qemu_savevm_state_complete(QEMUFile *f)
+static int qemu_savevm_state_complete_live(QEMUFile *f, bool postcopy)
 {
     SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -1678,20 +623,33 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
-        ret = se->ops->save_live_complete(f, se->opaque);
+        if (postcopy && se->ops->save_live_postcopy) {
+            ret = se->ops->save_live_postcopy(f, se->opaque);
+        } else {
+            ret = se->ops->save_live_complete(f, se->opaque);
+        }
         trace_savevm_section_end(se->section_id);
         if (ret < 0) {
             return ret;
         }
     }
+    return 0;
+}
+
+static void qemu_savevm_state_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_time, start_pos;
         int len;
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
 	    continue;
         }
         trace_savevm_section_start();
+        start_time = get_clock();
+        start_pos = qemu_ftell(f);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_FULL);
         qemu_put_be32(f, se->section_id);
@@ -1705,14 +663,92 @@ int qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se);
+        trace_savevm_section_full(se->idstr, se->instance_id,
+                                  qemu_ftell(f) - start_pos,
+                                  get_clock() - start_time);
         trace_savevm_section_end(se->section_id);
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+}
+
+int qemu_savevm_state_complete(QEMUFile *f)
+{
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f, false);
+    if (ret < 0) {
+        return ret;
+    }
+    qemu_savevm_state_devices(f);
+
+    return qemu_file_get_error(f);
+}
+
+/*
+ * qemu_savevm_state_postcopy: Stop-and-copy for a post-copy migration
+ *
+ * Like qemu_savevm_state_complete(), but the live sections that support
+ * post-copy only send what the destination needs to start running.  The
+ * device state goes as a single blob: the destination reads all of it
+ * before loading it, so that @f is free for the pages that the devices
+ * fault on while they are loaded.  What follows on @f is up to the
+ * save_live_postcopy handlers.
+ */
+int qemu_savevm_state_postcopy(QEMUFile *f)
+{
+    QEMUFileBuffer *b;
+    QEMUFile *pf;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    ret = qemu_savevm_state_complete_live(f, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    b = g_malloc0(sizeof(*b));
+    pf = qemu_fopen_ops(b, buffer_put_buffer, NULL, buffer_close,
+                        NULL, NULL, NULL);
+    qemu_savevm_state_devices(pf);
+    qemu_fflush(pf);
+
+    qemu_put_byte(f, QEMU_VM_POSTCOPY);
+    qemu_put_be32(f, b->size);
+    qemu_put_buffer(f, b->data, b->size);
+    qemu_fclose(pf);
 
     return qemu_file_get_error(f);
 }
 
+/*
+ * Returns the amount of data that the live handlers still have to send.
+ * max_size is the amount of data that can be sent within the allowed
+ * downtime; handlers may use it to decide whether it is worth resyncing
+ * their dirty state before answering.
+ */
+uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
+{
+    SaveStateEntry *se;
+    uint64_t ret = 0;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_pending) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        ret += se->ops->save_live_pending(f, se->opaque, max_size);
+    }
+    return ret;
+}
+
 void qemu_savevm_state_cancel(QEMUFile *f)
 {
     SaveStateEntry *se;
@@ -1743,8 +779,10 @@ static int qemu_savevm_state(QEMUFile *f)
 
     do {
         ret = qemu_savevm_state_iterate(f);
-        if (ret < 0)
+        if (ret < 0) {
+            qemu_savevm_state_cancel(f);
             goto out;
+        }
     } while (ret == 0);
 
     ret = qemu_savevm_state_complete(f);
@@ -1796,97 +834,56 @@ static int qemu_save_device_state(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
-static SaveStateEntry *find_se(const char *idstr, int instance_id)
+static void savevm_section_add(const char *idstr, int instance_id,
+                               SaveStateEntry *se)
 {
-    SaveStateEntry *se;
-
-    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        if (!strcmp(se->idstr, idstr) &&
-            (instance_id == se->instance_id ||
-             instance_id == se->alias_id))
-            return se;
-        /* Migrating from an older version? */
-        if (strstr(se->idstr, idstr) && se->compat) {
-            if (!strcmp(se->compat->idstr, idstr) &&
-                (instance_id == se->compat->instance_id ||
-                 instance_id == se->alias_id))
-                return se;
-        }
-    }
-    return NULL;
-}
+    char *key = g_strdup_printf("%d/%s", instance_id, idstr);
 
-static const VMStateDescription *vmstate_get_subsection(const VMStateSubsection *sub, char *idstr)
-{
-    while(sub && sub->needed) {
-        if (strcmp(idstr, sub->vmsd->name) == 0) {
-            return sub->vmsd;
-        }
-        sub++;
+    /* the first one registered wins, as with a walk of savevm_handlers */
+    if (g_hash_table_lookup(savevm_section_table, key)) {
+        g_free(key);
+        return;
     }
-    return NULL;
+    g_hash_table_insert(savevm_section_table, key, se);
 }
 
-static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
-                                   void *opaque)
+static void savevm_section_table_build(void)
 {
-    while (qemu_peek_byte(f, 0) == QEMU_VM_SUBSECTION) {
-        char idstr[256];
-        int ret;
-        uint8_t version_id, len, size;
-        const VMStateDescription *sub_vmsd;
-
-        len = qemu_peek_byte(f, 1);
-        if (len < strlen(vmsd->name) + 1) {
-            /* subsection name has be be "section_name/a" */
-            return 0;
-        }
-        size = qemu_peek_buffer(f, (uint8_t *)idstr, len, 2);
-        if (size != len) {
-            return 0;
-        }
-        idstr[size] = 0;
+    SaveStateEntry *se;
 
-        if (strncmp(vmsd->name, idstr, strlen(vmsd->name)) != 0) {
-            /* it don't have a valid subsection name */
-            return 0;
-        }
-        sub_vmsd = vmstate_get_subsection(vmsd->subsections, idstr);
-        if (sub_vmsd == NULL) {
-            return -ENOENT;
+    savevm_section_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        savevm_section_add(se->idstr, se->instance_id, se);
+        if (se->alias_id != -1) {
+            savevm_section_add(se->idstr, se->alias_id, se);
         }
-        qemu_file_skip(f, 1); /* subsection */
-        qemu_file_skip(f, 1); /* len */
-        qemu_file_skip(f, len); /* idstr */
-        version_id = qemu_get_be32(f);
-
-        ret = vmstate_load_state(f, sub_vmsd, opaque, version_id);
-        if (ret) {
-            return ret;
+        /* Migrating from an older version? */
+        if (se->compat) {
+            savevm_section_add(se->compat->idstr, se->compat->instance_id, se);
+            if (se->alias_id != -1) {
+                savevm_section_add(se->compat->idstr, se->alias_id, se);
+            }
         }
     }
-    return 0;
 }
 
-static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
-                                    void *opaque)
+/*
+ * Sections are looked up once per device on load, so a walk of
+ * savevm_handlers would be quadratic in the number of devices.
+ */
+static SaveStateEntry *find_se(const char *idstr, int instance_id)
 {
-    const VMStateSubsection *sub = vmsd->subsections;
-
-    while (sub && sub->needed) {
-        if (sub->needed(opaque)) {
-            const VMStateDescription *vmsd = sub->vmsd;
-            uint8_t len;
-
-            qemu_put_byte(f, QEMU_VM_SUBSECTION);
-            len = strlen(vmsd->name);
-            qemu_put_byte(f, len);
-            qemu_put_buffer(f, (uint8_t *)vmsd->name, len);
-            qemu_put_be32(f, vmsd->version_id);
-            vmstate_save_state(f, vmsd, opaque);
-        }
-        sub++;
+    SaveStateEntry *se;
+    char *key;
+
+    if (!savevm_section_table) {
+        savevm_section_table_build();
     }
+    key = g_strdup_printf("%d/%s", instance_id, idstr);
+    se = g_hash_table_lookup(savevm_section_table, key);
+    g_free(key);
+    return se;
 }
 
 typedef struct LoadStateEntry {
@@ -1896,35 +893,61 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntryList;
+
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers);
+
+/*
+ * Reads the device state blob of a post-copy migration, hands the rest of
+ * @f over to the RAM post-copy receiver and loads the devices.
+ */
+static int qemu_loadvm_postcopy(QEMUFile *f,
+                                LoadStateEntryList *loadvm_handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+    QEMUFileBuffer *b;
+    QEMUFile *pf;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
+    b = g_malloc0(sizeof(*b));
+    b->size = qemu_get_be32(f);
+    b->data = g_malloc(b->size);
+    qemu_get_buffer(f, b->data, b->size);
+    pf = qemu_fopen_ops(b, NULL, buffer_get_buffer, buffer_close,
+                        NULL, NULL, NULL);
+
+    ret = qemu_file_get_error(f);
+    if (ret == 0) {
+        ret = ram_postcopy_incoming_start(f);
+    }
+    if (ret == 0) {
+        ret = qemu_loadvm_state_main(pf, loadvm_handlers);
+        if (ret > 0) {
+            fprintf(stderr, "Nested post-copy device state\n");
+            ret = -EINVAL;
+        }
+    }
+    if (ret == 0) {
+        ret = qemu_file_get_error(pf);
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    qemu_fclose(pf);
+    return ret < 0 ? ret : 1;
+}
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+/* Returns 0 at QEMU_VM_EOF, 1 after switching to post-copy or -errno */
+static int qemu_loadvm_state_main(QEMUFile *f,
+                                  LoadStateEntryList *loadvm_handlers)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
         char idstr[257];
+        int64_t start_time, start_pos;
         int len;
 
         switch (section_type) {
@@ -1942,16 +965,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1960,47 +981,92 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(loadvm_handlers, le, entry);
 
+            start_time = get_clock();
+            start_pos = qemu_ftell(f);
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
+            trace_loadvm_section_full(idstr, instance_id,
+                                      qemu_ftell(f) - start_pos,
+                                      get_clock() - start_time);
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
             }
             break;
+        case QEMU_VM_POSTCOPY:
+            return qemu_loadvm_postcopy(f, loadvm_handlers);
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
+
+/*
+ * Returns 0 on success, or 1 if the migration switched to post-copy: in
+ * that case the RAM post-copy receiver owns @f (and its socket) from now
+ * on and closes it when it is done.
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateEntryList loadvm_handlers =
+        QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    LoadStateEntry *le, *new_le;
+    SaveStateEntry *se;
+    unsigned int v;
+    int ret;
+
+    if (qemu_savevm_state_blocked(NULL)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        ret = -ENOTSUP;
+        goto out;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        ret = -ENOTSUP;
+        goto out;
+    }
 
-    ret = 0;
+    ret = qemu_loadvm_state_main(f, &loadvm_handlers);
+    if (ret >= 0) {
+        cpu_synchronize_all_post_init();
+    }
 
 out:
     QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
@@ -2008,6 +1074,12 @@ out:
         g_free(le);
     }
 
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (se->ops && se->ops->load_cleanup) {
+            se->ops->load_cleanup(se->opaque);
+        }
+    }
+
     if (ret == 0) {
         ret = qemu_file_get_error(f);
     }
@@ -2064,22 +1136,13 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
-void do_savevm(Monitor *mon, const QDict *qdict)
+/*
+ * Returns the device that holds the VM state, or NULL if some writable
+ * device can not take a snapshot.
+ */
+static BlockDriverState *savevm_check_devices(Monitor *mon)
 {
-    BlockDriverState *bs, *bs1;
-    QEMUSnapshotInfo sn1, *sn = &sn1, old_sn1, *old_sn = &old_sn1;
-    int ret;
-    QEMUFile *f;
-    int saved_vm_running;
-    uint64_t vm_state_size;
-#ifdef _WIN32
-    struct _timeb tb;
-    struct tm *ptm;
-#else
-    struct timeval tv;
-    struct tm tm;
-#endif
-    const char *name = qdict_get_try_str(qdict, "name");
+    BlockDriverState *bs;
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -2092,18 +1155,31 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         if (!bdrv_can_snapshot(bs)) {
             monitor_printf(mon, "Device '%s' is writable but does not support snapshots.\n",
                                bdrv_get_device_name(bs));
-            return;
+            return NULL;
         }
     }
 
     bs = bdrv_snapshots();
     if (!bs) {
         monitor_printf(mon, "No block device can accept snapshots\n");
-        return;
+        return NULL;
     }
+    return bs;
+}
 
-    saved_vm_running = runstate_is_running();
-    vm_stop(RUN_STATE_SAVE_VM);
+/* Fills in the name and the times of a snapshot taken now */
+static void savevm_init_info(QEMUSnapshotInfo *sn, BlockDriverState *bs,
+                             const char *name)
+{
+    QEMUSnapshotInfo old_sn1, *old_sn = &old_sn1;
+    int ret;
+#ifdef _WIN32
+    struct _timeb tb;
+    struct tm *ptm;
+#else
+    struct timeval tv;
+    struct tm tm;
+#endif
 
     memset(sn, 0, sizeof(*sn));
 
@@ -2138,6 +1214,357 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         strftime(sn->name, sizeof(sn->name), "vm-%Y%m%d%H%M%S", &tm);
 #endif
     }
+}
+
+/* Snapshots every device; the VM state is already in the one of @bs */
+static int savevm_create_snapshots(Monitor *mon, BlockDriverState *bs,
+                                   QEMUSnapshotInfo *sn,
+                                   uint64_t vm_state_size)
+{
+    BlockDriverState *bs1;
+    int ret, err = 0;
+
+    bs1 = NULL;
+    while ((bs1 = bdrv_next(bs1))) {
+        if (bdrv_can_snapshot(bs1)) {
+            /* Write VM state size only to the image that contains the state */
+            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
+            ret = bdrv_snapshot_create(bs1, sn);
+            if (ret < 0) {
+                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
+                               bdrv_get_device_name(bs1));
+                err = ret;
+            }
+        }
+    }
+    return err;
+}
+
+/*
+ * Live snapshots.  A thread writes RAM to the VM state area of the image
+ * the way a migration thread sends it, while the VM runs.  Once what is
+ * left can be written within the maximum downtime, the main loop stops
+ * the VM, writes the rest of the state and snapshots all the disks, so
+ * that the snapshot is that of the moment the VM stopped.  If that point
+ * is not reached, the snapshot fails rather than stopping the VM for
+ * longer than the maximum downtime.
+ *
+ * A snapshot of the moment savevm -l was issued would need RAM to be
+ * write-protected and copied out before the guest changes it, with the
+ * disks snapshotted at once.  Internal snapshots record the VM state area
+ * when the disks are snapshotted, though, so the VM state would have to
+ * be complete by then.
+ */
+
+/* The thread writes the image in pieces of this size, each one with the
+ * iothread lock held.
+ */
+#define SAVEVM_LIVE_CHUNK       (1 << 20)
+
+/* How much the thread lets the save handlers buffer before writing it */
+#define SAVEVM_LIVE_BUFFER      (8 << 20)
+
+/* Passes over RAM after which the snapshot fails if the VM dirties its
+ * memory faster than the image is written
+ */
+#define SAVEVM_LIVE_MAX_PASSES  10
+
+typedef struct SaveVMLiveState {
+    QemuThread thread;
+    QEMUBH *bh;
+    QEMUFile *file;
+    BlockDriverState *bs;
+    char *name;
+    Error *blocker;
+    int ret;
+    /* RAM was dirtied faster than it could be written */
+    bool diverged;
+
+    /* data that is not written to the image yet, which starts at pos */
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+    int64_t pos;
+} SaveVMLiveState;
+
+static SaveVMLiveState *savevm_live;
+
+/* Outcome of the last live snapshot, for "info savevm" */
+static bool savevm_live_finished;
+static int savevm_live_last_ret;
+static int64_t savevm_live_last_downtime;
+
+static int savevm_live_put_buffer(void *opaque, const uint8_t *buf,
+                                  int64_t pos, int size)
+{
+    SaveVMLiveState *s = opaque;
+
+    if (size > s->buffer_capacity - s->buffer_size) {
+        s->buffer_capacity += MAX(size, SAVEVM_LIVE_CHUNK);
+        s->buffer = g_realloc(s->buffer, s->buffer_capacity);
+    }
+    memcpy(s->buffer + s->buffer_size, buf, size);
+    s->buffer_size += size;
+    return size;
+}
+
+static int savevm_live_rate_limit(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+
+    return s->buffer_size >= SAVEVM_LIVE_BUFFER;
+}
+
+/* Writes out the buffer; from the thread, @locked is false and the
+ * iothread lock is taken for each chunk.
+ */
+static int savevm_live_flush(SaveVMLiveState *s, bool locked)
+{
+    size_t offset = 0;
+    int len, ret = 0;
+
+    while (offset < s->buffer_size) {
+        len = MIN(s->buffer_size - offset, SAVEVM_LIVE_CHUNK);
+        if (!locked) {
+            qemu_mutex_lock_iothread();
+        }
+        ret = bdrv_save_vmstate(s->bs, s->buffer + offset, s->pos, len);
+        if (!locked) {
+            qemu_mutex_unlock_iothread();
+        }
+        if (ret < 0) {
+            break;
+        }
+        offset += len;
+        s->pos += len;
+    }
+
+    memmove(s->buffer, s->buffer + offset, s->buffer_size - offset);
+    s->buffer_size -= offset;
+    return ret < 0 ? ret : 0;
+}
+
+/* Called from the main loop */
+static int savevm_live_close(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    int ret;
+
+    ret = savevm_live_flush(s, true);
+    if (ret == 0) {
+        ret = bdrv_flush(s->bs);
+    }
+    return ret;
+}
+
+static void *savevm_live_thread(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    MigrationParams params = {
+        .blk = 0,
+        .shared = 0
+    };
+    uint64_t pending, max_size = 0;
+    int64_t start_time, start_pos, elapsed;
+    int passes = 0;
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    ret = qemu_savevm_state_begin(s->file, &params);
+    qemu_mutex_unlock_iothread();
+
+    while (ret >= 0) {
+        pending = qemu_savevm_state_pending(s->file, max_size);
+        if (!pending || pending < max_size) {
+            break;
+        }
+        if (passes >= SAVEVM_LIVE_MAX_PASSES) {
+            s->diverged = true;
+            ret = -EAGAIN;
+            break;
+        }
+
+        start_time = qemu_get_clock_ms(rt_clock);
+        start_pos = s->pos;
+
+        ret = qemu_savevm_state_iterate(s->file);
+        if (ret > 0) {
+            passes++;
+        }
+        qemu_fflush(s->file);
+        if (ret >= 0) {
+            ret = qemu_file_get_error(s->file);
+        }
+        if (ret >= 0) {
+            ret = savevm_live_flush(s, false);
+        }
+
+        /* what the image takes within the downtime, in bytes */
+        elapsed = qemu_get_clock_ms(rt_clock) - start_time;
+        if (elapsed > 0) {
+            max_size = (s->pos - start_pos) * migrate_max_downtime() /
+                       elapsed / 1000000;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    s->ret = ret;
+    qemu_bh_schedule(s->bh);
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+/* Stops the VM and completes the snapshot, in the main loop */
+static void savevm_live_complete(void *opaque)
+{
+    SaveVMLiveState *s = opaque;
+    QEMUSnapshotInfo sn;
+    uint64_t vm_state_size;
+    int64_t stop_time = 0;
+    bool vm_was_running = false;
+    int ret;
+
+    qemu_thread_join(&s->thread);
+    qemu_bh_delete(s->bh);
+
+    ret = s->ret;
+    if (ret >= 0) {
+        /* the user may have stopped the VM while RAM was being saved */
+        vm_was_running = runstate_is_running();
+        stop_time = qemu_get_clock_ms(rt_clock);
+        vm_stop(RUN_STATE_SAVE_VM);
+        ret = qemu_savevm_state_complete(s->file);
+    } else {
+        qemu_savevm_state_cancel(s->file);
+    }
+
+    vm_state_size = qemu_ftell(s->file);
+    if (qemu_fclose(s->file) < 0 && ret >= 0) {
+        ret = -EIO;
+    }
+
+    if (s->diverged) {
+        error_report("Live snapshot failed: the VM changes its RAM faster "
+                     "than it can be saved within the maximum downtime");
+    } else if (ret < 0) {
+        error_report("Error %d while writing VM", ret);
+    } else {
+        savevm_init_info(&sn, s->bs, s->name);
+        if (s->name && del_existing_snapshots(NULL, s->name) < 0) {
+            error_report("Error while deleting snapshot '%s'", s->name);
+            ret = -EIO;
+        } else if (savevm_create_snapshots(NULL, s->bs, &sn,
+                                           vm_state_size) < 0) {
+            error_report("Error while creating snapshot '%s'", sn.name);
+            ret = -EIO;
+        }
+    }
+
+    if (vm_was_running) {
+        vm_start();
+    }
+    savevm_live_last_downtime = stop_time ?
+        qemu_get_clock_ms(rt_clock) - stop_time : 0;
+    savevm_live_last_ret = ret;
+    savevm_live_finished = true;
+
+    migrate_del_blocker(s->blocker);
+    error_free(s->blocker);
+    g_free(s->buffer);
+    g_free(s->name);
+    g_free(s);
+    savevm_live = NULL;
+}
+
+bool savevm_live_is_running(void)
+{
+    return savevm_live != NULL;
+}
+
+void do_info_savevm(Monitor *mon)
+{
+    if (savevm_live) {
+        monitor_printf(mon, "Live snapshot status: active\n");
+    } else if (!savevm_live_finished) {
+        monitor_printf(mon, "No live snapshot was taken\n");
+    } else if (savevm_live_last_ret < 0) {
+        monitor_printf(mon, "Live snapshot status: failed\n");
+    } else {
+        monitor_printf(mon, "Live snapshot status: completed\n");
+        monitor_printf(mon, "downtime: %" PRId64 " milliseconds\n",
+                       savevm_live_last_downtime);
+    }
+}
+
+static void savevm_live_start(Monitor *mon, BlockDriverState *bs,
+                              const char *name)
+{
+    SaveVMLiveState *s;
+    Error *err = NULL;
+
+    if (migrate_is_running()) {
+        qerror_report(QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (qemu_savevm_state_blocked(&err) || migration_is_blocked(&err)) {
+        qerror_report_err(err);
+        error_free(err);
+        return;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->bs = bs;
+    s->name = g_strdup(name);
+    s->bh = qemu_bh_new(savevm_live_complete, s);
+    s->file = qemu_fopen_ops(s, savevm_live_put_buffer, NULL,
+                             savevm_live_close, savevm_live_rate_limit,
+                             NULL, NULL);
+
+    /* the save handlers can only serve one of them at a time */
+    error_set(&s->blocker, QERR_SNAPSHOT_ACTIVE);
+    migrate_add_blocker(s->blocker);
+
+    savevm_live = s;
+    qemu_thread_create(&s->thread, savevm_live_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    monitor_printf(mon, "Live snapshot started\n");
+}
+
+void do_savevm(Monitor *mon, const QDict *qdict)
+{
+    BlockDriverState *bs;
+    QEMUSnapshotInfo sn1, *sn = &sn1;
+    int ret;
+    QEMUFile *f;
+    int saved_vm_running;
+    uint64_t vm_state_size;
+    const char *name = qdict_get_try_str(qdict, "name");
+
+    if (savevm_live) {
+        qerror_report(QERR_SNAPSHOT_ACTIVE);
+        return;
+    }
+    /* saving RAM stops the dirty log at the end */
+    if (dirty_rate_is_measuring()) {
+        qerror_report(QERR_DIRTY_RATE_ACTIVE);
+        return;
+    }
+
+    bs = savevm_check_devices(mon);
+    if (!bs) {
+        return;
+    }
+
+    if (qdict_get_try_bool(qdict, "live", 0)) {
+        savevm_live_start(mon, bs, name);
+        return;
+    }
+
+    saved_vm_running = runstate_is_running();
+    vm_stop(RUN_STATE_SAVE_VM);
+
+    savevm_init_info(sn, bs, name);
 
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
@@ -2159,19 +1586,7 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     }
 
     /* create the snapshots */
-
-    bs1 = NULL;
-    while ((bs1 = bdrv_next(bs1))) {
-        if (bdrv_can_snapshot(bs1)) {
-            /* Write VM state size only to the image that contains the state */
-            sn->vm_state_size = (bs == bs1 ? vm_state_size : 0);
-            ret = bdrv_snapshot_create(bs1, sn);
-            if (ret < 0) {
-                monitor_printf(mon, "Error while creating snapshot on '%s'\n",
-                               bdrv_get_device_name(bs1));
-            }
-        }
-    }
+    savevm_create_snapshots(mon, bs, sn, vm_state_size);
 
  the_end:
     if (saved_vm_running)
@@ -2211,6 +1626,11 @@ int load_vmstate(const char *name)
     QEMUFile *f;
     int ret;
 
+    if (savevm_live) {
+        qerror_report(QERR_SNAPSHOT_ACTIVE);
+        return -EBUSY;
+    }
+
     bs_vm_state = bdrv_snapshots();
     if (!bs_vm_state) {
         error_report("No block device supports snapshots");
@@ -2392,162 +1812,3 @@ void vmstate_register_ram_global(MemoryRegion *mr)
 {
     vmstate_register_ram(mr, NULL);
 }
-
-/*
-  page = zrun nzrun
-       | zrun nzrun page
-
-  zrun = length
-
-  nzrun = length byte...
-
-  length = uleb128 encoded integer
- */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
-{
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
-
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
-    while (i < slen) {
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
-
-        /* buffer unchanged */
-        if (zrun_len == slen) {
-            return 0;
-        }
-
-        /* skip last zero run */
-        if (i == slen) {
-            return d;
-        }
-
-        d += uleb128_encode_small(dst + d, zrun_len);
-
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
-        /* overflow */
-        if (d + 2 > dlen) {
-            return -1;
-        }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = 0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
-
-        d += uleb128_encode_small(dst + d, nzrun_len);
-        /* overflow */
-        if (d + nzrun_len > dlen) {
-            return -1;
-        }
-        memcpy(dst + d, nzrun_start, nzrun_len);
-        d += nzrun_len;
-        nzrun_len = 0;
-    }
-
-    return d;
-}
-
-int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
-{
-    int i = 0, d = 0;
-    int ret;
-    uint32_t count = 0;
-
-    while (i < slen) {
-
-        /* zrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || (i && !count)) {
-            return -1;
-        }
-        i += ret;
-        d += count;
-
-        /* overflow */
-        if (d > dlen) {
-            return -1;
-        }
-
-        /* nzrun */
-        if ((slen - i) < 2) {
-            return -1;
-        }
-
-        ret = uleb128_decode_small(src + i, &count);
-        if (ret < 0 || !count) {
-            return -1;
-        }
-        i += ret;
-
-        /* overflow */
-        if (d + count > dlen || i + count > slen) {
-            return -1;
-        }
-
-        memcpy(dst + d, src + i, count);
-        d += count;
-        i += count;
-    }
-
-    return d;
-}
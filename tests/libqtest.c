@@ -87,6 +87,7 @@ static int socket_accept(int sock)
 
 QTestState *qtest_init(const char *extra_args)
 {
+    static int instance;
     QTestState *s;
     int sock, qmpsock, ret, i;
     gchar *pid_file;
@@ -99,9 +100,13 @@ QTestState *qtest_init(const char *extra_args)
 
     s = g_malloc(sizeof(*s));
 
-    s->socket_path = g_strdup_printf("/tmp/qtest-%d.sock", getpid());
-    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d.qmp", getpid());
-    pid_file = g_strdup_printf("/tmp/qtest-%d.pid", getpid());
+    /* a test may run several QEMUs at once, e.g. for migration */
+    instance++;
+    s->socket_path = g_strdup_printf("/tmp/qtest-%d-%d.sock", getpid(),
+                                     instance);
+    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d-%d.qmp", getpid(),
+                                         instance);
+    pid_file = g_strdup_printf("/tmp/qtest-%d-%d.pid", getpid(), instance);
 
     sock = init_socket(s->socket_path);
     qmpsock = init_socket(s->qmp_socket_path);
@@ -139,24 +144,34 @@ QTestState *qtest_init(const char *extra_args)
     return s;
 }
 
-void qtest_quit(QTestState *s)
+pid_t qtest_get_pid(QTestState *s)
 {
     FILE *f;
     char buffer[1024];
+    pid_t pid = -1;
 
     f = fopen(s->pid_file, "r");
     if (f) {
         if (fgets(buffer, sizeof(buffer), f)) {
-            pid_t pid = atoi(buffer);
-            int status = 0;
-
-            kill(pid, SIGTERM);
-            waitpid(pid, &status, 0);
+            pid = atoi(buffer);
         }
-
         fclose(f);
     }
 
+    return pid;
+}
+
+void qtest_quit(QTestState *s)
+{
+    pid_t pid = qtest_get_pid(s);
+
+    if (pid != -1) {
+        int status = 0;
+
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+
     unlink(s->pid_file);
     unlink(s->socket_path);
     unlink(s->qmp_socket_path);
@@ -273,16 +288,14 @@ redo:
     return words;
 }
 
-void qtest_qmp(QTestState *s, const char *fmt, ...)
+static void qtest_qmpv(QTestState *s, GString *reply, const char *fmt,
+                       va_list ap)
 {
-    va_list ap;
     bool has_reply = false;
     int nesting = 0;
 
     /* Send QMP request */
-    va_start(ap, fmt);
     socket_sendf(s->qmp_fd, fmt, ap);
-    va_end(ap);
 
     /* Receive reply */
     while (!has_reply || nesting > 0) {
@@ -308,9 +321,33 @@ void qtest_qmp(QTestState *s, const char *fmt, ...)
             nesting--;
             break;
         }
+        if (reply && has_reply) {
+            g_string_append_c(reply, c);
+        }
     }
 }
 
+void qtest_qmp(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    qtest_qmpv(s, NULL, fmt, ap);
+    va_end(ap);
+}
+
+char *qtest_qmp_reply(QTestState *s, const char *fmt, ...)
+{
+    GString *reply = g_string_new("");
+    va_list ap;
+
+    va_start(ap, fmt);
+    qtest_qmpv(s, reply, fmt, ap);
+    va_end(ap);
+
+    return g_string_free(reply, FALSE);
+}
+
 const char *qtest_get_arch(void)
 {
     const char *qemu = getenv("QTEST_QEMU_BINARY");
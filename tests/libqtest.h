@@ -37,6 +37,15 @@ QTestState *qtest_init(const char *extra_args);
  */
 void qtest_quit(QTestState *s);
 
+/**
+ * qtest_get_pid:
+ * @s: QTestState instance to operate on.
+ *
+ * Returns the process ID of the QEMU process associated to @s, or -1 if
+ * it is not known.
+ */
+pid_t qtest_get_pid(QTestState *s);
+
 /**
  * qtest_qmp:
  * @s: QTestState instance to operate on.
@@ -46,6 +55,17 @@ void qtest_quit(QTestState *s);
  */
 void qtest_qmp(QTestState *s, const char *fmt, ...);
 
+/**
+ * qtest_qmp_reply:
+ * @s: QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns the text of the first JSON
+ * object received after it, which has to be freed with g_free().  This
+ * may be an event instead of the reply.
+ */
+char *qtest_qmp_reply(QTestState *s, const char *fmt, ...);
+
 /**
  * qtest_get_irq:
  * @s: QTestState instance to operate on.
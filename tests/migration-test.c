@@ -0,0 +1,591 @@
+/*
+ * QTest testcase for migration to and from a file, over sockets, and for
+ * live snapshots
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "libqtest.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+/* Above the BIOS data, and small enough for the qtest protocol */
+#define TEST_ADDR    (1 << 20)
+#define TEST_PAGES   64
+#define TEST_SIZE    (TEST_PAGES * 4096)
+
+static int64_t plain_transferred;
+
+/* A mix of zero, constant, compressible and random pages */
+static void fill_pages(uint8_t *buf)
+{
+    int i, j;
+
+    for (i = 0; i < TEST_PAGES; i++) {
+        uint8_t *page = buf + i * 4096;
+
+        switch (i % 4) {
+        case 0:
+            memset(page, 0, 4096);
+            break;
+        case 1:
+            memset(page, i, 4096);
+            break;
+        case 2:
+            for (j = 0; j < 4096; j++) {
+                page[j] = "migration-test "[j % 15] + (j / 512);
+            }
+            break;
+        default:
+            for (j = 0; j < 4096; j++) {
+                page[j] = g_test_rand_int();
+            }
+            break;
+        }
+    }
+}
+
+/* How long a test waits for a migration, in seconds */
+#define MIGRATION_TIMEOUT 120
+
+/* Polls query-migrate, returns the RAM bytes sent once it is complete */
+static int64_t wait_for_migration(QTestState *s)
+{
+    time_t deadline = time(NULL) + MIGRATION_TIMEOUT;
+    int64_t transferred = -1;
+    char *reply, *p;
+
+    for (;;) {
+        reply = qtest_qmp_reply(s, "{ 'execute': 'query-migrate' }");
+        g_assert(!strstr(reply, "\"failed\""));
+        if (strstr(reply, "\"completed\"")) {
+            p = strstr(reply, "\"transferred\": ");
+            if (p) {
+                transferred = strtoll(strchr(p, ':') + 1, NULL, 10);
+            }
+            g_free(reply);
+            return transferred;
+        }
+        g_free(reply);
+        g_assert(time(NULL) < deadline);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void wait_for_incoming(QTestState *s)
+{
+    time_t deadline = time(NULL) + MIGRATION_TIMEOUT;
+    char *reply;
+    bool running;
+
+    do {
+        reply = qtest_qmp_reply(s, "{ 'execute': 'query-status' }");
+        running = strstr(reply, "\"running\": true") != NULL;
+        g_free(reply);
+        if (!running) {
+            g_assert(time(NULL) < deadline);
+            g_usleep(10 * 1000);
+        }
+    } while (!running);
+}
+
+/* Migrates through @file, with "file:" URIs if @to_file is set */
+static void test_migrate(const char *capability, bool to_file)
+{
+    char *file = g_strdup_printf("/tmp/qtest-migration-%d", getpid());
+    uint8_t *data = g_malloc(TEST_SIZE);
+    uint8_t *buf = g_malloc(TEST_SIZE);
+    QTestState *s;
+    char *args;
+    int64_t transferred;
+
+    fill_pages(data);
+
+    s = qtest_init("-display none");
+    qtest_memwrite(s, TEST_ADDR, data, TEST_SIZE);
+    if (capability) {
+        qtest_qmp(s, "{ 'execute': 'migrate-set-capabilities',"
+                  " 'arguments': { 'capabilities': ["
+                  " { 'capability': '%s', 'state': true } ] } }", capability);
+    }
+    qtest_qmp(s, "{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': '%s%s' } }",
+              to_file ? "file:" : "exec:cat > ", file);
+    transferred = wait_for_migration(s);
+    qtest_quit(s);
+
+    /* The destination needs no capability */
+    args = g_strdup_printf("-display none -incoming '%s%s'",
+                           to_file ? "file:" : "exec:cat ", file);
+    s = qtest_init(args);
+    wait_for_incoming(s);
+    qtest_memread(s, TEST_ADDR, buf, TEST_SIZE);
+    g_assert(memcmp(buf, data, TEST_SIZE) == 0);
+    qtest_quit(s);
+
+    /*
+     * The capabilities must not make the stream bigger.  mapped-ram is
+     * left out: it writes every non-zero page in full, at its place.
+     */
+    if (!to_file && !capability) {
+        plain_transferred = transferred;
+    } else if (!to_file && plain_transferred > 0 && transferred > 0) {
+        g_assert_cmpint(transferred, <=, plain_transferred);
+    }
+
+    unlink(file);
+    g_free(args);
+    g_free(file);
+    g_free(data);
+    g_free(buf);
+}
+
+static void test_migrate_plain(void)
+{
+    test_migrate(NULL, false);
+}
+
+static void test_migrate_compress(void)
+{
+    test_migrate("compress", false);
+}
+
+static void test_migrate_zero_map(void)
+{
+    test_migrate("zero-map", false);
+}
+
+static void test_migrate_file_plain(void)
+{
+    test_migrate(NULL, true);
+}
+
+static void test_migrate_file_mapped_ram(void)
+{
+    test_migrate("mapped-ram", true);
+}
+
+/*
+ * Migrates to a destination that listens on a unix socket if @tcp is
+ * false, or on a TCP port otherwise, spreading guest RAM over @streams
+ * connections.
+ */
+static void test_migrate_socket(bool tcp, int streams)
+{
+    char *sock = g_strdup_printf("/tmp/qtest-migration-%d.sock", getpid());
+    uint8_t *data = g_malloc(TEST_SIZE);
+    uint8_t *buf = g_malloc(TEST_SIZE);
+    QTestState *from, *to;
+    char *uri, *args;
+
+    fill_pages(data);
+
+    if (tcp) {
+        uri = g_strdup_printf("tcp:127.0.0.1:%d", 20000 + getpid() % 20000);
+    } else {
+        uri = g_strdup_printf("unix:%s", sock);
+    }
+    args = g_strdup_printf("-display none -incoming %s", uri);
+    to = qtest_init(args);
+
+    from = qtest_init("-display none");
+    qtest_memwrite(from, TEST_ADDR, data, TEST_SIZE);
+    qtest_qmp(from, "{ 'execute': 'migrate-set-ram-streams',"
+              " 'arguments': { 'value': %d } }", streams);
+    qtest_qmp(from, "{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': '%s' } }", uri);
+    wait_for_migration(from);
+    qtest_quit(from);
+
+    wait_for_incoming(to);
+    qtest_memread(to, TEST_ADDR, buf, TEST_SIZE);
+    g_assert(memcmp(buf, data, TEST_SIZE) == 0);
+    qtest_quit(to);
+
+    unlink(sock);
+    g_free(args);
+    g_free(uri);
+    g_free(sock);
+    g_free(data);
+    g_free(buf);
+}
+
+static void test_migrate_unix_plain(void)
+{
+    test_migrate_socket(false, 1);
+}
+
+static void test_migrate_unix_streams(void)
+{
+    test_migrate_socket(false, 4);
+}
+
+static void test_migrate_tcp_plain(void)
+{
+    test_migrate_socket(true, 1);
+}
+
+static void test_migrate_tcp_streams(void)
+{
+    test_migrate_socket(true, 4);
+}
+
+/* Maximum downtime of the live snapshot test, in milliseconds */
+#define SAVEVM_DOWNTIME 500
+
+/* Polls "info savevm" until the live snapshot is over, returns the reply */
+static char *wait_for_savevm(QTestState *s)
+{
+    time_t deadline = time(NULL) + MIGRATION_TIMEOUT;
+    char *reply;
+
+    for (;;) {
+        reply = qtest_qmp_reply(s, "{ 'execute': 'human-monitor-command',"
+                                " 'arguments': {"
+                                " 'command-line': 'info savevm' } }");
+        /* the STOP and RESUME events of the snapshot may come first */
+        while (strstr(reply, "\"event\"")) {
+            g_free(reply);
+            reply = qtest_qmp_reply(s, "");
+        }
+        if (!strstr(reply, "active")) {
+            return reply;
+        }
+        g_free(reply);
+        g_assert(time(NULL) < deadline);
+        g_usleep(10 * 1000);
+    }
+}
+
+/*
+ * Takes a live snapshot, checks that the VM was stopped for no longer
+ * than the maximum downtime, and that loading it brings RAM back.
+ */
+static void test_savevm_live(void)
+{
+    char *disk = g_strdup_printf("/tmp/qtest-savevm-%d.img", getpid());
+    uint8_t *data = g_malloc(TEST_SIZE);
+    uint8_t *buf = g_malloc(TEST_SIZE);
+    QTestState *s;
+    char *args, *reply, *p;
+    int64_t downtime;
+    FILE *f;
+
+    /* snapshot=on puts a qcow2 image, which can hold snapshots, on top */
+    f = fopen(disk, "w");
+    g_assert(f != NULL);
+    g_assert(ftruncate(fileno(f), 1 << 20) == 0);
+    fclose(f);
+
+    fill_pages(data);
+
+    args = g_strdup_printf("-display none -drive file=%s,snapshot=on", disk);
+    s = qtest_init(args);
+    qtest_memwrite(s, TEST_ADDR, data, TEST_SIZE);
+    qtest_qmp(s, "{ 'execute': 'migrate_set_downtime',"
+              " 'arguments': { 'value': %g } }", SAVEVM_DOWNTIME / 1000.0);
+    qtest_qmp(s, "{ 'execute': 'human-monitor-command',"
+              " 'arguments': { 'command-line': 'savevm -l live' } }");
+
+    reply = wait_for_savevm(s);
+    g_assert(strstr(reply, "completed"));
+    p = strstr(reply, "downtime: ");
+    g_assert(p != NULL);
+    downtime = strtoll(p + strlen("downtime: "), NULL, 10);
+    g_assert_cmpint(downtime, <=, SAVEVM_DOWNTIME);
+    g_free(reply);
+
+    memset(buf, 0xff, TEST_SIZE);
+    qtest_memwrite(s, TEST_ADDR, buf, TEST_SIZE);
+    qtest_qmp(s, "{ 'execute': 'human-monitor-command',"
+              " 'arguments': { 'command-line': 'loadvm live' } }");
+    qtest_memread(s, TEST_ADDR, buf, TEST_SIZE);
+    g_assert(memcmp(buf, data, TEST_SIZE) == 0);
+    qtest_quit(s);
+
+    unlink(disk);
+    g_free(args);
+    g_free(disk);
+    g_free(data);
+    g_free(buf);
+}
+
+/* Many devices of a kind whose state is mostly VMState fields */
+#define PERF_DEVICES 24
+#define PERF_ROUNDS  5
+
+/*
+ * Saves and loads the state of a guest with @nr_devices virtio-net
+ * devices, and returns the time that the load took, not counting the
+ * start of QEMU.  The time of the save is returned in @save_time.
+ */
+static double migrate_devices(int nr_devices, double *save_time)
+{
+    char *file = g_strdup_printf("/tmp/qtest-migration-%d", getpid());
+    GString *args = g_string_new("-display none");
+    QTestState *s;
+    double start_time, load_time;
+    char *incoming;
+    int i;
+
+    for (i = 0; i < nr_devices; i++) {
+        g_string_append_printf(args, " -device virtio-net-pci,addr=0x%x",
+                               i + 8);
+    }
+
+    g_test_timer_start();
+    s = qtest_init(args->str);
+    wait_for_incoming(s);
+    start_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    qtest_qmp(s, "{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': 'exec:cat > %s' } }", file);
+    wait_for_migration(s);
+    *save_time = g_test_timer_elapsed();
+    qtest_quit(s);
+
+    incoming = g_strdup_printf(" -incoming 'exec:cat %s'", file);
+    g_string_append(args, incoming);
+    g_test_timer_start();
+    s = qtest_init(args->str);
+    wait_for_incoming(s);
+    load_time = g_test_timer_elapsed() - start_time;
+    qtest_quit(s);
+
+    unlink(file);
+    g_free(incoming);
+    g_string_free(args, true);
+    g_free(file);
+    return load_time;
+}
+
+/* Guest RAM filled with pages that are sent in full */
+#define PERF_RAM_MB  64
+
+/* User plus system CPU time of process @pid, in seconds */
+static double process_cpu_time(pid_t pid)
+{
+    char *path = g_strdup_printf("/proc/%d/stat", pid);
+    unsigned long utime = 0, stime = 0;
+    char *stat, *p;
+
+    if (g_file_get_contents(path, &stat, NULL, NULL)) {
+        /* the fields after the command name, from the state on */
+        p = strrchr(stat, ')');
+        if (p) {
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                   "%lu %lu", &utime, &stime);
+        }
+        g_free(stat);
+    }
+    g_free(path);
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * CPU time that the source spends per GB of guest RAM sent over a unix
+ * socket, for pages that can not be sent as duplicates
+ */
+static void test_perf_ram(void)
+{
+    char *sock = g_strdup_printf("/tmp/qtest-migration-%d.sock", getpid());
+    uint8_t *data = g_malloc(1 << 20);
+    QTestState *from, *to;
+    double cpu_time;
+    int64_t transferred;
+    char *args;
+    int i, j;
+
+    args = g_strdup_printf("-display none -m 256 -incoming unix:%s", sock);
+    to = qtest_init(args);
+
+    from = qtest_init("-display none -m 256");
+    for (i = 0; i < PERF_RAM_MB; i++) {
+        for (j = 0; j < (1 << 20); j++) {
+            data[j] = g_test_rand_int();
+        }
+        qtest_memwrite(from, TEST_ADDR + ((uint64_t)i << 20), data, 1 << 20);
+    }
+
+    cpu_time = process_cpu_time(qtest_get_pid(from));
+    qtest_qmp(from, "{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': 'unix:%s' } }", sock);
+    transferred = wait_for_migration(from);
+    cpu_time = process_cpu_time(qtest_get_pid(from)) - cpu_time;
+    qtest_quit(from);
+
+    wait_for_incoming(to);
+    qtest_quit(to);
+
+    g_assert_cmpint(transferred, >, 0);
+    cpu_time = cpu_time / transferred * (1 << 30);
+    g_test_minimized_result(cpu_time, "source CPU per GB: %.3f s", cpu_time);
+
+    unlink(sock);
+    g_free(args);
+    g_free(sock);
+    g_free(data);
+}
+
+/* Value of the first "@key": member of a QMP reply, or -1 */
+static int64_t reply_get_int(const char *reply, const char *key)
+{
+    char *member = g_strdup_printf("\"%s\": ", key);
+    const char *p = strstr(reply, member);
+    int64_t val = p ? strtoll(p + strlen(member), NULL, 10) : -1;
+
+    g_free(member);
+    return val;
+}
+
+/*
+ * XBZRLE working set: PERF_CACHE_PAIRS pairs of pages that are
+ * PERF_CACHE_SIZE apart, so that both pages of a pair fall in the same
+ * set of a direct-mapped cache of that size, and the whole working set
+ * still fits in the cache.
+ */
+#define PERF_CACHE_SIZE   (1 << 20)
+#define PERF_CACHE_PAIRS  64
+#define PERF_CACHE_ROUNDS 20
+
+/*
+ * Migrates while the working set is rewritten, too slowly for the
+ * migration to ever catch up, and returns the XBZRLE cache misses per
+ * page sent with XBZRLE or missed, for a cache with @associativity ways.
+ */
+static double migrate_xbzrle_cache(int associativity)
+{
+    char *sock = g_strdup_printf("/tmp/qtest-migration-%d.sock", getpid());
+    uint8_t *page = g_malloc(4096);
+    QTestState *from, *to;
+    int64_t pages, misses;
+    char *args, *reply;
+    int round, i, j;
+
+    args = g_strdup_printf("-display none -m 256 -incoming unix:%s", sock);
+    to = qtest_init(args);
+    qtest_qmp(to, "{ 'execute': 'migrate-set-capabilities',"
+              " 'arguments': { 'capabilities': ["
+              " { 'capability': 'xbzrle', 'state': true } ] } }");
+
+    from = qtest_init("-display none -m 256");
+    qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+              " 'arguments': { 'capabilities': ["
+              " { 'capability': 'xbzrle', 'state': true } ] } }");
+    qtest_qmp(from, "{ 'execute': 'migrate-set-xbzrle-threads',"
+              " 'arguments': { 'value': 1 } }");
+    qtest_qmp(from, "{ 'execute': 'migrate-set-cache-size',"
+              " 'arguments': { 'value': %d, 'associativity': %d } }",
+              PERF_CACHE_SIZE, associativity);
+    /* less than a round of the working set per round, never converge */
+    qtest_qmp(from, "{ 'execute': 'migrate_set_speed',"
+              " 'arguments': { 'value': %d } }", 64 << 10);
+    qtest_qmp(from, "{ 'execute': 'migrate_set_downtime',"
+              " 'arguments': { 'value': 0.001 } }");
+    qtest_qmp(from, "{ 'execute': 'migrate',"
+              " 'arguments': { 'uri': 'unix:%s' } }", sock);
+
+    for (round = 0; round < PERF_CACHE_ROUNDS; round++) {
+        for (i = 0; i < PERF_CACHE_PAIRS * 2; i++) {
+            uint64_t addr = TEST_ADDR + (uint64_t)(i / 2) * 4096 +
+                            (i % 2) * PERF_CACHE_SIZE;
+
+            /*
+             * Change one byte in 8 per round: the page still fits in an
+             * XBZRLE encoding, but it takes about a third of the page
+             */
+            memset(page, i, 4096);
+            for (j = 0; j < 4096; j += 8) {
+                page[j] = round;
+            }
+            qtest_memwrite(from, addr, page, 4096);
+        }
+    }
+
+    reply = qtest_qmp_reply(from, "{ 'execute': 'query-migrate' }");
+    pages = reply_get_int(reply, "pages");
+    misses = reply_get_int(reply, "cache-miss");
+    g_free(reply);
+    qtest_qmp(from, "{ 'execute': 'migrate_cancel' }");
+    qtest_quit(from);
+    qtest_quit(to);
+
+    unlink(sock);
+    g_free(args);
+    g_free(sock);
+    g_free(page);
+
+    g_assert_cmpint(pages + misses, >, 0);
+    return (double)misses / (pages + misses);
+}
+
+/*
+ * XBZRLE cache misses of a set-associative cache against a direct-mapped
+ * one, for a working set that fits in the cache but collides in the
+ * direct-mapped one.
+ */
+static void test_perf_xbzrle_cache(void)
+{
+    double direct = migrate_xbzrle_cache(1);
+    double assoc = migrate_xbzrle_cache(8);
+
+    g_test_message("XBZRLE cache misses per page, direct-mapped: %.3f", direct);
+    g_test_minimized_result(assoc, "XBZRLE cache misses per page, 8-way: %.3f",
+                            assoc);
+}
+
+/*
+ * What each device adds to the time the guest is stopped for, measured
+ * against a guest without them.  The share of every section is traced by
+ * savevm_section_full and loadvm_section_full.
+ */
+static void test_perf_devices(void)
+{
+    double save_base = 0, load_base = 0, save_dev = 0, load_dev = 0;
+    double t;
+    int round;
+
+    for (round = 0; round < PERF_ROUNDS; round++) {
+        load_base += migrate_devices(0, &t);
+        save_base += t;
+        load_dev += migrate_devices(PERF_DEVICES, &t);
+        save_dev += t;
+    }
+
+    t = (save_dev - save_base) / PERF_ROUNDS / PERF_DEVICES;
+    g_test_minimized_result(t, "save per device: %.1f us", t * 1e6);
+    t = (load_dev - load_base) / PERF_ROUNDS / PERF_DEVICES;
+    g_test_minimized_result(t, "load per device: %.1f us", t * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/migration/exec/plain", test_migrate_plain);
+    qtest_add_func("/migration/exec/compress", test_migrate_compress);
+    qtest_add_func("/migration/exec/zero-map", test_migrate_zero_map);
+    qtest_add_func("/migration/file/plain", test_migrate_file_plain);
+    qtest_add_func("/migration/file/mapped-ram", test_migrate_file_mapped_ram);
+    qtest_add_func("/migration/unix/plain", test_migrate_unix_plain);
+    qtest_add_func("/migration/unix/streams", test_migrate_unix_streams);
+    qtest_add_func("/migration/tcp/plain", test_migrate_tcp_plain);
+    qtest_add_func("/migration/tcp/streams", test_migrate_tcp_streams);
+    qtest_add_func("/migration/savevm/live", test_savevm_live);
+
+    if (g_test_perf()) {
+        qtest_add_func("/migration/perf/devices", test_perf_devices);
+        qtest_add_func("/migration/perf/ram", test_perf_ram);
+        qtest_add_func("/migration/perf/xbzrle-cache",
+                       test_perf_xbzrle_cache);
+    }
+
+    return g_test_run();
+}
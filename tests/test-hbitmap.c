@@ -0,0 +1,294 @@
+/*
+ * Hierarchical bitmap tests
+ *
+ * The bitmap is checked against a flat one after random operations.  Run
+ * with -m=perf to compare finding the set bits of a sparse bitmap with a
+ * linear scan of the flat one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/hbitmap.h"
+
+#define L1 BITS_PER_LONG
+#define L2 (BITS_PER_LONG * L1)
+#define L3 (BITS_PER_LONG * L2)
+
+typedef struct {
+    HBitmap *hb;
+    uint8_t *flat;
+    uint64_t size;
+    int granularity;
+} TestData;
+
+static void data_init(TestData *data, uint64_t size, int granularity)
+{
+    data->hb = hbitmap_alloc(size, granularity);
+    data->flat = g_malloc0(size);
+    data->size = size;
+    data->granularity = granularity;
+}
+
+static void data_fini(TestData *data)
+{
+    hbitmap_free(data->hb);
+    g_free(data->flat);
+}
+
+/* Sets or clears the whole granules of the flat bitmap that are touched */
+static void flat_fill(TestData *data, uint64_t start, uint64_t count, int val)
+{
+    uint64_t first = start >> data->granularity << data->granularity;
+    uint64_t end = ((start + count - 1) >> data->granularity) + 1;
+
+    end = MIN(end << data->granularity, data->size);
+    memset(data->flat + first, val, end - first);
+}
+
+static void set(TestData *data, uint64_t start, uint64_t count)
+{
+    hbitmap_set(data->hb, start, count);
+    flat_fill(data, start, count, 1);
+}
+
+static void reset(TestData *data, uint64_t start, uint64_t count)
+{
+    hbitmap_reset(data->hb, start, count);
+    flat_fill(data, start, count, 0);
+}
+
+/* Iterates from @first and checks that exactly the set granules are seen */
+static void check_iter(TestData *data, uint64_t first)
+{
+    uint64_t step = 1ULL << data->granularity;
+    uint64_t expected = first >> data->granularity << data->granularity;
+    HBitmapIter hbi;
+    int64_t next;
+
+    hbitmap_iter_init(&hbi, data->hb, first);
+    while ((next = hbitmap_iter_next(&hbi)) >= 0) {
+        for (; expected < next; expected += step) {
+            g_assert(!data->flat[expected]);
+        }
+        g_assert_cmpint(expected, ==, next);
+        g_assert(data->flat[next]);
+        expected += step;
+    }
+    for (; expected < data->size; expected += step) {
+        g_assert(!data->flat[expected]);
+    }
+}
+
+static void check(TestData *data)
+{
+    uint64_t step = 1ULL << data->granularity;
+    uint64_t count = 0;
+    uint64_t i;
+
+    for (i = 0; i < data->size; i += step) {
+        g_assert_cmpint(hbitmap_get(data->hb, i), ==, data->flat[i]);
+        count += data->flat[i] ? step : 0;
+    }
+    g_assert_cmpint(hbitmap_count(data->hb), ==, count);
+    g_assert_cmpint(hbitmap_empty(data->hb), ==, count == 0);
+    check_iter(data, 0);
+}
+
+static void test_empty(void)
+{
+    TestData data;
+    HBitmapIter hbi;
+
+    data_init(&data, L3, 0);
+    g_assert(hbitmap_empty(data.hb));
+    hbitmap_iter_init(&hbi, data.hb, 0);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, -1);
+    data_fini(&data);
+}
+
+static void test_set_reset_ranges(void)
+{
+    TestData data;
+
+    data_init(&data, L3 * 2, 0);
+
+    /* within one word, across words and across second-level words */
+    set(&data, 3, 5);
+    set(&data, L1 - 2, 4);
+    set(&data, L2 - 1, L2 + 2);
+    check(&data);
+
+    reset(&data, 4, 2);
+    reset(&data, L2, L1 * 3);
+    check(&data);
+
+    set(&data, 0, L3 * 2);
+    g_assert_cmpint(hbitmap_count(data.hb), ==, L3 * 2);
+    reset(&data, 1, L3 * 2 - 2);
+    check(&data);
+    g_assert_cmpint(hbitmap_count(data.hb), ==, 2);
+
+    reset(&data, 0, L3 * 2);
+    g_assert(hbitmap_empty(data.hb));
+    check(&data);
+
+    data_fini(&data);
+}
+
+static void test_iter_first(void)
+{
+    TestData data;
+    HBitmapIter hbi;
+
+    data_init(&data, L3, 0);
+    set(&data, 5, 1);
+    set(&data, L2 + 7, 1);
+    set(&data, L3 - 1, 1);
+
+    hbitmap_iter_init(&hbi, data.hb, 6);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L2 + 7);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L3 - 1);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, -1);
+
+    hbitmap_iter_init(&hbi, data.hb, L2 + 7);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, L2 + 7);
+
+    data_fini(&data);
+}
+
+static void test_iter_past_end(void)
+{
+    TestData data;
+    HBitmapIter hbi;
+
+    /* a size that fills whole words, so the levels end right at @size */
+    data_init(&data, L2 << 11, 11);
+    set(&data, 0, data.size);
+
+    hbitmap_iter_init(&hbi, data.hb, data.size);
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, -1);
+
+    hbitmap_iter_init(&hbi, data.hb, data.size + (1 << 11));
+    g_assert_cmpint(hbitmap_iter_next(&hbi), ==, -1);
+
+    data_fini(&data);
+}
+
+static void test_granularity(void)
+{
+    TestData data;
+
+    /* the last granule is only partly covered by the bitmap */
+    data_init(&data, 1000, 4);
+    g_assert_cmpint(hbitmap_granularity(data.hb), ==, 4);
+
+    set(&data, 17, 1);
+    g_assert_cmpint(hbitmap_count(data.hb), ==, 16);
+    g_assert(hbitmap_get(data.hb, 16));
+    g_assert(hbitmap_get(data.hb, 31));
+    g_assert(!hbitmap_get(data.hb, 32));
+    check(&data);
+
+    set(&data, 990, 10);
+    reset(&data, 31, 1);
+    check(&data);
+
+    data_fini(&data);
+}
+
+static void test_random(void)
+{
+    TestData data;
+    uint64_t start, count;
+    int granularity, i;
+
+    for (granularity = 0; granularity < 4; granularity++) {
+        data_init(&data, g_test_rand_int_range(1, L3 * 2), granularity);
+        for (i = 0; i < 200; i++) {
+            start = g_test_rand_int_range(0, data.size);
+            count = g_test_rand_int_range(1, i % 4 ? 300 : data.size);
+            count = MIN(count, data.size - start);
+            if (g_test_rand_bit()) {
+                set(&data, start, count);
+            } else {
+                reset(&data, start, count);
+            }
+            if (i % 10 == 0) {
+                check(&data);
+                check_iter(&data, g_test_rand_int_range(0, data.size));
+            }
+        }
+        check(&data);
+        data_fini(&data);
+    }
+}
+
+/* A 1 TiB disk in 1 MiB chunks, with a few dirty ones */
+#define PERF_SIZE  (1 << 20)
+#define PERF_DIRTY 64
+#define PERF_ROUNDS 100
+
+static void test_perf(void)
+{
+    HBitmap *hb = hbitmap_alloc(PERF_SIZE, 0);
+    unsigned long *flat = g_malloc0(PERF_SIZE / 8);
+    HBitmapIter hbi;
+    double elapsed;
+    uint64_t i, found;
+    int round;
+
+    for (i = 0; i < PERF_DIRTY; i++) {
+        uint64_t item = g_test_rand_int_range(0, PERF_SIZE);
+
+        hbitmap_set(hb, item, 1);
+        set_bit(item, flat);
+    }
+
+    g_test_timer_start();
+    for (round = 0, found = 0; round < PERF_ROUNDS; round++) {
+        hbitmap_iter_init(&hbi, hb, 0);
+        while (hbitmap_iter_next(&hbi) >= 0) {
+            found++;
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_minimized_result(elapsed / PERF_ROUNDS,
+                            "hbitmap iteration: %.2f us",
+                            elapsed / PERF_ROUNDS * 1e6);
+    g_assert_cmpint(found, ==, hbitmap_count(hb) * PERF_ROUNDS);
+
+    g_test_timer_start();
+    for (round = 0, found = 0; round < PERF_ROUNDS; round++) {
+        for (i = 0; i < PERF_SIZE; i++) {
+            found += test_bit(i, flat);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_minimized_result(elapsed / PERF_ROUNDS,
+                            "flat bitmap scan: %.2f us",
+                            elapsed / PERF_ROUNDS * 1e6);
+    g_assert_cmpint(found, ==, hbitmap_count(hb) * PERF_ROUNDS);
+
+    hbitmap_free(hb);
+    g_free(flat);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/hbitmap/empty", test_empty);
+    g_test_add_func("/hbitmap/set-reset-ranges", test_set_reset_ranges);
+    g_test_add_func("/hbitmap/iter-first", test_iter_first);
+    g_test_add_func("/hbitmap/iter-past-end", test_iter_past_end);
+    g_test_add_func("/hbitmap/granularity", test_granularity);
+    g_test_add_func("/hbitmap/random", test_random);
+
+    if (g_test_perf()) {
+        g_test_add_func("/hbitmap/perf", test_perf);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,123 @@
+/*
+ * Page cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/page_cache.h"
+
+#define PAGE_SIZE 64
+#define NUM_PAGES 16
+
+static uint8_t page[PAGE_SIZE];
+
+/* Counts the misses of a cache that sees addrs over and over again */
+static int count_misses(PageCache *cache, const uint64_t *addrs, int n,
+                        int rounds)
+{
+    int misses = 0;
+    int i, round;
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < n; i++) {
+            if (!get_cached_data(cache, addrs[i])) {
+                misses++;
+                cache_insert(cache, addrs[i], page);
+            }
+        }
+    }
+
+    return misses;
+}
+
+static void test_conflict(void)
+{
+    /* two hot pages that map to the same bucket of a direct-mapped cache */
+    uint64_t addrs[] = { 0, NUM_PAGES * PAGE_SIZE };
+    PageCache *cache;
+
+    cache = cache_init(NUM_PAGES, PAGE_SIZE, 1, false);
+    g_assert_cmpint(cache_get_associativity(cache), ==, 1);
+    g_assert_cmpint(count_misses(cache, addrs, 2, 10), ==, 20);
+    cache_fini(cache);
+    g_free(cache);
+
+    cache = cache_init(NUM_PAGES, PAGE_SIZE, 2, false);
+    g_assert_cmpint(cache_get_associativity(cache), ==, 2);
+    g_assert_cmpint(count_misses(cache, addrs, 2, 10), ==, 2);
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(4, PAGE_SIZE, 4, false);
+    uint64_t addr;
+
+    /* fill the only set, and use page 0 again */
+    for (addr = 0; addr < 4 * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert_cmpint(cache_insert(cache, addr, page), ==, 0);
+    }
+    g_assert(get_cached_data(cache, 0));
+
+    /* page 1 is now the least recently used one */
+    cache_insert(cache, 4 * PAGE_SIZE, page);
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(!cache_is_cached(cache, PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 2 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 4 * PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_admit_on_second_dirty(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE, 2, true);
+    uint8_t data[PAGE_SIZE];
+
+    memset(data, 0x5a, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 0, data), ==, -1);
+    g_assert(!cache_is_cached(cache, 0));
+    g_assert_cmpint(cache_insert(cache, 0, data), ==, 0);
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(memcmp(get_cached_data(cache, 0), data, PAGE_SIZE) == 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE, 4, false);
+    uint64_t addr;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        cache_insert(cache, addr, page);
+    }
+
+    /* the most recently inserted pages survive a shrink */
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 2), ==, NUM_PAGES / 2);
+    g_assert_cmpint(cache_get_associativity(cache), ==, 4);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr) ==
+                 (addr >= NUM_PAGES / 2 * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/conflict", test_conflict);
+    g_test_add_func("/page-cache/lru", test_lru);
+    g_test_add_func("/page-cache/admit-on-second-dirty",
+                    test_admit_on_second_dirty);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
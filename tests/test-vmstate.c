@@ -0,0 +1,300 @@
+/*
+ * VMState tests: the compiled and the interpreted load must agree
+ *
+ * vmstate_load_state() goes through the compiled ops of a description
+ * when the stream has its version, and field by field otherwise.  Every
+ * field of the descriptions below exists from version 1 on, so a stream
+ * loads the same either way.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "hw/hw.h"
+
+#define TEST_BUF_SIZE 65536
+
+/* What follows the state in the stream; the subsection check peeks at it */
+#define TEST_END      0xee
+
+/* A QEMUFile in memory */
+typedef struct TestBuffer {
+    uint8_t data[TEST_BUF_SIZE];
+    int size;
+} TestBuffer;
+
+static int test_put_buffer(void *opaque, const uint8_t *buf,
+                           int64_t pos, int size)
+{
+    TestBuffer *b = opaque;
+
+    g_assert_cmpint(pos + size, <=, TEST_BUF_SIZE);
+    memcpy(b->data + pos, buf, size);
+    b->size = MAX(b->size, pos + size);
+    return size;
+}
+
+static int test_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    TestBuffer *b = opaque;
+
+    if (pos >= b->size) {
+        return 0;
+    }
+    size = MIN(size, b->size - pos);
+    memcpy(buf, b->data + pos, size);
+    return size;
+}
+
+static int test_close(void *opaque)
+{
+    return 0;
+}
+
+typedef struct TestPair {
+    uint16_t a;
+    uint32_t b[3];
+} TestPair;
+
+static const VMStateDescription vmstate_test_pair = {
+    .name = "test-pair",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT16(a, TestPair),
+        VMSTATE_UINT32_ARRAY(b, TestPair, 3),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+#define TEST_VARRAY 6
+
+typedef struct TestState {
+    uint8_t u8;
+    int16_t i16;
+    uint32_t u32;
+    int64_t i64;
+    uint16_t arr16[5];
+    int32_t arr32[4];
+    uint8_t buf[13];
+    TestPair pair;
+    TestPair pairs[2];
+    uint32_t *single;
+    int32_t nr_varray;
+    uint64_t *varray;
+    bool has_present;
+    uint32_t present;
+    uint32_t absent;
+    /* longer than a run can be */
+    uint8_t big[1500];
+    uint64_t tail;
+} TestState;
+
+static bool test_field_present(void *opaque, int version_id)
+{
+    TestState *s = opaque;
+
+    return s->has_present;
+}
+
+static bool test_field_absent(void *opaque, int version_id)
+{
+    return false;
+}
+
+static const VMStateDescription vmstate_test = {
+    .name = "test",
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields = (VMStateField []) {
+        VMSTATE_UINT8(u8, TestState),
+        VMSTATE_INT16(i16, TestState),
+        VMSTATE_UINT32(u32, TestState),
+        VMSTATE_INT64(i64, TestState),
+        VMSTATE_UINT16_ARRAY(arr16, TestState, 5),
+        VMSTATE_INT32_ARRAY(arr32, TestState, 4),
+        VMSTATE_BUFFER(buf, TestState),
+        VMSTATE_STRUCT(pair, TestState, 1, vmstate_test_pair, TestPair),
+        VMSTATE_STRUCT_ARRAY(pairs, TestState, 2, 1, vmstate_test_pair,
+                             TestPair),
+        VMSTATE_POINTER(single, TestState, 1, vmstate_info_uint32,
+                        uint32_t *),
+        VMSTATE_INT32(nr_varray, TestState),
+        VMSTATE_VARRAY_INT32(varray, TestState, nr_varray, 1,
+                             vmstate_info_uint64, uint64_t),
+        VMSTATE_BOOL(has_present, TestState),
+        VMSTATE_UINT32_TEST(present, TestState, test_field_present),
+        VMSTATE_UINT32_TEST(absent, TestState, test_field_absent),
+        VMSTATE_BUFFER(big, TestState),
+        VMSTATE_UINT64(tail, TestState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void test_state_init(TestState *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->single = g_new0(uint32_t, 1);
+    s->nr_varray = TEST_VARRAY;
+    s->varray = g_new0(uint64_t, TEST_VARRAY);
+}
+
+static void test_state_fill(TestState *s)
+{
+    int i;
+
+    test_state_init(s);
+    s->u8 = 0x81;
+    s->i16 = -2;
+    s->u32 = 0x01020304;
+    s->i64 = -0x0102030405060708LL;
+    for (i = 0; i < ARRAY_SIZE(s->arr16); i++) {
+        s->arr16[i] = 0x1100 + i;
+    }
+    for (i = 0; i < ARRAY_SIZE(s->arr32); i++) {
+        s->arr32[i] = -0x22000000 - i;
+    }
+    for (i = 0; i < sizeof(s->buf); i++) {
+        s->buf[i] = 0x30 + i;
+    }
+    s->pair.a = 0x4142;
+    for (i = 0; i < 3; i++) {
+        s->pair.b[i] = 0x43444546 + i;
+        s->pairs[0].b[i] = 0x47000000 + i;
+        s->pairs[1].b[i] = 0x48000000 + i;
+    }
+    s->pairs[0].a = 0x4900;
+    s->pairs[1].a = 0x4a00;
+    *s->single = 0x50515253;
+    for (i = 0; i < TEST_VARRAY; i++) {
+        s->varray[i] = 0x6000000000000000ULL + i;
+    }
+    s->has_present = true;
+    s->present = 0x70717273;
+    s->absent = 0x74757677;
+    for (i = 0; i < sizeof(s->big); i++) {
+        s->big[i] = i * 7;
+    }
+    s->tail = 0x8081828384858687ULL;
+}
+
+static void test_state_free(TestState *s)
+{
+    g_free(s->single);
+    g_free(s->varray);
+}
+
+/* Compares two states, following the pointers */
+static void test_state_compare(TestState *a, TestState *b)
+{
+    TestState ca = *a, cb = *b;
+
+    g_assert_cmpint(*a->single, ==, *b->single);
+    g_assert_cmpint(a->nr_varray, ==, b->nr_varray);
+    g_assert(memcmp(a->varray, b->varray,
+                    a->nr_varray * sizeof(uint64_t)) == 0);
+
+    ca.single = cb.single = NULL;
+    ca.varray = cb.varray = NULL;
+    g_assert(memcmp(&ca, &cb, sizeof(ca)) == 0);
+}
+
+static void test_save(TestBuffer *b, TestState *s)
+{
+    QEMUFile *f;
+
+    memset(b, 0, sizeof(*b));
+    f = qemu_fopen_ops(b, test_put_buffer, NULL, test_close,
+                       NULL, NULL, NULL);
+    vmstate_save_state(f, &vmstate_test, s);
+    qemu_put_byte(f, TEST_END);
+    g_assert_cmpint(qemu_fclose(f), ==, 0);
+}
+
+/* Loads @b into @s as a stream of @version_id, which must use all of it */
+static void test_load(TestBuffer *b, TestState *s, int version_id)
+{
+    QEMUFile *f;
+
+    f = qemu_fopen_ops(b, NULL, test_get_buffer, test_close,
+                       NULL, NULL, NULL);
+    g_assert_cmpint(vmstate_load_state(f, &vmstate_test, s, version_id),
+                    ==, 0);
+    g_assert_cmpint(qemu_get_byte(f), ==, TEST_END);
+    g_assert_cmpint(qemu_ftell(f), ==, b->size);
+    g_assert_cmpint(qemu_file_get_error(f), ==, 0);
+    g_assert_cmpint(qemu_fclose(f), ==, 0);
+}
+
+static void test_compiled_interpreted(void)
+{
+    static TestBuffer stream, compiled_stream, interpreted_stream;
+    TestState src, compiled, interpreted;
+
+    test_state_fill(&src);
+    test_save(&stream, &src);
+
+    /* version 2 is the one of the description, version 1 is older */
+    test_state_init(&compiled);
+    test_load(&stream, &compiled, 2);
+    test_state_init(&interpreted);
+    test_load(&stream, &interpreted, 1);
+
+    test_state_compare(&compiled, &interpreted);
+
+    /* all of it arrived, except the field that is not in the stream */
+    g_assert_cmpint(compiled.absent, ==, 0);
+    src.absent = 0;
+    test_state_compare(&compiled, &src);
+
+    /* and it goes out the same again */
+    test_save(&compiled_stream, &compiled);
+    test_save(&interpreted_stream, &interpreted);
+    g_assert_cmpint(compiled_stream.size, ==, stream.size);
+    g_assert_cmpint(interpreted_stream.size, ==, stream.size);
+    g_assert(memcmp(compiled_stream.data, stream.data, stream.size) == 0);
+    g_assert(memcmp(interpreted_stream.data, stream.data, stream.size) == 0);
+
+    test_state_free(&src);
+    test_state_free(&compiled);
+    test_state_free(&interpreted);
+}
+
+/* A field that is not in the stream shifts everything after it */
+static void test_field_exists(void)
+{
+    static TestBuffer stream;
+    TestState src, compiled, interpreted;
+
+    test_state_fill(&src);
+    src.has_present = false;
+    test_save(&stream, &src);
+
+    test_state_init(&compiled);
+    test_load(&stream, &compiled, 2);
+    test_state_init(&interpreted);
+    test_load(&stream, &interpreted, 1);
+
+    test_state_compare(&compiled, &interpreted);
+    g_assert_cmpint(compiled.present, ==, 0);
+    g_assert_cmpint(compiled.tail, ==, src.tail);
+
+    test_state_free(&src);
+    test_state_free(&compiled);
+    test_state_free(&interpreted);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/vmstate/compiled-interpreted",
+                    test_compiled_interpreted);
+    g_test_add_func("/vmstate/field-exists", test_field_exists);
+
+    return g_test_run();
+}
@@ -0,0 +1,111 @@
+/*
+ * Worker pool tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/worker-pool.h"
+
+#define NR_WORKERS 4
+#define NR_JOBS    64
+
+typedef struct TestWorker {
+    int runs;
+    int value;
+    int result;
+} TestWorker;
+
+static void square(void *opaque)
+{
+    TestWorker *w = opaque;
+
+    g_usleep(100);
+    w->runs++;
+    w->result = w->value * w->value;
+}
+
+static void test_kick_all(void)
+{
+    TestWorker workers[NR_WORKERS] = { { 0 } };
+    WorkerPool *pool;
+    int round, i;
+
+    pool = worker_pool_new(NR_WORKERS, square, workers, sizeof(TestWorker));
+    for (round = 1; round <= 3; round++) {
+        for (i = 0; i < NR_WORKERS; i++) {
+            workers[i].value = round * 10 + i;
+        }
+        worker_pool_kick_all(pool);
+        worker_pool_wait(pool);
+        for (i = 0; i < NR_WORKERS; i++) {
+            g_assert_cmpint(workers[i].runs, ==, round);
+            g_assert_cmpint(workers[i].result, ==,
+                            (round * 10 + i) * (round * 10 + i));
+        }
+    }
+    worker_pool_free(pool);
+}
+
+static void test_get_idle(void)
+{
+    TestWorker workers[NR_WORKERS] = { { 0 } };
+    WorkerPool *pool;
+    int total = 0;
+    int job, i;
+
+    pool = worker_pool_new(NR_WORKERS, square, workers, sizeof(TestWorker));
+    for (job = 0; job < NR_JOBS; job++) {
+        i = worker_pool_get_idle(pool);
+        /* the result of the previous job of the worker is there by now */
+        if (workers[i].runs) {
+            total += workers[i].result;
+        }
+        workers[i].value = job;
+        worker_pool_kick(pool, i);
+    }
+    worker_pool_wait(pool);
+    for (i = 0; i < NR_WORKERS; i++) {
+        if (workers[i].runs) {
+            total += workers[i].result;
+        }
+    }
+    g_assert_cmpint(total, ==, (NR_JOBS - 1) * NR_JOBS * (2 * NR_JOBS - 1) / 6);
+
+    total = 0;
+    for (i = 0; i < NR_WORKERS; i++) {
+        total += workers[i].runs;
+    }
+    g_assert_cmpint(total, ==, NR_JOBS);
+    worker_pool_free(pool);
+}
+
+/* Freeing the pool lets busy workers finish */
+static void test_free_busy(void)
+{
+    TestWorker workers[NR_WORKERS] = { { 0 } };
+    WorkerPool *pool;
+    int i;
+
+    pool = worker_pool_new(NR_WORKERS, square, workers, sizeof(TestWorker));
+    for (i = 0; i < NR_WORKERS; i++) {
+        workers[i].value = i;
+    }
+    worker_pool_kick_all(pool);
+    worker_pool_free(pool);
+    for (i = 0; i < NR_WORKERS; i++) {
+        g_assert_cmpint(workers[i].runs, ==, 1);
+        g_assert_cmpint(workers[i].result, ==, i * i);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/worker-pool/kick-all", test_kick_all);
+    g_test_add_func("/worker-pool/get-idle", test_get_idle);
+    g_test_add_func("/worker-pool/free-busy", test_free_busy);
+    return g_test_run();
+}
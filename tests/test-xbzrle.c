@@ -0,0 +1,256 @@
+/*
+ * XBZRLE encoder/decoder tests
+ *
+ * Every implementation must produce exactly the same encoding as the
+ * scalar one.  Run with -m=perf to get the throughput of each of them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/xbzrle.h"
+
+#define PAGE_SIZE 4096
+
+typedef enum {
+    PATTERN_UNCHANGED,
+    PATTERN_SPARSE,
+    PATTERN_BLOCKS,
+    PATTERN_RANDOM,
+    PATTERN_MAX,
+} Pattern;
+
+static const char *pattern_names[PATTERN_MAX] = {
+    [PATTERN_UNCHANGED] = "unchanged",
+    [PATTERN_SPARSE] = "sparse",
+    [PATTERN_BLOCKS] = "blocks",
+    [PATTERN_RANDOM] = "random",
+};
+
+typedef struct {
+    XBZRLEAccel accel;
+    Pattern pattern;
+} PerfTest;
+
+static void fill_random(uint8_t *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = g_test_rand_int();
+    }
+}
+
+/* Turns a copy of old_buf into new_buf, changing bytes as per pattern */
+static void make_delta(uint8_t *old_buf, uint8_t *new_buf, Pattern pattern)
+{
+    int i;
+
+    fill_random(old_buf, PAGE_SIZE);
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+
+    switch (pattern) {
+    case PATTERN_UNCHANGED:
+        break;
+    case PATTERN_SPARSE:
+        /* one changed word every 512 bytes */
+        for (i = 0; i < PAGE_SIZE; i += 512) {
+            new_buf[i + 100] ^= 0xff;
+            new_buf[i + 101] ^= 0xff;
+        }
+        break;
+    case PATTERN_BLOCKS:
+        /* every other 64 byte block is rewritten */
+        for (i = 0; i < PAGE_SIZE; i += 128) {
+            memset(new_buf + i, ~old_buf[i], 64);
+        }
+        break;
+    case PATTERN_RANDOM:
+        /* short runs at random places */
+        for (i = 0; i < PAGE_SIZE / 16; i++) {
+            new_buf[g_test_rand_int_range(0, PAGE_SIZE)] ^=
+                g_test_rand_int_range(1, 256);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void test_encode_decode(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *encoded = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    XBZRLEAccel accel;
+    int i, ref_len, len, dlen;
+
+    for (i = 0; i < 1000; i++) {
+        make_delta(old_buf, new_buf, i % PATTERN_MAX);
+        /* some short output buffers, to exercise the overflow checks */
+        dlen = i % 5 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+
+        g_assert(xbzrle_set_accel(XBZRLE_ACCEL_NONE));
+        ref_len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, ref, dlen);
+
+        for (accel = XBZRLE_ACCEL_NONE; accel < XBZRLE_ACCEL_MAX; accel++) {
+            if (!xbzrle_set_accel(accel)) {
+                continue;
+            }
+
+            len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                       encoded, dlen);
+            g_assert_cmpint(len, ==, ref_len);
+            if (len <= 0) {
+                continue;
+            }
+            g_assert(memcmp(encoded, ref, len) == 0);
+
+            memcpy(decoded, old_buf, PAGE_SIZE);
+            g_assert_cmpint(xbzrle_decode_buffer(encoded, len, decoded,
+                                                 PAGE_SIZE), >, 0);
+            g_assert(memcmp(decoded, new_buf, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(encoded);
+    g_free(decoded);
+}
+
+static void test_unchanged(void)
+{
+    uint8_t *buf = g_malloc(PAGE_SIZE);
+    uint8_t *encoded = g_malloc(PAGE_SIZE);
+    XBZRLEAccel accel;
+
+    fill_random(buf, PAGE_SIZE);
+    for (accel = XBZRLE_ACCEL_NONE; accel < XBZRLE_ACCEL_MAX; accel++) {
+        if (xbzrle_set_accel(accel)) {
+            g_assert_cmpint(xbzrle_encode_buffer(buf, buf, PAGE_SIZE,
+                                                 encoded, PAGE_SIZE), ==, 0);
+        }
+    }
+
+    g_free(buf);
+    g_free(encoded);
+}
+
+static void test_overflow(void)
+{
+    uint8_t *old_buf = g_malloc0(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *encoded = g_malloc(PAGE_SIZE);
+    XBZRLEAccel accel;
+
+    memset(new_buf, 1, PAGE_SIZE);
+    for (accel = XBZRLE_ACCEL_NONE; accel < XBZRLE_ACCEL_MAX; accel++) {
+        if (xbzrle_set_accel(accel)) {
+            g_assert_cmpint(xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                                 encoded, PAGE_SIZE), ==, -1);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(encoded);
+}
+
+#define PERF_PAGES 4096
+#define PERF_ROUNDS 64
+
+static void test_perf(gconstpointer opaque)
+{
+    const PerfTest *t = opaque;
+    uint8_t *old_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *encoded = g_malloc(PERF_PAGES * PAGE_SIZE);
+    int *encoded_len = g_malloc(PERF_PAGES * sizeof(int));
+    double bytes = (double)PERF_PAGES * PAGE_SIZE * PERF_ROUNDS;
+    double elapsed;
+    int i, round;
+
+    g_assert(xbzrle_set_accel(t->accel));
+
+    for (i = 0; i < PERF_PAGES; i++) {
+        make_delta(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE,
+                   t->pattern);
+    }
+
+    g_test_timer_start();
+    for (round = 0; round < PERF_ROUNDS; round++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            encoded_len[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                                  new_buf + i * PAGE_SIZE,
+                                                  PAGE_SIZE,
+                                                  encoded + i * PAGE_SIZE,
+                                                  PAGE_SIZE);
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(bytes / elapsed / 1e9,
+                            "encode %s %s: %.2f GB/s",
+                            xbzrle_accel_name(t->accel),
+                            pattern_names[t->pattern],
+                            bytes / elapsed / 1e9);
+
+    g_test_timer_start();
+    for (round = 0; round < PERF_ROUNDS; round++) {
+        for (i = 0; i < PERF_PAGES; i++) {
+            if (encoded_len[i] > 0) {
+                xbzrle_decode_buffer(encoded + i * PAGE_SIZE, encoded_len[i],
+                                     old_buf + i * PAGE_SIZE, PAGE_SIZE);
+            }
+        }
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_maximized_result(bytes / elapsed / 1e9,
+                            "decode %s %s: %.2f GB/s",
+                            xbzrle_accel_name(t->accel),
+                            pattern_names[t->pattern],
+                            bytes / elapsed / 1e9);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(encoded);
+    g_free(encoded_len);
+}
+
+int main(int argc, char **argv)
+{
+    XBZRLEAccel accel;
+    Pattern pattern;
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/encode-decode", test_encode_decode);
+    g_test_add_func("/xbzrle/unchanged", test_unchanged);
+    g_test_add_func("/xbzrle/overflow", test_overflow);
+
+    if (g_test_perf()) {
+        for (accel = XBZRLE_ACCEL_NONE; accel < XBZRLE_ACCEL_MAX; accel++) {
+            if (!xbzrle_accel_supported(accel)) {
+                continue;
+            }
+            for (pattern = 0; pattern < PATTERN_MAX; pattern++) {
+                PerfTest *t = g_malloc(sizeof(*t));
+                char *path;
+
+                t->accel = accel;
+                t->pattern = pattern;
+                path = g_strdup_printf("/xbzrle/perf/%s/%s",
+                                       xbzrle_accel_name(accel),
+                                       pattern_names[pattern]);
+                g_test_add_data_func(path, t, test_perf);
+                g_free(path);
+            }
+        }
+    }
+
+    return g_test_run();
+}
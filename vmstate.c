@@ -0,0 +1,865 @@
+/*
+ * QEMU System Emulator
+ *
+ * Copyright (c) 2003-2008 Fabrice Bellard
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "hw/hw.h"
+#include "qemu-timer.h"
+
+/* Section type of a subsection in the stream, see savevm.c for the others */
+#define QEMU_VM_SUBSECTION           0x05
+
+static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
+                                    void *opaque);
+static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
+                                   void *opaque);
+
+/* bool */
+
+static int get_bool(QEMUFile *f, void *pv, size_t size)
+{
+    bool *v = pv;
+    *v = qemu_get_byte(f);
+    return 0;
+}
+
+static void put_bool(QEMUFile *f, void *pv, size_t size)
+{
+    bool *v = pv;
+    qemu_put_byte(f, *v);
+}
+
+const VMStateInfo vmstate_info_bool = {
+    .name = "bool",
+    .get  = get_bool,
+    .put  = put_bool,
+};
+
+/* 8 bit int */
+
+static int get_int8(QEMUFile *f, void *pv, size_t size)
+{
+    int8_t *v = pv;
+    qemu_get_s8s(f, v);
+    return 0;
+}
+
+static void put_int8(QEMUFile *f, void *pv, size_t size)
+{
+    int8_t *v = pv;
+    qemu_put_s8s(f, v);
+}
+
+const VMStateInfo vmstate_info_int8 = {
+    .name = "int8",
+    .get  = get_int8,
+    .put  = put_int8,
+};
+
+/* 16 bit int */
+
+static int get_int16(QEMUFile *f, void *pv, size_t size)
+{
+    int16_t *v = pv;
+    qemu_get_sbe16s(f, v);
+    return 0;
+}
+
+static void put_int16(QEMUFile *f, void *pv, size_t size)
+{
+    int16_t *v = pv;
+    qemu_put_sbe16s(f, v);
+}
+
+const VMStateInfo vmstate_info_int16 = {
+    .name = "int16",
+    .get  = get_int16,
+    .put  = put_int16,
+};
+
+/* 32 bit int */
+
+static int get_int32(QEMUFile *f, void *pv, size_t size)
+{
+    int32_t *v = pv;
+    qemu_get_sbe32s(f, v);
+    return 0;
+}
+
+static void put_int32(QEMUFile *f, void *pv, size_t size)
+{
+    int32_t *v = pv;
+    qemu_put_sbe32s(f, v);
+}
+
+const VMStateInfo vmstate_info_int32 = {
+    .name = "int32",
+    .get  = get_int32,
+    .put  = put_int32,
+};
+
+/* 32 bit int. See that the received value is the same than the one
+   in the field */
+
+static int get_int32_equal(QEMUFile *f, void *pv, size_t size)
+{
+    int32_t *v = pv;
+    int32_t v2;
+    qemu_get_sbe32s(f, &v2);
+
+    if (*v == v2)
+        return 0;
+    return -EINVAL;
+}
+
+const VMStateInfo vmstate_info_int32_equal = {
+    .name = "int32 equal",
+    .get  = get_int32_equal,
+    .put  = put_int32,
+};
+
+/* 32 bit int. See that the received value is the less or the same
+   than the one in the field */
+
+static int get_int32_le(QEMUFile *f, void *pv, size_t size)
+{
+    int32_t *old = pv;
+    int32_t new;
+    qemu_get_sbe32s(f, &new);
+
+    if (*old <= new)
+        return 0;
+    return -EINVAL;
+}
+
+const VMStateInfo vmstate_info_int32_le = {
+    .name = "int32 equal",
+    .get  = get_int32_le,
+    .put  = put_int32,
+};
+
+/* 64 bit int */
+
+static int get_int64(QEMUFile *f, void *pv, size_t size)
+{
+    int64_t *v = pv;
+    qemu_get_sbe64s(f, v);
+    return 0;
+}
+
+static void put_int64(QEMUFile *f, void *pv, size_t size)
+{
+    int64_t *v = pv;
+    qemu_put_sbe64s(f, v);
+}
+
+const VMStateInfo vmstate_info_int64 = {
+    .name = "int64",
+    .get  = get_int64,
+    .put  = put_int64,
+};
+
+/* 8 bit unsigned int */
+
+static int get_uint8(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t *v = pv;
+    qemu_get_8s(f, v);
+    return 0;
+}
+
+static void put_uint8(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t *v = pv;
+    qemu_put_8s(f, v);
+}
+
+const VMStateInfo vmstate_info_uint8 = {
+    .name = "uint8",
+    .get  = get_uint8,
+    .put  = put_uint8,
+};
+
+/* 16 bit unsigned int */
+
+static int get_uint16(QEMUFile *f, void *pv, size_t size)
+{
+    uint16_t *v = pv;
+    qemu_get_be16s(f, v);
+    return 0;
+}
+
+static void put_uint16(QEMUFile *f, void *pv, size_t size)
+{
+    uint16_t *v = pv;
+    qemu_put_be16s(f, v);
+}
+
+const VMStateInfo vmstate_info_uint16 = {
+    .name = "uint16",
+    .get  = get_uint16,
+    .put  = put_uint16,
+};
+
+/* 32 bit unsigned int */
+
+static int get_uint32(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t *v = pv;
+    qemu_get_be32s(f, v);
+    return 0;
+}
+
+static void put_uint32(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t *v = pv;
+    qemu_put_be32s(f, v);
+}
+
+const VMStateInfo vmstate_info_uint32 = {
+    .name = "uint32",
+    .get  = get_uint32,
+    .put  = put_uint32,
+};
+
+/* 32 bit uint. See that the received value is the same than the one
+   in the field */
+
+static int get_uint32_equal(QEMUFile *f, void *pv, size_t size)
+{
+    uint32_t *v = pv;
+    uint32_t v2;
+    qemu_get_be32s(f, &v2);
+
+    if (*v == v2) {
+        return 0;
+    }
+    return -EINVAL;
+}
+
+const VMStateInfo vmstate_info_uint32_equal = {
+    .name = "uint32 equal",
+    .get  = get_uint32_equal,
+    .put  = put_uint32,
+};
+
+/* 64 bit unsigned int */
+
+static int get_uint64(QEMUFile *f, void *pv, size_t size)
+{
+    uint64_t *v = pv;
+    qemu_get_be64s(f, v);
+    return 0;
+}
+
+static void put_uint64(QEMUFile *f, void *pv, size_t size)
+{
+    uint64_t *v = pv;
+    qemu_put_be64s(f, v);
+}
+
+const VMStateInfo vmstate_info_uint64 = {
+    .name = "uint64",
+    .get  = get_uint64,
+    .put  = put_uint64,
+};
+
+/* 8 bit int. See that the received value is the same than the one
+   in the field */
+
+static int get_uint8_equal(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t *v = pv;
+    uint8_t v2;
+    qemu_get_8s(f, &v2);
+
+    if (*v == v2)
+        return 0;
+    return -EINVAL;
+}
+
+const VMStateInfo vmstate_info_uint8_equal = {
+    .name = "uint8 equal",
+    .get  = get_uint8_equal,
+    .put  = put_uint8,
+};
+
+/* 16 bit unsigned int int. See that the received value is the same than the one
+   in the field */
+
+static int get_uint16_equal(QEMUFile *f, void *pv, size_t size)
+{
+    uint16_t *v = pv;
+    uint16_t v2;
+    qemu_get_be16s(f, &v2);
+
+    if (*v == v2)
+        return 0;
+    return -EINVAL;
+}
+
+const VMStateInfo vmstate_info_uint16_equal = {
+    .name = "uint16 equal",
+    .get  = get_uint16_equal,
+    .put  = put_uint16,
+};
+
+/* timers  */
+
+static int get_timer(QEMUFile *f, void *pv, size_t size)
+{
+    QEMUTimer *v = pv;
+    qemu_get_timer(f, v);
+    return 0;
+}
+
+static void put_timer(QEMUFile *f, void *pv, size_t size)
+{
+    QEMUTimer *v = pv;
+    qemu_put_timer(f, v);
+}
+
+const VMStateInfo vmstate_info_timer = {
+    .name = "timer",
+    .get  = get_timer,
+    .put  = put_timer,
+};
+
+/* uint8_t buffers */
+
+static int get_buffer(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t *v = pv;
+    qemu_get_buffer(f, v, size);
+    return 0;
+}
+
+static void put_buffer(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t *v = pv;
+    qemu_put_buffer(f, v, size);
+}
+
+const VMStateInfo vmstate_info_buffer = {
+    .name = "buffer",
+    .get  = get_buffer,
+    .put  = put_buffer,
+};
+
+/* unused buffers: space that was used for some fields that are
+   not useful anymore */
+
+static int get_unused_buffer(QEMUFile *f, void *pv, size_t size)
+{
+    uint8_t buf[1024];
+    int block_len;
+
+    while (size > 0) {
+        block_len = MIN(sizeof(buf), size);
+        size -= block_len;
+        qemu_get_buffer(f, buf, block_len);
+    }
+   return 0;
+}
+
+static void put_unused_buffer(QEMUFile *f, void *pv, size_t size)
+{
+    static const uint8_t buf[1024];
+    int block_len;
+
+    while (size > 0) {
+        block_len = MIN(sizeof(buf), size);
+        size -= block_len;
+        qemu_put_buffer(f, buf, block_len);
+    }
+}
+
+const VMStateInfo vmstate_info_unused_buffer = {
+    .name = "unused_buffer",
+    .get  = get_unused_buffer,
+    .put  = put_unused_buffer,
+};
+
+static int vmstate_load_field(QEMUFile *f, VMStateField *field,
+                              void *opaque, int version_id)
+{
+    int ret;
+
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *base_addr = opaque + field->offset;
+        int i, n_elems = 1;
+        int size = field->size;
+
+        if (field->flags & VMS_VBUFFER) {
+            size = *(int32_t *)(opaque+field->size_offset);
+            if (field->flags & VMS_MULTIPLY) {
+                size *= field->size;
+            }
+        }
+        if (field->flags & VMS_ARRAY) {
+            n_elems = field->num;
+        } else if (field->flags & VMS_VARRAY_INT32) {
+            n_elems = *(int32_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT32) {
+            n_elems = *(uint32_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT16) {
+            n_elems = *(uint16_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT8) {
+            n_elems = *(uint8_t *)(opaque+field->num_offset);
+        }
+        if (field->flags & VMS_POINTER) {
+            base_addr = *(void **)base_addr + field->start;
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, addr, field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, addr, size);
+
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+static void vmstate_save_field(QEMUFile *f, VMStateField *field,
+                               void *opaque, int version_id)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, version_id)) {
+        void *base_addr = opaque + field->offset;
+        int i, n_elems = 1;
+        int size = field->size;
+
+        if (field->flags & VMS_VBUFFER) {
+            size = *(int32_t *)(opaque+field->size_offset);
+            if (field->flags & VMS_MULTIPLY) {
+                size *= field->size;
+            }
+        }
+        if (field->flags & VMS_ARRAY) {
+            n_elems = field->num;
+        } else if (field->flags & VMS_VARRAY_INT32) {
+            n_elems = *(int32_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT32) {
+            n_elems = *(uint32_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT16) {
+            n_elems = *(uint16_t *)(opaque+field->num_offset);
+        } else if (field->flags & VMS_VARRAY_UINT8) {
+            n_elems = *(uint8_t *)(opaque+field->num_offset);
+        }
+        if (field->flags & VMS_POINTER) {
+            base_addr = *(void **)base_addr + field->start;
+        }
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, addr);
+            } else {
+                field->info->put(f, addr, size);
+            }
+        }
+    }
+}
+
+/*
+ * Compiled descriptions
+ *
+ * Most fields are integers or buffers at a fixed offset of the device
+ * struct, and they follow each other on the wire in big endian.  The first
+ * time a description is saved or loaded, its fields are compiled into a
+ * list of ops in which runs of such fields are merged: a run goes through
+ * a single qemu_put_buffer() or qemu_get_buffer(), and only the byte
+ * swapping is left per element.  Fields that are adjacent in the struct
+ * too, like the elements of an array, end up in a single segment.
+ * Any other field is an op of its own and goes through vmstate_save_field()
+ * or vmstate_load_field() as before.
+ *
+ * A run is only valid for loading when the stream has the version of the
+ * description, which is the case when both sides run the same QEMU.
+ */
+
+/* Runs are staged on the stack */
+#define VMSTATE_RUN_MAX 1024
+
+typedef struct VMStateSegment {
+    size_t offset;
+    int elem_size;
+    int count;
+} VMStateSegment;
+
+typedef struct VMStateOp {
+    /* NULL for a run */
+    VMStateField *field;
+    /* bytes of the run on the wire, and where they go */
+    int size;
+    int nr_segs;
+    VMStateSegment *segs;
+} VMStateOp;
+
+typedef struct VMStateCompiled {
+    int nr_ops;
+    VMStateOp *ops;
+    VMStateSegment *segs;
+} VMStateCompiled;
+
+/* VMStateDescription -> VMStateCompiled; descriptions are never freed */
+static GHashTable *vmstate_compiled;
+
+/* Returns the size of the elements that @field can be run with, or 0 */
+static int vmstate_run_elem_size(const VMStateDescription *vmsd,
+                                 const VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int elem_size;
+
+    if (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER)) {
+        return 0;
+    }
+    if (field->field_exists || field->version_id > vmsd->version_id) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    } else if (info == &vmstate_info_int8 || info == &vmstate_info_uint8) {
+        elem_size = 1;
+    } else if (info == &vmstate_info_int16 || info == &vmstate_info_uint16) {
+        elem_size = 2;
+    } else if (info == &vmstate_info_int32 || info == &vmstate_info_uint32) {
+        elem_size = 4;
+    } else if (info == &vmstate_info_int64 || info == &vmstate_info_uint64) {
+        elem_size = 8;
+    } else {
+        return 0;
+    }
+    return field->size == elem_size ? elem_size : 0;
+}
+
+static VMStateCompiled *vmstate_compile(const VMStateDescription *vmsd)
+{
+    VMStateCompiled *c;
+    VMStateField *field;
+    VMStateOp *run = NULL;
+    int nr_fields = 0, nr_segs = 0;
+
+    if (!vmstate_compiled) {
+        vmstate_compiled = g_hash_table_new(NULL, NULL);
+    }
+    c = g_hash_table_lookup(vmstate_compiled, vmsd);
+    if (c) {
+        return c;
+    }
+
+    for (field = vmsd->fields; field->name; field++) {
+        nr_fields++;
+    }
+    /* a field adds at most one op and one segment */
+    c = g_malloc0(sizeof(*c));
+    c->ops = g_new0(VMStateOp, nr_fields);
+    c->segs = g_new0(VMStateSegment, nr_fields);
+
+    for (field = vmsd->fields; field->name; field++) {
+        int elem_size = vmstate_run_elem_size(vmsd, field);
+        int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+        int count = n_elems * field->size / MAX(elem_size, 1);
+        VMStateSegment *seg;
+
+        if (!elem_size || count * elem_size > VMSTATE_RUN_MAX) {
+            c->ops[c->nr_ops++].field = field;
+            run = NULL;
+            continue;
+        }
+
+        if (!run || run->size + count * elem_size > VMSTATE_RUN_MAX) {
+            run = &c->ops[c->nr_ops++];
+            run->segs = &c->segs[nr_segs];
+        }
+        run->size += count * elem_size;
+
+        seg = run->nr_segs ? &run->segs[run->nr_segs - 1] : NULL;
+        if (seg && seg->elem_size == elem_size &&
+            seg->offset + seg->count * elem_size == field->offset) {
+            seg->count += count;
+            continue;
+        }
+        seg = &c->segs[nr_segs++];
+        seg->offset = field->offset;
+        seg->elem_size = elem_size;
+        seg->count = count;
+        run->nr_segs++;
+    }
+
+    g_hash_table_insert(vmstate_compiled, (gpointer)vmsd, c);
+    return c;
+}
+
+static void vmstate_save_run(QEMUFile *f, const VMStateOp *op, void *opaque)
+{
+    uint8_t buf[VMSTATE_RUN_MAX];
+    uint8_t *p = buf;
+    int i, j;
+
+    for (i = 0; i < op->nr_segs; i++) {
+        const VMStateSegment *seg = &op->segs[i];
+        void *addr = opaque + seg->offset;
+
+        switch (seg->elem_size) {
+        case 1:
+            memcpy(p, addr, seg->count);
+            p += seg->count;
+            break;
+        case 2:
+            for (j = 0; j < seg->count; j++, p += 2) {
+                uint16_t v = cpu_to_be16(((uint16_t *)addr)[j]);
+                memcpy(p, &v, 2);
+            }
+            break;
+        case 4:
+            for (j = 0; j < seg->count; j++, p += 4) {
+                uint32_t v = cpu_to_be32(((uint32_t *)addr)[j]);
+                memcpy(p, &v, 4);
+            }
+            break;
+        case 8:
+            for (j = 0; j < seg->count; j++, p += 8) {
+                uint64_t v = cpu_to_be64(((uint64_t *)addr)[j]);
+                memcpy(p, &v, 8);
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+    qemu_put_buffer(f, buf, op->size);
+}
+
+static int vmstate_load_run(QEMUFile *f, const VMStateOp *op, void *opaque)
+{
+    uint8_t buf[VMSTATE_RUN_MAX];
+    uint8_t *p = buf;
+    int i, j;
+
+    if (qemu_get_buffer(f, buf, op->size) != op->size) {
+        return -EIO;
+    }
+
+    for (i = 0; i < op->nr_segs; i++) {
+        const VMStateSegment *seg = &op->segs[i];
+        void *addr = opaque + seg->offset;
+
+        switch (seg->elem_size) {
+        case 1:
+            memcpy(addr, p, seg->count);
+            p += seg->count;
+            break;
+        case 2:
+            for (j = 0; j < seg->count; j++, p += 2) {
+                uint16_t v;
+                memcpy(&v, p, 2);
+                ((uint16_t *)addr)[j] = be16_to_cpu(v);
+            }
+            break;
+        case 4:
+            for (j = 0; j < seg->count; j++, p += 4) {
+                uint32_t v;
+                memcpy(&v, p, 4);
+                ((uint32_t *)addr)[j] = be32_to_cpu(v);
+            }
+            break;
+        case 8:
+            for (j = 0; j < seg->count; j++, p += 8) {
+                uint64_t v;
+                memcpy(&v, p, 8);
+                ((uint64_t *)addr)[j] = be64_to_cpu(v);
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+    return 0;
+}
+
+int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
+                       void *opaque, int version_id)
+{
+    VMStateField *field;
+    int ret;
+
+    if (version_id > vmsd->version_id) {
+        return -EINVAL;
+    }
+    if (version_id < vmsd->minimum_version_id_old) {
+        return -EINVAL;
+    }
+    if  (version_id < vmsd->minimum_version_id) {
+        return vmsd->load_state_old(f, opaque, version_id);
+    }
+    if (vmsd->pre_load) {
+        int ret = vmsd->pre_load(opaque);
+        if (ret)
+            return ret;
+    }
+    if (version_id == vmsd->version_id) {
+        VMStateCompiled *c = vmstate_compile(vmsd);
+        int i;
+
+        for (i = 0; i < c->nr_ops; i++) {
+            VMStateOp *op = &c->ops[i];
+
+            if (op->field) {
+                ret = vmstate_load_field(f, op->field, opaque, version_id);
+            } else {
+                ret = vmstate_load_run(f, op, opaque);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    } else {
+        for (field = vmsd->fields; field->name; field++) {
+            ret = vmstate_load_field(f, field, opaque, version_id);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+    ret = vmstate_subsection_load(f, vmsd, opaque);
+    if (ret != 0) {
+        return ret;
+    }
+    if (vmsd->post_load) {
+        return vmsd->post_load(opaque, version_id);
+    }
+    return 0;
+}
+
+void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
+                        void *opaque)
+{
+    VMStateCompiled *c = vmstate_compile(vmsd);
+    int i;
+
+    if (vmsd->pre_save) {
+        vmsd->pre_save(opaque);
+    }
+    for (i = 0; i < c->nr_ops; i++) {
+        VMStateOp *op = &c->ops[i];
+
+        if (op->field) {
+            vmstate_save_field(f, op->field, opaque, vmsd->version_id);
+        } else {
+            vmstate_save_run(f, op, opaque);
+        }
+    }
+    vmstate_subsection_save(f, vmsd, opaque);
+}
+
+static const VMStateDescription *vmstate_get_subsection(const VMStateSubsection *sub, char *idstr)
+{
+    while(sub && sub->needed) {
+        if (strcmp(idstr, sub->vmsd->name) == 0) {
+            return sub->vmsd;
+        }
+        sub++;
+    }
+    return NULL;
+}
+
+static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
+                                   void *opaque)
+{
+    while (qemu_peek_byte(f, 0) == QEMU_VM_SUBSECTION) {
+        char idstr[256];
+        int ret;
+        uint8_t version_id, len, size;
+        const VMStateDescription *sub_vmsd;
+
+        len = qemu_peek_byte(f, 1);
+        if (len < strlen(vmsd->name) + 1) {
+            /* subsection name has be be "section_name/a" */
+            return 0;
+        }
+        size = qemu_peek_buffer(f, (uint8_t *)idstr, len, 2);
+        if (size != len) {
+            return 0;
+        }
+        idstr[size] = 0;
+
+        if (strncmp(vmsd->name, idstr, strlen(vmsd->name)) != 0) {
+            /* it don't have a valid subsection name */
+            return 0;
+        }
+        sub_vmsd = vmstate_get_subsection(vmsd->subsections, idstr);
+        if (sub_vmsd == NULL) {
+            return -ENOENT;
+        }
+        qemu_file_skip(f, 1); /* subsection */
+        qemu_file_skip(f, 1); /* len */
+        qemu_file_skip(f, len); /* idstr */
+        version_id = qemu_get_be32(f);
+
+        ret = vmstate_load_state(f, sub_vmsd, opaque, version_id);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
+                                    void *opaque)
+{
+    const VMStateSubsection *sub = vmsd->subsections;
+
+    while (sub && sub->needed) {
+        if (sub->needed(opaque)) {
+            const VMStateDescription *vmsd = sub->vmsd;
+            uint8_t len;
+
+            qemu_put_byte(f, QEMU_VM_SUBSECTION);
+            len = strlen(vmsd->name);
+            qemu_put_byte(f, len);
+            qemu_put_buffer(f, (uint8_t *)vmsd->name, len);
+            qemu_put_be32(f, vmsd->version_id);
+            vmstate_save_state(f, vmsd, opaque);
+        }
+        sub++;
+    }
+}
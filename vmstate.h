@@ -35,8 +35,13 @@ typedef struct SaveVMHandlers {
     int (*save_live_setup)(QEMUFile *f, void *opaque);
     int (*save_live_iterate)(QEMUFile *f, void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
+    /* optional; replaces save_live_complete when switching to post-copy */
+    int (*save_live_postcopy)(QEMUFile *f, void *opaque);
+    uint64_t (*save_live_pending)(QEMUFile *f, void *opaque, uint64_t max_size);
     void (*cancel)(void *opaque);
     LoadStateHandler *load_state;
+    /* optional; called at the end of an incoming migration or loadvm */
+    void (*load_cleanup)(void *opaque);
     bool (*is_active)(void *opaque);
 } SaveVMHandlers;
 
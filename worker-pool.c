@@ -0,0 +1,160 @@
+/*
+ * Pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "qemu/worker-pool.h"
+
+typedef struct Worker {
+    QemuThread thread;
+    WorkerPool *pool;
+    void *opaque;
+    bool busy;
+} Worker;
+
+struct WorkerPool {
+    WorkerFunc *func;
+    Worker *workers;
+    int nr_workers;
+    /* protects busy and quit */
+    QemuMutex lock;
+    /* signalled when a worker is given work, or has to quit */
+    QemuCond work_cond;
+    /* signalled when a worker becomes idle */
+    QemuCond done_cond;
+    bool quit;
+};
+
+static void *worker_thread(void *opaque)
+{
+    Worker *w = opaque;
+    WorkerPool *pool = w->pool;
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->quit && !w->busy) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (!w->busy) {
+            break;
+        }
+        qemu_mutex_unlock(&pool->lock);
+
+        pool->func(w->opaque);
+
+        qemu_mutex_lock(&pool->lock);
+        w->busy = false;
+        qemu_cond_broadcast(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+WorkerPool *worker_pool_new(int nr_workers, WorkerFunc *func, void *opaques,
+                            size_t opaque_size)
+{
+    WorkerPool *pool = g_malloc0(sizeof(*pool));
+    int i;
+
+    pool->func = func;
+    pool->workers = g_malloc0(nr_workers * sizeof(*pool->workers));
+    pool->nr_workers = nr_workers;
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    for (i = 0; i < nr_workers; i++) {
+        Worker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->opaque = (uint8_t *)opaques + i * opaque_size;
+        qemu_thread_create(&w->thread, worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    return pool;
+}
+
+void worker_pool_free(WorkerPool *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    /* busy workers finish their work before they look at quit */
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        qemu_thread_join(&pool->workers[i].thread);
+    }
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+void worker_pool_kick(WorkerPool *pool, int worker)
+{
+    qemu_mutex_lock(&pool->lock);
+    assert(!pool->workers[worker].busy);
+    pool->workers[worker].busy = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void worker_pool_kick_all(WorkerPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nr_workers; i++) {
+        assert(!pool->workers[i].busy);
+        pool->workers[i].busy = true;
+    }
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+int worker_pool_get_idle(WorkerPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        for (i = 0; i < pool->nr_workers; i++) {
+            if (!pool->workers[i].busy) {
+                qemu_mutex_unlock(&pool->lock);
+                return i;
+            }
+        }
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+}
+
+void worker_pool_wait(WorkerPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nr_workers; i++) {
+        while (pool->workers[i].busy) {
+            qemu_cond_wait(&pool->done_cond, &pool->lock);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,550 @@
+/*
+ * Xor Based Zero Run Length Encoding
+ *
+ * Copyright 2012 Red Hat, Inc. and/or its affiliates
+ *
+ * Authors:
+ *  Orit Wasserman  <owasserm@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "host-utils.h"
+#include "qemu/xbzrle.h"
+
+/*
+  page = zrun nzrun
+       | zrun nzrun page
+
+  zrun = length
+
+  nzrun = length byte...
+
+  length = uleb128 encoded integer
+ */
+static int xbzrle_encode_buffer_scalar(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    uint32_t zrun_len = 0, nzrun_len = 0;
+    int d = 0, i = 0;
+    long res, xor;
+    uint8_t *nzrun_start = NULL;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        /* not aligned to sizeof(long) */
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] == new_buf[i]) {
+            zrun_len++;
+            i++;
+            res--;
+        }
+
+        /* word at a time for speed */
+        if (!res) {
+            while (i < slen &&
+                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+                i += sizeof(long);
+                zrun_len += sizeof(long);
+            }
+
+            /* go over the rest */
+            while (i < slen && old_buf[i] == new_buf[i]) {
+                zrun_len++;
+                i++;
+            }
+        }
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        zrun_len = 0;
+        nzrun_start = new_buf + i;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        /* not aligned to sizeof(long) */
+        res = (slen - i) % sizeof(long);
+        while (res && old_buf[i] != new_buf[i]) {
+            i++;
+            nzrun_len++;
+            res--;
+        }
+
+        /* word at a time for speed, use of 32-bit long okay */
+        if (!res) {
+            /* truncation to 32-bit long okay */
+            long mask = 0x0101010101010101ULL;
+            while (i < slen) {
+                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+                if ((xor - mask) & ~xor & (mask << 7)) {
+                    /* found the end of an nzrun within the current long */
+                    while (old_buf[i] != new_buf[i]) {
+                        nzrun_len++;
+                        i++;
+                    }
+                    break;
+                } else {
+                    i += sizeof(long);
+                    nzrun_len += sizeof(long);
+                }
+            }
+        }
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, nzrun_start, nzrun_len);
+        d += nzrun_len;
+        nzrun_len = 0;
+    }
+
+    return d;
+}
+
+static int xbzrle_decode_buffer_scalar(uint8_t *src, int slen, uint8_t *dst,
+                                       int dlen)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count = 0;
+
+    while (i < slen) {
+
+        /* zrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* overflow */
+        if (d > dlen) {
+            return -1;
+        }
+
+        /* nzrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (d + count > dlen || i + count > slen) {
+            return -1;
+        }
+
+        memcpy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}
+
+/*
+ * Vector implementations.
+ *
+ * The encoding only depends on where the runs of equal and of differing
+ * bytes start and end, so the vector versions share the driver loops
+ * below and only differ in how they look for the end of a run.  They use
+ * unaligned loads and have no alignment requirement.
+ */
+
+typedef int (*XBZRLERunEnd)(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen);
+typedef void (*XBZRLECopy)(uint8_t *dst, const uint8_t *src, int count);
+
+static inline int xbzrle_encode_runs(const uint8_t *old_buf,
+                                     const uint8_t *new_buf, int slen,
+                                     uint8_t *dst, int dlen,
+                                     XBZRLERunEnd zrun_end,
+                                     XBZRLERunEnd nzrun_end)
+{
+    int d = 0, i = 0;
+    int start, zrun_len, nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = i - start;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        start = i;
+        i = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = i - start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+static inline int xbzrle_decode_runs(const uint8_t *src, int slen,
+                                     uint8_t *dst, int dlen, XBZRLECopy copy)
+{
+    int i = 0, d = 0;
+    int ret;
+    uint32_t count = 0;
+
+    while (i < slen) {
+
+        /* zrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || (i && !count)) {
+            return -1;
+        }
+        i += ret;
+        d += count;
+
+        /* overflow */
+        if (d > dlen) {
+            return -1;
+        }
+
+        /* nzrun */
+        if ((slen - i) < 2) {
+            return -1;
+        }
+
+        ret = uleb128_decode_small(src + i, &count);
+        if (ret < 0 || !count) {
+            return -1;
+        }
+        i += ret;
+
+        /* overflow */
+        if (d + count > dlen || i + count > slen) {
+            return -1;
+        }
+
+        copy(dst + d, src + i, count);
+        d += count;
+        i += count;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline unsigned int xbzrle_eq_mask_sse2(const uint8_t *old_buf,
+                                               const uint8_t *new_buf, int i)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+}
+
+static int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    unsigned int mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = xbzrle_eq_mask_sse2(old_buf, new_buf, i);
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    unsigned int mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        mask = xbzrle_eq_mask_sse2(old_buf, new_buf, i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static void xbzrle_copy_sse2(uint8_t *dst, const uint8_t *src, int count)
+{
+    for (; count >= 16; count -= 16, src += 16, dst += 16) {
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_loadu_si128((const __m128i *)src));
+    }
+    memcpy(dst, src, count);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_sse2, xbzrle_nzrun_end_sse2);
+}
+
+static int xbzrle_decode_buffer_sse2(uint8_t *src, int slen, uint8_t *dst,
+                                     int dlen)
+{
+    return xbzrle_decode_runs(src, slen, dst, dlen, xbzrle_copy_sse2);
+}
+#endif /* __SSE2__ */
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static inline uint32_t xbzrle_eq_mask_avx2(const uint8_t *old_buf,
+                                           const uint8_t *new_buf, int i)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+}
+
+static int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        mask = xbzrle_eq_mask_avx2(old_buf, new_buf, i);
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        mask = xbzrle_eq_mask_avx2(old_buf, new_buf, i);
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static void xbzrle_copy_avx2(uint8_t *dst, const uint8_t *src, int count)
+{
+    for (; count >= 32; count -= 32, src += 32, dst += 32) {
+        _mm256_storeu_si256((__m256i *)dst,
+                            _mm256_loadu_si256((const __m256i *)src));
+    }
+    memcpy(dst, src, count);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+
+static int xbzrle_decode_buffer_avx2(uint8_t *src, int slen, uint8_t *dst,
+                                     int dlen)
+{
+    return xbzrle_decode_runs(src, slen, dst, dlen, xbzrle_copy_avx2);
+}
+#pragma GCC pop_options
+
+/* Older cpuid.h do not know about these */
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+
+static bool xbzrle_cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    /* the OS must save the YMM registers on context switch */
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+#endif /* CONFIG_AVX2_OPT */
+
+static const struct {
+    const char *name;
+    int (*encode)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                  uint8_t *dst, int dlen);
+    int (*decode)(uint8_t *src, int slen, uint8_t *dst, int dlen);
+} xbzrle_accels[XBZRLE_ACCEL_MAX] = {
+    [XBZRLE_ACCEL_NONE] = {
+        .name = "scalar",
+        .encode = xbzrle_encode_buffer_scalar,
+        .decode = xbzrle_decode_buffer_scalar,
+    },
+#ifdef __SSE2__
+    [XBZRLE_ACCEL_SSE2] = {
+        .name = "sse2",
+        .encode = xbzrle_encode_buffer_sse2,
+        .decode = xbzrle_decode_buffer_sse2,
+    },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    [XBZRLE_ACCEL_AVX2] = {
+        .name = "avx2",
+        .encode = xbzrle_encode_buffer_avx2,
+        .decode = xbzrle_decode_buffer_avx2,
+    },
+#endif
+};
+
+static XBZRLEAccel xbzrle_accel = XBZRLE_ACCEL_NONE;
+
+bool xbzrle_accel_supported(XBZRLEAccel accel)
+{
+    if (accel >= XBZRLE_ACCEL_MAX || !xbzrle_accels[accel].encode) {
+        return false;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (accel == XBZRLE_ACCEL_AVX2) {
+        return xbzrle_cpu_has_avx2();
+    }
+#endif
+    return true;
+}
+
+bool xbzrle_set_accel(XBZRLEAccel accel)
+{
+    if (!xbzrle_accel_supported(accel)) {
+        return false;
+    }
+    xbzrle_accel = accel;
+    return true;
+}
+
+const char *xbzrle_accel_name(XBZRLEAccel accel)
+{
+    if (accel >= XBZRLE_ACCEL_MAX || !xbzrle_accels[accel].name) {
+        return "unknown";
+    }
+    return xbzrle_accels[accel].name;
+}
+
+static void __attribute__((constructor)) xbzrle_init_accel(void)
+{
+    int accel;
+
+    for (accel = XBZRLE_ACCEL_MAX - 1; accel > XBZRLE_ACCEL_NONE; accel--) {
+        if (xbzrle_set_accel(accel)) {
+            break;
+        }
+    }
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_accels[xbzrle_accel].encode(old_buf, new_buf, slen,
+                                              dst, dlen);
+}
+
+int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_accels[xbzrle_accel].decode(src, slen, dst, dlen);
+}